@@ -0,0 +1,81 @@
+/*
+ * Example span plugin for the rainbow program: a zone plate, rings of
+ * hue around the centre of the screen that get closer together towards
+ * the edges and flow outwards as time passes.
+ *
+ *   Compile: gcc -O2 -shared -fPIC -o zoneplate.so example_plugin.c
+ *   Run: ./rainbow --plugin ./zoneplate.so --fps 30 [--plugin-args RINGS]
+ *
+ * RINGS is how many rings fit between the centre and a corner (default 24).
+ */
+
+#include <stdlib.h>
+#include "rainbow_plugin.h"
+
+typedef struct {
+    float scale;        /* Hue degrees per squared pixel of distance */
+    int cx, cy;
+} ZonePlate;
+
+static void *zoneplate_create(int width, int height, const char *args, int *failed)
+{
+    ZonePlate *z = malloc(sizeof(*z));
+    int rings = args ? atoi(args) : 24;
+
+    if (!z) {
+        *failed = 1;
+        return NULL;
+    }
+    z->cx = width / 2;
+    z->cy = height / 2;
+    z->scale = 360.0f * (rings > 0 ? rings : 24) / ((float)z->cx * z->cx + (float)z->cy * z->cy);
+    return z;
+}
+
+static void zoneplate_destroy(void *state)
+{
+    free(state);
+}
+
+/* Hue in [0, 360) to 0x00RRGGBB, at the frame's saturation and value */
+static uint32_t hue_pixel(float h, float s, float v)
+{
+    int sextant = (int)(h / 60.0f);
+    float f = h / 60.0f - sextant;
+    float c = v * s, m = v - c;
+    float up = c * f + m, down = c * (1.0f - f) + m, hi = c + m;
+    float r, g, b;
+
+    switch (sextant) {
+    case 0:  r = hi;   g = up;   b = m;    break;
+    case 1:  r = down; g = hi;   b = m;    break;
+    case 2:  r = m;    g = hi;   b = up;   break;
+    case 3:  r = m;    g = down; b = hi;   break;
+    case 4:  r = up;   g = m;    b = hi;   break;
+    default: r = hi;   g = m;    b = down; break;
+    }
+    return (uint32_t)(r * 255.0f) << 16 | (uint32_t)(g * 255.0f) << 8 | (uint32_t)(b * 255.0f);
+}
+
+static void zoneplate_span(void *state, const RainbowFrame *frame, uint32_t *dst, int x, int y, int n)
+{
+    const ZonePlate *z = state;
+    float dy = (float)(y - z->cy);
+    float base = dy * dy * z->scale + 360.0f - frame->phase;
+
+    for (int i = 0; i < n; i++) {
+        float dx = (float)(x + i - z->cx);
+        float h = base + dx * dx * z->scale;
+        h -= 360.0f * (float)(int)(h / 360.0f);
+        dst[i] = hue_pixel(h, frame->saturation, frame->value);
+    }
+}
+
+static const RainbowPlugin zoneplate = {
+    RAINBOW_PLUGIN_ABI, "zoneplate", zoneplate_create, zoneplate_destroy, zoneplate_span,
+};
+
+const RainbowPlugin *rainbow_plugin_entry(void)
+{
+    return &zoneplate;
+}
@@ -1,392 +1,10745 @@
-/*
- * Frame Buffer Rainbow Gradient Program
- * 
- * This program directly writes to the frame buffer to create a smooth rainbow 
- * gradient across the entire screen. The rainbow transitions from red through 
- * orange, yellow, green, cyan, blue, and magenta.
- * 
- * Platform-specific compilation and execution:
- * 
- * LINUX:
- *   Compile: gcc -o rainbow main.c
- *   Run: sudo ./rainbow
- *   Note: This requires root privileges to access /dev/fb0
- * 
- * WINDOWS:
- *   Compile: gcc -o rainbow.exe main.c -luser32
- *   Run: rainbow.exe
- *   Note: Creates a fullscreen window and sets pixels directly
- */
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-/* Platform-specific includes */
-#ifdef __linux__
-    /* Linux frame buffer headers */
-    #include <fcntl.h>
-    #include <unistd.h>
-    #include <sys/ioctl.h>
-    #include <linux/fb.h>
-    #include <sys/mman.h>
-#elif defined(_WIN32) || defined(_WIN64)
-    /* Windows headers for graphics operations */
-    #include <windows.h>
-#else
-    #error "Unsupported platform. This program requires Linux or Windows."
-#endif
-
-/* Forward declarations for platform-specific main functions */
-#ifdef __linux__
-int main_linux(void);
-#endif
-
-#ifdef _WIN32
-int main_windows(void);
-#endif
-
-/* Structure to hold a single RGB pixel color */
-typedef struct {
-    unsigned char red;
-    unsigned char green;
-    unsigned char blue;
-} RGB;
-
-/*
- * Function: hsv_to_rgb
- * 
- * Converts HSV (Hue, Saturation, Value) color space to RGB color space.
- * HSV is useful for creating gradients because hue directly corresponds
- * to the color spectrum (0° = red, 120° = green, 240° = blue, etc).
- * 
- * Parameters:
- *   h: Hue in degrees (0.0 to 360.0)
- *   s: Saturation (0.0 to 1.0) - how intense the color is
- *   v: Value (0.0 to 1.0) - brightness of the color
- * 
- * Returns: RGB structure with red, green, and blue components (0-255)
- */
-RGB hsv_to_rgb(float h, float s, float v)
-{
-    RGB color;
-    float c = v * s;  /* Chroma: the color intensity component */
-    float hh = h / 60.0f;  /* Scale hue to 0-6 range */
-    float x = c * (1 - ((int)hh % 2 == 0 ? hh - (int)hh : 1 - (hh - (int)hh)));
-    float m = v - c;  /* Match value: brings color to desired brightness */
-
-    /* Determine which sextant of the color wheel we're in */
-    if (hh < 1) {
-        color.red = (unsigned char)((c + m) * 255);
-        color.green = (unsigned char)((x + m) * 255);
-        color.blue = (unsigned char)(m * 255);
-    } else if (hh < 2) {
-        color.red = (unsigned char)((x + m) * 255);
-        color.green = (unsigned char)((c + m) * 255);
-        color.blue = (unsigned char)(m * 255);
-    } else if (hh < 3) {
-        color.red = (unsigned char)(m * 255);
-        color.green = (unsigned char)((c + m) * 255);
-        color.blue = (unsigned char)((x + m) * 255);
-    } else if (hh < 4) {
-        color.red = (unsigned char)(m * 255);
-        color.green = (unsigned char)((x + m) * 255);
-        color.blue = (unsigned char)((c + m) * 255);
-    } else if (hh < 5) {
-        color.red = (unsigned char)((x + m) * 255);
-        color.green = (unsigned char)(m * 255);
-        color.blue = (unsigned char)((c + m) * 255);
-    } else {
-        color.red = (unsigned char)((c + m) * 255);
-        color.green = (unsigned char)(m * 255);
-        color.blue = (unsigned char)((x + m) * 255);
-    }
-
-    return color;
-}
-
-int main()
-{
-#ifdef __linux__
-    return main_linux();
-#elif defined(_WIN32) || defined(_WIN64)
-    return main_windows();
-#endif
-}
-
-/*
- * ============================================================================
- * LINUX IMPLEMENTATION
- * ============================================================================
- */
-#ifdef __linux__
-
-int main_linux()
-{
-    /* Declare the frame buffer file descriptor and variable info structures */
-    int fb_fd;
-    struct fb_var_screeninfo var_info;
-    struct fb_fix_screeninfo fix_info;
-    unsigned char *fb_data;  /* Pointer to the frame buffer memory */
-    
-    /* Open the frame buffer device for reading and writing */
-    fb_fd = open("/dev/fb0", O_RDWR);
-    if (fb_fd == -1) {
-        perror("Failed to open /dev/fb0. Make sure you're running with sudo.");
-        return 1;
-    }
-
-    /* 
-     * ioctl(FBIOGET_VSCREENINFO) retrieves the variable screen information
-     * This tells us:
-     *  - xres: horizontal resolution in pixels
-     *  - yres: vertical resolution in pixels
-     *  - bits_per_pixel: color depth (usually 32 for 24-bit RGB + 8-bit alpha)
-     */
-    if (ioctl(fb_fd, FBIOGET_VSCREENINFO, &var_info) == -1) {
-        perror("ioctl FBIOGET_VSCREENINFO");
-        close(fb_fd);
-        return 1;
-    }
-
-    /* 
-     * ioctl(FBIOGET_FSCREENINFO) retrieves fixed screen information
-     * This tells us:
-     *  - smem_len: total size of the frame buffer memory in bytes
-     *  - line_length: number of bytes per scanline (row)
-     */
-    if (ioctl(fb_fd, FBIOGET_FSCREENINFO, &fix_info) == -1) {
-        perror("ioctl FBIOGET_FSCREENINFO");
-        close(fb_fd);
-        return 1;
-    }
-
-    /* 
-     * mmap() maps the frame buffer device memory into our process's address space
-     * This allows us to directly write to video memory to update the screen
-     * 
-     * Parameters:
-     *  - NULL: let the kernel choose the address
-     *  - smem_len: size of memory to map (entire frame buffer)
-     *  - PROT_READ | PROT_WRITE: we need read and write access
-     *  - MAP_SHARED: changes are visible to other processes/hardware
-     *  - fb_fd: file descriptor of /dev/fb0
-     *  - 0: offset in the file (start from beginning)
-     */
-    fb_data = mmap(NULL, fix_info.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fb_fd, 0);
-    if (fb_data == MAP_FAILED) {
-        perror("mmap failed");
-        close(fb_fd);
-        return 1;
-    }
-
-    /* Print detected screen information for debugging */
-    printf("Frame Buffer Information:\n");
-    printf("Resolution: %d x %d\n", var_info.xres, var_info.yres);
-    printf("Bits per pixel: %d\n", var_info.bits_per_pixel);
-    printf("Frame buffer size: %ld bytes\n", fix_info.smem_len);
-    printf("Scanline length: %d bytes\n", fix_info.line_length);
-
-    /* 
-     * Main rendering loop: iterate through every pixel on the screen
-     * 
-     * Strategy: Use horizontal position (x) to determine the hue
-     * This creates a smooth left-to-right rainbow gradient
-     */
-    for (unsigned int y = 0; y < var_info.yres; y++) {
-        for (unsigned int x = 0; x < var_info.xres; x++) {
-            /* 
-             * Calculate the hue based on horizontal position
-             * hue ranges from 0° (red) to 360° (magenta)
-             * x ranges from 0 to xres-1, so divide by xres and multiply by 360
-             */
-            float hue = (x / (float)var_info.xres) * 360.0f;
-            
-            /* 
-             * Convert HSV to RGB for the rainbow effect
-             * Saturation = 1.0 (fully saturated, vivid colors)
-             * Value = 1.0 (full brightness)
-             */
-            RGB pixel_color = hsv_to_rgb(hue, 1.0f, 1.0f);
-
-            /* 
-             * Calculate the memory offset for this pixel
-             * 
-             * Frame buffer memory is laid out sequentially:
-             * - Row 0: pixels 0 to xres-1
-             * - Row 1: pixels xres to 2*xres-1
-             * - etc.
-             * 
-             * Each pixel takes (bits_per_pixel / 8) bytes
-             * Offset = (y * line_length) + (x * bytes_per_pixel)
-             */
-            unsigned int bytes_per_pixel = var_info.bits_per_pixel / 8;
-            unsigned long offset = (y * fix_info.line_length) + (x * bytes_per_pixel);
-
-            /* 
-             * Write the pixel color to frame buffer memory
-             * Most systems use 32-bit pixels (ARGB or BGRA format)
-             * We write: blue, green, red, alpha (in little-endian format)
-             * 
-             * The order might be BGR or RGB depending on the system,
-             * but BGR (Blue-Green-Red) is most common on x86 systems
-             */
-            if (bytes_per_pixel == 4) {
-                /* 32-bit color: ARGB or BGRA (try BGR first) */
-                fb_data[offset + 0] = pixel_color.blue;      /* Blue channel */
-                fb_data[offset + 1] = pixel_color.green;     /* Green channel */
-                fb_data[offset + 2] = pixel_color.red;       /* Red channel */
-                fb_data[offset + 3] = 255;                   /* Alpha (transparency) - fully opaque */
-            } else if (bytes_per_pixel == 3) {
-                /* 24-bit color: RGB */
-                fb_data[offset + 0] = pixel_color.blue;
-                fb_data[offset + 1] = pixel_color.green;
-                fb_data[offset + 2] = pixel_color.red;
-            }
-        }
-    }
-
-    printf("Rainbow gradient written to frame buffer!\n");
-    printf("Press Enter to exit and restore the display...\n");
-    getchar();
-
-    /* 
-     * Clean up: unmap the frame buffer memory
-     * This releases our access to the video memory
-     */
-    munmap(fb_data, fix_info.smem_len);
-
-    /* Close the frame buffer device */
-    close(fb_fd);
-
-    return 0;
-}
-
-#endif /* __linux__ */
-
-/*
- * ============================================================================
- * WINDOWS IMPLEMENTATION
- * ============================================================================
- */
-#ifdef _WIN32
-
-/* Global variables for Windows implementation */
-HWND hwnd = NULL;
-HDC hdc = NULL;
-unsigned int screen_width = 0;
-unsigned int screen_height = 0;
-
-/*
- * Window procedure: handles window events and messages
- * This window cannot be closed by user interaction - it will persist indefinitely
- */
-LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
-{
-    /* Ignore all messages - the window will not close */
-    return DefWindowProc(hwnd, uMsg, wParam, lParam);
-}
-
-int main_windows()
-{
-    /* Get the screen dimensions */
-    screen_width = GetSystemMetrics(SM_CXSCREEN);
-    screen_height = GetSystemMetrics(SM_CYSCREEN);
-
-    printf("Creating fullscreen window: %d x %d\n", screen_width, screen_height);
-
-    /* Register the window class */
-    const char CLASS_NAME[] = "Rainbow Window Class";
-    WNDCLASS wc = {0};
-    wc.lpfnWndProc = WindowProc;
-    wc.lpszClassName = CLASS_NAME;
-    wc.style = CS_HREDRAW | CS_VREDRAW;
-    wc.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
-
-    RegisterClass(&wc);
-
-    /* Create a fullscreen window */
-    hwnd = CreateWindowEx(
-        WS_EX_TOPMOST,           /* Window is always on top */
-        CLASS_NAME,
-        "Rainbow Gradient",
-        WS_POPUP,                /* Fullscreen, no decorations */
-        0, 0,                    /* Position at 0,0 */
-        screen_width,
-        screen_height,
-        NULL, NULL, NULL, NULL
-    );
-
-    if (hwnd == NULL) {
-        printf("Failed to create window\n");
-        return 1;
-    }
-
-    /* Display the window */
-    ShowWindow(hwnd, SW_SHOW);
-    UpdateWindow(hwnd);
-
-    /* Get the device context for drawing */
-    hdc = GetDC(hwnd);
-    if (hdc == NULL) {
-        printf("Failed to get device context\n");
-        DestroyWindow(hwnd);
-        return 1;
-    }
-
-    printf("Rendering rainbow gradient...\n");
-
-    /* 
-     * Main rendering loop: iterate through every pixel on the screen
-     * 
-     * Strategy: Use horizontal position (x) to determine the hue
-     * This creates a smooth left-to-right rainbow gradient
-     */
-    for (unsigned int y = 0; y < screen_height; y++) {
-        for (unsigned int x = 0; x < screen_width; x++) {
-            /* 
-             * Calculate the hue based on horizontal position
-             * hue ranges from 0° (red) to 360° (magenta)
-             */
-            float hue = (x / (float)screen_width) * 360.0f;
-            
-            /* Convert HSV to RGB for the rainbow effect */
-            RGB pixel_color = hsv_to_rgb(hue, 1.0f, 1.0f);
-
-            /* 
-             * Create a Windows COLORREF (0x00BGR format)
-             * RGB() macro packs the color values into the correct format
-             */
-            COLORREF color = RGB(pixel_color.red, pixel_color.green, pixel_color.blue);
-
-            /* Set the pixel at this location */
-            SetPixel(hdc, x, y, color);
-        }
-
-        /* 
-         * Process Windows messages to keep the window responsive
-         * This allows the user to close the window or press a key to exit
-         */
-        MSG msg;
-        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
-            TranslateMessage(&msg);
-            DispatchMessage(&msg);
-        }
-    }
-
-    printf("Rainbow gradient displayed!\n");
-    printf("Window is locked and cannot be closed. Use Ctrl+Alt+Delete or force-terminate the process to exit.\n");
-
-    /* Infinite loop - the window will never close */
-    while (1) {
-        MSG msg;
-        if (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
-            TranslateMessage(&msg);
-            DispatchMessage(&msg);
-        }
-    }
-
-    return 0;
-}
-
-#endif /* _WIN32 */
+/*
+ * Frame Buffer Rainbow Gradient Program
+ * 
+ * This program directly writes to the frame buffer to create a smooth rainbow 
+ * gradient across the entire screen. The rainbow transitions from red through 
+ * orange, yellow, green, cyan, blue, and magenta.
+ * 
+ * Platform-specific compilation and execution:
+ * 
+ * LINUX:
+ *   Compile: gcc -O2 -pthread -o rainbow main.c -ldl
+ *   Run: sudo ./rainbow [options]   (./rainbow --help lists them)
+ *   Note: This requires root privileges to access /dev/fb0
+ *   Remote viewing: ./rainbow --headless 1280x720 --rfb 5900, then point
+ *   a VNC viewer at localhost:5900
+ *   Shared screen: sudo ./rainbow --compositor /run/rainbow.sock, then start
+ *   clients with ./rainbow --client /run/rainbow.sock (see rainbow_shm.h)
+ * 
+ * WINDOWS:
+ *   Compile: gcc -o rainbow.exe main.c -luser32
+ *   Run: rainbow.exe
+ *   Note: Creates a fullscreen window and sets pixels directly
+ */
+
+#ifdef __linux__
+    #define _GNU_SOURCE  /* accept4(), strsignal(), CPU affinity */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
+/* Platform-specific includes */
+#ifdef __linux__
+    /* Linux frame buffer headers */
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/ioctl.h>
+    #include <linux/fb.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <errno.h>
+    #include <pthread.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <arpa/inet.h>
+    #include <sys/epoll.h>
+    #include <sys/eventfd.h>
+    #include <sys/signalfd.h>
+    #include <sys/timerfd.h>
+    #include <sys/inotify.h>
+    #include <signal.h>
+    #include <time.h>
+    #include <sched.h>
+    #include <stdatomic.h>
+    #include <dlfcn.h>
+    #include <sys/syscall.h>
+    #include <linux/perf_event.h>
+    #include <sys/un.h>
+    #include <limits.h>
+    #include "rainbow_plugin.h"
+    #include "rainbow_shm.h"
+#elif defined(_WIN32) || defined(_WIN64)
+    /* Windows headers for graphics operations */
+    #include <windows.h>
+#else
+    #error "Unsupported platform. This program requires Linux or Windows."
+#endif
+
+/* Forward declarations for platform-specific main functions */
+#ifdef __linux__
+int main_linux(int argc, char **argv);
+#endif
+
+#ifdef _WIN32
+int main_windows(void);
+#endif
+
+/* Structure to hold a single RGB pixel color */
+typedef struct {
+    unsigned char red;
+    unsigned char green;
+    unsigned char blue;
+} RGB;
+
+/*
+ * Function: hsv_to_rgb
+ * 
+ * Converts HSV (Hue, Saturation, Value) color space to RGB color space.
+ * HSV is useful for creating gradients because hue directly corresponds
+ * to the color spectrum (0° = red, 120° = green, 240° = blue, etc).
+ * 
+ * Parameters:
+ *   h: Hue in degrees (0.0 to 360.0)
+ *   s: Saturation (0.0 to 1.0) - how intense the color is
+ *   v: Value (0.0 to 1.0) - brightness of the color
+ * 
+ * Returns: RGB structure with red, green, and blue components (0-255)
+ */
+RGB hsv_to_rgb(float h, float s, float v)
+{
+    RGB color;
+    float c = v * s;  /* Chroma: the color intensity component */
+    float hh = h / 60.0f;  /* Scale hue to 0-6 range */
+    float x = c * ((int)hh % 2 == 0 ? hh - (int)hh : 1 - (hh - (int)hh));
+    float m = v - c;  /* Match value: brings color to desired brightness */
+
+    /* Determine which sextant of the color wheel we're in */
+    if (hh < 1) {
+        color.red = (unsigned char)((c + m) * 255);
+        color.green = (unsigned char)((x + m) * 255);
+        color.blue = (unsigned char)(m * 255);
+    } else if (hh < 2) {
+        color.red = (unsigned char)((x + m) * 255);
+        color.green = (unsigned char)((c + m) * 255);
+        color.blue = (unsigned char)(m * 255);
+    } else if (hh < 3) {
+        color.red = (unsigned char)(m * 255);
+        color.green = (unsigned char)((c + m) * 255);
+        color.blue = (unsigned char)((x + m) * 255);
+    } else if (hh < 4) {
+        color.red = (unsigned char)(m * 255);
+        color.green = (unsigned char)((x + m) * 255);
+        color.blue = (unsigned char)((c + m) * 255);
+    } else if (hh < 5) {
+        color.red = (unsigned char)((x + m) * 255);
+        color.green = (unsigned char)(m * 255);
+        color.blue = (unsigned char)((c + m) * 255);
+    } else {
+        color.red = (unsigned char)((c + m) * 255);
+        color.green = (unsigned char)(m * 255);
+        color.blue = (unsigned char)((x + m) * 255);
+    }
+
+    return color;
+}
+
+/*
+ * ============================================================================
+ * RENDER SURFACE AND DAMAGE TRACKING
+ * ============================================================================
+ */
+
+/* Axis-aligned rectangle in surface pixels, covering [x, x+w) by [y, y+h) */
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+} Rect;
+
+/*
+ * Off-screen "shadow" copy of the screen. Every pixel is stored as a
+ * 32-bit 0x00RRGGBB value regardless of the display's native format, so
+ * drawing code never has to care about bits_per_pixel or channel order.
+ */
+typedef struct {
+    uint32_t *pixels;
+    unsigned int width;
+    unsigned int height;
+    size_t stride;  /* Distance between rows, in pixels */
+    size_t map_len; /* Length of the pixel mapping, 0 if pixels came from calloc() */
+    int pages;      /* PAGES_* the pixels actually got */
+} Surface;
+
+/* How surface memory is backed (--huge-pages) */
+enum {
+    PAGES_SMALL,    /* Ordinary 4 KiB pages */
+    PAGES_THP,      /* Transparent huge pages, if the kernel has them enabled */
+    PAGES_HUGETLB   /* Reserved huge pages (vm.nr_hugepages), else transparent ones */
+};
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+/* Set once from the command line, before the first surface is created */
+static int surface_pages = PAGES_THP;
+
+/*
+ * Upper bound on tracked dirty rectangles. Once the list is full, new
+ * damage is merged into whichever existing rectangle grows the least,
+ * so memory stays fixed and a flush never degenerates into thousands of
+ * tiny copies.
+ */
+#define DAMAGE_MAX_RECTS 16
+
+/* Set of regions of a surface that changed since the last flush */
+typedef struct {
+    Rect rects[DAMAGE_MAX_RECTS];
+    int count;
+    Rect bounds;  /* Damage is clipped to this (the whole surface) */
+} Damage;
+
+static inline uint32_t pack_rgb(RGB c)
+{
+    return ((uint32_t)c.red << 16) | ((uint32_t)c.green << 8) | c.blue;
+}
+
+static inline uint32_t *surface_row(const Surface *s, unsigned int y)
+{
+    return s->pixels + (size_t)y * s->stride;
+}
+
+/*
+ * Function: pixels_alloc
+ *
+ * Allocates bytes of zeroed pixel memory. With 4 KiB pages, a pass
+ * down a column of a 1080p surface needs a new TLB entry every other
+ * row, and one at 8K needs one for every row. So buffers of a huge page
+ * or more are mapped on a 2 MiB boundary, where one TLB entry covers
+ * hundreds of rows. They are mapped from the reserved pool with
+ * MAP_HUGETLB when asked and the pool has room. Otherwise they are
+ * ordinary anonymous memory marked MADV_HUGEPAGE, which the kernel
+ * backs with transparent huge pages when it can.
+ *
+ * *map_len is set to the length of the mapping, or 0 if the memory came
+ * from calloc(), and *pages to the PAGES_* asked of the kernel.
+ *
+ * Returns: the memory, or NULL if it could not be allocated
+ */
+static void *pixels_alloc(size_t bytes, size_t *map_len, int *pages)
+{
+    *map_len = 0;
+    *pages = PAGES_SMALL;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (surface_pages != PAGES_SMALL && bytes >= HUGE_PAGE_SIZE) {
+        size_t len = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        unsigned char *p;
+
+#ifdef MAP_HUGETLB
+        if (surface_pages == PAGES_HUGETLB) {
+            p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) {
+                *map_len = len;
+                *pages = PAGES_HUGETLB;
+                return p;
+            }
+            /* No pool, or it is used up: fall through to transparent huge pages */
+        }
+#endif
+        /* One huge page extra, trimmed off again once the boundary is known */
+        p = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            size_t head = -(uintptr_t)p & (HUGE_PAGE_SIZE - 1);
+
+            if (head)
+                munmap(p, head);
+            munmap(p + head + len, HUGE_PAGE_SIZE - head);
+            madvise(p + head, len, MADV_HUGEPAGE);   /* A hint; fails harmlessly with THP off */
+            *map_len = len;
+            *pages = PAGES_THP;
+            return p + head;
+        }
+    }
+#endif
+    return calloc(bytes, 1);
+}
+
+static void pixels_free(void *p, size_t map_len)
+{
+#ifdef __linux__
+    if (map_len) {
+        munmap(p, map_len);
+        return;
+    }
+#endif
+    free(p);
+}
+
+/*
+ * Function: surface_create
+ *
+ * Allocates a zero-filled (black) surface of the given size, on huge
+ * pages when it is big enough (see pixels_alloc).
+ *
+ * Returns: 0 on success, -1 if memory could not be allocated
+ */
+int surface_create(Surface *s, unsigned int width, unsigned int height)
+{
+    s->width = width;
+    s->height = height;
+    s->stride = width;
+    s->pixels = pixels_alloc((size_t)width * height * sizeof(uint32_t), &s->map_len, &s->pages);
+    return s->pixels ? 0 : -1;
+}
+
+void surface_destroy(Surface *s)
+{
+    pixels_free(s->pixels, s->map_len);
+    s->pixels = NULL;
+    s->map_len = 0;
+}
+
+static inline int64_t rect_area(Rect r)
+{
+    return (int64_t)r.w * r.h;
+}
+
+static Rect rect_union(Rect a, Rect b)
+{
+    Rect u;
+    int x1 = a.x + a.w > b.x + b.w ? a.x + a.w : b.x + b.w;
+    int y1 = a.y + a.h > b.y + b.h ? a.y + a.h : b.y + b.h;
+
+    u.x = a.x < b.x ? a.x : b.x;
+    u.y = a.y < b.y ? a.y : b.y;
+    u.w = x1 - u.x;
+    u.h = y1 - u.y;
+    return u;
+}
+
+/* Clips r to bounds; returns 0 if nothing is left */
+static int rect_clip(Rect *r, Rect bounds)
+{
+    int x0 = r->x > bounds.x ? r->x : bounds.x;
+    int y0 = r->y > bounds.y ? r->y : bounds.y;
+    int x1 = r->x + r->w < bounds.x + bounds.w ? r->x + r->w : bounds.x + bounds.w;
+    int y1 = r->y + r->h < bounds.y + bounds.h ? r->y + r->h : bounds.y + bounds.h;
+
+    if (x1 <= x0 || y1 <= y0)
+        return 0;
+    r->x = x0;
+    r->y = y0;
+    r->w = x1 - x0;
+    r->h = y1 - y0;
+    return 1;
+}
+
+void damage_init(Damage *d, const Surface *s)
+{
+    d->count = 0;
+    d->bounds.x = 0;
+    d->bounds.y = 0;
+    d->bounds.w = (int)s->width;
+    d->bounds.h = (int)s->height;
+}
+
+void damage_clear(Damage *d)
+{
+    d->count = 0;
+}
+
+/*
+ * Function: damage_add
+ *
+ * Records that region r of the surface changed.
+ *
+ * Overlapping or nearly adjacent rectangles are merged when their union
+ * wastes little area (at most 1/8 more pixels than the two parts), which
+ * keeps the list short for typical widget-style updates. When the list is
+ * full, r is merged into the rectangle whose area grows the least.
+ */
+void damage_add(Damage *d, Rect r)
+{
+    if (!rect_clip(&r, d->bounds))
+        return;
+
+    for (;;) {
+        int merged = 0;
+
+        for (int i = 0; i < d->count; i++) {
+            Rect u = rect_union(d->rects[i], r);
+            int64_t parts = rect_area(d->rects[i]) + rect_area(r);
+
+            if (rect_area(u) <= parts + parts / 8) {
+                /* Take the union out of the list and retry, it may now touch others */
+                d->rects[i] = d->rects[--d->count];
+                r = u;
+                merged = 1;
+                break;
+            }
+        }
+        if (!merged)
+            break;
+    }
+
+    if (d->count < DAMAGE_MAX_RECTS) {
+        d->rects[d->count++] = r;
+        return;
+    }
+
+    int best = 0;
+    int64_t best_growth = INT64_MAX;
+    for (int i = 0; i < d->count; i++) {
+        int64_t growth = rect_area(rect_union(d->rects[i], r)) - rect_area(d->rects[i]);
+        if (growth < best_growth) {
+            best_growth = growth;
+            best = i;
+        }
+    }
+    d->rects[best] = rect_union(d->rects[best], r);
+}
+
+/* Marks the whole surface as changed */
+void damage_add_all(Damage *d)
+{
+    d->count = 0;
+    damage_add(d, d->bounds);
+}
+
+/*
+ * Where output stages (frame buffer flush, RFB publish) get finished
+ * pixels from. By default that is the surface itself; a compositor can
+ * step in and hand out rows with layers blended on top. row() returns w
+ * pixels of row y starting at column x, valid until the next call.
+ */
+typedef struct {
+    const uint32_t *(*row)(void *ctx, const Surface *s, int y, int x, int w);
+    void *ctx;
+} RowSource;
+
+/* Reads a row segment through src, or straight from the surface if src is NULL */
+static inline const uint32_t *source_row(const RowSource *src, const Surface *s, int y, int x, int w)
+{
+    return src ? src->row(src->ctx, s, y, x, w) : surface_row(s, (unsigned int)y) + x;
+}
+
+/*
+ * ============================================================================
+ * TILE HASH CHANGE DETECTION
+ * ============================================================================
+ *
+ * For content produced by code that cannot report what it changed, the
+ * surface is split into TILE_SIZE x TILE_SIZE tiles and each tile is
+ * hashed after rendering. Only tiles whose hash differs from the previous
+ * frame are flushed, and a frame identical to the last one is not flushed
+ * at all.
+ */
+
+#define TILE_SIZE 64
+
+typedef struct {
+    unsigned int cols;
+    unsigned int rows;
+    uint64_t *hashes;       /* Hash of every tile as of the last frame, 0 = never seen */
+    unsigned char *marks;   /* Scratch: 1 = candidate, 2 = changed */
+} TileHasher;
+
+int tile_hasher_init(TileHasher *th, const Surface *s)
+{
+    th->cols = (s->width + TILE_SIZE - 1) / TILE_SIZE;
+    th->rows = (s->height + TILE_SIZE - 1) / TILE_SIZE;
+    th->hashes = calloc((size_t)th->cols * th->rows, sizeof(uint64_t));
+    th->marks = calloc((size_t)th->cols * th->rows, 1);
+    if (!th->hashes || !th->marks) {
+        free(th->hashes);
+        free(th->marks);
+        return -1;
+    }
+    return 0;
+}
+
+void tile_hasher_destroy(TileHasher *th)
+{
+    free(th->hashes);
+    free(th->marks);
+    th->hashes = NULL;
+    th->marks = NULL;
+}
+
+#define HASH_PRIME1 0x9E3779B97F4A7C15ull
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define HASH_LANES 8
+
+static inline uint64_t hash_mix(uint64_t h, uint64_t v)
+{
+    h ^= v * HASH_PRIME1;
+    h = (h << 31) | (h >> 33);
+    return h * HASH_PRIME2;
+}
+
+/*
+ * Function: tile_hash
+ *
+ * Hashes the pixels of one tile. The inner loop is an XXH3-style
+ * accumulator: each 8-byte word is keyed and its two 32-bit halves are
+ * multiplied together, one 32x32->64 multiply per word across eight
+ * independent lanes. There is no loop-carried multiply chain, so with
+ * SSE2 (pmuludq) the hash runs well above DRAM bandwidth and the tile
+ * reads dominate.
+ */
+static uint64_t tile_hash(const Surface *s, unsigned int tx, unsigned int ty)
+{
+    static const uint64_t keys[HASH_LANES] = {
+        0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull, 0x78e5c0cc4ee679cbull,
+        0x2172ffcc7dd05a82ull, 0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull, 0xcb00c391bb52283cull,
+    };
+    unsigned int x0 = tx * TILE_SIZE;
+    unsigned int y0 = ty * TILE_SIZE;
+    unsigned int w = s->width - x0 < TILE_SIZE ? s->width - x0 : TILE_SIZE;
+    unsigned int h = s->height - y0 < TILE_SIZE ? s->height - y0 : TILE_SIZE;
+    size_t bytes = (size_t)w * 4;
+    size_t body = bytes - bytes % (HASH_LANES * 8);
+    uint64_t acc[HASH_LANES] = { 0 };
+    uint64_t tail = HASH_PRIME1;
+
+#ifdef __SSE2__
+    __m128i a0 = _mm_setzero_si128(), a1 = a0, a2 = a0, a3 = a0;
+    const __m128i k0 = _mm_loadu_si128((const __m128i *)keys + 0);
+    const __m128i k1 = _mm_loadu_si128((const __m128i *)keys + 1);
+    const __m128i k2 = _mm_loadu_si128((const __m128i *)keys + 2);
+    const __m128i k3 = _mm_loadu_si128((const __m128i *)keys + 3);
+#define HASH_ACCUMULATE(a, k, ptr) do { \
+        __m128i v_ = _mm_loadu_si128((const __m128i *)(ptr)); \
+        __m128i d_ = _mm_xor_si128(v_, k); \
+        a = _mm_add_epi64(a, _mm_add_epi64(v_, _mm_mul_epu32(d_, _mm_srli_epi64(d_, 32)))); \
+    } while (0)
+#endif
+
+    for (unsigned int y = 0; y < h; y++) {
+        const unsigned char *p = (const unsigned char *)(surface_row(s, y0 + y) + x0);
+        size_t i = 0;
+
+#ifdef __SSE2__
+        for (; i < body; i += HASH_LANES * 8) {
+            HASH_ACCUMULATE(a0, k0, p + i);
+            HASH_ACCUMULATE(a1, k1, p + i + 16);
+            HASH_ACCUMULATE(a2, k2, p + i + 32);
+            HASH_ACCUMULATE(a3, k3, p + i + 48);
+        }
+#else
+        for (; i < body; i += HASH_LANES * 8) {
+            uint64_t v[HASH_LANES];
+            memcpy(v, p + i, sizeof(v));
+            for (int l = 0; l < HASH_LANES; l++) {
+                uint64_t k = v[l] ^ keys[l];
+                acc[l] += v[l] + (k & 0xffffffffu) * (k >> 32);
+            }
+        }
+#endif
+        for (; i < bytes; i += 4) {
+            uint32_t v;
+            memcpy(&v, p + i, 4);
+            tail = hash_mix(tail, v);
+        }
+    }
+
+#ifdef __SSE2__
+#undef HASH_ACCUMULATE
+    _mm_storeu_si128((__m128i *)acc + 0, a0);
+    _mm_storeu_si128((__m128i *)acc + 1, a1);
+    _mm_storeu_si128((__m128i *)acc + 2, a2);
+    _mm_storeu_si128((__m128i *)acc + 3, a3);
+#endif
+    uint64_t result = tail;
+    for (int l = 0; l < HASH_LANES; l++)
+        result = hash_mix(result, acc[l]);
+    return result;
+}
+
+/*
+ * Function: tile_hasher_filter
+ *
+ * Narrows the damage in d down to the tiles whose contents really changed
+ * since the previous call. Only tiles touched by d are hashed, so callers
+ * that know nothing about what they changed simply report full-surface
+ * damage and let the hashes sort it out.
+ *
+ * Returns: number of changed tiles; 0 means d is empty and the flush can
+ *          be skipped entirely
+ */
+int tile_hasher_filter(TileHasher *th, const Surface *s, Damage *d)
+{
+    int changed = 0;
+
+    for (int i = 0; i < d->count; i++) {
+        Rect r = d->rects[i];
+        unsigned int tx1 = (unsigned int)(r.x + r.w - 1) / TILE_SIZE;
+        unsigned int ty1 = (unsigned int)(r.y + r.h - 1) / TILE_SIZE;
+
+        for (unsigned int ty = (unsigned int)r.y / TILE_SIZE; ty <= ty1; ty++)
+            for (unsigned int tx = (unsigned int)r.x / TILE_SIZE; tx <= tx1; tx++)
+                th->marks[(size_t)ty * th->cols + tx] = 1;
+    }
+    damage_clear(d);
+
+    for (unsigned int ty = 0; ty < th->rows; ty++) {
+        unsigned char *marks = th->marks + (size_t)ty * th->cols;
+        uint64_t *hashes = th->hashes + (size_t)ty * th->cols;
+
+        for (unsigned int tx = 0; tx < th->cols; tx++) {
+            if (!marks[tx])
+                continue;
+            uint64_t h = tile_hash(s, tx, ty);
+            if (h != hashes[tx]) {
+                hashes[tx] = h;
+                marks[tx] = 2;
+                changed++;
+            } else {
+                marks[tx] = 0;
+            }
+        }
+
+        /* Report each horizontal run of changed tiles as one rectangle */
+        for (unsigned int tx = 0; tx < th->cols; tx++) {
+            if (marks[tx] != 2)
+                continue;
+            unsigned int end = tx;
+            while (end < th->cols && marks[end] == 2)
+                marks[end++] = 0;
+            Rect run = { (int)(tx * TILE_SIZE), (int)(ty * TILE_SIZE),
+                         (int)((end - tx) * TILE_SIZE), TILE_SIZE };
+            damage_add(d, run);
+            tx = end;
+        }
+    }
+    return changed;
+}
+
+/*
+ * ============================================================================
+ * LAYER COMPOSITOR
+ * ============================================================================
+ *
+ * Semi-transparent layers (logos, status bars) are kept apart from the
+ * shadow surface and only blended in on the way out: the compositor acts
+ * as a RowSource, so fb_flush() reads a base row, blends every layer over
+ * it and converts the result to the native pixel format in one pass, for
+ * damaged rows only. The base surface is never modified, so a layer can
+ * move or change without redrawing what lies beneath it.
+ *
+ * Layer pixels are premultiplied 0xAARRGGBB. For each 64x64 tile of a
+ * layer the compositor knows whether it is fully transparent (skipped),
+ * fully opaque (copied) or mixed (blended), so the blend kernel only
+ * runs where it has to.
+ */
+
+#define COMPOSITOR_MAX_LAYERS 16
+
+enum { COVER_EMPTY, COVER_OPAQUE, COVER_MIXED };
+
+typedef struct {
+    Surface pixels;               /* Premultiplied 0xAARRGGBB */
+    int x;                        /* Position of the layer's top-left corner on screen */
+    int y;
+    int z;                        /* Stacking order for compositor_insert(), higher in front */
+    int visible;
+    unsigned int cols;
+    unsigned int rows;
+    unsigned char *coverage;      /* One COVER_* per TILE_SIZE tile of the layer */
+} Layer;
+
+typedef struct {
+    Layer *layers[COMPOSITOR_MAX_LAYERS];   /* Bottom to top */
+    int count;
+    uint32_t *row;                /* Scratch: one composed row segment */
+    RowSource source;
+} Compositor;
+
+int layer_create(Layer *l, unsigned int width, unsigned int height)
+{
+    memset(l, 0, sizeof(*l));
+    l->visible = 1;
+    l->cols = (width + TILE_SIZE - 1) / TILE_SIZE;
+    l->rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+    l->coverage = calloc((size_t)l->cols * l->rows, 1);   /* All COVER_EMPTY, like the pixels */
+    if (!l->coverage || surface_create(&l->pixels, width, height) != 0) {
+        free(l->coverage);
+        return -1;
+    }
+    return 0;
+}
+
+void layer_destroy(Layer *l)
+{
+    surface_destroy(&l->pixels);
+    free(l->coverage);
+    l->coverage = NULL;
+}
+
+/*
+ * Function: layer_update_coverage
+ *
+ * Re-derives the per-tile coverage of the tiles overlapping r (in layer
+ * coordinates). Call after drawing into the layer.
+ */
+void layer_update_coverage(Layer *l, Rect r)
+{
+    Rect all = { 0, 0, (int)l->pixels.width, (int)l->pixels.height };
+
+    if (!rect_clip(&r, all))
+        return;
+    for (unsigned int ty = (unsigned int)r.y / TILE_SIZE; ty <= (unsigned int)(r.y + r.h - 1) / TILE_SIZE; ty++) {
+        for (unsigned int tx = (unsigned int)r.x / TILE_SIZE; tx <= (unsigned int)(r.x + r.w - 1) / TILE_SIZE; tx++) {
+            Rect t = { (int)(tx * TILE_SIZE), (int)(ty * TILE_SIZE), TILE_SIZE, TILE_SIZE };
+            uint32_t and_all = 0xffffffffu, or_all = 0;
+
+            rect_clip(&t, all);
+            for (int y = t.y; y < t.y + t.h; y++) {
+                const uint32_t *p = surface_row(&l->pixels, (unsigned int)y) + t.x;
+                for (int x = 0; x < t.w; x++) {
+                    and_all &= p[x];
+                    or_all |= p[x];
+                }
+            }
+            l->coverage[(size_t)ty * l->cols + tx] =
+                (or_all >> 24) == 0 ? COVER_EMPTY : (and_all >> 24) == 0xff ? COVER_OPAQUE : COVER_MIXED;
+        }
+    }
+}
+
+static inline Rect layer_rect(const Layer *l)
+{
+    Rect r = { l->x, l->y, (int)l->pixels.width, (int)l->pixels.height };
+    return r;
+}
+
+/*
+ * Function: blend_over_span
+ *
+ * Porter-Duff "over": dst = src + dst * (255 - src.alpha) / 255 for n
+ * pixels, with premultiplied src and opaque 0x00RRGGBB dst. The division
+ * by 255 is exact (t + (t >> 8)) >> 8 with rounding, so the SSE2 path
+ * and the scalar path give identical results. Groups of four pixels that
+ * are all transparent or all opaque skip the arithmetic.
+ */
+static void blend_over_span(uint32_t *dst, const uint32_t *src, int n)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c255 = _mm_set1_epi16(255);
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000u);
+    const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i a = _mm_and_si128(s, alpha);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, zero)) == 0xffff)
+            continue;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, alpha)) == 0xffff) {
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_and_si128(s, rgb));
+            continue;
+        }
+
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i slo = _mm_unpacklo_epi8(s, zero), shi = _mm_unpackhi_epi8(s, zero);
+        __m128i dlo = _mm_unpacklo_epi8(d, zero), dhi = _mm_unpackhi_epi8(d, zero);
+        /* Broadcast each pixel's alpha word across its four channel words */
+        __m128i alo = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xff), 0xff));
+        __m128i ahi = _mm_sub_epi16(c255, _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xff), 0xff));
+        __m128i tlo = _mm_add_epi16(_mm_mullo_epi16(dlo, alo), c128);
+        __m128i thi = _mm_add_epi16(_mm_mullo_epi16(dhi, ahi), c128);
+
+        tlo = _mm_srli_epi16(_mm_add_epi16(tlo, _mm_srli_epi16(tlo, 8)), 8);
+        thi = _mm_srli_epi16(_mm_add_epi16(thi, _mm_srli_epi16(thi, 8)), 8);
+        __m128i out = _mm_adds_epu8(_mm_packus_epi16(tlo, thi), s);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_and_si128(out, rgb));
+    }
+#endif
+    for (; i < n; i++) {
+        uint32_t s = src[i];
+        uint32_t ia = 255 - (s >> 24);
+        uint32_t d = dst[i];
+        uint32_t out = 0;
+
+        if (ia == 255)
+            continue;
+        for (int shift = 0; shift < 24; shift += 8) {
+            uint32_t t = ((d >> shift) & 0xff) * ia + 128;
+            uint32_t c = ((t + (t >> 8)) >> 8) + ((s >> shift) & 0xff);
+            out |= (c > 255 ? 255 : c) << shift;
+        }
+        dst[i] = out;
+    }
+}
+
+/* Blends the part of layer l that overlaps row y, columns [x0, x1), into out (indexed from x0) */
+static void compose_layer_row(const Layer *l, int y, int x0, int x1, uint32_t *out)
+{
+    int ly = y - l->y;
+    int from = x0 > l->x ? x0 : l->x;
+    int to = x1 < l->x + (int)l->pixels.width ? x1 : l->x + (int)l->pixels.width;
+    const uint32_t *src = surface_row(&l->pixels, (unsigned int)ly) - l->x;
+    const unsigned char *cover = l->coverage + (size_t)(ly / TILE_SIZE) * l->cols;
+
+    /* Walk the span tile by tile so each piece is handled per its coverage */
+    for (int x = from; x < to;) {
+        int lx = x - l->x;
+        int end = l->x + (lx / TILE_SIZE + 1) * TILE_SIZE;
+        if (end > to)
+            end = to;
+
+        switch (cover[lx / TILE_SIZE]) {
+        case COVER_EMPTY:
+            break;
+        case COVER_OPAQUE:
+            for (int i = x; i < end; i++)
+                out[i - x0] = src[i] & 0x00ffffff;
+            break;
+        default:
+            blend_over_span(out + (x - x0), src + x, end - x);
+            break;
+        }
+        x = end;
+    }
+}
+
+/*
+ * RowSource callback: the finished (composited) pixels of one row segment.
+ * Rows no visible layer touches are returned straight from the surface.
+ */
+static const uint32_t *compositor_row(void *ctx, const Surface *s, int y, int x, int w)
+{
+    Compositor *c = ctx;
+    const uint32_t *base = surface_row(s, (unsigned int)y) + x;
+    int copied = 0;
+
+    for (int i = 0; i < c->count; i++) {
+        const Layer *l = c->layers[i];
+
+        if (!l->visible || y < l->y || y >= l->y + (int)l->pixels.height ||
+            x + w <= l->x || x >= l->x + (int)l->pixels.width)
+            continue;
+        if (!copied) {
+            memcpy(c->row, base, (size_t)w * sizeof(uint32_t));
+            copied = 1;
+        }
+        compose_layer_row(l, y, x, x + w, c->row);
+    }
+    return copied ? c->row : base;
+}
+
+/* Prepares a compositor for surfaces up to max_width pixels wide */
+int compositor_init(Compositor *c, unsigned int max_width)
+{
+    memset(c, 0, sizeof(*c));
+    c->row = malloc((size_t)max_width * sizeof(uint32_t));
+    c->source.row = compositor_row;
+    c->source.ctx = c;
+    return c->row ? 0 : -1;
+}
+
+void compositor_destroy(Compositor *c)
+{
+    free(c->row);
+    c->row = NULL;
+}
+
+/* Puts a layer on top of the stack; the caller keeps ownership */
+int compositor_add(Compositor *c, Layer *l)
+{
+    if (c->count == COMPOSITOR_MAX_LAYERS)
+        return -1;
+    c->layers[c->count++] = l;
+    return 0;
+}
+
+/* Puts a layer above every layer with the same or a lower z and below the rest */
+int compositor_insert(Compositor *c, Layer *l)
+{
+    int at = c->count;
+
+    if (c->count == COMPOSITOR_MAX_LAYERS)
+        return -1;
+    while (at > 0 && c->layers[at - 1]->z > l->z) {
+        c->layers[at] = c->layers[at - 1];
+        at--;
+    }
+    c->layers[at] = l;
+    c->count++;
+    return 0;
+}
+
+/* Takes a layer out of the stack, if it is in it */
+void compositor_remove(Compositor *c, const Layer *l)
+{
+    for (int i = 0; i < c->count; i++) {
+        if (c->layers[i] == l) {
+            memmove(&c->layers[i], &c->layers[i + 1], (size_t)(c->count - i - 1) * sizeof(c->layers[0]));
+            c->count--;
+            return;
+        }
+    }
+}
+
+/* Fills a rectangle of a layer with one premultiplied colour */
+void layer_fill(Layer *l, Rect r, uint32_t argb)
+{
+    Rect all = { 0, 0, (int)l->pixels.width, (int)l->pixels.height };
+
+    if (!rect_clip(&r, all))
+        return;
+    for (int y = r.y; y < r.y + r.h; y++) {
+        uint32_t *row = surface_row(&l->pixels, (unsigned int)y);
+        for (int x = r.x; x < r.x + r.w; x++)
+            row[x] = argb;
+    }
+}
+
+/*
+ * ============================================================================
+ * 2D PRIMITIVES
+ * ============================================================================
+ *
+ * Solid and gradient rectangles, lines (plain Bresenham and anti-aliased
+ * Wu), circles and filled polygons, all drawn straight into a Surface and
+ * clipped to a caller-supplied rectangle. Every function returns the
+ * rectangle it may have touched so the caller can feed it to damage_add().
+ *
+ * DrawBatch queues primitives into flat arrays that are reused from frame
+ * to frame, so building a frame of thousands of primitives costs no
+ * allocations once the arrays have grown to size.
+ */
+
+typedef struct {
+    int x;
+    int y;
+} Point;
+
+/* Fills wider than this many bytes in total bypass the cache */
+#define FILL_STREAM_BYTES (1u << 20)
+
+/* Polygons are filled from a fixed-size edge table on the stack */
+#define POLY_MAX_POINTS 64
+
+enum { GRADIENT_HORIZONTAL, GRADIENT_VERTICAL };
+
+static inline int64_t floor_div(int64_t a, int64_t b)   /* b > 0 */
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static inline int64_t ceil_div(int64_t a, int64_t b)    /* b > 0 */
+{
+    return -floor_div(-a, b);
+}
+
+/* Integer square root, floor(sqrt(v)) */
+static unsigned int isqrt(uint64_t v)
+{
+    uint64_t r = 0, bit = (uint64_t)1 << 62;
+
+    while (bit > v)
+        bit >>= 2;
+    while (bit) {
+        if (v >= r + bit) {
+            v -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (unsigned int)r;
+}
+
+/*
+ * Function: fill_span
+ *
+ * Sets n pixels to c. With stream set, the aligned middle of the span is
+ * written with non-temporal stores that do not pull the destination into
+ * the cache; the caller issues the closing _mm_sfence().
+ */
+static void fill_span(uint32_t *p, int n, uint32_t c, int stream)
+{
+#ifdef __SSE2__
+    __m128i v = _mm_set1_epi32((int)c);
+
+    for (; n > 0 && ((uintptr_t)p & 15); n--)
+        *p++ = c;
+    if (stream) {
+        for (; n >= 4; n -= 4, p += 4)
+            _mm_stream_si128((__m128i *)p, v);
+    } else {
+        for (; n >= 4; n -= 4, p += 4)
+            _mm_store_si128((__m128i *)p, v);
+    }
+#else
+    (void)stream;
+#endif
+    while (n-- > 0)
+        *p++ = c;
+}
+
+/*
+ * Blends colour c into one pixel with coverage a (0-256, 256 = opaque).
+ * A channel that gets darker borrows from the one above it; masking
+ * after the add drops that borrow with the carries.
+ */
+static inline void blend_pixel(uint32_t *p, uint32_t c, unsigned int a)
+{
+    uint32_t d = *p;
+    uint32_t rb = d & 0xff00ff, g = d & 0x00ff00;
+
+    rb = (rb + (((c & 0xff00ff) - rb) * a >> 8)) & 0xff00ff;
+    g = (g + (((c & 0x00ff00) - g) * a >> 8)) & 0x00ff00;
+    *p = rb | g;
+}
+
+/*
+ * Function: blend_check
+ *
+ * Blends dark over light, light over dark and both at once (one channel
+ * each way) at full and partial coverage, and compares with the results
+ * worked out by hand.
+ *
+ * Returns: 0 if blend_pixel() got every one right, -1 if not
+ */
+int blend_check(void)
+{
+    static const struct { uint32_t dst, c; unsigned int a; uint32_t want; } cases[] = {
+        { 0xffffff, 0x000000, 256, 0x000000 },
+        { 0xffffff, 0x000000, 128, 0x7f7f7f },
+        { 0x808080, 0x404040, 256, 0x404040 },
+        { 0x000000, 0xffffff, 256, 0xffffff },
+        { 0x000000, 0xffffff, 128, 0x7f7f7f },
+        { 0x404040, 0x808080, 64, 0x505050 },
+        { 0xf010f0, 0x10f010, 64, 0xb848b8 },
+        { 0x10f010, 0xf010f0, 256, 0xf010f0 },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        uint32_t p = cases[i].dst;
+        blend_pixel(&p, cases[i].c, cases[i].a);
+        if (p != cases[i].want) {
+            fprintf(stderr, "Blend check failed: %06x over %06x at %u/256 gave %08x, not %06x\n",
+                    cases[i].c, cases[i].dst, cases[i].a, p, cases[i].want);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* The part of clip that lies on the surface */
+static inline Rect clip_to_surface(const Surface *s, Rect clip)
+{
+    Rect all = { 0, 0, (int)s->width, (int)s->height };
+    if (!rect_clip(&clip, all))
+        clip.w = clip.h = 0;
+    return clip;
+}
+
+Rect fill_rect(Surface *s, Rect clip, Rect r, uint32_t c)
+{
+    if (!rect_clip(&r, clip_to_surface(s, clip)))
+        return r;
+
+    int stream = (uint64_t)r.w * (uint64_t)r.h * 4 >= FILL_STREAM_BYTES;
+    for (int y = r.y; y < r.y + r.h; y++)
+        fill_span(surface_row(s, (unsigned int)y) + r.x, r.w, c, stream);
+#ifdef __SSE2__
+    if (stream)
+        _mm_sfence();
+#endif
+    return r;
+}
+
+/* Colour a fraction pos/len of the way from c0 to c1, len > 0 */
+static inline uint32_t lerp_rgb(uint32_t c0, uint32_t c1, int64_t pos, int64_t len)
+{
+    uint32_t out = 0;
+
+    for (int shift = 0; shift < 24; shift += 8) {
+        int64_t a = (c0 >> shift) & 0xff, b = (c1 >> shift) & 0xff;
+        out |= (uint32_t)(a + floor_div((b - a) * pos * 2 + len, 2 * len)) << shift;
+    }
+    return out;
+}
+
+/*
+ * Function: fill_rect_gradient
+ *
+ * Fills r with a linear gradient from c0 to c1 running left to right
+ * (GRADIENT_HORIZONTAL) or top to bottom (GRADIENT_VERTICAL). Colours are
+ * positioned against the whole rectangle, so clipping does not shift them.
+ */
+Rect fill_rect_gradient(Surface *s, Rect clip, Rect r, uint32_t c0, uint32_t c1, int direction)
+{
+    Rect full = r;
+
+    if (!rect_clip(&r, clip_to_surface(s, clip)))
+        return r;
+
+    if (direction == GRADIENT_VERTICAL) {
+        int64_t len = full.h > 1 ? full.h - 1 : 1;
+        for (int y = r.y; y < r.y + r.h; y++)
+            fill_span(surface_row(s, (unsigned int)y) + r.x, r.w, lerp_rgb(c0, c1, y - full.y, len), 0);
+        return r;
+    }
+
+    /* Horizontal: one row is computed, the others are copies of it */
+    int64_t len = full.w > 1 ? full.w - 1 : 1;
+    uint32_t *first = surface_row(s, (unsigned int)r.y) + r.x;
+    for (int x = 0; x < r.w; x++)
+        first[x] = lerp_rgb(c0, c1, r.x + x - full.x, len);
+    for (int y = r.y + 1; y < r.y + r.h; y++)
+        memcpy(surface_row(s, (unsigned int)y) + r.x, first, (size_t)r.w * sizeof(uint32_t));
+    return r;
+}
+
+/*
+ * Function: draw_line
+ *
+ * One-pixel Bresenham line including both end points. Clipping is
+ * exact: the visible step range is solved for up front, so the pixels
+ * drawn are the same as for an unclipped line, and a line that runs far
+ * off screen costs only its visible length.
+ */
+Rect draw_line(Surface *s, Rect clip, int x0, int y0, int x1, int y1, uint32_t c)
+{
+    Rect box = { 0, 0, 0, 0 };
+
+    clip = clip_to_surface(s, clip);
+    if (clip.w == 0)
+        return box;
+
+    int64_t dx = (int64_t)x1 - x0, dy = (int64_t)y1 - y0;
+    int steep = (dy < 0 ? -dy : dy) > (dx < 0 ? -dx : dx);
+    /* Work in (major, minor) coordinates; steep lines swap x and y */
+    int64_t a0 = steep ? y0 : x0, b0 = steep ? x0 : y0;
+    int64_t da = steep ? dy : dx, db = steep ? dx : dy;
+    int64_t sa = da < 0 ? -1 : 1, sb = db < 0 ? -1 : 1;
+    int64_t ada = da * sa, adb = db * sb;
+    int64_t amin = steep ? clip.y : clip.x, amax = (steep ? clip.y + clip.h : clip.x + clip.w) - 1;
+    int64_t bmin = steep ? clip.x : clip.y, bmax = (steep ? clip.x + clip.w : clip.y + clip.h) - 1;
+
+    /* Step k puts the major coordinate at a0 + sa*k and the minor one at
+     * b0 + sb*q(k), q(k) = floor((2k*adb + ada) / (2*ada)). */
+    int64_t k0 = 0, k1 = ada;
+    int64_t lo = sa > 0 ? amin - a0 : a0 - amax, hi = sa > 0 ? amax - a0 : a0 - amin;
+    if (lo > k0) k0 = lo;
+    if (hi < k1) k1 = hi;
+
+    int64_t qlo = sb > 0 ? bmin - b0 : b0 - bmax, qhi = sb > 0 ? bmax - b0 : b0 - bmin;
+    if (adb == 0) {
+        if (qlo > 0 || qhi < 0)
+            return box;
+    } else {
+        int64_t klo = ceil_div(2 * ada * qlo - ada, 2 * adb);
+        int64_t khi = floor_div(2 * ada * (qhi + 1) - ada - 1, 2 * adb);
+        if (klo > k0) k0 = klo;
+        if (khi < k1) k1 = khi;
+    }
+    if (k0 > k1)
+        return box;
+
+    int64_t num = 2 * k0 * adb + ada, den = 2 * ada;
+    int64_t q = num / den, rem = num % den;
+    int64_t a = a0 + sa * k0, b = b0 + sb * q;
+    for (int64_t k = k0; k <= k1; k++) {
+        if (steep)
+            surface_row(s, (unsigned int)a)[b] = c;
+        else
+            surface_row(s, (unsigned int)b)[a] = c;
+        a += sa;
+        rem += 2 * adb;
+        if (rem >= den) {
+            rem -= den;
+            b += sb;
+        }
+    }
+
+    /* Bounding box of the drawn part: end points of the visible range */
+    int64_t b_end = b0 + sb * ((2 * k1 * adb + ada) / den);
+    int64_t b_start = b0 + sb * q;
+    int64_t a_start = a0 + sa * k0, a_end = a0 + sa * k1;
+    int64_t xa = steep ? b_start : a_start, xb = steep ? b_end : a_end;
+    int64_t ya = steep ? a_start : b_start, yb = steep ? a_end : b_end;
+    box.x = (int)(xa < xb ? xa : xb);
+    box.y = (int)(ya < yb ? ya : yb);
+    box.w = (int)((xa < xb ? xb - xa : xa - xb) + 1);
+    box.h = (int)((ya < yb ? yb - ya : ya - yb) + 1);
+    return box;
+}
+
+/*
+ * Function: draw_line_aa
+ *
+ * Xiaolin Wu anti-aliased line, blended into the surface. End points are
+ * in 24.8 fixed point so lines can start between pixels; as with
+ * draw_line(), whole numbers are pixel centres.
+ */
+Rect draw_line_aa(Surface *s, Rect clip, int fx0, int fy0, int fx1, int fy1, uint32_t c)
+{
+    Rect box = { 0, 0, 0, 0 };
+    int steep = abs(fy1 - fy0) > abs(fx1 - fx0);
+
+    clip = clip_to_surface(s, clip);
+    if (clip.w == 0)
+        return box;
+    if (steep) {
+        int t;
+        t = fx0; fx0 = fy0; fy0 = t;
+        t = fx1; fx1 = fy1; fy1 = t;
+    }
+    if (fx0 > fx1) {
+        int t;
+        t = fx0; fx0 = fx1; fx1 = t;
+        t = fy0; fy0 = fy1; fy1 = t;
+    }
+
+    /* Major axis runs over the pixel centres between x0 and x1 */
+    int64_t ax0 = ((int64_t)fx0 + 255) >> 8, ax1 = (int64_t)fx1 >> 8;
+    int64_t dx = fx1 - fx0, dy = fy1 - fy0;
+    int64_t grad = dx ? dy * 65536 / dx : 0;             /* 16.16 minor steps per major pixel */
+    int64_t amin = steep ? clip.y : clip.x, amax = (steep ? clip.y + clip.h : clip.x + clip.w) - 1;
+    int bmin = steep ? clip.x : clip.y, bmax = (steep ? clip.x + clip.w : clip.y + clip.h) - 1;
+    int64_t from = ax0 > amin ? ax0 : amin, to = ax1 < amax ? ax1 : amax;
+    int bx0 = bmax, bx1 = bmin;
+
+    for (int64_t a = from; a <= to; a++) {
+        /* Minor coordinate (24.16) at this column's centre */
+        int64_t along = a * 256 - fx0;
+        int64_t bpos = (int64_t)fy0 * 256 + along * grad / 256;
+        int b = (int)(bpos >> 16);
+        unsigned int frac = (unsigned int)(bpos >> 8) & 0xff;
+
+        for (int i = 0; i < 2; i++) {
+            int bb = b + i;
+            unsigned int cover = i ? frac : 255 - frac;
+            if (bb < bmin || bb > bmax || !cover)
+                continue;
+            blend_pixel(steep ? surface_row(s, (unsigned int)a) + bb : surface_row(s, (unsigned int)bb) + a,
+                        c, cover + 1);
+            if (bb < bx0) bx0 = bb;
+            if (bb > bx1) bx1 = bb;
+        }
+    }
+    if (from > to || bx0 > bx1)
+        return box;
+    box.x = steep ? bx0 : (int)from;
+    box.y = steep ? (int)from : bx0;
+    box.w = steep ? bx1 - bx0 + 1 : (int)(to - from + 1);
+    box.h = steep ? (int)(to - from + 1) : bx1 - bx0 + 1;
+    return box;
+}
+
+/* Half width of row dy of a circle of radius r, midpoint-rounded */
+static inline int circle_half_width(int r, int dy)
+{
+    return (int)isqrt((uint64_t)((int64_t)r * r + r - (int64_t)dy * dy));
+}
+
+/*
+ * Function: draw_circle
+ *
+ * One-pixel circle outline around (cx, cy), or a filled disc if fill is
+ * set. Both walk rows, so only visible rows cost anything.
+ */
+Rect draw_circle(Surface *s, Rect clip, int cx, int cy, int r, uint32_t c, int fill)
+{
+    Rect box = { cx - r, cy - r, 2 * r + 1, 2 * r + 1 };
+
+    if (r < 0 || !rect_clip(&box, clip_to_surface(s, clip))) {
+        box.w = box.h = 0;
+        return box;
+    }
+    clip = box;
+    for (int y = clip.y; y < clip.y + clip.h; y++) {
+        int dy = y - cy;
+        int hw = circle_half_width(r, dy);
+        uint32_t *row = surface_row(s, (unsigned int)y);
+        int x0 = cx - hw, x1 = cx + hw;
+
+        if (fill) {
+            if (x0 < clip.x) x0 = clip.x;
+            if (x1 > clip.x + clip.w - 1) x1 = clip.x + clip.w - 1;
+            if (x0 <= x1)
+                fill_span(row + x0, x1 - x0 + 1, c, 0);
+            continue;
+        }
+
+        /* Outline: each side runs from this row's edge in to just outside
+         * the next row towards the top or bottom, so the flat and steep
+         * parts of the circle both stay connected. */
+        int ady = dy < 0 ? -dy : dy;
+        int inner = ady < r ? circle_half_width(r, ady + 1) : -1;
+        if (inner >= hw)
+            inner = hw - 1;
+        for (int side = -1; side <= 1; side += 2) {
+            int lo = side < 0 ? cx - hw : cx + inner + 1;
+            int hi = side < 0 ? cx - inner - 1 : cx + hw;
+            if (lo < clip.x) lo = clip.x;
+            if (hi > clip.x + clip.w - 1) hi = clip.x + clip.w - 1;
+            for (int x = lo; x <= hi; x++)
+                row[x] = c;
+        }
+    }
+    return box;
+}
+
+typedef struct {
+    int64_t x;        /* 16.16 x at the current scan line's centre */
+    int64_t dxdy;     /* 16.16 x step per scan line */
+    int ymax;         /* Last scan line the edge covers */
+} PolyEdge;
+
+/*
+ * Function: fill_polygon
+ *
+ * Scan-line fill of a simple or self-intersecting polygon with the
+ * even-odd rule. A pixel is inside if its centre is, which makes
+ * polygons that share an edge tile without gaps or double coverage.
+ * Returns an empty rectangle for more than POLY_MAX_POINTS points.
+ */
+Rect fill_polygon(Surface *s, Rect clip, const Point *pts, int n, uint32_t c)
+{
+    PolyEdge edges[POLY_MAX_POINTS];
+    int ystart[POLY_MAX_POINTS];
+    int64_t xs[POLY_MAX_POINTS];
+    int order[POLY_MAX_POINTS];
+    int count = 0, miny = INT32_MAX, maxy = INT32_MIN;
+    Rect box = { 0, 0, 0, 0 };
+
+    clip = clip_to_surface(s, clip);
+    if (n < 3 || n > POLY_MAX_POINTS || clip.w == 0)
+        return box;
+
+    for (int i = 0; i < n; i++) {
+        Point p = pts[i], q = pts[(i + 1) % n];
+        if (p.y == q.y)
+            continue;
+        if (p.y > q.y) {
+            Point t = p;
+            p = q;
+            q = t;
+        }
+        /* Covers scan lines whose centre y + 0.5 lies in [p.y, q.y) */
+        PolyEdge *e = &edges[count];
+        e->dxdy = (int64_t)(q.x - p.x) * 65536 / (q.y - p.y);
+        e->x = (int64_t)p.x * 65536 + e->dxdy / 2;
+        e->ymax = q.y - 1;
+        ystart[count] = p.y;
+        if (p.y < miny) miny = p.y;
+        if (q.y - 1 > maxy) maxy = q.y - 1;
+        count++;
+    }
+    if (count == 0)
+        return box;
+
+    int y0 = miny > clip.y ? miny : clip.y;
+    int y1 = maxy < clip.y + clip.h - 1 ? maxy : clip.y + clip.h - 1;
+    int bx0 = clip.x + clip.w, bx1 = clip.x - 1;
+
+    for (int y = y0; y <= y1; y++) {
+        int m = 0;
+        for (int i = 0; i < count; i++) {
+            if (y < ystart[i] || y > edges[i].ymax)
+                continue;
+            int64_t x = edges[i].x + edges[i].dxdy * (y - ystart[i]);
+            /* Insertion sort: scan lines cross only a handful of edges */
+            int j = m++;
+            for (; j > 0 && xs[order[j - 1]] > x; j--)
+                order[j] = order[j - 1];
+            xs[i] = x;
+            order[j] = i;
+        }
+        uint32_t *row = surface_row(s, (unsigned int)y);
+        for (int i = 0; i + 1 < m; i += 2) {
+            /* Pixels whose centre x + 0.5 lies in [xa, xb) */
+            int64_t xa = (xs[order[i]] + 0x7fff) >> 16, xb = (xs[order[i + 1]] + 0x7fff) >> 16;
+            if (xa < clip.x) xa = clip.x;
+            if (xb > clip.x + clip.w) xb = clip.x + clip.w;
+            if (xa >= xb)
+                continue;
+            fill_span(row + xa, (int)(xb - xa), c, 0);
+            if (xa < bx0) bx0 = (int)xa;
+            if (xb - 1 > bx1) bx1 = (int)(xb - 1);
+        }
+    }
+    if (bx0 > bx1)
+        return box;
+    box.x = bx0;
+    box.y = y0;
+    box.w = bx1 - bx0 + 1;
+    box.h = y1 - y0 + 1;
+    return box;
+}
+
+enum { DRAW_RECT, DRAW_GRADIENT, DRAW_LINE, DRAW_LINE_AA, DRAW_CIRCLE, DRAW_DISC, DRAW_POLYGON };
+
+typedef struct {
+    unsigned char type;         /* DRAW_* */
+    unsigned char direction;    /* DRAW_GRADIENT: GRADIENT_* */
+    uint32_t color;
+    uint32_t color2;            /* DRAW_GRADIENT end colour */
+    int a, b, c, d;             /* Rect x/y/w/h, line end points, or circle cx/cy/r */
+    size_t points;              /* DRAW_POLYGON: offset into the point arena */
+} DrawCmd;
+
+typedef struct {
+    DrawCmd *cmds;
+    size_t count;
+    size_t cap;
+    Point *points;
+    size_t point_count;
+    size_t point_cap;
+} DrawBatch;
+
+void draw_batch_init(DrawBatch *b)
+{
+    memset(b, 0, sizeof(*b));
+}
+
+void draw_batch_destroy(DrawBatch *b)
+{
+    free(b->cmds);
+    free(b->points);
+    memset(b, 0, sizeof(*b));
+}
+
+void draw_batch_clear(DrawBatch *b)
+{
+    b->count = 0;
+    b->point_count = 0;
+}
+
+/* Reserves the next command slot; NULL if memory ran out */
+static DrawCmd *draw_batch_next(DrawBatch *b, int type, uint32_t color)
+{
+    if (b->count == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 256;
+        DrawCmd *c = realloc(b->cmds, cap * sizeof(*c));
+        if (!c)
+            return NULL;
+        b->cmds = c;
+        b->cap = cap;
+    }
+    DrawCmd *c = &b->cmds[b->count++];
+    c->type = (unsigned char)type;
+    c->color = color;
+    return c;
+}
+
+/* Queues a primitive; each returns -1 if memory ran out */
+int draw_batch_rect(DrawBatch *b, Rect r, uint32_t color)
+{
+    DrawCmd *c = draw_batch_next(b, DRAW_RECT, color);
+    if (!c)
+        return -1;
+    c->a = r.x, c->b = r.y, c->c = r.w, c->d = r.h;
+    return 0;
+}
+
+int draw_batch_gradient(DrawBatch *b, Rect r, uint32_t c0, uint32_t c1, int direction)
+{
+    DrawCmd *c = draw_batch_next(b, DRAW_GRADIENT, c0);
+    if (!c)
+        return -1;
+    c->color2 = c1;
+    c->direction = (unsigned char)direction;
+    c->a = r.x, c->b = r.y, c->c = r.w, c->d = r.h;
+    return 0;
+}
+
+/* Anti-aliased lines take 24.8 fixed-point end points, plain ones whole pixels */
+int draw_batch_line(DrawBatch *b, int x0, int y0, int x1, int y1, uint32_t color, int aa)
+{
+    DrawCmd *c = draw_batch_next(b, aa ? DRAW_LINE_AA : DRAW_LINE, color);
+    if (!c)
+        return -1;
+    c->a = x0, c->b = y0, c->c = x1, c->d = y1;
+    return 0;
+}
+
+int draw_batch_circle(DrawBatch *b, int cx, int cy, int r, uint32_t color, int fill)
+{
+    DrawCmd *c = draw_batch_next(b, fill ? DRAW_DISC : DRAW_CIRCLE, color);
+    if (!c)
+        return -1;
+    c->a = cx, c->b = cy, c->c = r;
+    return 0;
+}
+
+int draw_batch_polygon(DrawBatch *b, const Point *pts, int n, uint32_t color)
+{
+    if (n < 3 || n > POLY_MAX_POINTS)
+        return -1;
+    if (b->point_count + (size_t)n > b->point_cap) {
+        size_t cap = b->point_cap ? b->point_cap : 1024;
+        while (cap < b->point_count + (size_t)n)
+            cap *= 2;
+        Point *p = realloc(b->points, cap * sizeof(*p));
+        if (!p)
+            return -1;
+        b->points = p;
+        b->point_cap = cap;
+    }
+    DrawCmd *c = draw_batch_next(b, DRAW_POLYGON, color);
+    if (!c)
+        return -1;
+    memcpy(b->points + b->point_count, pts, (size_t)n * sizeof(*pts));
+    c->points = b->point_count;
+    c->a = n;
+    b->point_count += (size_t)n;
+    return 0;
+}
+
+/* Draws every queued primitive in order, clipped to clip, and adds what it touched to d */
+void draw_batch_run(const DrawBatch *b, Surface *s, Rect clip, Damage *d)
+{
+    for (size_t i = 0; i < b->count; i++) {
+        const DrawCmd *c = &b->cmds[i];
+        Rect r = { c->a, c->b, c->c, c->d };
+
+        switch (c->type) {
+        case DRAW_RECT:
+            r = fill_rect(s, clip, r, c->color);
+            break;
+        case DRAW_GRADIENT:
+            r = fill_rect_gradient(s, clip, r, c->color, c->color2, c->direction);
+            break;
+        case DRAW_LINE:
+            r = draw_line(s, clip, c->a, c->b, c->c, c->d, c->color);
+            break;
+        case DRAW_LINE_AA:
+            r = draw_line_aa(s, clip, c->a, c->b, c->c, c->d, c->color);
+            break;
+        case DRAW_CIRCLE:
+        case DRAW_DISC:
+            r = draw_circle(s, clip, c->a, c->b, c->c, c->color, c->type == DRAW_DISC);
+            break;
+        default:
+            r = fill_polygon(s, clip, b->points + c->points, c->a, c->color);
+            break;
+        }
+        if (r.w > 0 && r.h > 0)
+            damage_add(d, r);
+    }
+}
+
+/*
+ * ============================================================================
+ * IMAGE BLITTER
+ * ============================================================================
+ *
+ * Copies (parts of) images in memory onto a Surface: pre-rendered UI
+ * sprites, sprite sheets, pictures loaded from disk. Source pixels can be
+ * in any of the formats below and are converted on the fly, in chunks
+ * small enough to stay in L1, so no converted copy of the image is ever
+ * made. Keyed and alpha-blended copies work on whole SSE2 registers and
+ * only fall back to per-pixel work at mixed edges.
+ */
+
+enum {
+    PIXEL_XRGB8888,     /* 32-bit 0x??RRGGBB, top byte ignored */
+    PIXEL_ARGB8888,     /* 32-bit premultiplied 0xAARRGGBB, blended */
+    PIXEL_RGB565,       /* 16-bit native endian */
+    PIXEL_RGB24,        /* Bytes R, G, B, as in PPM files */
+};
+
+typedef struct {
+    const void *pixels;
+    int width;
+    int height;
+    size_t stride;      /* Bytes per row */
+    int format;         /* PIXEL_* */
+} Image;
+
+#define BLIT_COLOR_KEY 1    /* Skip source pixels equal to the key colour */
+
+/* Pixels converted per chunk; 1 KiB of scratch */
+#define BLIT_CHUNK 256
+
+static inline const unsigned char *image_row(const Image *img, int y)
+{
+    return (const unsigned char *)img->pixels + (size_t)y * img->stride;
+}
+
+/*
+ * Function: convert_to_xrgb
+ *
+ * Converts n pixels of the given format to 0x00RRGGBB (premultiplied
+ * 0xAARRGGBB for PIXEL_ARGB8888). 5- and 6-bit channels are widened by
+ * replicating their top bits, so full intensity stays 0xff.
+ */
+void convert_to_xrgb(uint32_t *out, const void *src, int format, int n)
+{
+    int i = 0;
+
+    switch (format) {
+    case PIXEL_RGB565: {
+        const uint16_t *p = src;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i m5 = _mm_set1_epi32(0x1f), m6 = _mm_set1_epi32(0x3f);
+        for (; i + 8 <= n; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            for (int half = 0; half < 2; half++) {
+                __m128i w = half ? _mm_unpackhi_epi16(v, zero) : _mm_unpacklo_epi16(v, zero);
+                __m128i r = _mm_and_si128(_mm_srli_epi32(w, 11), m5);
+                __m128i g = _mm_and_si128(_mm_srli_epi32(w, 5), m6);
+                __m128i b = _mm_and_si128(w, m5);
+                r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+                g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 4));
+                b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+                __m128i px = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, 16), _mm_slli_epi32(g, 8)), b);
+                _mm_storeu_si128((__m128i *)(out + i + half * 4), px);
+            }
+        }
+#endif
+        for (; i < n; i++) {
+            uint32_t v = p[i];
+            uint32_t r = v >> 11, g = (v >> 5) & 0x3f, b = v & 0x1f;
+            out[i] = ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) | (b << 3 | b >> 2);
+        }
+        break;
+    }
+    case PIXEL_RGB24: {
+        const unsigned char *p = src;
+        for (; i < n; i++, p += 3)
+            out[i] = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+        break;
+    }
+    case PIXEL_ARGB8888:
+        memcpy(out, src, (size_t)n * sizeof(uint32_t));
+        break;
+    default: {
+        const uint32_t *p = src;
+        for (; i < n; i++)
+            out[i] = p[i] & 0x00ffffff;
+        break;
+    }
+    }
+}
+
+/*
+ * Function: copy_keyed_span
+ *
+ * Copies n 0x00RRGGBB pixels, leaving dst alone wherever src equals key.
+ * Four pixels at a time: groups that are all key are skipped, groups
+ * without key are stored whole, mixed groups are merged with a mask.
+ */
+static void copy_keyed_span(uint32_t *dst, const uint32_t *src, int n, uint32_t key)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i k = _mm_set1_epi32((int)key);
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i m = _mm_cmpeq_epi32(s, k);
+        int bits = _mm_movemask_epi8(m);
+
+        if (bits == 0xffff)
+            continue;
+        if (bits != 0)
+            s = _mm_or_si128(_mm_and_si128(m, _mm_loadu_si128((const __m128i *)(dst + i))),
+                             _mm_andnot_si128(m, s));
+        _mm_storeu_si128((__m128i *)(dst + i), s);
+    }
+#endif
+    for (; i < n; i++)
+        if (src[i] != key)
+            dst[i] = src[i];
+}
+
+/*
+ * Function: blit_image
+ *
+ * Draws the part src_rect of img with its top-left corner at (x, y),
+ * clipped to clip and the surface. PIXEL_ARGB8888 images are blended
+ * (premultiplied "over"); other formats are copied, skipping pixels that
+ * equal key (0x00RRGGBB, compared after conversion) if flags include
+ * BLIT_COLOR_KEY. Returns the rectangle drawn to.
+ */
+Rect blit_image(Surface *s, Rect clip, int x, int y, const Image *img, Rect src_rect, int flags, uint32_t key)
+{
+    Rect bounds = { 0, 0, img->width, img->height };
+    Rect r;
+    uint32_t chunk[BLIT_CHUNK];
+    int bpp = img->format == PIXEL_RGB565 ? 2 : img->format == PIXEL_RGB24 ? 3 : 4;
+
+    /* Clip the source to the image, then the destination to clip and the surface */
+    int sx0 = src_rect.x, sy0 = src_rect.y;
+    if (!rect_clip(&src_rect, bounds)) {
+        src_rect.w = src_rect.h = 0;
+        return src_rect;
+    }
+    x += src_rect.x - sx0;
+    y += src_rect.y - sy0;
+    r.x = x;
+    r.y = y;
+    r.w = src_rect.w;
+    r.h = src_rect.h;
+    if (!rect_clip(&r, clip_to_surface(s, clip)))
+        return r;
+    src_rect.x += r.x - x;
+    src_rect.y += r.y - y;
+
+    for (int row = 0; row < r.h; row++) {
+        const unsigned char *src = image_row(img, src_rect.y + row) + (size_t)src_rect.x * bpp;
+        uint32_t *dst = surface_row(s, (unsigned int)(r.y + row)) + r.x;
+
+#ifdef __SSE2__
+        /* Rows of a sprite sheet are far apart; start fetching the next
+         * one while this one is converted. */
+        if (row + 1 < r.h) {
+            const char *next = (const char *)src + img->stride;
+            for (size_t off = 0; off < (size_t)r.w * bpp && off < 512; off += 64)
+                _mm_prefetch(next + off, _MM_HINT_T0);
+        }
+#endif
+        if (img->format == PIXEL_ARGB8888) {
+            blend_over_span(dst, (const uint32_t *)(const void *)src, r.w);
+            continue;
+        }
+        for (int done = 0; done < r.w; done += BLIT_CHUNK) {
+            int n = r.w - done < BLIT_CHUNK ? r.w - done : BLIT_CHUNK;
+            convert_to_xrgb(chunk, src + (size_t)done * bpp, img->format, n);
+            if (flags & BLIT_COLOR_KEY)
+                copy_keyed_span(dst + done, chunk, n, key & 0x00ffffff);
+            else
+                memcpy(dst + done, chunk, (size_t)n * sizeof(uint32_t));
+        }
+    }
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+#ifdef __linux__
+    return main_linux(argc, argv);
+#elif defined(_WIN32) || defined(_WIN64)
+    (void)argc;
+    (void)argv;
+    return main_windows();
+#endif
+}
+
+/*
+ * ============================================================================
+ * LINUX IMPLEMENTATION
+ * ============================================================================
+ */
+#ifdef __linux__
+
+/* An opened and memory-mapped fbdev device */
+typedef struct {
+    int fd;
+    struct fb_var_screeninfo var_info;
+    struct fb_fix_screeninfo fix_info;
+    unsigned char *data;              /* Pointer to the frame buffer memory */
+    unsigned int bytes_per_pixel;
+    unsigned int red_shift, green_shift, blue_shift;   /* Channel positions in a native pixel */
+    unsigned int red_loss, green_loss, blue_loss;      /* Bits dropped from each 8-bit channel */
+    uint32_t transp_mask;             /* Alpha bits of a native pixel, all set: pixels are opaque */
+    int native_xrgb;                  /* Native layout equals Surface layout: rows can be memcpy'd */
+    int rotate;                       /* FB_ROTATE_*: quarter turns clockwise from surface to panel */
+    int mirror;                       /* Surface is flipped left to right before rotating */
+    unsigned int width;               /* Surface size: xres by yres, swapped when rotated 90 or 270 */
+    unsigned int height;
+    uint32_t *rotate_rows;            /* FB_ROTATE_TILE surface rows being turned, when rotated */
+    int x;                            /* Where the panel's top-left corner is on the surface, */
+    int y;                            /* non-zero for the panels of a --wall */
+} FrameBuffer;
+
+/* Side of the square blocks a rotated flush is transposed in */
+#define FB_ROTATE_TILE 32
+
+int fb_set_orientation(FrameBuffer *fb, int rotate, int mirror);
+
+/*
+ * Function: fb_open
+ *
+ * Opens and maps a frame buffer device and works out how to convert
+ * surface pixels into its native layout.
+ *
+ * Returns: 0 on success, -1 on failure (after printing the reason)
+ */
+int fb_open(FrameBuffer *fb, const char *path)
+{
+    /* Open the frame buffer device for reading and writing */
+    fb->fd = open(path, O_RDWR);
+    if (fb->fd == -1) {
+        fprintf(stderr, "Failed to open %s: %s. Make sure you're running with sudo.\n",
+                path, strerror(errno));
+        return -1;
+    }
+
+    /* 
+     * ioctl(FBIOGET_VSCREENINFO) retrieves the variable screen information
+     * This tells us:
+     *  - xres: horizontal resolution in pixels
+     *  - yres: vertical resolution in pixels
+     *  - bits_per_pixel: color depth (usually 32 for 24-bit RGB + 8-bit alpha)
+     *  - red/green/blue: where each color channel lives inside a pixel
+     */
+    if (ioctl(fb->fd, FBIOGET_VSCREENINFO, &fb->var_info) == -1) {
+        perror("ioctl FBIOGET_VSCREENINFO");
+        close(fb->fd);
+        return -1;
+    }
+
+    /* 
+     * ioctl(FBIOGET_FSCREENINFO) retrieves fixed screen information
+     * This tells us:
+     *  - smem_len: total size of the frame buffer memory in bytes
+     *  - line_length: number of bytes per scanline (row)
+     */
+    if (ioctl(fb->fd, FBIOGET_FSCREENINFO, &fb->fix_info) == -1) {
+        perror("ioctl FBIOGET_FSCREENINFO");
+        close(fb->fd);
+        return -1;
+    }
+
+    /* 
+     * mmap() maps the frame buffer device memory into our process's address space
+     * This allows us to directly write to video memory to update the screen
+     * 
+     * Parameters:
+     *  - NULL: let the kernel choose the address
+     *  - smem_len: size of memory to map (entire frame buffer)
+     *  - PROT_READ | PROT_WRITE: we need read and write access
+     *  - MAP_SHARED: changes are visible to other processes/hardware
+     *  - fb_fd: file descriptor of /dev/fb0
+     *  - 0: offset in the file (start from beginning)
+     */
+    fb->data = mmap(NULL, fb->fix_info.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fb->fd, 0);
+    if (fb->data == MAP_FAILED) {
+        perror("mmap failed");
+        close(fb->fd);
+        return -1;
+    }
+
+    fb->bytes_per_pixel = fb->var_info.bits_per_pixel / 8;
+
+    /*
+     * Some drivers leave the channel bitfields empty. Fall back to BGR
+     * byte order (blue at the lowest address), which is what most x86
+     * systems use.
+     */
+    if (fb->var_info.red.length == 0 || fb->var_info.green.length == 0 ||
+        fb->var_info.blue.length == 0) {
+        fb->var_info.red.offset = 16;
+        fb->var_info.green.offset = 8;
+        fb->var_info.blue.offset = 0;
+        fb->var_info.red.length = fb->var_info.green.length = fb->var_info.blue.length = 8;
+    }
+    fb->red_shift = fb->var_info.red.offset;
+    fb->green_shift = fb->var_info.green.offset;
+    fb->blue_shift = fb->var_info.blue.offset;
+    fb->red_loss = 8 - (fb->var_info.red.length < 8 ? fb->var_info.red.length : 8);
+    fb->green_loss = 8 - (fb->var_info.green.length < 8 ? fb->var_info.green.length : 8);
+    fb->blue_loss = 8 - (fb->var_info.blue.length < 8 ? fb->var_info.blue.length : 8);
+    /* ARGB drivers would take the surface's zero top byte as fully transparent */
+    fb->transp_mask = fb->var_info.transp.length == 0 || fb->var_info.transp.length > 8 ||
+                      fb->var_info.transp.offset + fb->var_info.transp.length > 32 ? 0 :
+                      ((1u << fb->var_info.transp.length) - 1) << fb->var_info.transp.offset;
+    fb->native_xrgb = fb->bytes_per_pixel == 4 && fb->transp_mask == 0 &&
+                      fb->red_shift == 16 && fb->green_shift == 8 && fb->blue_shift == 0 &&
+                      fb->red_loss == 0 && fb->green_loss == 0 && fb->blue_loss == 0;
+    fb->rotate_rows = NULL;
+    fb->x = fb->y = 0;
+    if (fb_set_orientation(fb, (int)(fb->var_info.rotate & 3), 0) != 0) {
+        munmap(fb->data, fb->fix_info.smem_len);
+        close(fb->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Function: fb_set_orientation
+ *
+ * Sets how the surface is turned onto the panel: rotate is an
+ * FB_ROTATE_* value (the picture turned that many quarter turns
+ * clockwise) and mirror flips it left to right first. width and height
+ * become the surface size to draw at.
+ *
+ * Returns: 0 on success, -1 if memory ran out
+ */
+int fb_set_orientation(FrameBuffer *fb, int rotate, int mirror)
+{
+    unsigned int longest = fb->var_info.xres > fb->var_info.yres ? fb->var_info.xres : fb->var_info.yres;
+
+    fb->rotate = rotate & 3;
+    fb->mirror = mirror;
+    fb->width = fb->rotate & 1 ? fb->var_info.yres : fb->var_info.xres;
+    fb->height = fb->rotate & 1 ? fb->var_info.xres : fb->var_info.yres;
+    free(fb->rotate_rows);
+    fb->rotate_rows = NULL;
+    if (fb->rotate == FB_ROTATE_UR && !fb->mirror)
+        return 0;
+    fb->rotate_rows = malloc((size_t)FB_ROTATE_TILE * longest * sizeof(uint32_t));
+    if (!fb->rotate_rows) {
+        fprintf(stderr, "Failed to allocate rotation buffer\n");
+        return -1;
+    }
+    return 0;
+}
+
+void fb_close(FrameBuffer *fb)
+{
+    free(fb->rotate_rows);
+
+    /* 
+     * Clean up: unmap the frame buffer memory
+     * This releases our access to the video memory
+     */
+    munmap(fb->data, fb->fix_info.smem_len);
+
+    /* Close the frame buffer device */
+    close(fb->fd);
+}
+
+/* Converts one 0x00RRGGBB surface pixel into the device's native layout */
+static inline uint32_t fb_native_pixel(const FrameBuffer *fb, uint32_t p)
+{
+    uint32_t r = (p >> 16) & 0xff;
+    uint32_t g = (p >> 8) & 0xff;
+    uint32_t b = p & 0xff;
+
+    return ((r >> fb->red_loss) << fb->red_shift) |
+           ((g >> fb->green_loss) << fb->green_shift) |
+           ((b >> fb->blue_loss) << fb->blue_shift) | fb->transp_mask;
+}
+
+/*
+ * Function: fb_convert_row
+ *
+ * Writes n 0x00RRGGBB pixels into frame buffer memory at dst in the
+ * native pixel format.
+ *
+ * Returns: 0, or -1 for formats that are not supported
+ */
+static int fb_convert_row(const FrameBuffer *fb, unsigned char *dst, const uint32_t *src, int n)
+{
+    unsigned int bpp = fb->bytes_per_pixel;
+
+    if (fb->native_xrgb) {
+        memcpy(dst, src, (size_t)n * 4);
+    } else if (bpp == 4) {
+        for (int x = 0; x < n; x++) {
+            uint32_t v = fb_native_pixel(fb, src[x]);
+            memcpy(dst + (size_t)x * 4, &v, 4);
+        }
+    } else if (bpp == 3) {
+        for (int x = 0; x < n; x++) {
+            uint32_t v = fb_native_pixel(fb, src[x]);
+            dst[x * 3 + 0] = (unsigned char)v;
+            dst[x * 3 + 1] = (unsigned char)(v >> 8);
+            dst[x * 3 + 2] = (unsigned char)(v >> 16);
+        }
+    } else if (bpp == 2) {
+        for (int x = 0; x < n; x++) {
+            uint16_t v = (uint16_t)fb_native_pixel(fb, src[x]);
+            memcpy(dst + (size_t)x * 2, &v, 2);
+        }
+    } else {
+        return -1;  /* Palettized and sub-byte formats are not supported */
+    }
+    return 0;
+}
+
+static size_t fb_write_rotated(const FrameBuffer *fb, const Surface *s, Rect r, const RowSource *src_rows);
+
+/*
+ * Function: fb_write_rect
+ *
+ * Copies one rectangle of the surface into frame buffer memory,
+ * converting to the native pixel format on the way. Rows are read
+ * through src_rows (NULL reads the surface directly). Only the part of
+ * r that lies on the panel, at fb->x and fb->y on the surface, is
+ * written.
+ *
+ * Returns: number of bytes written to the frame buffer
+ */
+size_t fb_write_rect(const FrameBuffer *fb, const Surface *s, Rect r, const RowSource *src_rows)
+{
+    Rect screen = { fb->x, fb->y, (int)fb->width, (int)fb->height };
+    unsigned int bpp = fb->bytes_per_pixel;
+
+    if (!rect_clip(&r, screen))
+        return 0;
+    if (fb->rotate_rows) {
+        r.x -= fb->x;
+        r.y -= fb->y;
+        return fb_write_rotated(fb, s, r, src_rows);
+    }
+
+    for (int y = r.y; y < r.y + r.h; y++) {
+        const uint32_t *src = source_row(src_rows, s, y, r.x, r.w);
+        /* 
+         * Frame buffer memory is laid out sequentially, one scanline
+         * of line_length bytes after another. Keep the arithmetic in
+         * size_t: y * line_length overflows 32 bits on large virtual screens.
+         */
+        unsigned char *dst = fb->data + (size_t)(y - fb->y) * fb->fix_info.line_length +
+                             (size_t)(r.x - fb->x) * bpp;
+
+        if (fb_convert_row(fb, dst, src, r.w) != 0)
+            return 0;
+    }
+    return (size_t)r.w * r.h * bpp;
+}
+
+/* dst[i] = src[n - 1 - i] */
+static void copy_reversed(uint32_t *dst, const uint32_t *src, int n)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(src + n - 4 - i)), 0x1b));
+#endif
+    for (; i < n; i++)
+        dst[i] = src[n - 1 - i];
+}
+
+/*
+ * Transposes a rows x cols block of band (stride pixels apart) into
+ * tile, so that tile[x] holds column x; with reverse set, bottom row
+ * first.
+ */
+static void transpose_tile(uint32_t tile[FB_ROTATE_TILE][FB_ROTATE_TILE], const uint32_t *band, size_t stride,
+                           int rows, int cols, int reverse)
+{
+#ifdef __SSE2__
+    if (rows % 4 == 0 && cols % 4 == 0) {
+        /* 4x4 blocks: four row loads become four column stores */
+        for (int i = 0; i < rows; i += 4) {
+            const uint32_t *p = band + (size_t)i * stride;
+            int di = reverse ? rows - 4 - i : i;
+            for (int x = 0; x < cols; x += 4) {
+                __m128i a = _mm_loadu_si128((const __m128i *)(p + x));
+                __m128i b = _mm_loadu_si128((const __m128i *)(p + stride + x));
+                __m128i c = _mm_loadu_si128((const __m128i *)(p + 2 * stride + x));
+                __m128i d = _mm_loadu_si128((const __m128i *)(p + 3 * stride + x));
+                __m128i ab_lo = _mm_unpacklo_epi32(a, b), cd_lo = _mm_unpacklo_epi32(c, d);
+                __m128i ab_hi = _mm_unpackhi_epi32(a, b), cd_hi = _mm_unpackhi_epi32(c, d);
+                __m128i col[4] = {
+                    _mm_unpacklo_epi64(ab_lo, cd_lo), _mm_unpackhi_epi64(ab_lo, cd_lo),
+                    _mm_unpacklo_epi64(ab_hi, cd_hi), _mm_unpackhi_epi64(ab_hi, cd_hi),
+                };
+                for (int k = 0; k < 4; k++)
+                    _mm_storeu_si128((__m128i *)(tile[x + k] + di),
+                                     reverse ? _mm_shuffle_epi32(col[k], 0x1b) : col[k]);
+            }
+        }
+        return;
+    }
+#endif
+    for (int i = 0; i < rows; i++) {
+        const uint32_t *p = band + (size_t)i * stride;
+        int di = reverse ? rows - 1 - i : i;
+        for (int x = 0; x < cols; x++)
+            tile[x][di] = p[x];
+    }
+}
+
+/*
+ * Function: fb_write_rotated
+ *
+ * fb_write_rect() for a turned or mirrored panel. Upside down and
+ * mirrored rows are written reversed. For quarter turns the rectangle
+ * is read FB_ROTATE_TILE surface rows at a time into fb->rotate_rows,
+ * and each FB_ROTATE_TILE square of that band is transposed in L1, so
+ * every column comes out as a run of one panel row. Either way the
+ * pixels pass through one extra buffer on their way to the panel. r is
+ * relative to the panel's corner at fb->x, fb->y.
+ */
+static size_t fb_write_rotated(const FrameBuffer *fb, const Surface *s, Rect r, const RowSource *src_rows)
+{
+    int w = (int)fb->width, h = (int)fb->height;
+    unsigned int bpp = fb->bytes_per_pixel, pitch = fb->fix_info.line_length;
+    uint32_t *band = fb->rotate_rows;
+
+    if (!(fb->rotate & 1)) {
+        /* Rows stay rows: reversed when exactly one of upside down and mirror applies */
+        int reverse = (fb->rotate == FB_ROTATE_UD) != fb->mirror;
+        int px = reverse ? w - r.x - r.w : r.x;
+        for (int y = r.y; y < r.y + r.h; y++) {
+            const uint32_t *row = source_row(src_rows, s, fb->y + y, fb->x + r.x, r.w);
+            int py = fb->rotate == FB_ROTATE_UD ? h - 1 - y : y;
+            if (reverse) {
+                copy_reversed(band, row, r.w);
+                row = band;
+            }
+            if (fb_convert_row(fb, fb->data + (size_t)py * pitch + (size_t)px * bpp, row, r.w) != 0)
+                return 0;
+        }
+        return (size_t)r.w * r.h * bpp;
+    }
+
+    for (int y0 = r.y; y0 < r.y + r.h; y0 += FB_ROTATE_TILE) {
+        int rows = r.y + r.h - y0 < FB_ROTATE_TILE ? r.y + r.h - y0 : FB_ROTATE_TILE;
+        /* Clockwise, the bottom surface row of the band comes first on the panel */
+        int px = fb->rotate == FB_ROTATE_CW ? h - y0 - rows : y0;
+        uint32_t tile[FB_ROTATE_TILE][FB_ROTATE_TILE];
+
+        for (int i = 0; i < rows; i++)
+            memcpy(band + (size_t)i * r.w, source_row(src_rows, s, fb->y + y0 + i, fb->x + r.x, r.w),
+                   (size_t)r.w * 4);
+        for (int x0 = 0; x0 < r.w; x0 += FB_ROTATE_TILE) {
+            int cols = r.w - x0 < FB_ROTATE_TILE ? r.w - x0 : FB_ROTATE_TILE;
+            transpose_tile(tile, band + x0, (size_t)r.w, rows, cols, fb->rotate == FB_ROTATE_CW);
+            for (int x = 0; x < cols; x++) {
+                /* Surface column sx is panel row sx (CW) or w - 1 - sx (CCW), after mirroring */
+                int sx = fb->mirror ? w - 1 - (r.x + x0 + x) : r.x + x0 + x;
+                int py = fb->rotate == FB_ROTATE_CW ? sx : w - 1 - sx;
+                if (fb_convert_row(fb, fb->data + (size_t)py * pitch + (size_t)px * bpp, tile[x], rows) != 0)
+                    return 0;
+            }
+        }
+    }
+    return (size_t)r.w * r.h * bpp;
+}
+
+/*
+ * Function: fb_flush
+ *
+ * Writes every damaged region of the surface to the frame buffer and
+ * clears the damage. Untouched parts of the screen are not written at
+ * all, so a frame where only a small widget changed costs a few
+ * kilobytes of frame buffer traffic instead of the whole screen.
+ *
+ * Returns: number of bytes written to the frame buffer
+ */
+size_t fb_flush(const FrameBuffer *fb, const Surface *s, Damage *d, const RowSource *src)
+{
+    size_t written = 0;
+
+    for (int i = 0; i < d->count; i++)
+        written += fb_write_rect(fb, s, d->rects[i], src);
+    damage_clear(d);
+    return written;
+}
+
+/*
+ * ============================================================================
+ * DISPLAY WALL
+ * ============================================================================
+ *
+ * A video wall is several fbdev nodes showing one picture. Each panel is
+ * a FrameBuffer whose x and y place it on a surface as big as the whole
+ * wall, so everything upstream (effects, damage, layers, RFB) sees one
+ * large screen and the gradient runs across the seams. Panels are laid
+ * out in a grid in device order; a column is as wide as its widest
+ * panel and a row as tall as its tallest one.
+ *
+ * Each panel is flushed by a thread of its own. The render thread hands
+ * a frame over at one barrier, every panel thread writes the damage
+ * that falls on its panel, and a second barrier holds the render thread
+ * until all of them are done. No panel starts on a frame before every
+ * panel has finished the one before, so the wall changes as one.
+ */
+
+#define WALL_MAX_PANELS 16
+#define WALL_SCAN_DEVICES 32   /* FB_MAX: /dev/fb0 to /dev/fb31 */
+
+typedef struct Wall Wall;
+
+typedef struct {
+    Wall *wall;
+    FrameBuffer fb;
+    char path[32];
+    Compositor layers;          /* Own row scratch over the render thread's layers */
+    size_t written;             /* Bytes written by the last flush */
+    pthread_t thread;
+} WallPanel;
+
+struct Wall {
+    WallPanel panels[WALL_MAX_PANELS];
+    int count;
+    int started;                /* wall_start() was called */
+    int threads;                /* Panels 0..threads-1 have a thread; the rest are flushed inline */
+    unsigned int width;         /* Size of the whole wall */
+    unsigned int height;
+    pthread_mutex_t lock;       /* Held while wall_start() sets up the barriers */
+    pthread_barrier_t start;    /* A frame is ready to be written ... */
+    pthread_barrier_t done;     /* ... and every panel has written it */
+    const Surface *surface;     /* The frame being flushed */
+    const Damage *damage;
+    const Compositor *layers;   /* Blended in on the way out, or NULL */
+    int stopping;
+};
+
+/* Writes the part of the current frame's damage that lies on one panel */
+static void wall_panel_flush(WallPanel *p)
+{
+    const Wall *w = p->wall;
+    const RowSource *src = NULL;
+
+    if (w->layers) {
+        memcpy(p->layers.layers, w->layers->layers, sizeof(p->layers.layers));
+        p->layers.count = w->layers->count;
+        src = &p->layers.source;
+    }
+    p->written = 0;
+    for (int i = 0; i < w->damage->count; i++)
+        p->written += fb_write_rect(&p->fb, w->surface, w->damage->rects[i], src);
+}
+
+static void *wall_panel_main(void *arg)
+{
+    WallPanel *p = arg;
+    Wall *w = p->wall;
+
+    /* The barriers are sized once every thread has been started */
+    pthread_mutex_lock(&w->lock);
+    pthread_mutex_unlock(&w->lock);
+    for (;;) {
+        pthread_barrier_wait(&w->start);
+        if (w->stopping)
+            break;
+        wall_panel_flush(p);
+        pthread_barrier_wait(&w->done);
+    }
+    return NULL;
+}
+
+/* Places the open panels cols to a row and sizes the wall to fit them */
+static void wall_layout(Wall *w, int cols)
+{
+    unsigned int col_w[WALL_MAX_PANELS] = { 0 }, row_h[WALL_MAX_PANELS] = { 0 };
+    int rows = (w->count + cols - 1) / cols;
+
+    for (int i = 0; i < w->count; i++) {
+        const FrameBuffer *fb = &w->panels[i].fb;
+        if (fb->width > col_w[i % cols])
+            col_w[i % cols] = fb->width;
+        if (fb->height > row_h[i / cols])
+            row_h[i / cols] = fb->height;
+    }
+    for (int i = 0; i < w->count; i++) {
+        FrameBuffer *fb = &w->panels[i].fb;
+        fb->x = fb->y = 0;
+        for (int c = 0; c < i % cols; c++)
+            fb->x += (int)col_w[c];
+        for (int r = 0; r < i / cols; r++)
+            fb->y += (int)row_h[r];
+    }
+    w->width = w->height = 0;
+    for (int c = 0; c < cols; c++)
+        w->width += col_w[c];
+    for (int r = 0; r < rows; r++)
+        w->height += row_h[r];
+}
+
+/*
+ * Function: wall_open
+ *
+ * Opens the frame buffer devices found in /dev as a wall of cols by
+ * rows panels, in device order from the top left. cols 0 puts every
+ * device found side by side. rotate (FB_ROTATE_*, or -1 to keep each
+ * device's own setting) and mirror apply to every panel.
+ *
+ * Returns: 0 on success, -1 on failure (after printing the reason)
+ */
+int wall_open(Wall *w, int cols, int rows, int rotate, int mirror)
+{
+    char paths[WALL_MAX_PANELS][32];
+    int found = 0;
+
+    memset(w, 0, sizeof(*w));
+    for (int i = 0; i < WALL_SCAN_DEVICES && found < WALL_MAX_PANELS; i++) {
+        snprintf(paths[found], sizeof(paths[0]), "/dev/fb%d", i);
+        if (access(paths[found], F_OK) == 0)
+            found++;
+    }
+    if (found == 0) {
+        fprintf(stderr, "No frame buffer devices found in /dev\n");
+        return -1;
+    }
+    if (cols == 0) {
+        cols = found;
+        rows = 1;
+    }
+    if (found < cols * rows) {
+        fprintf(stderr, "A %d x %d wall needs %d frame buffer devices, found %d\n",
+                cols, rows, cols * rows, found);
+        return -1;
+    }
+
+    for (int i = 0; i < cols * rows; i++) {
+        WallPanel *p = &w->panels[i];
+
+        p->wall = w;
+        memcpy(p->path, paths[i], sizeof(p->path));
+        if (fb_open(&p->fb, p->path) != 0)
+            goto fail;
+        w->count++;
+        if (((rotate >= 0 || mirror) &&
+             fb_set_orientation(&p->fb, rotate >= 0 ? rotate : p->fb.rotate, mirror) != 0) ||
+            compositor_init(&p->layers, p->fb.width) != 0) {
+            fprintf(stderr, "Failed to set up %s\n", p->path);
+            goto fail;
+        }
+    }
+    wall_layout(w, cols);
+    return 0;
+
+fail:
+    for (int i = 0; i < w->count; i++) {
+        compositor_destroy(&w->panels[i].layers);
+        fb_close(&w->panels[i].fb);
+    }
+    w->count = 0;
+    return -1;
+}
+
+/*
+ * Function: wall_start
+ *
+ * Starts one flushing thread per panel. If the system runs out of
+ * threads, the panels left without one are flushed by the render
+ * thread instead.
+ */
+void wall_start(Wall *w)
+{
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_mutex_lock(&w->lock);
+    w->started = 1;
+    for (int i = 0; i < w->count; i++) {
+        if (pthread_create(&w->panels[i].thread, NULL, wall_panel_main, &w->panels[i]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        w->threads++;
+    }
+    pthread_barrier_init(&w->start, NULL, (unsigned int)w->threads + 1);
+    pthread_barrier_init(&w->done, NULL, (unsigned int)w->threads + 1);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Function: wall_flush
+ *
+ * fb_flush() for a wall: writes every damaged region to the panels it
+ * falls on, all panels at once, blending layers in if given. Returns
+ * once every panel is done, and clears the damage.
+ *
+ * Returns: number of bytes written to all panels together
+ */
+size_t wall_flush(Wall *w, const Surface *s, Damage *d, const Compositor *layers)
+{
+    size_t written = 0;
+
+    w->surface = s;
+    w->damage = d;
+    w->layers = layers;
+    pthread_barrier_wait(&w->start);
+    for (int i = w->threads; i < w->count; i++)
+        wall_panel_flush(&w->panels[i]);
+    pthread_barrier_wait(&w->done);
+
+    for (int i = 0; i < w->count; i++)
+        written += w->panels[i].written;
+    damage_clear(d);
+    return written;
+}
+
+/* Writes one rectangle to every panel from the calling thread, for the splash screen */
+size_t wall_write_rect(const Wall *w, const Surface *s, Rect r)
+{
+    size_t written = 0;
+
+    for (int i = 0; i < w->count; i++)
+        written += fb_write_rect(&w->panels[i].fb, s, r, NULL);
+    return written;
+}
+
+/* Stops the panel threads, if started, and closes the devices */
+void wall_close(Wall *w)
+{
+    if (w->started) {
+        w->stopping = 1;
+        pthread_barrier_wait(&w->start);
+        for (int i = 0; i < w->threads; i++)
+            pthread_join(w->panels[i].thread, NULL);
+        pthread_barrier_destroy(&w->start);
+        pthread_barrier_destroy(&w->done);
+        pthread_mutex_destroy(&w->lock);
+    }
+    for (int i = 0; i < w->count; i++) {
+        compositor_destroy(&w->panels[i].layers);
+        fb_close(&w->panels[i].fb);
+    }
+    w->count = w->threads = w->started = 0;
+}
+
+/*
+ * ============================================================================
+ * SHARED-MEMORY COMPOSITOR
+ * ============================================================================
+ *
+ * With --compositor the program draws nothing of its own and shows the
+ * surfaces of other processes instead (rainbow_shm.h has the client's
+ * side of the protocol; --client makes this program one). Every client
+ * surface is a memfd both sides map. When a frame is posted, the
+ * compositor copies just the rectangles the client declared into a
+ * private Layer and hands the surface straight back, so a client never
+ * waits for the screen to be flushed and a client drawing its next
+ * frame cannot tear the one on screen. The layers are stacked by z in
+ * the ordinary layer compositor, which blends damaged rows only, on
+ * their way to the frame buffer.
+ *
+ * Frames are announced through a single-producer, single-consumer ring
+ * in the shared header: the client publishes rectangles by moving head,
+ * the compositor takes them by moving tail, and an eventfd in each
+ * direction wakes the other side. No lock is shared between processes,
+ * so a client that stalls or crashes cannot block the compositor.
+ */
+
+#define SHM_MAX_CLIENTS 8
+#define SHM_MAX_SIZE 8192       /* Longest side of a client surface */
+
+/* epoll tags of the compositor's descriptors, above the event loop's own */
+enum {
+    EV_SHM_LISTEN = 0x100,
+    EV_SHM_PEER = 0x200,        /* + slot: a client's socket */
+    EV_SHM_READY = 0x300,       /* + slot: a client posted a frame */
+    EV_SHM_SERVER = 0x400,      /* --client: the socket to the compositor */
+    EV_SHM_RELEASE              /* --client: the compositor took a frame */
+};
+
+/* A connected client, as the compositor sees it */
+typedef struct {
+    int sock;                   /* -1: free slot */
+    int ready_fd;
+    int release_fd;
+    RainbowShmHeader *hdr;      /* NULL until the hello has been answered */
+    size_t map_len;
+    Surface shared;             /* The client's pixels, inside the mapping */
+    int premultiplied;
+    Layer layer;                /* What is on screen, premultiplied */
+    uint64_t frames;
+    uint64_t rects;
+} ShmPeer;
+
+typedef struct {
+    int listen_fd;
+    char path[108];
+    int epoll_fd;
+    ShmPeer peers[SHM_MAX_CLIENTS];
+    Compositor *layers;         /* Client layers are stacked into this */
+    unsigned int screen_w;
+    unsigned int screen_h;
+    Damage damage;              /* Screen area clients changed since the last flush */
+    uint64_t clients;           /* Connections accepted */
+    uint64_t bytes_copied;
+} ShmServer;
+
+static int shm_epoll_add(int epoll_fd, int fd, uint64_t tag)
+{
+    struct epoll_event ev = { EPOLLIN, { .u64 = tag } };
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void shm_close_fd(int epoll_fd, int *fd)
+{
+    if (*fd >= 0) {
+        if (epoll_fd >= 0)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+/*
+ * Function: shm_server_open
+ *
+ * Listens for clients on the Unix socket at path and registers with
+ * epoll_fd. Client layers go into layers, over screen.
+ *
+ * Returns: 0 on success, -1 on failure (after printing the reason)
+ */
+int shm_server_open(ShmServer *srv, const char *path, int epoll_fd, Compositor *layers, const Surface *screen)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    memset(srv, 0, sizeof(*srv));
+    for (int i = 0; i < SHM_MAX_CLIENTS; i++)
+        srv->peers[i].sock = srv->peers[i].ready_fd = srv->peers[i].release_fd = -1;
+    srv->listen_fd = -1;
+    srv->epoll_fd = epoll_fd;
+    srv->layers = layers;
+    srv->screen_w = screen->width;
+    srv->screen_h = screen->height;
+    damage_init(&srv->damage, screen);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    srv->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (srv->listen_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    /* A socket left behind by a compositor that did not exit cleanly, but not a live one */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        int live = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+
+        if (probe >= 0)
+            close(probe);
+        if (!live)
+            unlink(path);
+    }
+    if (bind(srv->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(srv->listen_fd, SHM_MAX_CLIENTS) != 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+        shm_close_fd(-1, &srv->listen_fd);
+        return -1;
+    }
+    snprintf(srv->path, sizeof(srv->path), "%s", path);
+    shm_epoll_add(epoll_fd, srv->listen_fd, EV_SHM_LISTEN);
+    return 0;
+}
+
+/* Disconnects a client and takes its surface off the screen */
+static void shm_peer_drop(ShmServer *srv, int slot)
+{
+    ShmPeer *p = &srv->peers[slot];
+
+    if (p->hdr) {
+        compositor_remove(srv->layers, &p->layer);
+        damage_add(&srv->damage, layer_rect(&p->layer));
+        layer_destroy(&p->layer);
+        munmap(p->hdr, p->map_len);
+        p->hdr = NULL;
+        fprintf(stderr, "Client %d left after %llu frames\n", slot, (unsigned long long)p->frames);
+    }
+    shm_close_fd(srv->epoll_fd, &p->sock);
+    shm_close_fd(srv->epoll_fd, &p->ready_fd);
+    shm_close_fd(-1, &p->release_fd);
+}
+
+/* Sends the welcome, with the surface's descriptors unless it was refused */
+static int shm_send_welcome(int sock, const RainbowShmWelcome *welcome, const int *fds, int nfds)
+{
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { (void *)welcome, sizeof(*welcome) };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds) {
+        struct cmsghdr *cm;
+
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE((size_t)nfds * sizeof(int));
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN((size_t)nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, (size_t)nfds * sizeof(int));
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(*welcome) ? 0 : -1;
+}
+
+/*
+ * Answers a client's hello: creates its surface and layer and sends the
+ * descriptors, or sends the reason it was refused.
+ *
+ * Returns: 0 if the client is now on screen, -1 if it should be dropped
+ */
+static int shm_peer_hello(ShmServer *srv, int slot)
+{
+    ShmPeer *p = &srv->peers[slot];
+    RainbowShmHello hello;
+    RainbowShmWelcome welcome = { RAINBOW_SHM_MAGIC, RAINBOW_SHM_VERSION, 0, srv->screen_w, srv->screen_h, 0, 0 };
+    size_t header_len = (sizeof(RainbowShmHeader) + 4095) & ~(size_t)4095;
+    unsigned int w, h;
+    int fd = -1, fds[3];
+    void *map = MAP_FAILED;
+
+    if (recv(p->sock, &hello, sizeof(hello), 0) != (ssize_t)sizeof(hello))
+        return -1;
+    if (hello.magic != RAINBOW_SHM_MAGIC || hello.version != RAINBOW_SHM_VERSION) {
+        welcome.status = EPROTO;
+        goto refuse;
+    }
+    w = hello.width ? hello.width : srv->screen_w;
+    h = hello.height ? hello.height : srv->screen_h;
+    /* Bounding the position as well keeps layer_rect() and the damage offsets in int range */
+    if (!hello.width != !hello.height || w > SHM_MAX_SIZE || h > SHM_MAX_SIZE ||
+        hello.x < -SHM_MAX_SIZE || hello.x > SHM_MAX_SIZE || hello.y < -SHM_MAX_SIZE || hello.y > SHM_MAX_SIZE) {
+        welcome.status = EINVAL;
+        goto refuse;
+    }
+    p->map_len = header_len + (size_t)w * h * sizeof(uint32_t);
+
+    /* Sealed against shrinking, so a client cannot pull the pages out from under the copy */
+    fd = memfd_create("rainbow-surface", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0 || ftruncate(fd, (off_t)p->map_len) != 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 ||
+        (map = mmap(NULL, p->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+        (p->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        (p->release_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        welcome.status = errno ? errno : ENOMEM;
+        goto refuse;
+    }
+    if (layer_create(&p->layer, w, h) != 0) {
+        welcome.status = ENOMEM;
+        goto refuse;
+    }
+    p->layer.x = hello.x;
+    p->layer.y = hello.y;
+    p->layer.z = hello.z < INT_MAX ? hello.z : INT_MAX - 1;   /* INT_MAX is the status bar's */
+    if (compositor_insert(srv->layers, &p->layer) != 0) {
+        layer_destroy(&p->layer);
+        welcome.status = ENOSPC;
+        goto refuse;
+    }
+
+    p->hdr = map;
+    p->hdr->width = w;
+    p->hdr->height = h;
+    p->hdr->stride = w;
+    p->hdr->pixels_offset = (uint32_t)header_len;
+    atomic_init(&p->hdr->head, 0);
+    atomic_init(&p->hdr->tail, 0);
+    p->shared.pixels = (uint32_t *)(void *)((unsigned char *)map + header_len);
+    p->shared.width = w;
+    p->shared.height = h;
+    p->shared.stride = w;
+    p->premultiplied = (hello.flags & RAINBOW_SHM_PREMULTIPLIED) != 0;
+    p->frames = p->rects = 0;
+    welcome.width = w;
+    welcome.height = h;
+    fds[0] = fd;
+    fds[1] = p->ready_fd;
+    fds[2] = p->release_fd;
+    if (shm_send_welcome(p->sock, &welcome, fds, 3) != 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);   /* The mapping and the client's copy keep it alive */
+    shm_epoll_add(srv->epoll_fd, p->ready_fd, EV_SHM_READY + (uint64_t)slot);
+    fprintf(stderr, "Client %d: %u x %u at %d,%d, z %d%s\n", slot, w, h, hello.x, hello.y, p->layer.z,
+            p->premultiplied ? ", translucent" : "");
+    return 0;
+
+refuse:
+    if (map != MAP_FAILED)
+        munmap(map, p->map_len);
+    if (fd >= 0)
+        close(fd);
+    shm_send_welcome(p->sock, &welcome, NULL, 0);
+    fprintf(stderr, "Refused client %d: %s\n", slot, strerror(welcome.status));
+    return -1;
+}
+
+/* Accepts waiting connections; each gets a slot until the hello arrives */
+void shm_server_accept(ShmServer *srv)
+{
+    int fd;
+
+    while ((fd = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int slot = 0;
+
+        while (slot < SHM_MAX_CLIENTS && srv->peers[slot].sock >= 0)
+            slot++;
+        if (slot == SHM_MAX_CLIENTS) {
+            fprintf(stderr, "Compositor full (%d clients), refusing a connection\n", SHM_MAX_CLIENTS);
+            close(fd);
+            continue;
+        }
+        srv->peers[slot].sock = fd;
+        srv->clients++;
+        shm_epoll_add(srv->epoll_fd, fd, EV_SHM_PEER + (uint64_t)slot);
+    }
+}
+
+/*
+ * A client's socket is readable: the hello if it has none yet, else the
+ * end of the connection, since clients send nothing after the hello.
+ */
+void shm_server_peer_event(ShmServer *srv, int slot)
+{
+    if (srv->peers[slot].hdr || shm_peer_hello(srv, slot) != 0)
+        shm_peer_drop(srv, slot);
+}
+
+/* Copies r of a client's surface into its layer, making opaque pixels opaque */
+static void shm_copy_rect(ShmPeer *p, Rect r)
+{
+    for (int y = r.y; y < r.y + r.h; y++) {
+        const uint32_t *src = surface_row(&p->shared, (unsigned int)y) + r.x;
+        uint32_t *dst = surface_row(&p->layer.pixels, (unsigned int)y) + r.x;
+
+        if (p->premultiplied) {
+            memcpy(dst, src, (size_t)r.w * sizeof(uint32_t));
+        } else {
+            for (int x = 0; x < r.w; x++)
+                dst[x] = src[x] | 0xff000000u;
+        }
+    }
+}
+
+/*
+ * Function: shm_server_ready
+ *
+ * A client posted a frame: copies the rectangles it declared into its
+ * layer, adds them to srv->damage and gives the surface back. A client
+ * can only hurt itself: rectangles are clipped to its surface, and one
+ * that ran more than the ring ahead loses the oldest entries.
+ */
+void shm_server_ready(ShmServer *srv, int slot)
+{
+    ShmPeer *p = &srv->peers[slot];
+    uint64_t n;
+    uint32_t head, tail;
+    int sw = (int)p->shared.width, sh = (int)p->shared.height;
+    uint64_t one = 1;
+
+    if (!p->hdr || read(p->ready_fd, &n, sizeof(n)) != (ssize_t)sizeof(n))
+        return;
+    head = atomic_load_explicit(&p->hdr->head, memory_order_acquire);
+    tail = atomic_load_explicit(&p->hdr->tail, memory_order_relaxed);
+    if (head - tail > RAINBOW_SHM_RING)
+        tail = head - RAINBOW_SHM_RING;
+    for (; tail != head; tail++) {
+        RainbowShmRect in = p->hdr->ring[tail % RAINBOW_SHM_RING];
+        Rect r;
+
+        if (in.x < 0 || in.y < 0 || in.x >= sw || in.y >= sh || in.w <= 0 || in.h <= 0)
+            continue;
+        r.x = in.x;
+        r.y = in.y;
+        r.w = in.w < sw - in.x ? in.w : sw - in.x;
+        r.h = in.h < sh - in.y ? in.h : sh - in.y;
+        shm_copy_rect(p, r);
+        layer_update_coverage(&p->layer, r);
+        srv->bytes_copied += (size_t)r.w * r.h * sizeof(uint32_t);
+        p->rects++;
+        r.x += p->layer.x;
+        r.y += p->layer.y;
+        damage_add(&srv->damage, r);
+    }
+    p->frames++;
+    atomic_store_explicit(&p->hdr->tail, head, memory_order_release);
+    if (write(p->release_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+}
+
+void shm_server_close(ShmServer *srv)
+{
+    if (!srv->layers)
+        return;   /* Never opened */
+    for (int i = 0; i < SHM_MAX_CLIENTS; i++)
+        shm_peer_drop(srv, i);
+    if (srv->listen_fd >= 0) {
+        shm_close_fd(srv->epoll_fd, &srv->listen_fd);
+        unlink(srv->path);
+    }
+}
+
+/* The connection to a compositor, for --client */
+typedef struct {
+    int sock;
+    int ready_fd;
+    int release_fd;
+    RainbowShmHeader *hdr;
+    size_t map_len;
+    Surface shared;             /* Our pixels, inside the mapping */
+    unsigned int screen_w;      /* The compositor's screen */
+    unsigned int screen_h;
+    uint32_t head;              /* Rectangles posted so far */
+    Damage pending;             /* Changes not posted yet: the compositor still had the surface */
+    uint64_t frames_posted;
+    uint64_t frames_held;       /* Flushes that found the surface still taken */
+} ShmClient;
+
+void shm_client_close(ShmClient *c)
+{
+    if (c->hdr)
+        munmap(c->hdr, c->map_len);
+    c->hdr = NULL;
+    shm_close_fd(-1, &c->ready_fd);
+    shm_close_fd(-1, &c->release_fd);
+    shm_close_fd(-1, &c->sock);
+}
+
+/*
+ * Function: shm_client_connect
+ *
+ * Connects to the compositor at path and asks for a surface of the
+ * size of want (0 x 0 for the whole screen) at its position, stacked
+ * at z.
+ *
+ * Returns: 0 on success, -1 on failure (after printing the reason)
+ */
+int shm_client_connect(ShmClient *c, const char *path, Rect want, int z)
+{
+    RainbowShmHello hello = { RAINBOW_SHM_MAGIC, RAINBOW_SHM_VERSION, want.x, want.y,
+                              (uint32_t)want.w, (uint32_t)want.h, z, 0 };
+    RainbowShmWelcome welcome;
+    struct sockaddr_un addr;
+    struct timeval timeout = { 5, 0 };
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { &welcome, sizeof(welcome) };
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct stat st;
+    int fds[3] = { -1, -1, -1 };
+
+    memset(c, 0, sizeof(*c));
+    c->ready_fd = c->release_fd = -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    c->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (c->sock < 0 || connect(c->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Cannot connect to the compositor at %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    setsockopt(c->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (send(c->sock, &hello, sizeof(hello), MSG_NOSIGNAL) != (ssize_t)sizeof(hello)) {
+        perror("Failed to greet the compositor");
+        goto fail;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(c->sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(welcome) ||
+        welcome.magic != RAINBOW_SHM_MAGIC || welcome.version != RAINBOW_SHM_VERSION) {
+        fprintf(stderr, "No answer from the compositor at %s\n", path);
+        goto fail;
+    }
+    cm = CMSG_FIRSTHDR(&msg);
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS &&
+        cm->cmsg_len == CMSG_LEN(3 * sizeof(int)))
+        memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    if (welcome.status || fds[0] < 0) {
+        fprintf(stderr, "The compositor refused the surface: %s\n",
+                strerror(welcome.status ? welcome.status : EPROTO));
+        goto fail;
+    }
+    c->ready_fd = fds[1];
+    c->release_fd = fds[2];
+    c->hdr = fstat(fds[0], &st) == 0 ? mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                            fds[0], 0) : MAP_FAILED;
+    if (c->hdr == MAP_FAILED) {
+        perror("Failed to map the surface");
+        c->hdr = NULL;
+        goto fail;
+    }
+    c->map_len = (size_t)st.st_size;
+    close(fds[0]);
+    fds[0] = -1;
+    if (c->hdr->width != welcome.width || c->hdr->height != welcome.height ||
+        c->hdr->pixels_offset + (size_t)c->hdr->stride * c->hdr->height * sizeof(uint32_t) > c->map_len) {
+        fprintf(stderr, "The compositor sent a malformed surface\n");
+        goto fail;
+    }
+    c->shared.pixels = (uint32_t *)(void *)((unsigned char *)c->hdr + c->hdr->pixels_offset);
+    c->shared.width = c->hdr->width;
+    c->shared.height = c->hdr->height;
+    c->shared.stride = c->hdr->stride;
+    c->screen_w = welcome.screen_width;
+    c->screen_h = welcome.screen_height;
+    c->head = atomic_load_explicit(&c->hdr->head, memory_order_relaxed);
+    damage_init(&c->pending, &c->shared);
+    return 0;
+
+fail:
+    if (fds[0] >= 0)
+        close(fds[0]);
+    shm_client_close(c);
+    return -1;
+}
+
+/*
+ * Function: shm_client_flush
+ *
+ * fb_flush() for a client: adds d (which is cleared; NULL for none) to
+ * the pending changes and, if the compositor has given the surface
+ * back, copies them into it and posts them as one frame. Otherwise they
+ * wait for the next flush, which is also made when the compositor
+ * releases the surface.
+ *
+ * Returns: number of bytes copied into the shared surface
+ */
+size_t shm_client_flush(ShmClient *c, const Surface *s, Damage *d, const RowSource *src)
+{
+    size_t bytes = 0;
+    uint64_t one = 1;
+
+    if (d) {
+        for (int i = 0; i < d->count; i++)
+            damage_add(&c->pending, d->rects[i]);
+        damage_clear(d);
+    }
+    if (!c->pending.count)
+        return 0;
+    if (atomic_load_explicit(&c->hdr->tail, memory_order_acquire) != c->head) {
+        c->frames_held++;
+        return 0;
+    }
+    for (int i = 0; i < c->pending.count; i++) {
+        Rect r = c->pending.rects[i];
+        RainbowShmRect out = { r.x, r.y, r.w, r.h };
+
+        for (int y = r.y; y < r.y + r.h; y++)
+            memcpy(surface_row(&c->shared, (unsigned int)y) + r.x, source_row(src, s, y, r.x, r.w),
+                   (size_t)r.w * sizeof(uint32_t));
+        c->hdr->ring[c->head++ % RAINBOW_SHM_RING] = out;
+        bytes += (size_t)r.w * r.h * sizeof(uint32_t);
+    }
+    atomic_store_explicit(&c->hdr->head, c->head, memory_order_release);
+    if (write(c->ready_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+    damage_clear(&c->pending);
+    c->frames_posted++;
+    return bytes;
+}
+
+/* Rainbow settings that can change while running (command line or config file) */
+typedef struct {
+    float fps;          /* Animation frame rate; 0 draws once and leaves it static */
+    float speed;        /* Hue drift while animating, in degrees per second */
+    float saturation;   /* 0.0 to 1.0 */
+    float value;        /* 0.0 to 1.0 */
+} RainbowParams;
+
+/*
+ * ============================================================================
+ * FRAME TELEMETRY
+ * ============================================================================
+ *
+ * Each thread that reports timings registers a TelemetrySlot and is the
+ * only writer of it. Updates are relaxed atomic load/store pairs, not
+ * read-modify-write instructions, so recording costs a few ordinary
+ * stores. Slots are cache-line aligned so threads never share a line,
+ * and any thread may read any slot at any time for a report.
+ *
+ * Durations go into a log-bucketed (HDR-style) histogram: values below
+ * 64 ns get exact buckets, and above that every power of two is split
+ * into 32 linear sub-buckets. Any percentile is accurate to about 3%
+ * across the whole 64-bit range, with fixed memory.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1u << HIST_SUB_BITS)
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) * HIST_SUB_COUNT)   /* hist_index(UINT64_MAX) + 1 */
+#define TELEMETRY_MAX_SLOTS 8
+
+typedef struct {
+    _Alignas(64) char name[16];
+    atomic_uint_fast64_t count;       /* Samples recorded */
+    atomic_uint_fast64_t missed;      /* Samples longer than their deadline */
+    atomic_uint_fast64_t bytes;       /* Output produced, meaning depends on the thread */
+    atomic_uint_fast64_t max_ns;
+    atomic_uint_fast64_t hist[HIST_BUCKETS];
+} TelemetrySlot;
+
+static TelemetrySlot telemetry_slots[TELEMETRY_MAX_SLOTS];
+static atomic_int telemetry_slot_count;
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Single-writer increment: no lock prefix needed since only the owner writes */
+static inline void counter_add(atomic_uint_fast64_t *c, uint64_t v)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v,
+                          memory_order_relaxed);
+}
+
+static inline unsigned int hist_index(uint64_t v)
+{
+    if (v < 2 * HIST_SUB_COUNT)
+        return (unsigned int)v;
+    unsigned int shift = (unsigned int)(63 - __builtin_clzll(v)) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_COUNT + (unsigned int)(v >> shift) - HIST_SUB_COUNT;
+}
+
+/* Middle of the value range covered by a bucket */
+static uint64_t hist_value(unsigned int index)
+{
+    if (index < 2 * HIST_SUB_COUNT)
+        return index;
+    unsigned int shift = index / HIST_SUB_COUNT - 1;
+    uint64_t low = (uint64_t)(HIST_SUB_COUNT + index % HIST_SUB_COUNT) << shift;
+    return low + ((uint64_t)1 << shift) / 2;
+}
+
+/*
+ * Function: telemetry_register
+ *
+ * Claims a slot for the calling thread.
+ *
+ * Returns: the slot, or NULL when all slots are taken (recording into
+ *          NULL is a no-op, so callers need not check)
+ */
+TelemetrySlot *telemetry_register(const char *name)
+{
+    int i = atomic_fetch_add(&telemetry_slot_count, 1);
+
+    if (i >= TELEMETRY_MAX_SLOTS)
+        return NULL;
+    snprintf(telemetry_slots[i].name, sizeof(telemetry_slots[i].name), "%s", name);
+    return &telemetry_slots[i];
+}
+
+/* Records one duration; deadline_ns of 0 means the sample has no deadline */
+void telemetry_record(TelemetrySlot *slot, uint64_t ns, uint64_t deadline_ns)
+{
+    if (!slot)
+        return;
+    counter_add(&slot->hist[hist_index(ns)], 1);
+    counter_add(&slot->count, 1);
+    if (deadline_ns && ns > deadline_ns)
+        counter_add(&slot->missed, 1);
+    if (ns > atomic_load_explicit(&slot->max_ns, memory_order_relaxed))
+        atomic_store_explicit(&slot->max_ns, ns, memory_order_relaxed);
+}
+
+void telemetry_add_bytes(TelemetrySlot *slot, uint64_t bytes)
+{
+    if (slot)
+        counter_add(&slot->bytes, bytes);
+}
+
+/* Duration below which the given fraction of samples fall, in ns */
+uint64_t telemetry_percentile(const TelemetrySlot *slot, double fraction)
+{
+    uint64_t total = atomic_load_explicit(&slot->count, memory_order_relaxed);
+    uint64_t target = (uint64_t)(fraction * (double)total);
+    uint64_t seen = 0;
+    uint64_t max = atomic_load_explicit(&slot->max_ns, memory_order_relaxed);
+
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&slot->hist[i], memory_order_relaxed);
+        if (seen > target) {
+            uint64_t v = hist_value(i);
+            return v < max ? v : max;
+        }
+    }
+    return max;
+}
+
+void telemetry_print(FILE *out)
+{
+    int n = atomic_load(&telemetry_slot_count);
+
+    for (int i = 0; i < n && i < TELEMETRY_MAX_SLOTS; i++) {
+        const TelemetrySlot *slot = &telemetry_slots[i];
+        uint64_t count = atomic_load_explicit(&slot->count, memory_order_relaxed);
+
+        if (!count)
+            continue;
+        fprintf(out, "%s: %llu samples, p50 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms, "
+                     "%llu over deadline, %.1f MB\n",
+                slot->name, (unsigned long long)count,
+                telemetry_percentile(slot, 0.50) / 1e6, telemetry_percentile(slot, 0.99) / 1e6,
+                telemetry_percentile(slot, 0.999) / 1e6,
+                atomic_load_explicit(&slot->max_ns, memory_order_relaxed) / 1e6,
+                (unsigned long long)atomic_load_explicit(&slot->missed, memory_order_relaxed),
+                atomic_load_explicit(&slot->bytes, memory_order_relaxed) / 1e6);
+    }
+}
+
+/*
+ * ============================================================================
+ * DYNAMIC RESOLUTION
+ * ============================================================================
+ *
+ * Heavy effects can be drawn at a fraction of the screen size and
+ * scaled up. The fraction is a level out of RES_LEVELS, so the internal
+ * size only takes a few distinct values. A governor can also move the
+ * level between two limits to keep frames within their period. It
+ * looks at the mean frame time over RES_WINDOW frames:
+ *  - above RES_HIGH of the period, it drops as many levels as a cost
+ *    proportional to the pixel count says are needed to get back under
+ *    RES_TARGET;
+ *  - below RES_LOW, it rises one level, if that is predicted to stay
+ *    under RES_TARGET.
+ * The gap between the two thresholds keeps it from flapping. The window
+ * after a change is thrown away, since it includes the change itself.
+ */
+
+#define RES_LEVELS 16           /* The internal size is level / RES_LEVELS of the screen */
+#define RES_WINDOW 15           /* Frames averaged per decision */
+#define RES_HIGH 0.85           /* Fractions of the frame period */
+#define RES_TARGET 0.75
+#define RES_LOW 0.5
+
+typedef struct {
+    int level;                  /* 1..RES_LEVELS */
+    int min_level;
+    int max_level;
+    int adaptive;               /* 0 = stays at max_level */
+    uint64_t period_ns;         /* Frame period; 0 (not animating) holds the level */
+    uint64_t window_ns;         /* Frame times summed over the current window */
+    int window_frames;
+    int settling;               /* Discard the current window */
+    uint64_t changes;
+} ResGovernor;
+
+/* min_level 0 keeps the level fixed at max_level */
+void res_governor_init(ResGovernor *g, int min_level, int max_level)
+{
+    memset(g, 0, sizeof(*g));
+    g->max_level = max_level < 1 ? 1 : max_level > RES_LEVELS ? RES_LEVELS : max_level;
+    g->min_level = min_level < 1 ? 1 : min_level > g->max_level ? g->max_level : min_level;
+    g->level = g->max_level;
+    g->adaptive = min_level > 0 && g->min_level < g->max_level;
+}
+
+/* Internal size of one screen dimension at level */
+static inline unsigned int res_scaled(unsigned int size, int level)
+{
+    unsigned int n = (unsigned int)(((uint64_t)size * (unsigned int)level + RES_LEVELS - 1) / RES_LEVELS);
+    return n ? n : 1;
+}
+
+/*
+ * Function: res_governor_update
+ *
+ * Counts one frame that took frame_ns.
+ *
+ * Returns: 1 if the level changed, 0 otherwise
+ */
+int res_governor_update(ResGovernor *g, uint64_t frame_ns)
+{
+    int level = g->level;
+
+    if (!g->adaptive || !g->period_ns)
+        return 0;
+    g->window_ns += frame_ns;
+    if (++g->window_frames < RES_WINDOW)
+        return 0;
+
+    double mean = (double)g->window_ns / g->window_frames;
+    double target = RES_TARGET * (double)g->period_ns;
+    g->window_ns = 0;
+    g->window_frames = 0;
+    if (g->settling) {
+        g->settling = 0;
+        return 0;
+    }
+    if (mean > RES_HIGH * (double)g->period_ns) {
+        /* Highest level whose predicted cost, proportional to level squared, meets the target */
+        while (level > g->min_level && mean * level * level > target * g->level * g->level)
+            level--;
+    } else if (mean < RES_LOW * (double)g->period_ns && level < g->max_level &&
+               mean * (level + 1) * (level + 1) < target * level * level) {
+        level++;
+    }
+    if (level == g->level)
+        return 0;
+    g->level = level;
+    g->settling = 1;
+    g->changes++;
+    return 1;
+}
+
+/*
+ * ============================================================================
+ * ON-SCREEN TEXT
+ * ============================================================================
+ */
+
+#define FONT_W 5
+#define FONT_H 7
+
+/*
+ * Built-in 5x7 font for ASCII 32 to 95 (space, punctuation, digits and
+ * capitals); lowercase letters are drawn as capitals. One byte per row,
+ * top row first, bit 4 is the leftmost column.
+ */
+static const unsigned char font5x7[64][FONT_H] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  /* ' ' */
+    { 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04 },  /* '!' */
+    { 0x0a, 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00 },  /* '"' */
+    { 0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a },  /* '#' */
+    { 0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04 },  /* '$' */
+    { 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 },  /* '%' */
+    { 0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d },  /* '&' */
+    { 0x04, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00 },  /* "'" */
+    { 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 },  /* '(' */
+    { 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 },  /* ')' */
+    { 0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00 },  /* '*' */
+    { 0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00 },  /* '+' */
+    { 0x00, 0x00, 0x00, 0x00, 0x04, 0x04, 0x08 },  /* ',' */
+    { 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00 },  /* '-' */
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c },  /* '.' */
+    { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 },  /* '/' */
+    { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e },  /* '0' */
+    { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e },  /* '1' */
+    { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f },  /* '2' */
+    { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e },  /* '3' */
+    { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 },  /* '4' */
+    { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e },  /* '5' */
+    { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e },  /* '6' */
+    { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },  /* '7' */
+    { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e },  /* '8' */
+    { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c },  /* '9' */
+    { 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 },  /* ':' */
+    { 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08 },  /* ';' */
+    { 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 },  /* '<' */
+    { 0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00 },  /* '=' */
+    { 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 },  /* '>' */
+    { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04 },  /* '?' */
+    { 0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e },  /* '@' */
+    { 0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 },  /* 'A' */
+    { 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e },  /* 'B' */
+    { 0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e },  /* 'C' */
+    { 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c },  /* 'D' */
+    { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f },  /* 'E' */
+    { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 },  /* 'F' */
+    { 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f },  /* 'G' */
+    { 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 },  /* 'H' */
+    { 0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e },  /* 'I' */
+    { 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c },  /* 'J' */
+    { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 },  /* 'K' */
+    { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f },  /* 'L' */
+    { 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 },  /* 'M' */
+    { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 },  /* 'N' */
+    { 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e },  /* 'O' */
+    { 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 },  /* 'P' */
+    { 0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d },  /* 'Q' */
+    { 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 },  /* 'R' */
+    { 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e },  /* 'S' */
+    { 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 },  /* 'T' */
+    { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e },  /* 'U' */
+    { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04 },  /* 'V' */
+    { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a },  /* 'W' */
+    { 0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11 },  /* 'X' */
+    { 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04, 0x04 },  /* 'Y' */
+    { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f },  /* 'Z' */
+    { 0x0e, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0e },  /* '[' */
+    { 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00 },  /* '\\' */
+    { 0x0e, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0e },  /* ']' */
+    { 0x04, 0x0a, 0x11, 0x00, 0x00, 0x00, 0x00 },  /* '^' */
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f },  /* '_' */
+};
+
+/*
+ * A monospaced bitmap font: either the built-in one or a PSF console font
+ * loaded from disk. Glyph rows are stored MSB-first (bit 7 of the first
+ * byte is the leftmost pixel), as in PSF files.
+ */
+typedef struct {
+    unsigned int width;
+    unsigned int height;
+    unsigned int glyph_count;
+    unsigned int row_bytes;       /* Bytes per glyph row: (width + 7) / 8 */
+    unsigned int first;           /* Character code of glyph 0 */
+    unsigned int spacing_x;       /* Blank columns/rows added after each glyph; PSF */
+    unsigned int spacing_y;       /* glyphs already include their own spacing */
+    int fold_lowercase;           /* Font has no lowercase: draw it as capitals */
+    unsigned char *bitmap;        /* glyph_count * height * row_bytes */
+} Font;
+
+/* Loads the built-in 5x7 font */
+int font_builtin(Font *f)
+{
+    memset(f, 0, sizeof(*f));
+    f->width = FONT_W;
+    f->height = FONT_H;
+    f->glyph_count = 64;
+    f->row_bytes = 1;
+    f->first = 32;
+    f->spacing_x = 1;
+    f->spacing_y = 2;
+    f->fold_lowercase = 1;
+    f->bitmap = malloc(sizeof(font5x7));
+    if (!f->bitmap)
+        return -1;
+    for (unsigned int g = 0; g < 64; g++)
+        for (unsigned int y = 0; y < FONT_H; y++)
+            f->bitmap[g * FONT_H + y] = (unsigned char)(font5x7[g][y] << (8 - FONT_W));
+    return 0;
+}
+
+#define PSF1_MAGIC 0x0436
+#define PSF1_MODE512 0x01
+#define PSF2_MAGIC 0x864ab572u
+
+/*
+ * Function: font_load_psf
+ *
+ * Loads a PSF1 or PSF2 console font (as shipped in
+ * /usr/share/consolefonts, uncompressed). Glyphs are indexed by character
+ * code directly; the optional Unicode table is ignored, which is right
+ * for ASCII text in all the standard Latin fonts.
+ *
+ * Returns: 0 on success, -1 on failure (after printing the reason)
+ */
+int font_load_psf(Font *f, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    unsigned char hdr[32];
+    size_t header_size, glyph_bytes;
+
+    memset(f, 0, sizeof(*f));
+    if (!fp) {
+        fprintf(stderr, "Failed to open font %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fread(hdr, 1, 4, fp) != 4)
+        goto bad;
+
+    if ((hdr[0] | hdr[1] << 8) == PSF1_MAGIC) {
+        header_size = 4;
+        f->width = 8;
+        f->height = hdr[3];
+        f->glyph_count = hdr[2] & PSF1_MODE512 ? 512 : 256;
+    } else if (((uint32_t)hdr[0] | (uint32_t)hdr[1] << 8 | (uint32_t)hdr[2] << 16 |
+                (uint32_t)hdr[3] << 24) == PSF2_MAGIC) {
+        uint32_t v[7];
+        if (fread(hdr + 4, 1, 28, fp) != 28)
+            goto bad;
+        for (int i = 0; i < 7; i++)
+            v[i] = (uint32_t)hdr[4 + 4 * i] | (uint32_t)hdr[5 + 4 * i] << 8 |
+                   (uint32_t)hdr[6 + 4 * i] << 16 | (uint32_t)hdr[7 + 4 * i] << 24;
+        /* version, headersize, flags, length, charsize, height, width */
+        header_size = v[1];
+        f->glyph_count = v[3];
+        f->height = v[5];
+        f->width = v[6];
+        if (v[4] != (size_t)f->height * ((f->width + 7) / 8))
+            goto bad;
+    } else {
+        goto bad;
+    }
+    if (f->width == 0 || f->width > 64 || f->height == 0 || f->height > 64 ||
+        f->glyph_count == 0 || f->glyph_count > 65536)
+        goto bad;
+
+    f->row_bytes = (f->width + 7) / 8;
+    glyph_bytes = (size_t)f->height * f->row_bytes;
+    f->bitmap = malloc(glyph_bytes * f->glyph_count);
+    if (!f->bitmap || fseek(fp, (long)header_size, SEEK_SET) != 0 ||
+        fread(f->bitmap, glyph_bytes, f->glyph_count, fp) != f->glyph_count)
+        goto bad;
+    fclose(fp);
+    return 0;
+
+bad:
+    fprintf(stderr, "%s is not a valid PSF1/PSF2 font\n", path);
+    free(f->bitmap);
+    f->bitmap = NULL;
+    fclose(fp);
+    return -1;
+}
+
+void font_destroy(Font *f)
+{
+    free(f->bitmap);
+    f->bitmap = NULL;
+}
+
+/* Glyph index for a character; unknown characters map to '?' */
+static inline unsigned int font_glyph(const Font *f, unsigned char ch)
+{
+    if (f->fold_lowercase && ch >= 'a' && ch <= 'z')
+        ch = (unsigned char)(ch - 'a' + 'A');
+    if (ch < f->first || ch - f->first >= f->glyph_count)
+        ch = '?';
+    return ch - f->first < f->glyph_count ? ch - f->first : 0;
+}
+
+static inline int font_pixel(const Font *f, unsigned int g, unsigned int x, unsigned int y)
+{
+    return (f->bitmap[((size_t)g * f->height + y) * f->row_bytes + x / 8] >> (7 - x % 8)) & 1;
+}
+
+/* Background colour meaning "leave the surface as it is" (surface pixels never set the top byte) */
+#define TEXT_TRANSPARENT 0xff000000u
+
+/* Horizontal run of foreground pixels within a glyph cell */
+typedef struct {
+    uint16_t y;
+    uint16_t x;
+    uint16_t len;
+} GlyphSpan;
+
+/*
+ * Every glyph of a font pre-rasterized once, at a fixed scale and colour
+ * pair, and packed into one contiguous block so a line of text touches a
+ * single compact allocation:
+ *  - with an opaque background, glyph cells are stored as finished
+ *    surface-format pixels and drawing is one memcpy per cell row;
+ *  - with a transparent background, each glyph is stored as its runs of
+ *    foreground pixels and drawing is one fill per run.
+ * Either way there are no per-pixel bit tests when drawing.
+ */
+typedef struct {
+    const Font *font;
+    unsigned int scale;
+    uint32_t fg;
+    uint32_t bg;                  /* TEXT_TRANSPARENT for see-through text */
+    unsigned int cell_w;          /* Glyph plus spacing, scaled */
+    unsigned int cell_h;
+    uint32_t *cells;              /* Opaque: glyph_count cells of cell_w * cell_h pixels */
+    GlyphSpan *spans;             /* Transparent: all glyphs' runs, glyph by glyph ... */
+    uint32_t *span_start;         /* ... glyph g owns spans[span_start[g] .. span_start[g + 1]) */
+} GlyphCache;
+
+int glyph_cache_init(GlyphCache *gc, const Font *f, unsigned int scale, uint32_t fg, uint32_t bg)
+{
+    memset(gc, 0, sizeof(*gc));
+    gc->font = f;
+    gc->scale = scale;
+    gc->fg = fg;
+    gc->bg = bg;
+    gc->cell_w = (f->width + f->spacing_x) * scale;
+    gc->cell_h = (f->height + f->spacing_y) * scale;
+
+    if (bg != TEXT_TRANSPARENT) {
+        gc->cells = malloc((size_t)f->glyph_count * gc->cell_w * gc->cell_h * sizeof(uint32_t));
+        if (!gc->cells)
+            return -1;
+        for (unsigned int g = 0; g < f->glyph_count; g++) {
+            uint32_t *cell = gc->cells + (size_t)g * gc->cell_w * gc->cell_h;
+
+            for (unsigned int y = 0; y < gc->cell_h; y++) {
+                unsigned int fy = y / scale;
+                for (unsigned int x = 0; x < gc->cell_w; x++) {
+                    unsigned int fx = x / scale;
+                    int on = fy < f->height && fx < f->width && font_pixel(f, g, fx, fy);
+                    cell[y * gc->cell_w + x] = on ? fg : bg;
+                }
+            }
+        }
+        return 0;
+    }
+
+    /* Count runs first so the span array is allocated exactly once */
+    size_t total = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        size_t n = 0;
+
+        for (unsigned int g = 0; g < f->glyph_count; g++) {
+            if (pass)
+                gc->span_start[g] = (uint32_t)n;
+            for (unsigned int fy = 0; fy < f->height; fy++) {
+                for (unsigned int fx = 0; fx < f->width;) {
+                    if (!font_pixel(f, g, fx, fy)) {
+                        fx++;
+                        continue;
+                    }
+                    unsigned int end = fx;
+                    while (end < f->width && font_pixel(f, g, end, fy))
+                        end++;
+                    for (unsigned int sy = 0; sy < scale; sy++, n++) {
+                        if (pass) {
+                            gc->spans[n].y = (uint16_t)(fy * scale + sy);
+                            gc->spans[n].x = (uint16_t)(fx * scale);
+                            gc->spans[n].len = (uint16_t)((end - fx) * scale);
+                        }
+                    }
+                    fx = end;
+                }
+            }
+        }
+        if (pass) {
+            gc->span_start[f->glyph_count] = (uint32_t)n;
+        } else {
+            total = n;
+            gc->spans = malloc((total ? total : 1) * sizeof(GlyphSpan));
+            gc->span_start = malloc(((size_t)f->glyph_count + 1) * sizeof(uint32_t));
+            if (!gc->spans || !gc->span_start) {
+                free(gc->spans);
+                free(gc->span_start);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+void glyph_cache_destroy(GlyphCache *gc)
+{
+    free(gc->cells);
+    free(gc->spans);
+    free(gc->span_start);
+    gc->cells = NULL;
+    gc->spans = NULL;
+    gc->span_start = NULL;
+}
+
+/* Size of a line of text in pixels */
+static inline Rect text_extent(const GlyphCache *gc, int x, int y, size_t len)
+{
+    Rect r = { x, y, (int)(len * gc->cell_w), (int)gc->cell_h };
+    return r;
+}
+
+/*
+ * Function: draw_text_n
+ *
+ * Draws len characters of text with the top-left corner at (x, y),
+ * clipped to the surface.
+ *
+ * Returns: the rectangle covered by the text (before clipping)
+ */
+Rect draw_text_n(Surface *s, const GlyphCache *gc, int x, int y, const char *text, size_t len)
+{
+    Rect covered = text_extent(gc, x, y, len);
+    Rect screen = { 0, 0, (int)s->width, (int)s->height };
+
+    /* Rows entirely above or below the surface cost nothing per character */
+    if (y >= (int)s->height || y + (int)gc->cell_h <= 0 || x >= (int)s->width)
+        return covered;
+
+    for (size_t i = 0; i < len; i++, x += (int)gc->cell_w) {
+        Rect cell = { x, y, (int)gc->cell_w, (int)gc->cell_h };
+        unsigned int g;
+
+        if (!rect_clip(&cell, screen)) {
+            if (x >= (int)s->width)
+                break;
+            continue;
+        }
+        g = font_glyph(gc->font, (unsigned char)text[i]);
+
+        if (gc->cells) {
+            const uint32_t *src = gc->cells + (size_t)g * gc->cell_w * gc->cell_h;
+            for (int row = cell.y; row < cell.y + cell.h; row++)
+                memcpy(surface_row(s, (unsigned int)row) + cell.x,
+                       src + (size_t)(row - y) * gc->cell_w + (cell.x - x),
+                       (size_t)cell.w * sizeof(uint32_t));
+        } else {
+            int fully_visible = cell.w == (int)gc->cell_w && cell.h == (int)gc->cell_h;
+
+            for (uint32_t k = gc->span_start[g]; k < gc->span_start[g + 1]; k++) {
+                const GlyphSpan *sp = &gc->spans[k];
+                int sy = y + sp->y, sx = x + sp->x, end = sx + sp->len;
+
+                if (!fully_visible) {
+                    if (sy < cell.y || sy >= cell.y + cell.h)
+                        continue;
+                    if (sx < cell.x)
+                        sx = cell.x;
+                    if (end > cell.x + cell.w)
+                        end = cell.x + cell.w;
+                }
+                uint32_t *row = surface_row(s, (unsigned int)sy);
+                for (int px = sx; px < end; px++)
+                    row[px] = gc->fg;
+            }
+        }
+    }
+    return covered;
+}
+
+Rect draw_text(Surface *s, const GlyphCache *gc, int x, int y, const char *text)
+{
+    return draw_text_n(s, gc, x, y, text, strlen(text));
+}
+
+/*
+ * Text batch: labels are collected during a frame (or once, for static
+ * ones) and drawn together in the order they were added, so later labels
+ * paint over earlier ones. Each label costs one glyph lookup per
+ * character plus one damage rectangle. Label text lives in one growing
+ * character arena, so adding a label never allocates once the batch has
+ * reached its working size.
+ */
+typedef struct {
+    const GlyphCache *gc;
+    int x;
+    int y;
+    size_t text;                  /* Offset into the arena */
+    size_t len;
+} TextLabel;
+
+typedef struct {
+    TextLabel *labels;
+    size_t count;
+    size_t cap;
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+} TextBatch;
+
+void text_batch_init(TextBatch *b)
+{
+    memset(b, 0, sizeof(*b));
+}
+
+void text_batch_destroy(TextBatch *b)
+{
+    free(b->labels);
+    free(b->arena);
+    memset(b, 0, sizeof(*b));
+}
+
+/* Queues a label; returns -1 if memory ran out */
+int text_batch_add(TextBatch *b, const GlyphCache *gc, int x, int y, const char *text)
+{
+    size_t len = strlen(text);
+
+    if (b->count == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 64;
+        TextLabel *l = realloc(b->labels, cap * sizeof(*l));
+        if (!l)
+            return -1;
+        b->labels = l;
+        b->cap = cap;
+    }
+    if (b->arena_len + len > b->arena_cap) {
+        size_t cap = b->arena_cap ? b->arena_cap : 1024;
+        while (cap < b->arena_len + len)
+            cap *= 2;
+        char *a = realloc(b->arena, cap);
+        if (!a)
+            return -1;
+        b->arena = a;
+        b->arena_cap = cap;
+    }
+    memcpy(b->arena + b->arena_len, text, len);
+    b->labels[b->count].gc = gc;
+    b->labels[b->count].x = x;
+    b->labels[b->count].y = y;
+    b->labels[b->count].text = b->arena_len;
+    b->labels[b->count].len = len;
+    b->count++;
+    b->arena_len += len;
+    return 0;
+}
+
+/* Draws every queued label and adds its rectangle to d */
+void text_batch_draw(const TextBatch *b, Surface *s, Damage *d)
+{
+    for (size_t i = 0; i < b->count; i++) {
+        const TextLabel *l = &b->labels[i];
+        damage_add(d, draw_text_n(s, l->gc, l->x, l->y, b->arena + l->text, l->len));
+    }
+}
+
+/*
+ * Live statistics box in the top-left corner. It is drawn over the
+ * finished frame and damages only its own rectangle. A frosted box has
+ * no background of its own: the caller blurs what lies under
+ * overlay_rect() and the box only darkens it.
+ */
+#define OVERLAY_LINES 3
+
+typedef struct {
+    GlyphCache glyphs;
+    char lines[OVERLAY_LINES][48];
+    uint64_t window_start_ns;   /* FPS is measured over windows of about half a second */
+    uint64_t window_frames;
+    int width;                  /* Widest the box has been (see overlay_rect) */
+} Overlay;
+
+/* Widens the box to fit the current text */
+static void overlay_fit(Overlay *o)
+{
+    const GlyphCache *gc = &o->glyphs;
+    unsigned int pad = gc->scale * 2;
+
+    for (int i = 0; i < OVERLAY_LINES; i++) {
+        int w = (int)(strlen(o->lines[i]) * gc->cell_w + 2 * pad);
+        if (w > o->width)
+            o->width = w;
+    }
+}
+
+int overlay_init(Overlay *o, const Font *f, unsigned int scale, int frosted)
+{
+    memset(o, 0, sizeof(*o));
+    strcpy(o->lines[0], "FPS --");
+    if (glyph_cache_init(&o->glyphs, f, scale, 0xffffff, frosted ? TEXT_TRANSPARENT : 0x202020) != 0)
+        return -1;
+    overlay_fit(o);
+    return 0;
+}
+
+void overlay_destroy(Overlay *o)
+{
+    glyph_cache_destroy(&o->glyphs);
+}
+
+/* Counts a frame and refreshes the text from the render telemetry twice a second */
+void overlay_update(Overlay *o, const TelemetrySlot *render)
+{
+    uint64_t now = now_ns();
+
+    o->window_frames++;
+    if (o->window_start_ns == 0) {
+        o->window_start_ns = now;
+        o->window_frames = 0;
+        return;
+    }
+    if (now - o->window_start_ns < 500000000u || !render)
+        return;
+
+    snprintf(o->lines[0], sizeof(o->lines[0]), "FPS %.1f",
+             o->window_frames * 1e9 / (double)(now - o->window_start_ns));
+    snprintf(o->lines[1], sizeof(o->lines[1]), "P50 %.2f P99 %.2f P999 %.2f MS",
+             telemetry_percentile(render, 0.50) / 1e6, telemetry_percentile(render, 0.99) / 1e6,
+             telemetry_percentile(render, 0.999) / 1e6);
+    snprintf(o->lines[2], sizeof(o->lines[2]), "MISSED %llu",
+             (unsigned long long)atomic_load_explicit(&render->missed, memory_order_relaxed));
+    overlay_fit(o);
+    o->window_start_ns = now;
+    o->window_frames = 0;
+}
+
+/*
+ * Screen area the box covers. It never gets narrower when the text
+ * does: a static --image or a --play background is not redrawn under
+ * it, so a strip of the wider box would stay behind.
+ */
+Rect overlay_rect(const Overlay *o)
+{
+    const GlyphCache *gc = &o->glyphs;
+    Rect box = { 0, 0, o->width, (int)(OVERLAY_LINES * gc->cell_h + 4 * gc->scale) };
+
+    return box;
+}
+
+void overlay_draw(const Overlay *o, Surface *s, Damage *d)
+{
+    const GlyphCache *gc = &o->glyphs;
+    unsigned int pad = gc->scale * 2;
+    Rect box = overlay_rect(o);
+    Rect screen = { 0, 0, (int)s->width, (int)s->height };
+
+    /* Background first (or, frosted, the darkened backdrop), then text over it */
+    Rect fill = box;
+    if (rect_clip(&fill, screen))
+        for (int y = fill.y; y < fill.y + fill.h; y++) {
+            uint32_t *row = surface_row(s, (unsigned int)y);
+            for (int x = fill.x; x < fill.x + fill.w; x++)
+                row[x] = gc->bg == TEXT_TRANSPARENT ? row[x] >> 1 & 0x7f7f7f : gc->bg;
+        }
+    for (int i = 0; i < OVERLAY_LINES; i++)
+        draw_text(s, gc, (int)pad, (int)(pad + i * gc->cell_h), o->lines[i]);
+    damage_add(d, box);
+}
+
+/*
+ * ============================================================================
+ * WORKER POOL
+ * ============================================================================
+ *
+ * A fixed set of threads for data-parallel jobs: worker_pool_run() hands
+ * out item numbers 0..items-1 from an atomic counter until they run out,
+ * with the calling thread joining in, and returns once every item is
+ * done. Jobs are expected to be coarse (bands of rows), so one atomic
+ * increment per item is all the scheduling there is.
+ *
+ * Kernels whose cost varies across the picture (noise, shaders,
+ * plugins, convolution over part of the screen) use
+ * worker_pool_run_tiles() instead, which cuts a rectangle into
+ * POOL_TILE squares and schedules them by work stealing. Every worker
+ * starts with an equal run of consecutive tiles in a deque of its own,
+ * which it works through from the front, so it stays in one region of
+ * the picture. A worker that runs dry takes the back half of another
+ * worker's run. A deque is one 64-bit word holding the first and end
+ * tile of the run, so taking from either end is a single CAS, and each
+ * deque has a cache line to itself.
+ *
+ * Either way the pool counts how long each worker spent inside jobs,
+ * against how long the jobs took, for the benchmark.
+ */
+
+#define POOL_MAX_THREADS 16
+#define POOL_TILE 64            /* Side of a worker_pool_run_tiles() tile */
+
+/* item: which piece of the job; worker: 0..count, stable for the call, for per-thread scratch */
+typedef void (*WorkFn)(void *ctx, int item, int worker);
+
+/* tile: the piece of the job's area to do; worker as for WorkFn */
+typedef void (*TileFn)(void *ctx, Rect tile, int worker);
+
+typedef struct WorkerPool WorkerPool;
+
+typedef struct {
+    WorkerPool *pool;
+    int id;
+} WorkerArg;
+
+/* One worker's deque of tiles and its counters, each on a cache line of its own */
+typedef struct {
+    _Alignas(64) atomic_uint_fast64_t range;   /* Tiles left: first in the low 32 bits, end in the high */
+    _Alignas(64) uint32_t dealt_first;         /* The run this worker started the job with */
+    uint32_t dealt_end;
+    uint64_t busy_ns;           /* Time inside job functions; only this worker writes these */
+    uint64_t items;             /* Items and tiles done */
+    uint64_t stolen;            /* Tiles done that were dealt to other workers */
+} PoolWorker;
+
+struct WorkerPool {
+    pthread_t threads[POOL_MAX_THREADS];
+    WorkerArg args[POOL_MAX_THREADS];
+    int count;                  /* Worker threads; the thread calling worker_pool_run() is worker count */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        /* A new job was posted, or the pool is stopping */
+    pthread_cond_t done;        /* The last worker finished the current job */
+    WorkFn fn;
+    TileFn tile_fn;             /* Set instead of fn for a tiled job ... */
+    void *ctx;
+    int items;
+    Rect area;                  /* ... cut into tiles_x tiles across */
+    int tiles_x;
+    atomic_int next;            /* Next item number to hand out */
+    int busy;                   /* Workers still inside the current job */
+    unsigned long generation;   /* Bumped for every job */
+    int stopping;
+    uint64_t run_ns;            /* Time the caller spent in jobs, for utilization */
+    PoolWorker workers[POOL_MAX_THREADS];
+};
+
+/* Number of distinct worker ids a job may see */
+static inline int worker_pool_size(const WorkerPool *p)
+{
+    return p->count + 1;
+}
+
+static void pool_drain(WorkerPool *p, WorkFn fn, void *ctx, int items, int worker)
+{
+    PoolWorker *w = &p->workers[worker];
+
+    for (;;) {
+        int i = atomic_fetch_add_explicit(&p->next, 1, memory_order_relaxed);
+        if (i >= items)
+            break;
+        uint64_t start = now_ns();
+        fn(ctx, i, worker);
+        w->busy_ns += now_ns() - start;
+        w->items++;
+    }
+}
+
+static inline uint64_t tile_range(uint32_t first, uint32_t end)
+{
+    return (uint64_t)end << 32 | first;
+}
+
+/* Takes the first tile of worker w's own deque; -1 once it is empty */
+static int tile_pop(PoolWorker *w)
+{
+    uint64_t r = atomic_load_explicit(&w->range, memory_order_acquire);
+
+    while ((uint32_t)r < (uint32_t)(r >> 32))
+        if (atomic_compare_exchange_weak_explicit(&w->range, &r, tile_range((uint32_t)r + 1, (uint32_t)(r >> 32)),
+                                                  memory_order_acq_rel, memory_order_acquire))
+            return (int)(uint32_t)r;
+    return -1;
+}
+
+/*
+ * Takes the back half of another worker's tiles: returns the first of
+ * them and puts the rest in w's own (empty) deque, or -1 if every other
+ * deque is empty. A range once taken never comes back, so a CAS cannot
+ * mistake a refilled deque for the one it loaded.
+ */
+static int tile_steal(WorkerPool *p, int worker)
+{
+    int n = worker_pool_size(p);
+
+    for (int k = 1; k < n; k++) {
+        PoolWorker *v = &p->workers[(worker + k) % n];
+        uint64_t r = atomic_load_explicit(&v->range, memory_order_acquire);
+
+        for (;;) {
+            uint32_t first = (uint32_t)r, end = (uint32_t)(r >> 32);
+            if (first >= end)
+                break;
+            uint32_t from = end - (end - first + 1) / 2;
+            if (atomic_compare_exchange_weak_explicit(&v->range, &r, tile_range(first, from),
+                                                      memory_order_acq_rel, memory_order_acquire)) {
+                atomic_store_explicit(&p->workers[worker].range, tile_range(from + 1, end), memory_order_release);
+                return (int)from;
+            }
+        }
+    }
+    return -1;
+}
+
+static void pool_drain_tiles(WorkerPool *p, TileFn fn, void *ctx, int worker)
+{
+    PoolWorker *w = &p->workers[worker];
+    Rect a = p->area;
+
+    for (;;) {
+        int t = tile_pop(w);
+        if (t < 0 && (t = tile_steal(p, worker)) < 0)
+            break;
+        Rect tile = { a.x + t % p->tiles_x * POOL_TILE, a.y + t / p->tiles_x * POOL_TILE, POOL_TILE, POOL_TILE };
+        if (tile.w > a.x + a.w - tile.x)
+            tile.w = a.x + a.w - tile.x;
+        if (tile.h > a.y + a.h - tile.y)
+            tile.h = a.y + a.h - tile.y;
+        uint64_t start = now_ns();
+        fn(ctx, tile, worker);
+        w->busy_ns += now_ns() - start;
+        w->items++;
+        w->stolen += (uint32_t)t < w->dealt_first || (uint32_t)t >= w->dealt_end;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    WorkerArg *a = arg;
+    WorkerPool *p = a->pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->generation == seen && !p->stopping)
+            pthread_cond_wait(&p->wake, &p->lock);
+        if (p->stopping)
+            break;
+        seen = p->generation;
+        WorkFn fn = p->fn;
+        TileFn tile_fn = p->tile_fn;
+        void *ctx = p->ctx;
+        int items = p->items;
+        pthread_mutex_unlock(&p->lock);
+
+        if (tile_fn)
+            pool_drain_tiles(p, tile_fn, ctx, a->id);
+        else
+            pool_drain(p, fn, ctx, items, a->id);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->busy == 0)
+            pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* Starts threads - 1 workers (the caller is the last thread); threads <= 1 runs jobs inline */
+int worker_pool_start(WorkerPool *p, int threads)
+{
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_cond_init(&p->done, NULL);
+    if (threads > POOL_MAX_THREADS)
+        threads = POOL_MAX_THREADS;
+    for (int i = 0; i < threads - 1; i++) {
+        p->args[i].pool = p;
+        p->args[i].id = i;
+        if (pthread_create(&p->threads[i], NULL, worker_main, &p->args[i]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        p->count++;
+    }
+    return 0;
+}
+
+/* Hands the job set up in p to the workers, joins in and waits for all of them */
+static void pool_post(WorkerPool *p)
+{
+    p->busy = p->count;
+    p->generation++;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    if (p->tile_fn)
+        pool_drain_tiles(p, p->tile_fn, p->ctx, p->count);
+    else
+        pool_drain(p, p->fn, p->ctx, p->items, p->count);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->busy)
+        pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void worker_pool_run(WorkerPool *p, WorkFn fn, void *ctx, int items)
+{
+    uint64_t start = now_ns();
+
+    if (p->count == 0 || items <= 1) {
+        atomic_store_explicit(&p->next, 0, memory_order_relaxed);
+        pool_drain(p, fn, ctx, items, p->count);
+    } else {
+        pthread_mutex_lock(&p->lock);
+        p->fn = fn;
+        p->tile_fn = NULL;
+        p->ctx = ctx;
+        p->items = items;
+        atomic_store_explicit(&p->next, 0, memory_order_relaxed);
+        pool_post(p);
+    }
+    p->run_ns += now_ns() - start;
+}
+
+/*
+ * Function: worker_pool_run_tiles
+ *
+ * Calls fn for every POOL_TILE square of area (smaller along the right
+ * and bottom edges), spread over the pool by work stealing, and
+ * returns once every tile is done. Each worker starts on a run of
+ * consecutive tiles in row order.
+ */
+void worker_pool_run_tiles(WorkerPool *p, TileFn fn, void *ctx, Rect area)
+{
+    uint64_t start = now_ns();
+    int n = worker_pool_size(p);
+
+    if (area.w <= 0 || area.h <= 0)
+        return;
+    if (p->count)
+        pthread_mutex_lock(&p->lock);
+    p->fn = NULL;
+    p->tile_fn = fn;
+    p->ctx = ctx;
+    p->area = area;
+    p->tiles_x = (area.w + POOL_TILE - 1) / POOL_TILE;
+    int tiles = p->tiles_x * ((area.h + POOL_TILE - 1) / POOL_TILE);
+    for (int i = 0; i < n; i++) {
+        PoolWorker *w = &p->workers[i];
+        w->dealt_first = (uint32_t)((int64_t)tiles * i / n);
+        w->dealt_end = (uint32_t)((int64_t)tiles * (i + 1) / n);
+        atomic_store_explicit(&w->range, tile_range(w->dealt_first, w->dealt_end), memory_order_relaxed);
+    }
+    if (p->count)
+        pool_post(p);
+    else
+        pool_drain_tiles(p, fn, ctx, 0);
+    p->run_ns += now_ns() - start;
+}
+
+/* Starts counting worker utilization from zero */
+void worker_pool_reset_stats(WorkerPool *p)
+{
+    p->run_ns = 0;
+    for (int i = 0; i < POOL_MAX_THREADS; i++) {
+        p->workers[i].busy_ns = 0;
+        p->workers[i].items = 0;
+        p->workers[i].stolen = 0;
+    }
+}
+
+/* Percentage of the job time worker spent inside job functions since the last reset */
+static inline double worker_pool_utilization(const WorkerPool *p, int worker)
+{
+    return p->run_ns ? 100.0 * (double)p->workers[worker].busy_ns / (double)p->run_ns : 0.0;
+}
+
+void worker_pool_stop(WorkerPool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->stopping = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->count; i++)
+        pthread_join(p->threads[i], NULL);
+    p->count = 0;
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    pthread_cond_destroy(&p->done);
+}
+
+/*
+ * ============================================================================
+ * IMAGE SCALER
+ * ============================================================================
+ *
+ * Resamples an Image to an arbitrary rectangle of a Surface:
+ *
+ *   SCALE_NEAREST   picks the source pixel under each output pixel centre
+ *   SCALE_BILINEAR  interpolates the 2x2 source pixels around it
+ *   SCALE_AREA      averages every source pixel the output pixel covers,
+ *                   weighted by overlap; the right choice for shrinking
+ *
+ * All filters are separable. Each output row is produced by a horizontal
+ * pass over the source rows it needs (cached per thread, since
+ * neighbouring output rows share source rows) and a vertical pass that
+ * combines them. Per-axis coordinate and weight tables depend only on
+ * the sizes involved and are kept across calls. Output rows are split
+ * into bands that run on the worker pool.
+ *
+ * The top byte is filtered along with the colour channels, so
+ * premultiplied ARGB images scale correctly; XRGB sources come out with
+ * it cleared.
+ */
+
+enum { SCALE_NEAREST, SCALE_BILINEAR, SCALE_AREA };
+
+#define SCALER_CACHE 4          /* (size, filter) combinations whose tables are kept */
+#define SCALE_BAND_ROWS 16      /* Minimum rows per band */
+
+typedef struct {
+    int *first;                 /* Nearest: the source pixel. Bilinear: left/top tap. Area: first tap */
+    int *second;                /* Bilinear: right/bottom tap */
+    uint16_t *weight;           /* Bilinear: weight of the second tap, 0-128 */
+    int *taps;                  /* Area: offsets into weights, one more entry than pixels */
+    int16_t *weights;           /* Area: weights (sum 16384) of first[i], first[i] + 1, ... */
+} ScaleAxis;
+
+typedef struct {
+    int src_w, src_h, dst_w, dst_h, filter;
+    unsigned long used;         /* LRU stamp, 0 = empty slot */
+    ScaleAxis x;
+    ScaleAxis y;
+} ScaleMap;
+
+typedef struct {
+    WorkerPool *pool;
+    ScaleMap maps[SCALER_CACHE];
+    unsigned long clock;
+    uint32_t *scratch;          /* Per-worker rows, scratch_stride words each */
+    size_t scratch_stride;
+    size_t scratch_cap;
+} Scaler;
+
+static void scale_axis_free(ScaleAxis *a)
+{
+    free(a->first);
+    free(a->second);
+    free(a->weight);
+    free(a->taps);
+    free(a->weights);
+    memset(a, 0, sizeof(*a));
+}
+
+/* Fills the tables mapping n output pixels onto m source pixels */
+static int scale_axis_build(ScaleAxis *a, int m, int n, int filter)
+{
+    memset(a, 0, sizeof(*a));
+    a->first = malloc((size_t)n * sizeof(int));
+    if (!a->first)
+        return -1;
+
+    if (filter == SCALE_NEAREST) {
+        for (int i = 0; i < n; i++)
+            a->first[i] = (int)(((int64_t)2 * i + 1) * m / (2 * (int64_t)n));
+        return 0;
+    }
+
+    if (filter == SCALE_BILINEAR) {
+        a->second = malloc((size_t)n * sizeof(int));
+        a->weight = malloc((size_t)n * sizeof(uint16_t));
+        if (!a->second || !a->weight)
+            return -1;
+        for (int i = 0; i < n; i++) {
+            /* Source position of the output pixel centre, 16.16, pixel centres on whole numbers */
+            int64_t pos = (((int64_t)2 * i + 1) * m << 16) / (2 * (int64_t)n) - 32768;
+            if (pos < 0)
+                pos = 0;
+            if (pos > (int64_t)(m - 1) << 16)
+                pos = (int64_t)(m - 1) << 16;
+            a->first[i] = (int)(pos >> 16);
+            a->second[i] = a->first[i] + 1 < m ? a->first[i] + 1 : m - 1;
+            a->weight[i] = (uint16_t)(((pos & 0xffff) + 256) >> 9);
+        }
+        return 0;
+    }
+
+    /* Area: output pixel i spans [i*m, (i+1)*m) and source pixel j spans
+     * [j*n, (j+1)*n), both in units of 1/(m*n) of the full width. */
+    size_t max_taps = (size_t)n * ((size_t)m / (size_t)n + 2);
+    a->taps = malloc(((size_t)n + 1) * sizeof(int));
+    a->weights = malloc(max_taps * sizeof(int16_t));
+    if (!a->taps || !a->weights)
+        return -1;
+    int t = 0;
+    for (int i = 0; i < n; i++) {
+        int64_t lo = (int64_t)i * m, hi = lo + m;
+        int j0 = (int)(lo / n), j1 = (int)((hi - 1) / n);
+        int sum = 0, big = t;
+
+        a->first[i] = j0;
+        a->taps[i] = t;
+        for (int j = j0; j <= j1; j++, t++) {
+            int64_t from = (int64_t)j * n > lo ? (int64_t)j * n : lo;
+            int64_t to = (int64_t)(j + 1) * n < hi ? (int64_t)(j + 1) * n : hi;
+            a->weights[t] = (int16_t)(((to - from) * 16384 + m / 2) / m);
+            sum += a->weights[t];
+            if (a->weights[t] > a->weights[big])
+                big = t;
+        }
+        a->weights[big] = (int16_t)(a->weights[big] + 16384 - sum);   /* Exact unit gain */
+    }
+    a->taps[n] = t;
+    return 0;
+}
+
+/* Finds or builds the tables for one size pair, replacing the least recently used entry */
+static const ScaleMap *scaler_map(Scaler *sc, int sw, int sh, int dw, int dh, int filter)
+{
+    ScaleMap *victim = &sc->maps[0];
+
+    sc->clock++;
+    for (int i = 0; i < SCALER_CACHE; i++) {
+        ScaleMap *m = &sc->maps[i];
+        if (m->used && m->src_w == sw && m->src_h == sh && m->dst_w == dw && m->dst_h == dh &&
+            m->filter == filter) {
+            m->used = sc->clock;
+            return m;
+        }
+        if (m->used < victim->used)
+            victim = m;
+    }
+
+    scale_axis_free(&victim->x);
+    scale_axis_free(&victim->y);
+    victim->used = 0;
+    if (scale_axis_build(&victim->x, sw, dw, filter) != 0 ||
+        scale_axis_build(&victim->y, sh, dh, filter) != 0) {
+        scale_axis_free(&victim->x);
+        scale_axis_free(&victim->y);
+        return NULL;
+    }
+    victim->src_w = sw;
+    victim->src_h = sh;
+    victim->dst_w = dw;
+    victim->dst_h = dh;
+    victim->filter = filter;
+    victim->used = sc->clock;
+    return victim;
+}
+
+void scaler_init(Scaler *sc, WorkerPool *pool)
+{
+    memset(sc, 0, sizeof(*sc));
+    sc->pool = pool;
+}
+
+void scaler_destroy(Scaler *sc)
+{
+    for (int i = 0; i < SCALER_CACHE; i++) {
+        scale_axis_free(&sc->maps[i].x);
+        scale_axis_free(&sc->maps[i].y);
+    }
+    free(sc->scratch);
+    memset(sc, 0, sizeof(*sc));
+}
+
+#ifdef __SSE2__
+/* One pixel's four channels as 32-bit lanes interleaved with zeros, ready for _mm_madd_epi16 */
+static inline __m128i widen_pixel(uint32_t p)
+{
+    __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)p), _mm_setzero_si128());
+    return _mm_unpacklo_epi16(v, _mm_setzero_si128());
+}
+
+/* Rounds four 32-bit channel sums in 1/16384 units back into one pixel */
+static inline uint32_t narrow_pixel(__m128i acc)
+{
+    acc = _mm_srli_epi32(_mm_add_epi32(acc, _mm_set1_epi32(8192)), 14);
+    acc = _mm_packs_epi32(acc, acc);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+}
+#endif
+
+/* a*(128-w) + b*w, rounded, per channel; w in 0-128 */
+static inline uint32_t lerp_pixel(uint32_t a, uint32_t b, unsigned int w)
+{
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t ca = (a >> shift) & 0xff, cb = (b >> shift) & 0xff;
+        out |= ((ca * (128 - w) + cb * w + 64) >> 7) << shift;
+    }
+    return out;
+}
+
+static void scale_h_bilinear(uint32_t *out, const uint32_t *src, const ScaleAxis *a, int x0, int n)
+{
+    const int *f = a->first + x0, *s = a->second + x0;
+    const uint16_t *w = a->weight + x0;
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128(), c64 = _mm_set1_epi32(64);
+    for (; i + 2 <= n; i += 2) {
+        /* Interleave each pixel's channels with its neighbour's and weigh
+         * both taps with a single multiply-add per pixel */
+        __m128i pa = _mm_unpacklo_epi32(_mm_cvtsi32_si128((int)src[f[i]]), _mm_cvtsi32_si128((int)src[f[i + 1]]));
+        __m128i pb = _mm_unpacklo_epi32(_mm_cvtsi32_si128((int)src[s[i]]), _mm_cvtsi32_si128((int)src[s[i + 1]]));
+        __m128i ab = _mm_unpacklo_epi8(pa, pb);
+        __m128i w0 = _mm_shuffle_epi32(_mm_cvtsi32_si128((int)((uint32_t)w[i] << 16 | (128u - w[i]))), 0);
+        __m128i w1 = _mm_shuffle_epi32(_mm_cvtsi32_si128((int)((uint32_t)w[i + 1] << 16 | (128u - w[i + 1]))), 0);
+        __m128i r0 = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(ab, zero), w0), c64), 7);
+        __m128i r1 = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi8(ab, zero), w1), c64), 7);
+        r0 = _mm_packs_epi32(r0, r1);
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(r0, r0));
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = lerp_pixel(src[f[i]], src[s[i]], w[i]);
+}
+
+static void scale_v_bilinear(uint32_t *out, const uint32_t *a, const uint32_t *b, unsigned int w, int n)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wb = _mm_set1_epi16((short)w), wa = _mm_set1_epi16((short)(128 - w));
+    const __m128i c64 = _mm_set1_epi16(64);
+    for (; i + 4 <= n; i += 4) {
+        __m128i pa = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i pb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pa, zero), wa),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(pb, zero), wb));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pa, zero), wa),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(pb, zero), wb));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, c64), 7);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, c64), 7);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = lerp_pixel(a[i], b[i], w);
+}
+
+static void scale_h_area(uint32_t *out, const uint32_t *src, const ScaleAxis *a, int x0, int n)
+{
+    for (int i = 0; i < n; i++) {
+        const uint32_t *p = src + a->first[x0 + i];
+        const int16_t *w = a->weights + a->taps[x0 + i];
+        int taps = a->taps[x0 + i + 1] - a->taps[x0 + i];
+#ifdef __SSE2__
+        /* Two taps per multiply-add: channels of neighbouring source
+         * pixels interleaved against a (w[t], w[t + 1]) weight pair */
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc = _mm_setzero_si128();
+        int t = 0;
+        for (; t + 2 <= taps; t += 2) {
+            __m128i pair = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)p[t]), _mm_cvtsi32_si128((int)p[t + 1]));
+            __m128i wp = _mm_set1_epi32((int)((uint32_t)(uint16_t)w[t + 1] << 16 | (uint16_t)w[t]));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(pair, zero), wp));
+        }
+        if (t < taps)
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(widen_pixel(p[t]), _mm_set1_epi32(w[t])));
+        out[i] = narrow_pixel(acc);
+#else
+        uint32_t px = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            uint32_t sum = 8192;
+            for (int t = 0; t < taps; t++)
+                sum += ((p[t] >> shift) & 0xff) * (uint32_t)w[t];
+            px |= (sum >> 14) << shift;
+        }
+        out[i] = px;
+#endif
+    }
+}
+
+/*
+ * Vertical area pass for two source rows at a time: adds a * wa + b * wb
+ * to the four 32-bit channel sums per pixel in acc. The first pair of a
+ * row starts the sums instead of adding to them; the last pair writes
+ * finished pixels to out instead of storing them. With two or fewer taps
+ * (any enlargement) acc is never touched.
+ */
+static void scale_v_area_pair(uint32_t *acc, uint32_t *out, const uint32_t *a, const uint32_t *b,
+                              int wa, int wb, int n, int first, int last)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(8192);
+    const __m128i wp = _mm_set1_epi32((int)((uint32_t)(uint16_t)wb << 16 | (uint16_t)wa));
+    for (; i + 4 <= n; i += 4) {
+        __m128i pa = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i pb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i lo = _mm_unpacklo_epi8(pa, pb), hi = _mm_unpackhi_epi8(pa, pb);
+        __m128i s[4] = {
+            _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), wp), _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), wp),
+            _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), wp), _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), wp),
+        };
+        __m128i *sums = (__m128i *)(void *)(acc + 4 * i);
+        for (int k = 0; k < 4; k++) {
+            if (!first)
+                s[k] = _mm_add_epi32(s[k], _mm_loadu_si128(sums + k));
+            if (!last)
+                _mm_storeu_si128(sums + k, s[k]);
+            else
+                s[k] = _mm_srli_epi32(_mm_add_epi32(s[k], round), 14);
+        }
+        if (last) {
+            __m128i px = _mm_packus_epi16(_mm_packs_epi32(s[0], s[1]), _mm_packs_epi32(s[2], s[3]));
+            _mm_storeu_si128((__m128i *)(out + i), px);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        uint32_t px = 0;
+        for (int c = 0; c < 4; c++) {
+            uint32_t v = ((a[i] >> (8 * c)) & 0xff) * (uint32_t)wa + ((b[i] >> (8 * c)) & 0xff) * (uint32_t)wb;
+            if (!first)
+                v += acc[4 * i + c];
+            if (!last)
+                acc[4 * i + c] = v;
+            px |= ((v + 8192) >> 14) << (8 * c);
+        }
+        if (last)
+            out[i] = px;
+    }
+}
+
+typedef struct {
+    Scaler *sc;
+    const ScaleMap *map;
+    const Image *img;
+    Rect clip;                  /* Output rectangle actually written */
+    Rect full;                  /* Output rectangle the whole image maps to */
+    Surface *surface;           /* Destination */
+    uint32_t keep;              /* Mask applied to output pixels */
+    int band_rows;
+} ScaleJob;
+
+/* Per-worker scratch layout, in 32-bit words */
+typedef struct {
+    uint32_t *conv;             /* One source row converted to 32 bits */
+    int conv_tag;               /* Source row held in conv, -1 = none */
+    uint32_t *h[2];             /* Horizontally scaled source rows, by parity of row number */
+    int h_tag[2];
+    uint32_t *acc;              /* Area: four 32-bit sums per output pixel */
+} ScaleScratch;
+
+static size_t scale_scratch_words(int src_w, int out_w)
+{
+    return (size_t)src_w + (size_t)out_w * 6;
+}
+
+static const uint32_t *scale_source_row(const ScaleJob *job, ScaleScratch *ws, int sy)
+{
+    const Image *img = job->img;
+
+    if (img->format == PIXEL_XRGB8888 || img->format == PIXEL_ARGB8888)
+        return (const uint32_t *)(const void *)image_row(img, sy);
+    if (ws->conv_tag != sy) {
+        convert_to_xrgb(ws->conv, image_row(img, sy), img->format, img->width);
+        ws->conv_tag = sy;
+    }
+    return ws->conv;
+}
+
+/* Source row sy scaled horizontally to the clipped output width */
+static const uint32_t *scale_h_row(const ScaleJob *job, ScaleScratch *ws, int sy)
+{
+    int slot = sy & 1;
+
+    if (ws->h_tag[slot] != sy) {
+        const uint32_t *src = scale_source_row(job, ws, sy);
+        int x0 = job->clip.x - job->full.x;
+        if (job->map->filter == SCALE_BILINEAR)
+            scale_h_bilinear(ws->h[slot], src, &job->map->x, x0, job->clip.w);
+        else
+            scale_h_area(ws->h[slot], src, &job->map->x, x0, job->clip.w);
+        ws->h_tag[slot] = sy;
+    }
+    return ws->h[slot];
+}
+
+static void scale_band(void *ctx, int band, int worker)
+{
+    const ScaleJob *job = ctx;
+    const ScaleMap *map = job->map;
+    ScaleScratch ws;
+    int w = job->clip.w, x0 = job->clip.x - job->full.x;
+    int y_from = band * job->band_rows;
+    int y_to = y_from + job->band_rows < job->clip.h ? y_from + job->band_rows : job->clip.h;
+
+    ws.conv = job->sc->scratch + (size_t)worker * job->sc->scratch_stride;
+    ws.h[0] = ws.conv + job->img->width;
+    ws.h[1] = ws.h[0] + w;
+    ws.acc = ws.h[1] + w;
+    ws.conv_tag = ws.h_tag[0] = ws.h_tag[1] = -1;
+
+    for (int row = y_from; row < y_to; row++) {
+        int y = job->clip.y + row;          /* Destination row */
+        int my = y - job->full.y;           /* Row within the mapped image */
+        uint32_t *dst = surface_row(job->surface, (unsigned int)y) + job->clip.x;
+
+        switch (map->filter) {
+        case SCALE_NEAREST: {
+            const uint32_t *src = scale_source_row(job, &ws, map->y.first[my]);
+            const int *xs = map->x.first + x0;
+            for (int i = 0; i < w; i++)
+                dst[i] = src[xs[i]];
+            break;
+        }
+        case SCALE_BILINEAR: {
+            const uint32_t *a = scale_h_row(job, &ws, map->y.first[my]);
+            const uint32_t *b = scale_h_row(job, &ws, map->y.second[my]);
+            scale_v_bilinear(dst, a, b, map->y.weight[my], w);
+            break;
+        }
+        default: {
+            int t0 = map->y.taps[my], t1 = map->y.taps[my + 1];
+            const int16_t *wy = map->y.weights;
+            for (int t = t0; t < t1; t += 2) {
+                int sy = map->y.first[my] + t - t0;
+                const uint32_t *a = scale_h_row(job, &ws, sy);
+                /* An odd tap out pairs with itself at zero weight */
+                const uint32_t *b = t + 1 < t1 ? scale_h_row(job, &ws, sy + 1) : a;
+                scale_v_area_pair(ws.acc, dst, a, b, wy[t], t + 1 < t1 ? wy[t + 1] : 0, w, t == t0, t + 2 >= t1);
+            }
+            break;
+        }
+        }
+
+        if (job->keep != 0xffffffffu)
+            for (int i = 0; i < w; i++)
+                dst[i] &= job->keep;
+    }
+}
+
+static Rect scale_run(Scaler *sc, ScaleJob *job, Rect bounds, int filter)
+{
+    const Image *img = job->img;
+    int workers = sc->pool ? worker_pool_size(sc->pool) : 1;
+
+    job->clip = job->full;
+    if (img->width <= 0 || img->height <= 0 || !rect_clip(&job->clip, bounds))
+        return job->clip;
+    job->sc = sc;
+    job->map = scaler_map(sc, img->width, img->height, job->full.w, job->full.h, filter);
+    if (!job->map)
+        goto fail;
+
+    size_t stride = (scale_scratch_words(img->width, job->clip.w) + 15) & ~(size_t)15;
+    if (stride * (size_t)workers > sc->scratch_cap) {
+        uint32_t *p = realloc(sc->scratch, stride * (size_t)workers * sizeof(uint32_t));
+        if (!p)
+            goto fail;
+        sc->scratch = p;
+        sc->scratch_cap = stride * (size_t)workers;
+    }
+    sc->scratch_stride = stride;
+    job->keep = img->format == PIXEL_ARGB8888 ? 0xffffffffu : 0x00ffffffu;
+
+    /* A few bands per thread so uneven progress evens out */
+    job->band_rows = (job->clip.h + workers * 4 - 1) / (workers * 4);
+    if (job->band_rows < SCALE_BAND_ROWS)
+        job->band_rows = SCALE_BAND_ROWS;
+    int bands = (job->clip.h + job->band_rows - 1) / job->band_rows;
+    if (sc->pool)
+        worker_pool_run(sc->pool, scale_band, job, bands);
+    else
+        for (int i = 0; i < bands; i++)
+            scale_band(job, i, 0);
+    return job->clip;
+
+fail:
+    job->clip.w = job->clip.h = 0;
+    return job->clip;
+}
+
+/*
+ * Function: scale_image
+ *
+ * Scales the whole of img to fill dst_rect of the surface, clipped to
+ * clip and the surface, with one of the SCALE_* filters. Returns the
+ * rectangle written, empty if memory ran out.
+ */
+Rect scale_image(Scaler *sc, const Image *img, Surface *s, Rect clip, Rect dst_rect, int filter)
+{
+    ScaleJob job;
+
+    memset(&job, 0, sizeof(job));
+    job.img = img;
+    job.full = dst_rect;
+    job.surface = s;
+    return scale_run(sc, &job, clip_to_surface(s, clip), filter);
+}
+
+/*
+ * ============================================================================
+ * BLUR AND CONVOLUTION FILTERS
+ * ============================================================================
+ *
+ * In-place filters over a rectangle of a surface, with edge pixels
+ * repeated outwards so the rectangle is filtered as if nothing lay
+ * beyond it:
+ *
+ *   box       averages the (2r+1) x (2r+1) square around each pixel
+ *   gaussian  approximates a Gaussian of standard deviation sigma with
+ *             three box passes of suitably chosen radii
+ *   kernel    a 3x3 or 5x5 integer convolution from filter_kernels[]
+ *
+ * The box filter is separable. A horizontal pass over bands of rows
+ * writes into a scratch copy of the rectangle; a vertical pass over
+ * strips of columns writes back. Both keep a running sum
+ * that adds the pixel entering the window and subtracts the one leaving
+ * it, so the cost per pixel is the same for any radius. A convolution
+ * first copies the rectangle and its border into scratch, then filters
+ * it in POOL_TILE tiles from there, scheduled by work stealing. All
+ * passes run on the worker pool.
+ *
+ * Results are rounded from a float multiply by the reciprocal of the
+ * divisor. The SSE2 and scalar paths do the same float operations and
+ * give identical pixels.
+ */
+
+enum { FILTER_NONE, FILTER_BOX, FILTER_GAUSSIAN, FILTER_KERNEL };
+
+#define FILTER_BAND_ROWS 16     /* Rows per horizontal pass item */
+#define FILTER_STRIP 64         /* Minimum columns per vertical pass item */
+#define FILTER_MAX_RADIUS 500
+#define GAUSSIAN_PASSES 3
+
+typedef struct {
+    const char *name;
+    int size;                   /* 3 or 5 */
+    int divisor;
+    int bias;                   /* Added after dividing */
+    int8_t k[25];               /* size * size weights, row by row */
+} FilterKernel;
+
+static const FilterKernel filter_kernels[] = {
+    { "smooth", 3, 16, 0, { 1, 2, 1, 2, 4, 2, 1, 2, 1 } },
+    { "smooth5", 5, 256, 0, { 1, 4, 6, 4, 1, 4, 16, 24, 16, 4, 6, 24, 36, 24, 6, 4, 16, 24, 16, 4,
+                              1, 4, 6, 4, 1 } },
+    { "sharpen", 3, 1, 0, { 0, -1, 0, -1, 5, -1, 0, -1, 0 } },
+    { "edge", 3, 1, 0, { -1, -1, -1, -1, 8, -1, -1, -1, -1 } },
+    { "emboss", 3, 1, 128, { -1, -1, 0, -1, 0, 1, 0, 1, 1 } },
+};
+
+/* A filter as given on the command line */
+typedef struct {
+    int kind;                   /* FILTER_* */
+    int radius;                 /* Box */
+    int passes;                 /* Box: times it is applied (3 already looks close to Gaussian) */
+    float sigma;                /* Gaussian */
+    const FilterKernel *kernel;
+} FilterSpec;
+
+typedef struct {
+    WorkerPool *pool;           /* NULL = run on the calling thread */
+    int scalar;                 /* Use the portable kernels even where SSE2 is available */
+    uint32_t *copy;             /* Intermediate copy of the rectangle (plus border for kernels) */
+    size_t copy_cap;
+    uint32_t *scratch;          /* Per-worker padded rows, scratch_stride words each */
+    size_t scratch_stride;
+    size_t scratch_cap;
+} Filter;
+
+typedef struct {
+    Filter *f;
+    Surface *s;
+    Rect r;
+    int radius;                 /* Box radius, or kernel size / 2 */
+    float inv;                  /* 1 / divisor */
+    const FilterKernel *kernel;
+    size_t copy_stride;
+    int strip;                  /* Box: columns per vertical pass item */
+} FilterJob;
+
+void filter_init(Filter *f, WorkerPool *pool)
+{
+    memset(f, 0, sizeof(*f));
+    f->pool = pool;
+}
+
+void filter_destroy(Filter *f)
+{
+    free(f->copy);
+    free(f->scratch);
+    memset(f, 0, sizeof(*f));
+}
+
+/*
+ * Function: filter_parse
+ *
+ * Reads "box:RADIUS[:PASSES]", "gaussian:SIGMA" or the name of one of
+ * filter_kernels[].
+ *
+ * Returns: 0 on success, -1 if text is not a filter
+ */
+int filter_parse(FilterSpec *spec, const char *text)
+{
+    char *end;
+
+    memset(spec, 0, sizeof(*spec));
+    if (strncmp(text, "box:", 4) == 0) {
+        long r = strtol(text + 4, &end, 10), passes = 1;
+        if (*end == ':')
+            passes = strtol(end + 1, &end, 10);
+        if (*end || r < 1 || r > FILTER_MAX_RADIUS || passes < 1 || passes > 8)
+            return -1;
+        spec->kind = FILTER_BOX;
+        spec->radius = (int)r;
+        spec->passes = (int)passes;
+        return 0;
+    }
+    if (strncmp(text, "gaussian:", 9) == 0) {
+        float sigma = strtof(text + 9, &end);
+        if (*end || !(sigma >= 0.5f && sigma <= FILTER_MAX_RADIUS / 2))
+            return -1;
+        spec->kind = FILTER_GAUSSIAN;
+        spec->sigma = sigma;
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(filter_kernels) / sizeof(filter_kernels[0]); i++) {
+        if (strcmp(text, filter_kernels[i].name) == 0) {
+            spec->kind = FILTER_KERNEL;
+            spec->kernel = &filter_kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Radii of GAUSSIAN_PASSES box passes whose combined variance matches
+ * sigma squared: m passes of width wl and the rest of width wl + 2,
+ * where wl is the largest odd width not above the ideal one.
+ */
+static void gaussian_radii(float sigma, int radii[GAUSSIAN_PASSES])
+{
+    float var12 = 12.0f * sigma * sigma;
+    int n = GAUSSIAN_PASSES, wl = 1, m;
+
+    while ((float)((wl + 1) * (wl + 1)) <= var12 / (float)n + 1.0f)
+        wl++;
+    if (wl % 2 == 0)
+        wl--;
+    float mf = (var12 - (float)(n * wl * wl + 4 * n * wl + 3 * n)) / (float)(-4 * wl - 4);
+    m = (int)(mf + 0.5f);
+    if (m < 0)
+        m = 0;
+    if (m > n)
+        m = n;
+    for (int i = 0; i < n; i++)
+        radii[i] = ((i < m ? wl : wl + 2) - 1) / 2;
+}
+
+static void filter_run(Filter *f, WorkFn fn, FilterJob *job, int items)
+{
+    if (f->pool)
+        worker_pool_run(f->pool, fn, job, items);
+    else
+        for (int i = 0; i < items; i++)
+            fn(job, i, 0);
+}
+
+/* Makes room for copy_words of copy and scratch_words per worker */
+static int filter_reserve(Filter *f, size_t copy_words, size_t scratch_words)
+{
+    int workers = f->pool ? worker_pool_size(f->pool) : 1;
+    size_t stride = (scratch_words + 15) & ~(size_t)15;
+
+    if (copy_words > f->copy_cap) {
+        uint32_t *p = realloc(f->copy, copy_words * sizeof(uint32_t));
+        if (!p)
+            return -1;
+        f->copy = p;
+        f->copy_cap = copy_words;
+    }
+    if (stride * (size_t)workers > f->scratch_cap) {
+        uint32_t *p = realloc(f->scratch, stride * (size_t)workers * sizeof(uint32_t));
+        if (!p)
+            return -1;
+        f->scratch = p;
+        f->scratch_cap = stride * (size_t)workers;
+    }
+    f->scratch_stride = stride;
+    return 0;
+}
+
+static inline uint32_t filter_round(uint32_t sum, float inv)
+{
+    return (uint32_t)((float)sum * inv + 0.5f);
+}
+
+#ifdef __SSE2__
+/* The four channels of a pixel as 32-bit lanes */
+static inline __m128i px_widen(uint32_t px)
+{
+    __m128i zero = _mm_setzero_si128();
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)px), zero), zero);
+}
+
+static inline __m128i px_average(__m128i sum, __m128 inv)
+{
+    return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(sum), inv), _mm_set1_ps(0.5f)));
+}
+
+static inline uint32_t px_narrow(__m128i sum, __m128 inv)
+{
+    __m128i v = px_average(sum, inv);
+    v = _mm_packs_epi32(v, v);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+}
+
+/* Two pixels' channels as 16-bit lanes (lo or hi pair of a) minus the same of b, widened to 32-bit */
+static inline void px_delta(__m128i d[4], __m128i a, __m128i b)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+    d[0] = _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16);
+    d[1] = _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16);
+    d[2] = _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16);
+    d[3] = _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16);
+}
+#endif
+
+/*
+ * Running box average of one row: dst[x] is the mean of
+ * src[x .. x + 2r], for w pixels. src holds w + 2r + 1 pixels.
+ */
+static void box_row(uint32_t *dst, const uint32_t *src, int w, int r, float inv, int scalar)
+{
+    int win = 2 * r + 1;
+
+#ifdef __SSE2__
+    if (!scalar) {
+        __m128i sum = _mm_setzero_si128();
+        __m128 vinv = _mm_set1_ps(inv);
+        int x = 0;
+        for (int i = 0; i < win; i++)
+            sum = _mm_add_epi32(sum, px_widen(src[i]));
+        /* Four pixels per step, so only the additions depend on each other */
+        for (; x + 4 <= w; x += 4) {
+            __m128i d[4], avg[4];
+            px_delta(d, _mm_loadu_si128((const __m128i *)(src + x + win)), _mm_loadu_si128((const __m128i *)(src + x)));
+            for (int i = 0; i < 4; i++) {
+                avg[i] = px_average(sum, vinv);
+                sum = _mm_add_epi32(sum, d[i]);
+            }
+            _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(_mm_packs_epi32(avg[0], avg[1]),
+                                                                    _mm_packs_epi32(avg[2], avg[3])));
+        }
+        for (; x < w; x++) {
+            dst[x] = px_narrow(sum, vinv);
+            sum = _mm_sub_epi32(_mm_add_epi32(sum, px_widen(src[x + win])), px_widen(src[x]));
+        }
+        return;
+    }
+#else
+    (void)scalar;
+#endif
+    uint32_t s[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < win; i++)
+        for (int c = 0; c < 4; c++)
+            s[c] += src[i] >> (8 * c) & 0xff;
+    for (int x = 0; x < w; x++) {
+        dst[x] = filter_round(s[0], inv) | filter_round(s[1], inv) << 8 |
+                 filter_round(s[2], inv) << 16 | filter_round(s[3], inv) << 24;
+        for (int c = 0; c < 4; c++)
+            s[c] += (src[x + win] >> (8 * c) & 0xff) - (src[x] >> (8 * c) & 0xff);
+    }
+}
+
+/* Horizontal box pass: a band of rows from the surface into the copy */
+static void box_h_band(void *ctx, int band, int worker)
+{
+    const FilterJob *job = ctx;
+    uint32_t *pad = job->f->scratch + (size_t)worker * job->f->scratch_stride;
+    int w = job->r.w, r = job->radius;
+    int y_to = (band + 1) * FILTER_BAND_ROWS < job->r.h ? (band + 1) * FILTER_BAND_ROWS : job->r.h;
+
+    for (int y = band * FILTER_BAND_ROWS; y < y_to; y++) {
+        const uint32_t *src = surface_row(job->s, (unsigned int)(job->r.y + y)) + job->r.x;
+
+        /* Edge pixels repeated r times on the left and r + 1 on the right */
+        for (int i = 0; i < r; i++)
+            pad[i] = src[0];
+        memcpy(pad + r, src, (size_t)w * sizeof(uint32_t));
+        for (int i = 0; i <= r; i++)
+            pad[r + w + i] = src[w - 1];
+        box_row(job->f->copy + (size_t)y * w, pad, w, r, job->inv, job->f->scalar);
+    }
+}
+
+/*
+ * Vertical box pass: a strip of columns from the copy back into the
+ * surface, row by row, with the column sums in the worker's scratch.
+ * Strips are as wide as the thread count allows so the rows are read
+ * as long sequential runs rather than a page apart.
+ */
+static void box_v_strip(void *ctx, int strip, int worker)
+{
+    const FilterJob *job = ctx;
+    const uint32_t *copy = job->f->copy;
+    int w = job->r.w, h = job->r.h, r = job->radius;
+    int x0 = strip * job->strip, n = w - x0 < job->strip ? w - x0 : job->strip;
+
+#ifdef __SSE2__
+    if (!job->f->scalar) {
+        __m128i *sum = (__m128i *)(void *)(job->f->scratch + (size_t)worker * job->f->scratch_stride);
+        __m128 vinv = _mm_set1_ps(job->inv);
+        __m128i rr = _mm_set1_epi32(r + 1);
+
+        /* Window of row 0: the top row r + 1 times, then rows 1..r */
+        for (int x = 0; x < n; x++)
+            sum[x] = _mm_madd_epi16(px_widen(copy[x0 + x]), rr);   /* Channels and r + 1 fit 16 bits */
+        for (int i = 1; i <= r; i++) {
+            const uint32_t *row = copy + (size_t)(i < h ? i : h - 1) * w + x0;
+            for (int x = 0; x < n; x++)
+                sum[x] = _mm_add_epi32(sum[x], px_widen(row[x]));
+        }
+        for (int y = 0; y < h; y++) {
+            uint32_t *dst = surface_row(job->s, (unsigned int)(job->r.y + y)) + job->r.x + x0;
+            const uint32_t *in = copy + (size_t)(y + r + 1 < h ? y + r + 1 : h - 1) * w + x0;
+            const uint32_t *out = copy + (size_t)(y - r > 0 ? y - r : 0) * w + x0;
+            int x = 0;
+            /* Four pixels per step: one load, one store and shared unpacking */
+            for (; x + 4 <= n; x += 4) {
+                __m128i d[4];
+                __m128i lo = _mm_packs_epi32(px_average(sum[x], vinv), px_average(sum[x + 1], vinv));
+                __m128i hi = _mm_packs_epi32(px_average(sum[x + 2], vinv), px_average(sum[x + 3], vinv));
+                _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+                px_delta(d, _mm_loadu_si128((const __m128i *)(in + x)), _mm_loadu_si128((const __m128i *)(out + x)));
+                for (int i = 0; i < 4; i++)
+                    sum[x + i] = _mm_add_epi32(sum[x + i], d[i]);
+            }
+            for (; x < n; x++) {
+                dst[x] = px_narrow(sum[x], vinv);
+                sum[x] = _mm_sub_epi32(_mm_add_epi32(sum[x], px_widen(in[x])), px_widen(out[x]));
+            }
+        }
+        return;
+    }
+#endif
+    uint32_t (*sum)[4] = (uint32_t (*)[4])(job->f->scratch + (size_t)worker * job->f->scratch_stride);
+
+    for (int x = 0; x < n; x++)
+        for (int c = 0; c < 4; c++)
+            sum[x][c] = (uint32_t)(r + 1) * (copy[x0 + x] >> (8 * c) & 0xff);
+    for (int i = 1; i <= r; i++) {
+        const uint32_t *row = copy + (size_t)(i < h ? i : h - 1) * w + x0;
+        for (int x = 0; x < n; x++)
+            for (int c = 0; c < 4; c++)
+                sum[x][c] += row[x] >> (8 * c) & 0xff;
+    }
+    for (int y = 0; y < h; y++) {
+        uint32_t *dst = surface_row(job->s, (unsigned int)(job->r.y + y)) + job->r.x + x0;
+        const uint32_t *in = copy + (size_t)(y + r + 1 < h ? y + r + 1 : h - 1) * w + x0;
+        const uint32_t *out = copy + (size_t)(y - r > 0 ? y - r : 0) * w + x0;
+        for (int x = 0; x < n; x++) {
+            dst[x] = filter_round(sum[x][0], job->inv) | filter_round(sum[x][1], job->inv) << 8 |
+                     filter_round(sum[x][2], job->inv) << 16 | filter_round(sum[x][3], job->inv) << 24;
+            for (int c = 0; c < 4; c++)
+                sum[x][c] += (in[x] >> (8 * c) & 0xff) - (out[x] >> (8 * c) & 0xff);
+        }
+    }
+}
+
+/*
+ * Function: filter_box
+ *
+ * Box-blurs rectangle r of s in place with the given radius, passes
+ * times over.
+ *
+ * Returns: 0 on success, -1 if memory ran out (s is left unfiltered)
+ */
+int filter_box(Filter *f, Surface *s, Rect r, int radius, int passes)
+{
+    FilterJob job;
+    int workers = f->pool ? worker_pool_size(f->pool) : 1;
+
+    r = clip_to_surface(s, r);
+    if (r.w <= 0 || r.h <= 0 || radius <= 0)
+        return 0;
+    memset(&job, 0, sizeof(job));
+    /* A couple of strips per thread, a whole number of cache lines wide */
+    job.strip = (r.w / (2 * workers) + 15) & ~15;
+    if (job.strip < FILTER_STRIP)
+        job.strip = FILTER_STRIP;
+    if (filter_reserve(f, (size_t)r.w * r.h, (size_t)r.w + 2 * (size_t)radius + 1 > 4 * (size_t)job.strip ?
+                                             (size_t)r.w + 2 * (size_t)radius + 1 : 4 * (size_t)job.strip) != 0)
+        return -1;
+    job.f = f;
+    job.s = s;
+    job.r = r;
+    job.radius = radius;
+    job.inv = 1.0f / (float)(2 * radius + 1);
+    for (int i = 0; i < passes; i++) {
+        filter_run(f, box_h_band, &job, (r.h + FILTER_BAND_ROWS - 1) / FILTER_BAND_ROWS);
+        filter_run(f, box_v_strip, &job, (r.w + job.strip - 1) / job.strip);
+    }
+    return 0;
+}
+
+/*
+ * Function: filter_gaussian
+ *
+ * Approximately Gaussian blur of rectangle r of s in place.
+ *
+ * Returns: 0 on success, -1 if memory ran out
+ */
+int filter_gaussian(Filter *f, Surface *s, Rect r, float sigma)
+{
+    int radii[GAUSSIAN_PASSES];
+
+    gaussian_radii(sigma, radii);
+    for (int i = 0; i < GAUSSIAN_PASSES; i++)
+        if (filter_box(f, s, r, radii[i], 1) != 0)
+            return -1;
+    return 0;
+}
+
+/* Copies a band of rectangle rows, plus the border rows and columns, into the copy */
+static void kernel_copy_band(void *ctx, int band, int worker)
+{
+    const FilterJob *job = ctx;
+    int k = job->radius, w = job->r.w, h = job->r.h + 2 * k;
+    int y_to = (band + 1) * FILTER_BAND_ROWS < h ? (band + 1) * FILTER_BAND_ROWS : h;
+
+    (void)worker;
+    for (int y = band * FILTER_BAND_ROWS; y < y_to; y++) {
+        int sy = y - k < 0 ? 0 : y - k >= job->r.h ? job->r.h - 1 : y - k;
+        const uint32_t *src = surface_row(job->s, (unsigned int)(job->r.y + sy)) + job->r.x;
+        uint32_t *dst = job->f->copy + (size_t)y * job->copy_stride;
+
+        for (int i = 0; i < k; i++) {
+            dst[i] = src[0];
+            dst[k + w + i] = src[w - 1];
+        }
+        memcpy(dst + k, src, (size_t)w * sizeof(uint32_t));
+    }
+}
+
+static inline uint32_t kernel_channel(int acc, float inv, float bias)
+{
+    float v = (float)acc * inv + bias;
+    v = v < 0.0f ? 0.0f : v;
+    v = v > 255.0f ? 255.0f : v;
+    return (uint32_t)(v + 0.5f);
+}
+
+/* One output pixel; src is the top-left tap */
+static inline uint32_t kernel_pixel(const FilterJob *job, const uint32_t *src)
+{
+    const FilterKernel *kn = job->kernel;
+    int acc[3] = { 0, 0, 0 };
+
+    for (int ky = 0; ky < kn->size; ky++) {
+        const uint32_t *row = src + (size_t)ky * job->copy_stride;
+        for (int kx = 0; kx < kn->size; kx++) {
+            int wt = kn->k[ky * kn->size + kx];
+            for (int c = 0; c < 3; c++)
+                acc[c] += wt * (int)(row[kx] >> (8 * c) & 0xff);
+        }
+    }
+    return kernel_channel(acc[0], job->inv, (float)kn->bias) |
+           kernel_channel(acc[1], job->inv, (float)kn->bias) << 8 |
+           kernel_channel(acc[2], job->inv, (float)kn->bias) << 16;
+}
+
+/* tile is relative to the rectangle being filtered */
+static void kernel_tile(void *ctx, Rect tile, int worker)
+{
+    const FilterJob *job = ctx;
+    int x0 = tile.x, y0 = tile.y, x1 = tile.x + tile.w, y1 = tile.y + tile.h;
+
+    (void)worker;
+    for (int y = y0; y < y1; y++) {
+        const uint32_t *src = job->f->copy + (size_t)y * job->copy_stride;
+        uint32_t *dst = surface_row(job->s, (unsigned int)(job->r.y + y)) + job->r.x;
+        int x = x0;
+
+#ifdef __SSE2__
+        if (!job->f->scalar) {
+            const FilterKernel *kn = job->kernel;
+            const __m128i mask = _mm_set1_epi32(0xff);
+            const __m128 inv = _mm_set1_ps(job->inv), bias = _mm_set1_ps((float)kn->bias);
+            const __m128 zero = _mm_setzero_ps(), top = _mm_set1_ps(255.0f), half = _mm_set1_ps(0.5f);
+
+            /* Four output pixels at a time, each channel in 32-bit lanes */
+            for (; x + 4 <= x1; x += 4) {
+                __m128i acc[3] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+                __m128i out = _mm_setzero_si128();
+                for (int ky = 0; ky < kn->size; ky++) {
+                    const uint32_t *row = src + (size_t)ky * job->copy_stride + x;
+                    for (int kx = 0; kx < kn->size; kx++) {
+                        int wt = kn->k[ky * kn->size + kx];
+                        if (wt == 0)
+                            continue;
+                        __m128i px = _mm_loadu_si128((const __m128i *)(row + kx));
+                        /* madd of a channel and a weight, both in the low 16 bits of each lane */
+                        __m128i vw = _mm_set1_epi32(wt & 0xffff);
+                        acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(_mm_and_si128(px, mask), vw));
+                        acc[1] = _mm_add_epi32(acc[1], _mm_madd_epi16(_mm_and_si128(_mm_srli_epi32(px, 8), mask), vw));
+                        acc[2] = _mm_add_epi32(acc[2], _mm_madd_epi16(_mm_and_si128(_mm_srli_epi32(px, 16), mask), vw));
+                    }
+                }
+                for (int c = 0; c < 3; c++) {
+                    __m128 v = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(acc[c]), inv), bias);
+                    v = _mm_min_ps(_mm_max_ps(v, zero), top);
+                    out = _mm_or_si128(out, _mm_slli_epi32(_mm_cvttps_epi32(_mm_add_ps(v, half)), 8 * c));
+                }
+                _mm_storeu_si128((__m128i *)(dst + x), out);
+            }
+        }
+#endif
+        for (; x < x1; x++)
+            dst[x] = kernel_pixel(job, src + x);
+    }
+}
+
+/*
+ * Function: filter_kernel
+ *
+ * Convolves rectangle r of s in place with kernel. The top byte of the
+ * pixels is cleared.
+ *
+ * Returns: 0 on success, -1 if memory ran out
+ */
+int filter_kernel(Filter *f, Surface *s, Rect r, const FilterKernel *kernel)
+{
+    FilterJob job;
+    int k = kernel->size / 2;
+
+    r = clip_to_surface(s, r);
+    if (r.w <= 0 || r.h <= 0)
+        return 0;
+    memset(&job, 0, sizeof(job));
+    job.copy_stride = (size_t)r.w + 2 * k;
+    if (filter_reserve(f, job.copy_stride * (size_t)(r.h + 2 * k), 0) != 0)
+        return -1;
+    job.f = f;
+    job.s = s;
+    job.r = r;
+    job.radius = k;
+    job.kernel = kernel;
+    job.inv = 1.0f / (float)kernel->divisor;
+    filter_run(f, kernel_copy_band, &job, (r.h + 2 * k + FILTER_BAND_ROWS - 1) / FILTER_BAND_ROWS);
+    Rect tiles = { 0, 0, r.w, r.h };
+    if (f->pool)
+        worker_pool_run_tiles(f->pool, kernel_tile, &job, tiles);
+    else
+        kernel_tile(&job, tiles, 0);
+    return 0;
+}
+
+/* Applies spec to rectangle r of s; 0 on success, -1 if memory ran out */
+int filter_apply(Filter *f, Surface *s, Rect r, const FilterSpec *spec)
+{
+    switch (spec->kind) {
+    case FILTER_BOX:
+        return filter_box(f, s, r, spec->radius, spec->passes);
+    case FILTER_GAUSSIAN:
+        return filter_gaussian(f, s, r, spec->sigma);
+    case FILTER_KERNEL:
+        return filter_kernel(f, s, r, spec->kernel);
+    default:
+        return 0;
+    }
+}
+
+/*
+ * ============================================================================
+ * SPAN PLUGINS
+ * ============================================================================
+ *
+ * Effects loaded at run time from shared objects (see rainbow_plugin.h).
+ * A loaded plugin becomes one more effect after the built-in ones and
+ * is drawn by the same tiled renderer, one call per row of a tile. Each
+ * tile's spans are timed together and added to the plugin's totals,
+ * which are printed with the frame statistics.
+ */
+
+#define PLUGIN_MAX 4
+
+typedef struct {
+    void *handle;
+    const RainbowPlugin *api;
+    void *state;                /* From api->create() */
+    atomic_uint_fast64_t spans; /* Totals over every thread */
+    atomic_uint_fast64_t pixels;
+    atomic_uint_fast64_t ns;
+} Plugin;
+
+static Plugin plugins[PLUGIN_MAX];
+static int plugin_count;
+
+/*
+ * Function: plugin_load
+ *
+ * Opens the shared object at path, checks its interface version and
+ * creates its state for a width x height screen.
+ *
+ * Returns: 0 on success, -1 on failure
+ */
+int plugin_load(const char *path, int width, int height, const char *args)
+{
+    Plugin *p = &plugins[plugin_count];
+    RainbowPluginEntry entry;
+    int failed = 0;
+
+    if (plugin_count == PLUGIN_MAX) {
+        fprintf(stderr, "At most %d plugins can be loaded\n", PLUGIN_MAX);
+        return -1;
+    }
+    memset(p, 0, sizeof(*p));
+    p->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!p->handle) {
+        fprintf(stderr, "Failed to load plugin: %s\n", dlerror());
+        return -1;
+    }
+    *(void **)&entry = dlsym(p->handle, RAINBOW_PLUGIN_ENTRY);
+    p->api = entry ? entry() : NULL;
+    if (!p->api || p->api->abi != RAINBOW_PLUGIN_ABI || !p->api->span || !p->api->name) {
+        fprintf(stderr, "%s: not a rainbow plugin (interface version %d)\n", path, RAINBOW_PLUGIN_ABI);
+        goto fail;
+    }
+    if (p->api->create)
+        p->state = p->api->create(width, height, args, &failed);
+    if (failed) {
+        fprintf(stderr, "%s: plugin %s failed to start\n", path, p->api->name);
+        goto fail;
+    }
+    plugin_count++;
+    return 0;
+
+fail:
+    dlclose(p->handle);
+    p->handle = NULL;
+    return -1;
+}
+
+void plugin_unload_all(void)
+{
+    while (plugin_count > 0) {
+        Plugin *p = &plugins[--plugin_count];
+        if (p->api->destroy)
+            p->api->destroy(p->state);
+        dlclose(p->handle);
+        p->handle = NULL;
+    }
+}
+
+void plugin_print_stats(FILE *out)
+{
+    for (int i = 0; i < plugin_count; i++) {
+        const Plugin *p = &plugins[i];
+        uint64_t spans = atomic_load_explicit(&p->spans, memory_order_relaxed);
+        uint64_t pixels = atomic_load_explicit(&p->pixels, memory_order_relaxed);
+        uint64_t ns = atomic_load_explicit(&p->ns, memory_order_relaxed);
+
+        if (spans)
+            fprintf(out, "plugin %s: %llu spans, %.1f Mpixels, %.3f us per span, %.2f ns per pixel\n",
+                    p->api->name, (unsigned long long)spans, pixels / 1e6, ns / 1e3 / spans,
+                    (double)ns / (pixels ? pixels : 1));
+    }
+}
+
+/*
+ * ============================================================================
+ * EXPRESSION SHADERS
+ * ============================================================================
+ *
+ * A small expression language for trying out patterns without a
+ * compiler, for example the rainbow itself:
+ *
+ *   hsv(x * 360 / w + phase, sat, val)
+ *
+ * Numbers, + - * / % (modulo), a < b and a > b (1 or 0), parentheses and
+ *   x, y       pixel position
+ *   w, h       screen size
+ *   t          time in seconds
+ *   phase      hue drift at time t in degrees (from --speed)
+ *   speed, sat, val, pi
+ *   sin cos abs floor fract sqrt min max mod mix clamp
+ *   hsv(h, s, v) and rgb(r, g, b), with h in degrees and the rest 0-1,
+ *   which may only be the whole expression; anything else is grey.
+ *
+ * The source is parsed once and constant-folded, then every node is
+ * placed by what it depends on: nothing but the frame (t, w, ...), the
+ * row (y) or the pixel (x). Each group is compiled into register
+ * bytecode of its own, run once a frame, once a row and once per chunk
+ * of EXPR_CHUNK pixels, so dispatching an instruction costs the same
+ * however many pixels it covers. The per-pixel code works on four
+ * lanes at a time with SSE2; the scalar path does the same float
+ * operations in the same order and gives identical pixels.
+ */
+
+#define EXPR_CHUNK 64           /* Pixels per register */
+#define EXPR_REGS 16
+#define EXPR_MAX_CODE 256       /* Instructions per program */
+#define EXPR_MAX_SLOTS 64       /* Per-frame inputs and hoisted values */
+#define EXPR_MAX_NODES 256
+
+#define SHADER_RAINBOW "hsv(x * 360 / w + phase, sat, val)"
+
+enum {
+    EXPR_CONST, EXPR_X, EXPR_SLOT, EXPR_STORE,
+    EXPR_NEG, EXPR_ADD, EXPR_SUB, EXPR_MUL, EXPR_DIV, EXPR_MOD, EXPR_LT, EXPR_GT,
+    EXPR_SIN, EXPR_COS, EXPR_ABS, EXPR_FLOOR, EXPR_FRACT, EXPR_SQRT,
+    EXPR_MIN, EXPR_MAX, EXPR_MIX, EXPR_CLAMP,
+    EXPR_HSV, EXPR_RGB, EXPR_GREY,
+};
+
+/* Slots the renderer fills in before running the programs */
+enum { SLOT_T, SLOT_W, SLOT_H, SLOT_PHASE, SLOT_SPEED, SLOT_SAT, SLOT_VAL, SLOT_Y, SLOT_INPUTS };
+
+/* Programs, by what their values depend on */
+enum { EXPR_PER_FRAME, EXPR_PER_ROW, EXPR_PER_PIXEL };
+
+typedef struct {
+    uint8_t op;
+    uint8_t dst;                /* Register; three in a row for colours */
+    uint8_t a, b, c;            /* Argument registers; b is the slot for EXPR_SLOT and EXPR_STORE */
+    float imm;                  /* EXPR_CONST */
+} ExprInsn;
+
+typedef struct {
+    ExprInsn code[3][EXPR_MAX_CODE];
+    int length[3];
+    int slots;                  /* In use, inputs included */
+    int uses_y;                 /* Rows differ; otherwise one row serves for all */
+} ExprProgram;
+
+static ExprProgram shader_program;
+
+static inline float expr_floor(float x)
+{
+    float t;
+
+    if (!(x > -8388608.0f && x < 8388608.0f))
+        return x;   /* Already whole, or NaN */
+    t = (float)(int32_t)x;
+    return t > x ? t - 1.0f : t;
+}
+
+static inline float expr_abs(float x)
+{
+    uint32_t u;
+
+    memcpy(&u, &x, sizeof(u));
+    u &= 0x7fffffffu;
+    memcpy(&x, &u, sizeof(u));
+    return x;
+}
+
+static inline float expr_min(float a, float b)
+{
+    return a < b ? a : b;   /* As MINPS, NaN included */
+}
+
+static inline float expr_max(float a, float b)
+{
+    return a > b ? a : b;
+}
+
+static inline float expr_sqrt(float x)
+{
+#ifdef __SSE2__
+    return _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(x)));
+#else
+    /* Newton's method from a bit-level first guess */
+    uint32_t u;
+    float r;
+    if (!(x > 0.0f))
+        return x == 0.0f ? 0.0f : (x - x) / (x - x);
+    memcpy(&u, &x, sizeof(u));
+    u = (u >> 1) + 0x1fc00000u;
+    memcpy(&r, &u, sizeof(r));
+    for (int i = 0; i < 4; i++)
+        r = 0.5f * (r + x / r);
+    return r;
+#endif
+}
+
+/*
+ * sin() by reduction to [-pi/2, pi/2] and an odd polynomial there;
+ * good to a few units in the last place for moderate arguments.
+ */
+static inline float expr_sin(float x)
+{
+    float k = expr_floor(x * 0.159154943f + 0.5f);
+    float r = x - k * 6.28318548f - k * -1.74845553e-7f;
+    float r2;
+
+    if (r > 1.57079637f)
+        r = 3.14159274f - r;
+    else if (r < -1.57079637f)
+        r = -3.14159274f - r;
+    r2 = r * r;
+    return r * (1.0f + r2 * (-0.166666672f + r2 * (8.33333377e-3f + r2 * (-1.98412701e-4f +
+           r2 * (2.75573188e-6f + r2 * -2.50521079e-8f)))));
+}
+
+/* Channel n of hsv(h, s, v): 5 for red, 3 for green, 1 for blue */
+static inline float expr_hsv_channel(float n, float h, float s, float v)
+{
+    float k = n + h * 0.0166666675f;
+    k = k - 6.0f * expr_floor(k * 0.166666672f);
+    return v - v * s * expr_max(expr_min(expr_min(k, 4.0f - k), 1.0f), 0.0f);
+}
+
+static inline uint32_t expr_pack(float r, float g, float b)
+{
+    r = expr_min(expr_max(r, 0.0f), 1.0f);
+    g = expr_min(expr_max(g, 0.0f), 1.0f);
+    b = expr_min(expr_max(b, 0.0f), 1.0f);
+    return (uint32_t)(int32_t)(r * 255.0f) << 16 | (uint32_t)(int32_t)(g * 255.0f) << 8 |
+           (uint32_t)(int32_t)(b * 255.0f);
+}
+
+/* One operation on one lane; also used to fold constants */
+static float expr_apply(int op, float a, float b, float c)
+{
+    switch (op) {
+    case EXPR_NEG:   return -a;
+    case EXPR_ADD:   return a + b;
+    case EXPR_SUB:   return a - b;
+    case EXPR_MUL:   return a * b;
+    case EXPR_DIV:   return a / b;
+    case EXPR_MOD:   return a - b * expr_floor(a / b);
+    case EXPR_LT:    return a < b ? 1.0f : 0.0f;
+    case EXPR_GT:    return a > b ? 1.0f : 0.0f;
+    case EXPR_SIN:   return expr_sin(a);
+    case EXPR_COS:   return expr_sin(a + 1.57079637f);
+    case EXPR_ABS:   return expr_abs(a);
+    case EXPR_FLOOR: return expr_floor(a);
+    case EXPR_FRACT: return a - expr_floor(a);
+    case EXPR_SQRT:  return expr_sqrt(a);
+    case EXPR_MIN:   return expr_min(a, b);
+    case EXPR_MAX:   return expr_max(a, b);
+    case EXPR_MIX:   return a + (b - a) * c;
+    case EXPR_CLAMP: return expr_min(expr_max(a, b), c);
+    }
+    return 0.0f;
+}
+
+#ifdef __SSE2__
+static inline __m128 v_floor(__m128 x)
+{
+    __m128 whole = _mm_cmpnlt_ps(_mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff))),
+                                 _mm_set1_ps(8388608.0f));
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    t = _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1.0f)));
+    return _mm_or_ps(_mm_and_ps(whole, x), _mm_andnot_ps(whole, t));
+}
+
+static inline __m128 v_select(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 v_sin(__m128 x)
+{
+    __m128 k = v_floor(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(0.159154943f)), _mm_set1_ps(0.5f)));
+    __m128 r = _mm_sub_ps(_mm_sub_ps(x, _mm_mul_ps(k, _mm_set1_ps(6.28318548f))),
+                          _mm_mul_ps(k, _mm_set1_ps(-1.74845553e-7f)));
+    __m128 r2, p;
+
+    r = v_select(_mm_cmpgt_ps(r, _mm_set1_ps(1.57079637f)), _mm_sub_ps(_mm_set1_ps(3.14159274f), r), r);
+    r = v_select(_mm_cmplt_ps(r, _mm_set1_ps(-1.57079637f)), _mm_sub_ps(_mm_set1_ps(-3.14159274f), r), r);
+    r2 = _mm_mul_ps(r, r);
+    p = _mm_add_ps(_mm_set1_ps(2.75573188e-6f), _mm_mul_ps(r2, _mm_set1_ps(-2.50521079e-8f)));
+    p = _mm_add_ps(_mm_set1_ps(-1.98412701e-4f), _mm_mul_ps(r2, p));
+    p = _mm_add_ps(_mm_set1_ps(8.33333377e-3f), _mm_mul_ps(r2, p));
+    p = _mm_add_ps(_mm_set1_ps(-0.166666672f), _mm_mul_ps(r2, p));
+    p = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(r2, p));
+    return _mm_mul_ps(r, p);
+}
+
+static inline __m128 v_hsv_channel(float n, __m128 h, __m128 s, __m128 v)
+{
+    __m128 k = _mm_add_ps(_mm_set1_ps(n), _mm_mul_ps(h, _mm_set1_ps(0.0166666675f)));
+    __m128 m;
+
+    k = _mm_sub_ps(k, _mm_mul_ps(_mm_set1_ps(6.0f), v_floor(_mm_mul_ps(k, _mm_set1_ps(0.166666672f)))));
+    m = _mm_min_ps(_mm_min_ps(k, _mm_sub_ps(_mm_set1_ps(4.0f), k)), _mm_set1_ps(1.0f));
+    return _mm_sub_ps(v, _mm_mul_ps(_mm_mul_ps(v, s), _mm_max_ps(m, _mm_setzero_ps())));
+}
+
+/*
+ * One operation over lanes lanes, four at a time; false for the ones
+ * left to expr_apply(). The switch sits outside the loops so each
+ * operation runs as its own tight loop.
+ */
+static int expr_apply_lanes(int op, float *d, const float *pa, const float *pb, const float *pc, int lanes)
+{
+#define EXPR_LANES(expr) \
+    for (int i = 0; i < lanes; i += 4) { \
+        __m128 a = _mm_load_ps(pa + i), b = _mm_load_ps(pb + i), c = _mm_load_ps(pc + i); \
+        (void)a; (void)b; (void)c; \
+        _mm_store_ps(d + i, (expr)); \
+    } \
+    break
+
+    switch (op) {
+    case EXPR_NEG:   EXPR_LANES(_mm_sub_ps(_mm_setzero_ps(), a));
+    case EXPR_ADD:   EXPR_LANES(_mm_add_ps(a, b));
+    case EXPR_SUB:   EXPR_LANES(_mm_sub_ps(a, b));
+    case EXPR_MUL:   EXPR_LANES(_mm_mul_ps(a, b));
+    case EXPR_DIV:   EXPR_LANES(_mm_div_ps(a, b));
+    case EXPR_MOD:   EXPR_LANES(_mm_sub_ps(a, _mm_mul_ps(b, v_floor(_mm_div_ps(a, b)))));
+    case EXPR_LT:    EXPR_LANES(_mm_and_ps(_mm_cmplt_ps(a, b), _mm_set1_ps(1.0f)));
+    case EXPR_GT:    EXPR_LANES(_mm_and_ps(_mm_cmpgt_ps(a, b), _mm_set1_ps(1.0f)));
+    case EXPR_SIN:   EXPR_LANES(v_sin(a));
+    case EXPR_COS:   EXPR_LANES(v_sin(_mm_add_ps(a, _mm_set1_ps(1.57079637f))));
+    case EXPR_ABS:   EXPR_LANES(_mm_and_ps(a, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff))));
+    case EXPR_FLOOR: EXPR_LANES(v_floor(a));
+    case EXPR_FRACT: EXPR_LANES(_mm_sub_ps(a, v_floor(a)));
+    case EXPR_SQRT:  EXPR_LANES(_mm_sqrt_ps(a));
+    case EXPR_MIN:   EXPR_LANES(_mm_min_ps(a, b));
+    case EXPR_MAX:   EXPR_LANES(_mm_max_ps(a, b));
+    case EXPR_MIX:   EXPR_LANES(_mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), c)));
+    case EXPR_CLAMP: EXPR_LANES(_mm_min_ps(_mm_max_ps(a, b), c));
+    default:
+        return 0;
+    }
+#undef EXPR_LANES
+    return 1;
+}
+#endif
+
+/* d[i] = v + i * step for lanes (a multiple of 4) lanes; exact while the values are whole */
+static inline void expr_fill(float *d, float v, float step, int lanes)
+{
+#ifdef __SSE2__
+    __m128 x = _mm_add_ps(_mm_set1_ps(v), _mm_mul_ps(_mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f), _mm_set1_ps(step)));
+    __m128 inc = _mm_set1_ps(4.0f * step);
+    for (int i = 0; i < lanes; i += 4) {
+        _mm_store_ps(d + i, x);
+        x = _mm_add_ps(x, inc);
+    }
+#else
+    for (int i = 0; i < lanes; i++)
+        d[i] = v + (float)i * step;
+#endif
+}
+
+static void expr_store_rgb(uint32_t *dst, const float *r, const float *g, const float *b, int n, int scalar)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    if (!scalar) {
+        const __m128 one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps(), scale = _mm_set1_ps(255.0f);
+        for (; i + 4 <= n; i += 4) {
+            __m128i vr = _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_load_ps(r + i), zero), one), scale));
+            __m128i vg = _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_load_ps(g + i), zero), one), scale));
+            __m128i vb = _mm_cvttps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_load_ps(b + i), zero), one), scale));
+            __m128i px = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(vr, 16), _mm_slli_epi32(vg, 8)), vb);
+            _mm_storeu_si128((__m128i *)(dst + i), px);
+        }
+    }
+#else
+    (void)scalar;
+#endif
+    for (; i < n; i++)
+        dst[i] = expr_pack(r[i], g[i], b[i]);
+}
+
+/*
+ * Function: expr_run
+ *
+ * Runs one program over n lanes (at most EXPR_CHUNK) of registers r,
+ * with x0 the x of lane 0. Colour results are written to dst; per-frame
+ * and per-row programs (n = 1) store theirs in slots instead.
+ */
+static void expr_run(const ExprProgram *prog, int which, float (*r)[EXPR_CHUNK], float *slots,
+                     int x0, int n, uint32_t *dst, int scalar)
+{
+    const ExprInsn *code = prog->code[which];
+    int lanes = (n + 3) & ~3;   /* Whole SSE2 vectors; the spare lanes are never stored */
+
+    (void)scalar;
+    for (int pc = 0; pc < prog->length[which]; pc++) {
+        const ExprInsn *in = &code[pc];
+        float *d = r[in->dst];
+        int i = 0;
+
+        switch (in->op) {
+        case EXPR_CONST:
+            expr_fill(d, in->imm, 0.0f, lanes);
+            break;
+        case EXPR_X:
+            expr_fill(d, (float)x0, 1.0f, lanes);
+            break;
+        case EXPR_SLOT:
+            expr_fill(d, slots[in->b], 0.0f, lanes);
+            break;
+        case EXPR_STORE:
+            slots[in->b] = r[in->a][0];
+            break;
+        case EXPR_HSV: {
+            const float *a = r[in->a], *b = r[in->b], *c = r[in->c];
+#ifdef __SSE2__
+            if (!scalar) {
+                for (; i < lanes; i += 4) {
+                    __m128 h = _mm_load_ps(a + i), s = _mm_load_ps(b + i), v = _mm_load_ps(c + i);
+                    _mm_store_ps(d + i, v_hsv_channel(5.0f, h, s, v));
+                    _mm_store_ps(r[in->dst + 1] + i, v_hsv_channel(3.0f, h, s, v));
+                    _mm_store_ps(r[in->dst + 2] + i, v_hsv_channel(1.0f, h, s, v));
+                }
+            }
+#endif
+            for (; i < n; i++) {
+                float h = a[i], s = b[i], v = c[i];
+                d[i] = expr_hsv_channel(5.0f, h, s, v);
+                r[in->dst + 1][i] = expr_hsv_channel(3.0f, h, s, v);
+                r[in->dst + 2][i] = expr_hsv_channel(1.0f, h, s, v);
+            }
+            expr_store_rgb(dst, d, r[in->dst + 1], r[in->dst + 2], n, scalar);
+            break;
+        }
+        case EXPR_RGB:
+            expr_store_rgb(dst, d, r[in->dst + 1], r[in->dst + 2], n, scalar);
+            break;
+        case EXPR_GREY:
+            expr_store_rgb(dst, d, d, d, n, scalar);
+            break;
+        default: {
+            const float *a = r[in->a], *b = r[in->b], *c = r[in->c];
+#ifdef __SSE2__
+            if (!scalar && expr_apply_lanes(in->op, d, a, b, c, lanes))
+                break;
+#endif
+            for (; i < n; i++)
+                d[i] = expr_apply(in->op, a[i], b[i], c[i]);
+            break;
+        }
+        }
+    }
+}
+
+typedef struct {
+    int op;
+    int level;                  /* EXPR_PER_* it can first be computed at; -1 = constant */
+    int args[3];
+    int argc;
+    float value;                /* EXPR_CONST */
+    int slot;                   /* EXPR_SLOT input, or where a hoisted value is kept; -1 = none */
+} ExprNode;
+
+typedef struct {
+    const char *src;
+    const char *p;
+    const char *error;
+    const char *error_at;
+    ExprNode nodes[EXPR_MAX_NODES];
+    int count;
+    ExprProgram *prog;
+} ExprParser;
+
+static const struct {
+    const char *name;
+    int op;
+    int argc;
+} expr_functions[] = {
+    { "sin", EXPR_SIN, 1 }, { "cos", EXPR_COS, 1 }, { "abs", EXPR_ABS, 1 }, { "floor", EXPR_FLOOR, 1 },
+    { "fract", EXPR_FRACT, 1 }, { "sqrt", EXPR_SQRT, 1 }, { "min", EXPR_MIN, 2 }, { "max", EXPR_MAX, 2 },
+    { "mod", EXPR_MOD, 2 }, { "mix", EXPR_MIX, 3 }, { "clamp", EXPR_CLAMP, 3 }, { "hsv", EXPR_HSV, 3 },
+    { "rgb", EXPR_RGB, 3 },
+};
+
+static const char *const expr_inputs[SLOT_INPUTS] = { "t", "w", "h", "phase", "speed", "sat", "val", "y" };
+
+static int expr_fail(ExprParser *ps, const char *msg)
+{
+    if (!ps->error) {
+        ps->error = msg;
+        ps->error_at = ps->p;
+    }
+    return -1;
+}
+
+static void expr_skip_space(ExprParser *ps)
+{
+    while (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\n')
+        ps->p++;
+}
+
+/* Consumes c, which must come next */
+static int expr_expect(ExprParser *ps, char c, const char *msg)
+{
+    expr_skip_space(ps);
+    if (*ps->p != c)
+        return expr_fail(ps, msg);
+    ps->p++;
+    return 0;
+}
+
+/* Adds a node, folding it to a constant when all its arguments are */
+static int expr_node(ExprParser *ps, int op, int argc, const int *args)
+{
+    ExprNode *e;
+    /* Colours are only ever the final per-pixel result */
+    int level = op == EXPR_X || op == EXPR_HSV || op == EXPR_RGB ? EXPR_PER_PIXEL : -1;
+
+    if (ps->count == EXPR_MAX_NODES)
+        return expr_fail(ps, "expression too long");
+    e = &ps->nodes[ps->count];
+    memset(e, 0, sizeof(*e));
+    e->op = op;
+    e->argc = argc;
+    e->slot = -1;
+    for (int i = 0; i < argc; i++) {
+        e->args[i] = args[i];
+        if (ps->nodes[args[i]].level > level)
+            level = ps->nodes[args[i]].level;
+        if (op != EXPR_HSV && op != EXPR_RGB &&
+            (ps->nodes[args[i]].op == EXPR_HSV || ps->nodes[args[i]].op == EXPR_RGB))
+            return expr_fail(ps, "hsv() and rgb() make a colour, which can only be the whole expression");
+    }
+    e->level = level;
+    if (level < 0 && argc > 0 && op != EXPR_HSV && op != EXPR_RGB) {
+        float v[3] = { 0.0f, 0.0f, 0.0f };
+        for (int i = 0; i < argc; i++)
+            v[i] = ps->nodes[args[i]].value;
+        e->value = expr_apply(op, v[0], v[1], v[2]);
+        e->op = EXPR_CONST;
+        e->argc = 0;
+    }
+    return ps->count++;
+}
+
+static int expr_parse_compare(ExprParser *ps);
+
+static int expr_parse_atom(ExprParser *ps)
+{
+    const char *start;
+    int node;
+
+    expr_skip_space(ps);
+    start = ps->p;
+    if ((*ps->p >= '0' && *ps->p <= '9') || *ps->p == '.') {
+        char *end;
+        float v = strtof(ps->p, &end);
+        if (end == ps->p)
+            return expr_fail(ps, "bad number");
+        ps->p = end;
+        node = expr_node(ps, EXPR_CONST, 0, NULL);
+        if (node >= 0)
+            ps->nodes[node].value = v;
+        return node;
+    }
+    if (*ps->p == '(') {
+        ps->p++;
+        node = expr_parse_compare(ps);
+        if (node >= 0 && expr_expect(ps, ')', "expected ')'") < 0)
+            return -1;
+        return node;
+    }
+    while ((*ps->p >= 'a' && *ps->p <= 'z') || (*ps->p >= 'A' && *ps->p <= 'Z'))
+        ps->p++;
+    size_t len = (size_t)(ps->p - start);
+    if (len == 0)
+        return expr_fail(ps, "expected a number, name or '('");
+
+    for (size_t f = 0; f < sizeof(expr_functions) / sizeof(expr_functions[0]); f++) {
+        int args[3];
+        if (strlen(expr_functions[f].name) != len || strncmp(start, expr_functions[f].name, len) != 0)
+            continue;
+        if (expr_expect(ps, '(', "expected '(' after a function name") < 0)
+            return -1;
+        for (int i = 0; i < expr_functions[f].argc; i++) {
+            if ((args[i] = expr_parse_compare(ps)) < 0)
+                return -1;
+            if (i + 1 < expr_functions[f].argc ? expr_expect(ps, ',', "expected ','") < 0
+                                               : expr_expect(ps, ')', "expected ')'") < 0)
+                return -1;
+        }
+        return expr_node(ps, expr_functions[f].op, expr_functions[f].argc, args);
+    }
+    if (len == 1 && *start == 'x')
+        return expr_node(ps, EXPR_X, 0, NULL);
+    if (len == 2 && strncmp(start, "pi", 2) == 0) {
+        node = expr_node(ps, EXPR_CONST, 0, NULL);
+        if (node >= 0)
+            ps->nodes[node].value = 3.14159274f;
+        return node;
+    }
+    for (int i = 0; i < SLOT_INPUTS; i++) {
+        if (strlen(expr_inputs[i]) == len && strncmp(start, expr_inputs[i], len) == 0) {
+            node = expr_node(ps, EXPR_SLOT, 0, NULL);
+            if (node >= 0) {
+                ps->nodes[node].slot = i;
+                ps->nodes[node].level = i == SLOT_Y ? EXPR_PER_ROW : EXPR_PER_FRAME;
+                ps->prog->uses_y |= i == SLOT_Y;
+            }
+            return node;
+        }
+    }
+    ps->p = start;
+    return expr_fail(ps, "unknown name");
+}
+
+static int expr_parse_unary(ExprParser *ps)
+{
+    expr_skip_space(ps);
+    if (*ps->p == '-') {
+        int arg;
+        ps->p++;
+        arg = expr_parse_unary(ps);
+        return arg < 0 ? -1 : expr_node(ps, EXPR_NEG, 1, &arg);
+    }
+    return expr_parse_atom(ps);
+}
+
+static int expr_parse_product(ExprParser *ps)
+{
+    int args[2];
+
+    if ((args[0] = expr_parse_unary(ps)) < 0)
+        return -1;
+    for (;;) {
+        expr_skip_space(ps);
+        char c = *ps->p;
+        if (c != '*' && c != '/' && c != '%')
+            return args[0];
+        ps->p++;
+        if ((args[1] = expr_parse_unary(ps)) < 0 ||
+            (args[0] = expr_node(ps, c == '*' ? EXPR_MUL : c == '/' ? EXPR_DIV : EXPR_MOD, 2, args)) < 0)
+            return -1;
+    }
+}
+
+static int expr_parse_sum(ExprParser *ps)
+{
+    int args[2];
+
+    if ((args[0] = expr_parse_product(ps)) < 0)
+        return -1;
+    for (;;) {
+        expr_skip_space(ps);
+        char c = *ps->p;
+        if (c != '+' && c != '-')
+            return args[0];
+        ps->p++;
+        if ((args[1] = expr_parse_product(ps)) < 0 ||
+            (args[0] = expr_node(ps, c == '+' ? EXPR_ADD : EXPR_SUB, 2, args)) < 0)
+            return -1;
+    }
+}
+
+static int expr_parse_compare(ExprParser *ps)
+{
+    int args[2];
+    char c;
+
+    if ((args[0] = expr_parse_sum(ps)) < 0)
+        return -1;
+    expr_skip_space(ps);
+    c = *ps->p;
+    if (c != '<' && c != '>')
+        return args[0];
+    ps->p++;
+    if ((args[1] = expr_parse_sum(ps)) < 0)
+        return -1;
+    return expr_node(ps, c == '<' ? EXPR_LT : EXPR_GT, 2, args);
+}
+
+static int expr_insn(ExprParser *ps, int which, int op, int dst, int a, int b, int c, float imm)
+{
+    ExprProgram *prog = ps->prog;
+    ExprInsn *in;
+
+    if (prog->length[which] == EXPR_MAX_CODE)
+        return expr_fail(ps, "expression too long");
+    if (dst + 2 >= EXPR_REGS || a >= EXPR_REGS || c >= EXPR_REGS)
+        return expr_fail(ps, "expression nested too deeply");
+    in = &prog->code[which][prog->length[which]++];
+    in->op = (uint8_t)op;
+    in->dst = (uint8_t)dst;
+    in->a = (uint8_t)a;
+    in->b = (uint8_t)b;
+    in->c = (uint8_t)c;
+    in->imm = imm;
+    return 0;
+}
+
+/*
+ * Emits code into program which (one of EXPR_PER_*) leaving node's value
+ * in register reg, and its arguments' in the registers after it. Parts
+ * that depend on less than the program's level are computed by the
+ * program for their own level, once, and read back from a slot.
+ */
+static int expr_emit(ExprParser *ps, int node, int which, int reg)
+{
+    ExprNode *e = &ps->nodes[node];
+
+    switch (e->op) {
+    case EXPR_CONST:
+        return expr_insn(ps, which, EXPR_CONST, reg, 0, 0, 0, e->value);
+    case EXPR_X:
+        return expr_insn(ps, which, EXPR_X, reg, 0, 0, 0, 0.0f);
+    case EXPR_SLOT:
+        return expr_insn(ps, which, EXPR_SLOT, reg, 0, e->slot, 0, 0.0f);
+    }
+    if (e->level < which) {
+        if (e->slot < 0) {
+            if (ps->prog->slots == EXPR_MAX_SLOTS)
+                return expr_fail(ps, "expression too long");
+            if (expr_emit(ps, node, e->level, 0) != 0)
+                return -1;
+            e->slot = ps->prog->slots++;
+            if (expr_insn(ps, e->level, EXPR_STORE, 0, 0, e->slot, 0, 0.0f) != 0)
+                return -1;
+        }
+        return expr_insn(ps, which, EXPR_SLOT, reg, 0, e->slot, 0, 0.0f);
+    }
+    for (int i = 0; i < e->argc; i++)
+        if (expr_emit(ps, e->args[i], which, reg + i) != 0)
+            return -1;
+    return expr_insn(ps, which, e->op, reg, reg, reg + 1, reg + 2, 0.0f);
+}
+
+/*
+ * Function: expr_compile
+ *
+ * Compiles src into prog, printing where the error is if it cannot.
+ *
+ * Returns: 0 on success, -1 on a syntax error or an expression too big
+ */
+int expr_compile(ExprProgram *prog, const char *src)
+{
+    static ExprParser ps;
+    int root;
+
+    memset(prog, 0, sizeof(*prog));
+    memset(&ps, 0, sizeof(ps));
+    prog->slots = SLOT_INPUTS;
+    ps.src = ps.p = src;
+    ps.prog = prog;
+    root = expr_parse_compare(&ps);
+    expr_skip_space(&ps);
+    if (root >= 0 && *ps.p != '\0')
+        root = expr_fail(&ps, "unexpected text after the expression");
+    if (root >= 0 && expr_emit(&ps, root, EXPR_PER_PIXEL, 0) == 0) {
+        int op = ps.nodes[root].op;
+        if (op != EXPR_HSV && op != EXPR_RGB)
+            expr_insn(&ps, EXPR_PER_PIXEL, EXPR_GREY, 0, 0, 0, 0, 0.0f);
+    }
+    if (ps.error) {
+        fprintf(stderr, "Shader error: %s\n  %s\n  %*s^\n", ps.error, src, (int)(ps.error_at - src), "");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * PROCEDURAL EFFECTS
+ * ============================================================================
+ *
+ * Full-screen animated patterns, each drawn by a span kernel that fills
+ * n pixels of row y from column x. Kernels may be called for any span
+ * of any row, in any order and from any thread: everything that only
+ * changes once a frame (palettes, tables of the terms that depend on x
+ * or y alone) is set up by effect_render() before the picture is handed
+ * out over the worker pool in tiles.
+ *
+ *   EFFECT_RAINBOW  the hue gradient, copied from one precomputed row
+ *   EFFECT_PLASMA   four sine waves across x, y and both diagonals
+ *   EFFECT_NOISE    four octaves of value noise drifting apart
+ *   EFFECT_FIRE     heat rising from flickering embers, cooling as it goes
+ *   EFFECT_SHADER   the --shader expression (the rainbow if none is given)
+ *
+ * Kernels work in integers so the SSE2 and scalar paths give identical
+ * pixels. Fire is a simulation rather than a function of time: every
+ * frame is one step on from the one before. Effect numbers from
+ * EFFECT_COUNT on are the loaded plugins.
+ */
+
+enum { EFFECT_RAINBOW, EFFECT_PLASMA, EFFECT_NOISE, EFFECT_FIRE, EFFECT_SHADER, EFFECT_COUNT };
+
+static const char *const effect_names[EFFECT_COUNT] = { "rainbow", "plasma", "noise", "fire", "shader" };
+
+#define EFFECT_BAND_ROWS 16     /* Heat rows per fire step item */
+#define EFFECT_CHUNK 256        /* Pixels a kernel works on at a time */
+#define SINE_SIZE 1024          /* sine_table entries per turn */
+#define NOISE_OCTAVES 4
+#define FIRE_SCALE 2            /* Screen pixels per heat cell, each way */
+
+/* sin(2 pi i / SINE_SIZE) * 2047: four of them add up without overflowing 16 bits */
+static int16_t sine_table[SINE_SIZE];
+
+typedef struct EffectRenderer EffectRenderer;
+
+typedef void (*SpanFn)(const EffectRenderer *fx, uint32_t *dst, int x, int y, int n);
+
+struct EffectRenderer {
+    int effect;                 /* EFFECT_*, or EFFECT_COUNT + plugin number */
+    SpanFn span;
+    Plugin *plugin;             /* Plugin effects */
+    RainbowFrame frame;         /* Passed to the plugin for every span */
+    WorkerPool *pool;           /* NULL renders on the calling thread */
+    int scalar;                 /* Skip the SSE2 paths (for the benchmark) */
+    int width, height;
+    uint32_t palette[256];
+    Surface *target;            /* Frame being drawn */
+    uint32_t *rainbow;          /* The row every row copies (rainbow, shaders without y) */
+    int16_t *plasma;            /* EFFECT_PLASMA: terms along x, y, x + y and x - y */
+    int16_t *plasma_y, *plasma_diag, *plasma_anti;
+    int16_t *smooth[NOISE_OCTAVES];     /* EFFECT_NOISE: smoothstep weights across a cell, 0-128 */
+    int noise_shift[NOISE_OCTAVES];     /* Cell size, log2 */
+    uint32_t noise_ox[NOISE_OCTAVES];   /* Drift this frame */
+    uint32_t noise_oy[NOISE_OCTAVES];
+    uint8_t *heat[2];           /* EFFECT_FIRE: this step's and the last, with two ember rows below */
+    int heat_w, heat_h;
+    int heat_cur;
+    uint32_t cooling;           /* Heat lost per row, 8.8 fixed point */
+    uint64_t steps;
+    const ExprProgram *shader;  /* EFFECT_SHADER */
+    float shader_slots[EXPR_MAX_SLOTS];     /* Inputs and per-frame values */
+};
+
+/* sin(x) for |x| <= pi by its Taylor series, so the tables need no libm */
+static double taylor_sin(double x)
+{
+    double term = x, sum = x;
+
+    for (int k = 1; k < 12; k++) {
+        term *= -x * x / ((2 * k) * (2 * k + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+static uint32_t lattice_hash(uint32_t x, uint32_t y, uint32_t seed)
+{
+    uint32_t h = x * 0x8da6b343u ^ y * 0xd8163841u ^ seed * 0xcb1ab31fu;
+
+    h ^= h >> 15;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+/* Writes width hue-gradient pixels shifted by phase degrees to row */
+static void rainbow_row(uint32_t *row, unsigned int width, const RainbowParams *p, float phase)
+{
+    /* 
+     * Strategy: Use horizontal position (x) to determine the hue
+     * This creates a smooth left-to-right rainbow gradient. Every row is
+     * identical, so the colors are computed once and the row is copied.
+     */
+    for (unsigned int x = 0; x < width; x++) {
+        /* 
+         * Calculate the hue based on horizontal position
+         * hue ranges from 0° (red) to 360° (magenta)
+         * x ranges from 0 to width-1, so divide by width and multiply by 360
+         */
+        float hue = (x / (float)width) * 360.0f + phase;
+        if (hue >= 360.0f)
+            hue -= 360.0f;
+
+        row[x] = pack_rgb(hsv_to_rgb(hue, p->saturation, p->value));
+    }
+}
+
+static void rainbow_span(const EffectRenderer *fx, uint32_t *dst, int x, int y, int n)
+{
+    (void)y;
+    memcpy(dst, fx->rainbow + x, (size_t)n * sizeof(uint32_t));
+}
+
+static void plasma_span(const EffectRenderer *fx, uint32_t *dst, int x, int y, int n)
+{
+    const int16_t *px = fx->plasma + x;
+    const int16_t *pd = fx->plasma_diag + x + y;
+    const int16_t *pa = fx->plasma_anti + x - y + fx->height - 1;
+    int base = fx->plasma_y[y] + 8192;
+    int i = 0;
+
+#ifdef __SSE2__
+    if (!fx->scalar) {
+        const __m128i b = _mm_set1_epi16((short)base);
+        for (; i + 8 <= n; i += 8) {
+            __m128i v = _mm_add_epi16(_mm_add_epi16(_mm_loadu_si128((const __m128i *)(px + i)), b),
+                                      _mm_add_epi16(_mm_loadu_si128((const __m128i *)(pd + i)),
+                                                    _mm_loadu_si128((const __m128i *)(pa + i))));
+            uint16_t idx[8];
+            _mm_storeu_si128((__m128i *)idx, _mm_srli_epi16(v, 6));
+            for (int k = 0; k < 8; k++)
+                dst[i + k] = fx->palette[idx[k]];
+        }
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = fx->palette[(px[i] + pd[i] + pa[i] + base) >> 6];
+}
+
+/* Noise value at column cx of the lattice, blended between rows cy and cy + 1 by sy (0-128) */
+static inline int noise_lattice(uint32_t cx, uint32_t cy, int sy, uint32_t seed)
+{
+    int a = (int)(lattice_hash(cx, cy, seed) & 0xff);
+    int b = (int)(lattice_hash(cx, cy + 1, seed) & 0xff);
+    return a + (int)floor_div((int64_t)(b - a) * sy, 128);
+}
+
+/* acc[i] += (a + (b - a) * w[i] / 128) << shift for n pixels of one cell */
+static void noise_lerp(int16_t *acc, int a, int b, const int16_t *w, int n, int shift, int scalar)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    if (!scalar) {
+        const __m128i av = _mm_set1_epi16((short)a), dv = _mm_set1_epi16((short)(b - a));
+        for (; i + 8 <= n; i += 8) {
+            __m128i t = _mm_srai_epi16(_mm_mullo_epi16(dv, _mm_loadu_si128((const __m128i *)(w + i))), 7);
+            __m128i v = _mm_slli_epi16(_mm_add_epi16(av, t), shift);
+            _mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi16(_mm_loadu_si128((__m128i *)(acc + i)), v));
+        }
+    }
+#else
+    (void)scalar;
+#endif
+    for (; i < n; i++)
+        acc[i] = (int16_t)(acc[i] + ((a + (int)floor_div((int64_t)(b - a) * w[i], 128)) << shift));
+}
+
+/*
+ * Octave o has cells of 2^noise_shift[o] pixels and weighs half as much
+ * as the one before; the lattice values at the cell corners are blended
+ * with smoothstep weights. One pass per cell keeps the two corner
+ * values fixed, so the pixels across it vectorise without gathers.
+ */
+static void noise_span(const EffectRenderer *fx, uint32_t *dst, int x, int y, int n)
+{
+    int16_t acc[EFFECT_CHUNK];
+
+    for (int done = 0; done < n; done += EFFECT_CHUNK) {
+        int m = n - done < EFFECT_CHUNK ? n - done : EFFECT_CHUNK;
+
+        memset(acc, 0, (size_t)m * sizeof(acc[0]));
+        for (int o = 0; o < NOISE_OCTAVES; o++) {
+            int k = fx->noise_shift[o];
+            uint32_t mask = (1u << k) - 1;
+            uint32_t v = (uint32_t)y + fx->noise_oy[o];
+            uint32_t u = (uint32_t)(x + done) + fx->noise_ox[o];
+            int sy = fx->smooth[o][v & mask];
+
+            for (int i = 0; i < m; ) {
+                uint32_t cx = (u + (uint32_t)i) >> k, f = (u + (uint32_t)i) & mask;
+                int len = (int)(mask + 1 - f) < m - i ? (int)(mask + 1 - f) : m - i;
+                noise_lerp(acc + i, noise_lattice(cx, v >> k, sy, (uint32_t)o),
+                           noise_lattice(cx + 1, v >> k, sy, (uint32_t)o), fx->smooth[o] + f, len,
+                           NOISE_OCTAVES - 1 - o, fx->scalar);
+                i += len;
+            }
+        }
+        /* Sum is 0 to 255 * 15; scale to a palette index */
+        for (int i = 0; i < m; i++)
+            dst[done + i] = fx->palette[(acc[i] * 17) >> 8];
+    }
+}
+
+static inline int avg_u8(int a, int b)
+{
+    return (a + b + 1) >> 1;
+}
+
+/*
+ * Heat row y of this step: the average of the three cells below it and
+ * the one under those in the last step, less the row's cooling. The
+ * cooling is dithered across rows, so heat rising through the whole
+ * screen always loses the same total.
+ */
+static void fire_step_row(const EffectRenderer *fx, int y)
+{
+    int w = fx->heat_w;
+    const uint8_t *below = fx->heat[fx->heat_cur ^ 1] + (size_t)(y + 1) * w;
+    const uint8_t *under = below + w;
+    uint8_t *out = fx->heat[fx->heat_cur] + (size_t)y * w;
+    int cool = (int)(((uint32_t)(y + 1) * fx->cooling >> 8) - ((uint32_t)y * fx->cooling >> 8));
+    int x = 1;
+
+#ifdef __SSE2__
+    if (!fx->scalar) {
+        const __m128i c = _mm_set1_epi8((char)cool);
+        for (; x + 17 <= w; x += 16) {
+            __m128i l = _mm_loadu_si128((const __m128i *)(below + x - 1));
+            __m128i m = _mm_loadu_si128((const __m128i *)(below + x));
+            __m128i r = _mm_loadu_si128((const __m128i *)(below + x + 1));
+            __m128i u = _mm_loadu_si128((const __m128i *)(under + x));
+            __m128i v = _mm_avg_epu8(_mm_avg_epu8(l, r), _mm_avg_epu8(m, u));
+            _mm_storeu_si128((__m128i *)(out + x), _mm_subs_epu8(v, c));
+        }
+    }
+#endif
+    for (; x < w - 1; x++) {
+        int v = avg_u8(avg_u8(below[x - 1], below[x + 1]), avg_u8(below[x], under[x])) - cool;
+        out[x] = (uint8_t)(v < 0 ? 0 : v);
+    }
+    /* The edges take the missing neighbour from the middle */
+    for (x = 0; x < w; x += w - 1 > 0 ? w - 1 : 1) {
+        int l = below[x > 0 ? x - 1 : x], r = below[x + 1 < w ? x + 1 : x];
+        int v = avg_u8(avg_u8(l, r), avg_u8(below[x], under[x])) - cool;
+        out[x] = (uint8_t)(v < 0 ? 0 : v);
+    }
+}
+
+static void fire_step_band(void *ctx, int item, int worker)
+{
+    const EffectRenderer *fx = ctx;
+    int y0 = item * EFFECT_BAND_ROWS;
+    int y1 = y0 + EFFECT_BAND_ROWS < fx->heat_h ? y0 + EFFECT_BAND_ROWS : fx->heat_h;
+
+    (void)worker;
+    for (int y = y0; y < y1; y++)
+        fire_step_row(fx, y);
+}
+
+static void fire_span(const EffectRenderer *fx, uint32_t *dst, int x, int y, int n)
+{
+    const uint8_t *heat = fx->heat[fx->heat_cur] + (size_t)(y / FIRE_SCALE) * fx->heat_w;
+
+    for (int i = 0; i < n; i++)
+        dst[i] = fx->palette[heat[(x + i) / FIRE_SCALE]];
+}
+
+static void shader_span(const EffectRenderer *fx, uint32_t *dst, int x, int y, int n)
+{
+    _Alignas(16) float regs[EXPR_REGS][EXPR_CHUNK];
+    float slots[EXPR_MAX_SLOTS];
+
+    memcpy(slots, fx->shader_slots, (size_t)fx->shader->slots * sizeof(float));
+    slots[SLOT_Y] = (float)y;
+    expr_run(fx->shader, EXPR_PER_ROW, regs, slots, 0, 1, NULL, 1);
+    for (int done = 0; done < n; done += EXPR_CHUNK)
+        expr_run(fx->shader, EXPR_PER_PIXEL, regs, slots, x + done,
+                 n - done < EXPR_CHUNK ? n - done : EXPR_CHUNK, dst + done, fx->scalar);
+}
+
+static void plugin_span(const EffectRenderer *fx, uint32_t *dst, int x, int y, int n)
+{
+    fx->plugin->api->span(fx->plugin->state, &fx->frame, dst, x, y, n);
+}
+
+static const SpanFn effect_spans[EFFECT_COUNT] = { rainbow_span, plasma_span, noise_span, fire_span, shader_span };
+
+static const char *effect_name(int effect)
+{
+    return effect < EFFECT_COUNT ? effect_names[effect] : plugins[effect - EFFECT_COUNT].api->name;
+}
+
+/* Spans of some effects cost far more in some places than others, so the frame is drawn in tiles */
+static void effect_tile(void *ctx, Rect tile, int worker)
+{
+    const EffectRenderer *fx = ctx;
+    Surface *s = fx->target;
+    uint64_t start = fx->plugin ? now_ns() : 0;
+
+    (void)worker;
+    for (int y = tile.y; y < tile.y + tile.h; y++)
+        fx->span(fx, surface_row(s, (unsigned int)y) + tile.x, tile.x, y, tile.w);
+    if (fx->plugin) {
+        atomic_fetch_add_explicit(&fx->plugin->spans, (uint64_t)tile.h, memory_order_relaxed);
+        atomic_fetch_add_explicit(&fx->plugin->pixels, (uint64_t)tile.w * tile.h, memory_order_relaxed);
+        atomic_fetch_add_explicit(&fx->plugin->ns, now_ns() - start, memory_order_relaxed);
+    }
+}
+
+/* Runs fn over rows in bands, on the pool if there is one */
+static void effect_run(EffectRenderer *fx, WorkFn fn, int rows)
+{
+    int bands = (rows + EFFECT_BAND_ROWS - 1) / EFFECT_BAND_ROWS;
+
+    if (fx->pool)
+        worker_pool_run(fx->pool, fn, fx, bands);
+    else
+        for (int i = 0; i < bands; i++)
+            fn(fx, i, 0);
+}
+
+/* Advances the fire one step: new embers along the bottom, then every heat row */
+static void fire_step(EffectRenderer *fx)
+{
+    uint8_t *embers;
+
+    fx->heat_cur ^= 1;
+    embers = fx->heat[fx->heat_cur ^ 1] + (size_t)fx->heat_h * fx->heat_w;
+    for (int x = 0; x < fx->heat_w; x++) {
+        /* Clumps of four cells flare up and die down together */
+        uint32_t h = lattice_hash((uint32_t)x / 4, (uint32_t)fx->steps, 0xf1e) & 0xff;
+        embers[x] = embers[x + fx->heat_w] = (uint8_t)(h > 96 ? 255 : h / 2);
+    }
+    effect_run(fx, fire_step_band, fx->heat_h);
+    fx->steps++;
+}
+
+static void effect_renderer_destroy(EffectRenderer *fx);
+
+/*
+ * Function: effect_renderer_init
+ *
+ * Sets fx up to draw one of the EFFECT_* patterns, or a loaded plugin,
+ * at the given size over pool (NULL for the calling thread only).
+ *
+ * Returns: 0 on success, -1 if memory could not be allocated
+ */
+int effect_renderer_init(EffectRenderer *fx, int effect, WorkerPool *pool, int width, int height)
+{
+    memset(fx, 0, sizeof(*fx));
+    fx->effect = effect;
+    fx->pool = pool;
+    fx->width = width;
+    fx->height = height;
+    if (effect >= EFFECT_COUNT) {
+        fx->plugin = &plugins[effect - EFFECT_COUNT];
+        fx->span = plugin_span;
+        return 0;
+    }
+    fx->span = effect_spans[effect];
+
+    for (int i = 0; i < SINE_SIZE; i++) {
+        double a = 2.0 * 3.14159265358979323846 * i / SINE_SIZE;
+        double v = taylor_sin(a > 3.14159265358979323846 ? a - 2.0 * 3.14159265358979323846 : a) * 2047.0;
+        sine_table[i] = (int16_t)(v < 0 ? v - 0.5 : v + 0.5);
+    }
+
+    switch (effect) {
+    case EFFECT_RAINBOW:
+        fx->rainbow = malloc((size_t)width * sizeof(uint32_t));
+        if (!fx->rainbow)
+            goto fail;
+        break;
+    case EFFECT_PLASMA:
+        fx->plasma = malloc((size_t)(3 * width + 3 * height) * sizeof(int16_t));
+        if (!fx->plasma)
+            goto fail;
+        fx->plasma_y = fx->plasma + width;
+        fx->plasma_diag = fx->plasma_y + height;
+        fx->plasma_anti = fx->plasma_diag + width + height;
+        break;
+    case EFFECT_NOISE: {
+        int k = 3;
+        while (k < 12 && 2 << k <= (height < width ? height : width) / 2)
+            k++;
+        for (int o = 0; o < NOISE_OCTAVES; o++) {
+            int64_t size = (int64_t)1 << k;
+            fx->noise_shift[o] = k;
+            fx->smooth[o] = malloc((size_t)size * sizeof(int16_t));
+            if (!fx->smooth[o])
+                goto fail;
+            for (int64_t f = 0; f < size; f++)
+                fx->smooth[o][f] = (int16_t)((3 * f * f * size - 2 * f * f * f) * 128 / (size * size * size));
+            if (k > 3)
+                k--;
+        }
+        break;
+    }
+    case EFFECT_FIRE:
+        fx->heat_w = (width + FIRE_SCALE - 1) / FIRE_SCALE;
+        fx->heat_h = (height + FIRE_SCALE - 1) / FIRE_SCALE;
+        for (int i = 0; i < 2; i++)
+            if (!(fx->heat[i] = calloc((size_t)fx->heat_w * (fx->heat_h + 2), 1)))
+                goto fail;
+        /* Flames reach about two thirds of the way up */
+        fx->cooling = (uint32_t)(255 * 256 * 3 / 2) / (uint32_t)fx->heat_h;
+        break;
+    case EFFECT_SHADER:
+        fx->shader = &shader_program;
+        if (!fx->shader->uses_y) {
+            /* Every row is the same: work out one and copy it */
+            fx->rainbow = malloc((size_t)width * sizeof(uint32_t));
+            if (!fx->rainbow)
+                goto fail;
+            fx->span = rainbow_span;
+        }
+        break;
+    }
+    return 0;
+
+fail:
+    effect_renderer_destroy(fx);
+    return -1;
+}
+
+static void effect_renderer_destroy(EffectRenderer *fx)
+{
+    free(fx->rainbow);
+    free(fx->plasma);
+    for (int o = 0; o < NOISE_OCTAVES; o++)
+        free(fx->smooth[o]);
+    free(fx->heat[0]);
+    free(fx->heat[1]);
+    memset(fx, 0, sizeof(*fx));
+}
+
+/* Sine term i of a wave with step (16.16 table entries per pixel) and phase */
+static inline int16_t sine_term(int64_t i, uint64_t step, uint64_t phase)
+{
+    return sine_table[(((uint64_t)i * step + phase) >> 16) & (SINE_SIZE - 1)];
+}
+
+/* Phase of a wave moving at turns per second, in 16.16 sine table entries */
+static inline uint64_t sine_phase(double t, double turns)
+{
+    return (uint64_t)(t * turns * SINE_SIZE * 65536.0);
+}
+
+/* Per-frame set-up: palette and tables for time t; phase is the hue drift in degrees */
+static void effect_prepare(EffectRenderer *fx, const RainbowParams *p, double t, float phase)
+{
+    int w = fx->width, h = fx->height;
+
+    switch (fx->effect) {
+    case EFFECT_RAINBOW:
+        rainbow_row(fx->rainbow, (unsigned int)w, p, phase);
+        break;
+    case EFFECT_PLASMA: {
+        /* Wavelengths follow the width, so it looks the same at any resolution */
+        uint64_t unit = (uint64_t)SINE_SIZE * 65536 / (uint64_t)w;
+        uint64_t sx = sine_phase(t, 0.13), sy = sine_phase(t, 0.17);
+        uint64_t sd = sine_phase(t, 0.23), sa = sine_phase(t, 0.07);
+
+        for (int x = 0; x < w; x++)
+            fx->plasma[x] = sine_term(x, unit * 2, sx);
+        for (int y = 0; y < h; y++)
+            fx->plasma_y[y] = sine_term(y, unit * 3 / 2, sy);
+        for (int i = 0; i < w + h - 1; i++) {
+            fx->plasma_diag[i] = sine_term(i, unit, sd);
+            fx->plasma_anti[i] = sine_term(i, unit * 5 / 4, sa);
+        }
+        for (int i = 0; i < 256; i++) {
+            float hue = (float)(i * 720 / 256 % 360) + phase;
+            fx->palette[i] = pack_rgb(hsv_to_rgb(hue >= 360.0f ? hue - 360.0f : hue, p->saturation, p->value));
+        }
+        break;
+    }
+    case EFFECT_NOISE: {
+        static const float dirs[NOISE_OCTAVES][2] = { { 1.0f, 0.3f }, { -0.6f, 0.8f }, { 0.2f, -1.0f }, { -1.0f, -0.4f } };
+        double speed = h / 12.0;   /* Pixels per second for the coarsest octave */
+
+        for (int o = 0; o < NOISE_OCTAVES; o++) {
+            fx->noise_ox[o] = (uint32_t)(int64_t)(t * speed * dirs[o][0] * (1 + o)) + 0x40000000u;
+            fx->noise_oy[o] = (uint32_t)(int64_t)(t * speed * dirs[o][1] * (1 + o)) + 0x40000000u;
+        }
+        for (int i = 0; i < 256; i++) {
+            float hue = 240.0f - i * 60.0f / 255.0f + phase;
+            hue = hue >= 360.0f ? hue - 360.0f : hue;
+            fx->palette[i] = pack_rgb(hsv_to_rgb(hue, p->saturation * (1.0f - i / 400.0f),
+                                                 p->value * (0.1f + 0.9f * i / 255.0f)));
+        }
+        break;
+    }
+    case EFFECT_FIRE:
+        for (int i = 0; i < 256; i++) {
+            int r = i * 3, g = (i - 80) * 3, b = (i - 170) * 3;
+            RGB c = { (unsigned char)((r > 255 ? 255 : r) * p->value),
+                      (unsigned char)((g < 0 ? 0 : g > 255 ? 255 : g) * p->value),
+                      (unsigned char)((b < 0 ? 0 : b > 255 ? 255 : b) * p->value) };
+            fx->palette[i] = pack_rgb(c);
+        }
+        /* Start with the flames already burning */
+        for (int i = fx->steps ? 1 : fx->heat_h; i > 0; i--)
+            fire_step(fx);
+        break;
+    case EFFECT_SHADER: {
+        _Alignas(16) float regs[EXPR_REGS][EXPR_CHUNK];
+        float *in = fx->shader_slots;
+
+        in[SLOT_T] = (float)t;
+        in[SLOT_W] = (float)w;
+        in[SLOT_H] = (float)h;
+        in[SLOT_PHASE] = phase;
+        in[SLOT_SPEED] = p->speed;
+        in[SLOT_SAT] = p->saturation;
+        in[SLOT_VAL] = p->value;
+        expr_run(fx->shader, EXPR_PER_FRAME, regs, in, 0, 1, NULL, 1);
+        if (!fx->shader->uses_y)
+            shader_span(fx, fx->rainbow, 0, 0, w);
+        break;
+    }
+    default: {
+        RainbowFrame f = { t, w, h, p->speed, p->saturation, p->value, phase };
+        fx->frame = f;
+        break;
+    }
+    }
+}
+
+/*
+ * Function: effect_render
+ *
+ * Draws the frame at time t (seconds) into s, which must have the size
+ * given to effect_renderer_init(), and marks it all damaged. The hue
+ * drifts with p->speed as the plain rainbow does.
+ */
+void effect_render(EffectRenderer *fx, Surface *s, Damage *d, const RainbowParams *p, double t)
+{
+    double turns = t * p->speed / 360.0;
+    float phase = (float)((turns - (double)(uint64_t)turns) * 360.0);
+
+    effect_prepare(fx, p, t, phase);
+    Rect all = { 0, 0, (int)s->width, (int)s->height };
+
+    fx->target = s;
+    if (fx->pool)
+        worker_pool_run_tiles(fx->pool, effect_tile, fx, all);
+    else
+        effect_tile(fx, all, 0);
+    damage_add_all(d);
+}
+
+/*
+ * ============================================================================
+ * IMAGE FILES
+ * ============================================================================
+ *
+ * Images are never decoded into a buffer of their own: the file is
+ * mmapped and an Image points straight at the pixel data in the
+ * mapping, so drawing it (blit_image(), scale_image()) converts rows
+ * directly from the page cache into their destination. Two formats are
+ * understood:
+ *
+ *   PPM   binary "P6" with a maximum value of 255, pixels R, G, B
+ *   raw   headerless 32-bit XRGB8888 at exactly the screen size, e.g. a
+ *         dump of a 32 bpp frame buffer taken with cat /dev/fb0
+ */
+
+typedef struct {
+    Image image;                /* Pixels point into the mapping */
+    void *map;
+    size_t map_len;
+} MappedImage;
+
+/* Reads one decimal header field, skipping whitespace and # comments */
+static int ppm_field(const unsigned char *p, size_t len, size_t *pos, int *out)
+{
+    long v = 0;
+    size_t i = *pos;
+
+    for (;;) {
+        while (i < len && (p[i] == ' ' || p[i] == '\t' || p[i] == '\r' || p[i] == '\n'))
+            i++;
+        if (i < len && p[i] == '#') {
+            while (i < len && p[i] != '\n')
+                i++;
+            continue;
+        }
+        break;
+    }
+    if (i == len || p[i] < '0' || p[i] > '9')
+        return -1;
+    while (i < len && p[i] >= '0' && p[i] <= '9' && v <= 1000000)
+        v = v * 10 + (p[i++] - '0');
+    if (v > 1000000)
+        return -1;
+    *out = (int)v;
+    *pos = i;
+    return 0;
+}
+
+/*
+ * Function: image_map
+ *
+ * Maps an image file. Files not starting with a PPM header are taken as
+ * raw XRGB8888 and must be raw_w x raw_h pixels. The kernel is told the
+ * mapping will be read front to back, so it reads ahead aggressively and
+ * drops pages behind the reader.
+ */
+int image_map(MappedImage *mi, const char *path, int raw_w, int raw_h)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    const unsigned char *p;
+
+    memset(mi, 0, sizeof(*mi));
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open image %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "Image %s is empty\n", path);
+        close(fd);
+        return -1;
+    }
+    mi->map_len = (size_t)st.st_size;
+    mi->map = mmap(NULL, mi->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mi->map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map image %s: %s\n", path, strerror(errno));
+        mi->map = NULL;
+        return -1;
+    }
+    madvise(mi->map, mi->map_len, MADV_SEQUENTIAL);
+    p = mi->map;
+
+    if (mi->map_len >= 2 && p[0] == 'P' && p[1] == '6') {
+        size_t pos = 2;
+        int w, h, maxval;
+        if (ppm_field(p, mi->map_len, &pos, &w) != 0 || ppm_field(p, mi->map_len, &pos, &h) != 0 ||
+            ppm_field(p, mi->map_len, &pos, &maxval) != 0 || w == 0 || h == 0 || maxval != 255 ||
+            pos + 1 + (size_t)w * h * 3 > mi->map_len) {
+            fprintf(stderr, "%s: not a supported PPM (binary P6, maximum value 255)\n", path);
+            goto bad;
+        }
+        mi->image.pixels = p + pos + 1;   /* Exactly one whitespace byte ends the header */
+        mi->image.width = w;
+        mi->image.height = h;
+        mi->image.stride = (size_t)w * 3;
+        mi->image.format = PIXEL_RGB24;
+        return 0;
+    }
+
+    if (mi->map_len != (size_t)raw_w * raw_h * 4) {
+        fprintf(stderr, "%s: raw images must be %dx%d XRGB8888 (%zu bytes)\n",
+                path, raw_w, raw_h, (size_t)raw_w * raw_h * 4);
+        goto bad;
+    }
+    mi->image.pixels = p;
+    mi->image.width = raw_w;
+    mi->image.height = raw_h;
+    mi->image.stride = (size_t)raw_w * 4;
+    mi->image.format = PIXEL_XRGB8888;
+    return 0;
+
+bad:
+    munmap(mi->map, mi->map_len);
+    mi->map = NULL;
+    return -1;
+}
+
+void image_unmap(MappedImage *mi)
+{
+    if (mi->map)
+        munmap(mi->map, mi->map_len);
+    memset(mi, 0, sizeof(*mi));
+}
+
+/* Asks the kernel to start reading rows [y0, y1) of the image in now */
+void image_prefetch_rows(const MappedImage *mi, int y0, int y1)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t from, to;
+
+    if (y0 < 0)
+        y0 = 0;
+    if (y1 > mi->image.height)
+        y1 = mi->image.height;
+    if (!mi->map || y0 >= y1)
+        return;
+    from = (uintptr_t)image_row(&mi->image, y0) & ~(uintptr_t)(page - 1);
+    to = (uintptr_t)image_row(&mi->image, y1);
+    madvise((void *)from, to - from, MADV_WILLNEED);
+}
+
+/* The largest rectangle with the image's aspect ratio that fits w x h, centred */
+Rect image_fit(const Image *img, int w, int h)
+{
+    Rect r = { 0, 0, w, h };
+
+    if ((int64_t)img->width * h > (int64_t)img->height * w)
+        r.h = (int)((int64_t)img->height * w / img->width);
+    else
+        r.w = (int)((int64_t)img->width * h / img->height);
+    if (r.w < 1)
+        r.w = 1;
+    if (r.h < 1)
+        r.h = 1;
+    r.x = (w - r.w) / 2;
+    r.y = (h - r.h) / 2;
+    return r;
+}
+
+/*
+ * ============================================================================
+ * FRAME SEQUENCES
+ * ============================================================================
+ *
+ * Pre-rendered animations for devices that cannot render an effect in
+ * real time. A sequence file is mmapped and each frame is decoded
+ * straight into the surface that already holds the previous one, so
+ * only pixels that changed are touched.
+ *
+ * File layout (all fields little endian):
+ *
+ *   "RSEQ"  u32 version (1)  u32 width  u32 height  u32 frames  u32 fps x 1000
+ *   u64 index[frames]        offset of each frame; bit 63 marks keyframes
+ *   frame data
+ *
+ * A frame is a stream of spans covering width x height pixels in row
+ * order (spans may run on across rows). Each span starts with a u32
+ * whose top two bits say what it is and whose low 30 bits count pixels:
+ *
+ *   SEQ_SKIP     pixels unchanged from the previous frame
+ *   SEQ_LITERAL  followed by count XRGB8888 pixels
+ *   SEQ_FILL     followed by one XRGB8888 pixel, repeated count times
+ *
+ * Keyframes contain no SKIP spans and can be decoded on their own; they
+ * make looping and seeking cheap. Frame 0 is always a keyframe.
+ */
+
+#define SEQ_MAGIC "RSEQ"
+#define SEQ_VERSION 1
+#define SEQ_HEADER_SIZE 24
+#define SEQ_KEYFRAME (1ull << 63)
+
+enum { SEQ_SKIP, SEQ_LITERAL, SEQ_FILL };
+
+#define SEQ_SPAN(op, count) ((uint32_t)(op) << 30 | (uint32_t)(count))
+#define SEQ_MAX_SPAN ((1u << 30) - 1)
+
+typedef struct {
+    const unsigned char *map;
+    size_t map_len;
+    int width;
+    int height;
+    int frames;
+    double fps;
+    int current;                /* Frame the destination holds, -1 = none */
+} Sequence;
+
+static inline uint32_t read_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t seq_index(const Sequence *seq, int frame)
+{
+    const unsigned char *p = seq->map + SEQ_HEADER_SIZE + (size_t)frame * 8;
+    return read_le32(p) | (uint64_t)read_le32(p + 4) << 32;
+}
+
+int sequence_open(Sequence *seq, const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    memset(seq, 0, sizeof(*seq));
+    seq->current = -1;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open sequence %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < SEQ_HEADER_SIZE) {
+        close(fd);
+        goto bad;
+    }
+    seq->map_len = (size_t)st.st_size;
+    seq->map = mmap(NULL, seq->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (seq->map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map sequence %s: %s\n", path, strerror(errno));
+        seq->map = NULL;
+        return -1;
+    }
+    /* Loops re-read the whole file; ask for all of it up front */
+    madvise((void *)seq->map, seq->map_len, MADV_WILLNEED);
+
+    seq->width = (int)read_le32(seq->map + 8);
+    seq->height = (int)read_le32(seq->map + 12);
+    seq->frames = (int)read_le32(seq->map + 16);
+    seq->fps = read_le32(seq->map + 20) / 1000.0;
+    if (memcmp(seq->map, SEQ_MAGIC, 4) != 0 || read_le32(seq->map + 4) != SEQ_VERSION ||
+        seq->width <= 0 || seq->height <= 0 || seq->width > 32768 || seq->height > 32768 ||
+        seq->frames <= 0 || seq->fps <= 0.0 ||
+        SEQ_HEADER_SIZE + (uint64_t)seq->frames * 8 > seq->map_len ||
+        !(seq_index(seq, 0) & SEQ_KEYFRAME))
+        goto bad;
+    for (int i = 0; i < seq->frames; i++) {
+        uint64_t off = seq_index(seq, i) & ~SEQ_KEYFRAME;
+        if (off < SEQ_HEADER_SIZE + (uint64_t)seq->frames * 8 || off > seq->map_len ||
+            (i > 0 && off < (seq_index(seq, i - 1) & ~SEQ_KEYFRAME)))
+            goto bad;
+    }
+    return 0;
+
+bad:
+    fprintf(stderr, "%s is not a valid frame sequence\n", path);
+    if (seq->map)
+        munmap((void *)seq->map, seq->map_len);
+    seq->map = NULL;
+    return -1;
+}
+
+void sequence_close(Sequence *seq)
+{
+    if (seq->map)
+        munmap((void *)seq->map, seq->map_len);
+    seq->map = NULL;
+}
+
+/*
+ * Function: sequence_apply
+ *
+ * Applies the spans of one frame to the surface area whose top-left
+ * corner is (x0, y0), adding the rows it changed to d in bands of
+ * TILE_SIZE rows. The caller makes sure the surface holds the previous
+ * frame (or anything, for keyframes).
+ *
+ * Returns: 0, or -1 if the frame data is corrupt
+ */
+static int sequence_apply(const Sequence *seq, int frame, Surface *s, int x0, int y0, Damage *d)
+{
+    const unsigned char *p = seq->map + (seq_index(seq, frame) & ~SEQ_KEYFRAME);
+    const unsigned char *end = frame + 1 < seq->frames ?
+                               seq->map + (seq_index(seq, frame + 1) & ~SEQ_KEYFRAME) :
+                               seq->map + seq->map_len;
+    int w = seq->width;
+    size_t left = (size_t)w * seq->height;
+    int x = 0, y = 0;
+    /* Changed columns within the current band of rows */
+    int band = 0, minx = w, maxx = -1;
+
+    while (left > 0) {
+        if (end - p < 4)
+            return -1;
+        uint32_t span = read_le32(p);
+        int op = (int)(span >> 30);
+        size_t count = span & SEQ_MAX_SPAN;
+        uint32_t color = 0;
+        p += 4;
+
+        if (op > SEQ_FILL || count == 0 || count > left)
+            return -1;
+        if (op == SEQ_LITERAL && (size_t)(end - p) < count * 4)
+            return -1;
+        if (op == SEQ_FILL) {
+            if (end - p < 4)
+                return -1;
+            color = read_le32(p) & 0x00ffffff;
+            p += 4;
+        }
+        left -= count;
+
+        /* Walk the span row by row */
+        while (count > 0) {
+            int n = count < (size_t)(w - x) ? (int)count : w - x;
+
+            if (op != SEQ_SKIP) {
+                uint32_t *dst = surface_row(s, (unsigned int)(y0 + y)) + x0 + x;
+                if (op == SEQ_LITERAL) {
+                    memcpy(dst, p, (size_t)n * 4);
+                    p += (size_t)n * 4;
+                } else {
+                    fill_span(dst, n, color, 0);
+                }
+                if (x < minx)
+                    minx = x;
+                if (x + n - 1 > maxx)
+                    maxx = x + n - 1;
+            }
+            count -= (size_t)n;
+            x += n;
+            if (x == w) {
+                x = 0;
+                y++;
+                if (y % TILE_SIZE == 0 || y == seq->height) {
+                    if (maxx >= minx) {
+                        Rect r = { x0 + minx, y0 + band, maxx - minx + 1, y - band };
+                        damage_add(d, r);
+                    }
+                    band = y;
+                    minx = w;
+                    maxx = -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: sequence_show
+ *
+ * Brings the surface area at (x, y) to the given frame: the next frame
+ * is a single delta, anything else restarts from the closest keyframe at
+ * or before it. Frames in between are decoded but not shown.
+ *
+ * Returns: 0, or -1 if the file turned out to be corrupt
+ */
+int sequence_show(Sequence *seq, int frame, Surface *s, int x, int y, Damage *d)
+{
+    int from = frame;
+
+    if (frame == seq->current)
+        return 0;
+    if (seq->current >= 0 && seq->current < frame) {
+        while (from > seq->current + 1 && !(seq_index(seq, from) & SEQ_KEYFRAME))
+            from--;
+    } else {
+        while (from > 0 && !(seq_index(seq, from) & SEQ_KEYFRAME))
+            from--;
+    }
+    for (int i = from; i <= frame; i++) {
+        if (sequence_apply(seq, i, s, x, y, d) != 0) {
+            seq->current = -1;
+            return -1;
+        }
+        seq->current = i;
+    }
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * RFB (VNC) SERVER
+ * ============================================================================
+ *
+ * Serves the shadow surface to VNC viewers over TCP (RFB protocol 3.3,
+ * 3.7 and 3.8, security type "None"). The server runs on its own thread
+ * around a non-blocking epoll loop. The renderer hands over changed
+ * regions with rfb_server_publish(), which only copies them into a
+ * staging surface under a mutex; conversion and encoding happen on the
+ * server thread from a private copy, so a slow viewer can never hold up
+ * rendering.
+ *
+ * Only tiles that changed since a viewer's last update are sent, using
+ * the best encoding the viewer supports out of ZRLE, RRE and Raw.
+ */
+
+#define RFB_MAX_CLIENTS 8
+#define RFB_ENCODING_RAW 0
+#define RFB_ENCODING_RRE 2
+#define RFB_ENCODING_ZRLE 16
+#define RFB_ZRLE_TILE 64
+#define RFB_IN_BUFFER 4096
+
+/* Growable output byte buffer; failed is set if an allocation ever fails */
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t pos;   /* Bytes already sent to the socket */
+    size_t cap;
+    int failed;
+} ByteBuffer;
+
+typedef struct {
+    unsigned char bpp;
+    unsigned char depth;
+    unsigned char big_endian;
+    unsigned char true_colour;
+    uint16_t red_max, green_max, blue_max;
+    unsigned char red_shift, green_shift, blue_shift;
+} RfbPixelFormat;
+
+typedef enum {
+    RFB_STATE_VERSION,
+    RFB_STATE_SECURITY,
+    RFB_STATE_CLIENT_INIT,
+    RFB_STATE_NORMAL
+} RfbState;
+
+typedef struct {
+    int fd;
+    RfbState state;
+    int minor;                    /* Negotiated protocol version 3.minor */
+    unsigned char in[RFB_IN_BUFFER];
+    size_t in_len;
+    size_t discard;               /* Bytes of an oversized message still to drop */
+    ByteBuffer out;
+    int want_write;               /* EPOLLOUT currently requested */
+    RfbPixelFormat pf;
+    int native;                   /* pf matches the surface layout: rows can be memcpy'd */
+    int cpixel_offset;            /* ZRLE compressed pixel: first byte used ... */
+    int cpixel_size;              /* ... and number of bytes */
+    int encoding;
+    int update_requested;
+    Rect requested;
+    unsigned char *dirty;         /* One flag per tile: changed since last sent */
+    int zlib_started;             /* ZRLE zlib stream header already sent */
+} RfbClient;
+
+typedef struct {
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;                  /* eventfd: renderer published a frame, or stop */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int stopping;                 /* Under lock */
+    Surface staging;              /* Under lock: written by the renderer */
+    unsigned char *staged;        /* Under lock: tiles changed in staging since last pickup */
+    Surface frame;                /* Server thread only: what viewers are served from */
+    unsigned int cols;
+    unsigned int rows;
+    Rect *update_rects;           /* Server thread scratch, cols * rows entries */
+    ByteBuffer scratch;           /* Server thread scratch for ZRLE data before zlib framing */
+    TelemetrySlot *telemetry;     /* Server thread: update encode times and bytes */
+    RfbClient *clients[RFB_MAX_CLIENTS];
+} RfbServer;
+
+static const RfbPixelFormat rfb_server_format = {
+    32, 24, 0, 1, 255, 255, 255, 16, 8, 0
+};
+
+static int buf_reserve(ByteBuffer *b, size_t extra)
+{
+    if (b->failed)
+        return -1;
+    if (b->len + extra <= b->cap)
+        return 0;
+
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + extra)
+        cap *= 2;
+    unsigned char *data = realloc(b->data, cap);
+    if (!data) {
+        b->failed = 1;
+        return -1;
+    }
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+static void buf_put(ByteBuffer *b, const void *p, size_t n)
+{
+    if (buf_reserve(b, n) == 0) {
+        memcpy(b->data + b->len, p, n);
+        b->len += n;
+    }
+}
+
+static void buf_u8(ByteBuffer *b, unsigned int v)
+{
+    unsigned char c = (unsigned char)v;
+    buf_put(b, &c, 1);
+}
+
+static void buf_u16(ByteBuffer *b, unsigned int v)
+{
+    unsigned char c[2] = { (unsigned char)(v >> 8), (unsigned char)v };
+    buf_put(b, c, 2);
+}
+
+static void buf_u32(ByteBuffer *b, uint32_t v)
+{
+    unsigned char c[4] = { (unsigned char)(v >> 24), (unsigned char)(v >> 16),
+                           (unsigned char)(v >> 8), (unsigned char)v };
+    buf_put(b, c, 4);
+}
+
+static void buf_free(ByteBuffer *b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+static inline uint16_t rd_u16(const unsigned char *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t rd_u32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* Encodes one surface pixel as the viewer's pixel, bpp/8 bytes into out */
+static inline void rfb_pixel_bytes(const RfbPixelFormat *pf, uint32_t p, unsigned char *out)
+{
+    uint32_t r = (p >> 16) & 0xff;
+    uint32_t g = (p >> 8) & 0xff;
+    uint32_t b = p & 0xff;
+    uint32_t v = (((r * pf->red_max + 127) / 255) << pf->red_shift) |
+                 (((g * pf->green_max + 127) / 255) << pf->green_shift) |
+                 (((b * pf->blue_max + 127) / 255) << pf->blue_shift);
+    int n = pf->bpp / 8;
+
+    for (int i = 0; i < n; i++)
+        out[i] = (unsigned char)(pf->big_endian ? v >> (8 * (n - 1 - i)) : v >> (8 * i));
+}
+
+/* A channel of max << shift (max of the form 2^n - 1) that fits in bpp bits */
+static int rfb_channel_valid(unsigned int max, unsigned int shift, unsigned int bpp)
+{
+    return max != 0 && (max & (max + 1)) == 0 && shift < bpp && ((uint64_t)max << shift) >> bpp == 0;
+}
+
+/*
+ * Checks a SetPixelFormat from a viewer: the shifts and maxima are used
+ * as they come when encoding, so anything that does not describe true
+ * colour channels inside the pixel is refused.
+ */
+static int rfb_format_valid(const RfbPixelFormat *pf)
+{
+    return pf->true_colour && (pf->bpp == 8 || pf->bpp == 16 || pf->bpp == 32) && pf->depth <= pf->bpp &&
+           rfb_channel_valid(pf->red_max, pf->red_shift, pf->bpp) &&
+           rfb_channel_valid(pf->green_max, pf->green_shift, pf->bpp) &&
+           rfb_channel_valid(pf->blue_max, pf->blue_shift, pf->bpp);
+}
+
+static void rfb_client_set_format(RfbClient *c, const RfbPixelFormat *pf)
+{
+    uint32_t mask = ((uint32_t)pf->red_max << pf->red_shift) |
+                    ((uint32_t)pf->green_max << pf->green_shift) |
+                    ((uint32_t)pf->blue_max << pf->blue_shift);
+
+    c->pf = *pf;
+    c->native = pf->bpp == 32 && !pf->big_endian &&
+                pf->red_max == 255 && pf->green_max == 255 && pf->blue_max == 255 &&
+                pf->red_shift == 16 && pf->green_shift == 8 && pf->blue_shift == 0;
+
+    /* ZRLE drops the unused byte of 32-bit pixels whose colour fits in three bytes */
+    c->cpixel_offset = 0;
+    c->cpixel_size = pf->bpp / 8;
+    if (pf->bpp == 32 && pf->depth <= 24) {
+        if (mask <= 0xffffff) {
+            c->cpixel_offset = pf->big_endian ? 1 : 0;
+            c->cpixel_size = 3;
+        } else if ((mask & 0xff) == 0) {
+            c->cpixel_offset = pf->big_endian ? 0 : 1;
+            c->cpixel_size = 3;
+        }
+    }
+}
+
+static void rfb_put_cpixel(ByteBuffer *b, const RfbClient *c, uint32_t p)
+{
+    unsigned char bytes[4];
+
+    rfb_pixel_bytes(&c->pf, p, bytes);
+    buf_put(b, bytes + c->cpixel_offset, (size_t)c->cpixel_size);
+}
+
+static void rfb_rect_header(ByteBuffer *b, Rect r, int32_t encoding)
+{
+    buf_u16(b, (unsigned int)r.x);
+    buf_u16(b, (unsigned int)r.y);
+    buf_u16(b, (unsigned int)r.w);
+    buf_u16(b, (unsigned int)r.h);
+    buf_u32(b, (uint32_t)encoding);
+}
+
+static void rfb_encode_raw(ByteBuffer *b, const RfbClient *c, const Surface *s, Rect r)
+{
+    size_t bpp = c->pf.bpp / 8;
+
+    rfb_rect_header(b, r, RFB_ENCODING_RAW);
+    if (buf_reserve(b, (size_t)r.w * r.h * bpp) != 0)
+        return;
+    for (int y = r.y; y < r.y + r.h; y++) {
+        const uint32_t *src = surface_row(s, (unsigned int)y) + r.x;
+        unsigned char *dst = b->data + b->len;
+
+        if (c->native) {
+            memcpy(dst, src, (size_t)r.w * 4);
+        } else {
+            for (int x = 0; x < r.w; x++)
+                rfb_pixel_bytes(&c->pf, src[x], dst + (size_t)x * bpp);
+        }
+        b->len += (size_t)r.w * bpp;
+    }
+}
+
+/*
+ * RRE: a background colour plus solid subrectangles. Horizontal runs of
+ * one colour become subrectangles, and a run identical to one directly
+ * above it extends that subrectangle downwards, so solid bars and blocks
+ * cost one subrectangle each. Falls back to Raw when the content is too
+ * busy for RRE to pay off.
+ */
+static void rfb_encode_rre(ByteBuffer *b, const RfbClient *c, const Surface *s, Rect r)
+{
+    size_t bpp = c->pf.bpp / 8;
+    size_t record = bpp + 8;
+    size_t max_subrects = (size_t)r.w * r.h * bpp / record;
+    uint32_t bg = surface_row(s, (unsigned int)r.y)[r.x];
+    size_t header = b->len;
+    size_t count = 0;
+    /* Subrectangles ending on the previous row and on this row, sorted by x */
+    size_t *open = malloc(2 * (size_t)r.w * sizeof(size_t));
+    size_t *prev = open, *cur = open ? open + r.w : NULL;
+    size_t n_prev = 0;
+    unsigned char pixel[4];
+
+    if (!open) {
+        rfb_encode_raw(b, c, s, r);
+        return;
+    }
+
+    rfb_rect_header(b, r, RFB_ENCODING_RRE);
+    buf_u32(b, 0);  /* Subrectangle count, patched below */
+    rfb_pixel_bytes(&c->pf, bg, pixel);
+    buf_put(b, pixel, bpp);
+    size_t first = b->len;
+
+    for (int y = 0; y < r.h && count <= max_subrects && !b->failed; y++) {
+        const uint32_t *row = surface_row(s, (unsigned int)(r.y + y)) + r.x;
+        size_t n_cur = 0, scan = 0;
+
+        for (int x = 0; x < r.w;) {
+            uint32_t p = row[x];
+            int end = x + 1;
+
+            while (end < r.w && row[end] == p)
+                end++;
+            if (p != bg) {
+                unsigned char *sr = NULL;
+
+                rfb_pixel_bytes(&c->pf, p, pixel);
+                while (scan < n_prev && rd_u16(b->data + first + prev[scan] * record + bpp) < x)
+                    scan++;
+                if (scan < n_prev) {
+                    sr = b->data + first + prev[scan] * record;
+                    if (rd_u16(sr + bpp) != x || rd_u16(sr + bpp + 4) != end - x ||
+                        memcmp(sr, pixel, bpp) != 0)
+                        sr = NULL;
+                }
+                if (sr) {
+                    uint16_t h = (uint16_t)(rd_u16(sr + bpp + 6) + 1);
+                    sr[bpp + 6] = (unsigned char)(h >> 8);
+                    sr[bpp + 7] = (unsigned char)h;
+                    cur[n_cur++] = prev[scan++];
+                } else {
+                    buf_put(b, pixel, bpp);
+                    buf_u16(b, (unsigned int)x);
+                    buf_u16(b, (unsigned int)y);
+                    buf_u16(b, (unsigned int)(end - x));
+                    buf_u16(b, 1);
+                    cur[n_cur++] = count++;
+                }
+            }
+            x = end;
+        }
+
+        size_t *t = prev;
+        prev = cur;
+        cur = t;
+        n_prev = n_cur;
+    }
+    free(open);
+
+    if (count > max_subrects || b->failed) {
+        b->len = header;
+        rfb_encode_raw(b, c, s, r);
+        return;
+    }
+    b->data[header + 12] = (unsigned char)(count >> 24);
+    b->data[header + 13] = (unsigned char)(count >> 16);
+    b->data[header + 14] = (unsigned char)(count >> 8);
+    b->data[header + 15] = (unsigned char)count;
+}
+
+/*
+ * Function: zlib_stored
+ *
+ * Appends data as a chunk of a zlib stream made of uncompressed (stored)
+ * deflate blocks. Blocks are never marked final, so one stream can run
+ * for the whole connection as ZRLE requires, and each chunk ends on a
+ * block boundary the viewer can inflate up to. The palette and run-length
+ * tile encodings of ZRLE do the actual compression; this keeps the server
+ * free of a zlib dependency and its per-rectangle deflate cost.
+ */
+static void zlib_stored(ByteBuffer *b, const unsigned char *data, size_t len, int *started)
+{
+    size_t blocks = (len + 65534) / 65535;
+    size_t total = (*started ? 0 : 2) + blocks * 5 + len;
+
+    buf_u32(b, (uint32_t)total);
+    if (!*started) {
+        buf_u8(b, 0x78);  /* CMF: deflate, 32K window */
+        buf_u8(b, 0x01);  /* FLG: no dictionary, fastest; (CMF * 256 + FLG) % 31 == 0 */
+        *started = 1;
+    }
+    while (len > 0) {
+        size_t n = len < 65535 ? len : 65535;
+        unsigned char hdr[5] = { 0x00, (unsigned char)n, (unsigned char)(n >> 8),
+                                 (unsigned char)~n, (unsigned char)(~n >> 8) };
+        buf_put(b, hdr, 5);
+        buf_put(b, data, n);
+        data += n;
+        len -= n;
+    }
+}
+
+static void rfb_zrle_length(ByteBuffer *z, size_t run)
+{
+    for (run--; run >= 255; run -= 255)
+        buf_u8(z, 255);
+    buf_u8(z, (unsigned int)run);
+}
+
+/*
+ * Function: rfb_zrle_tile
+ *
+ * Encodes one ZRLE tile (at most 64x64) using whichever sub-encoding is
+ * smallest for its contents: solid, packed palette, palette RLE, plain
+ * RLE or raw.
+ */
+static void rfb_zrle_tile(ByteBuffer *z, const RfbClient *c, const Surface *s, Rect t)
+{
+    uint32_t palette[127];
+    unsigned char index[RFB_ZRLE_TILE * RFB_ZRLE_TILE];
+    int n = 0;
+    int last = 0;
+    size_t runs = 0, rle_bytes = 0, pal_rle_bytes = 0;
+    size_t run = 0;
+    uint32_t run_pixel = 0;
+    size_t cp = (size_t)c->cpixel_size;
+    size_t npix = (size_t)t.w * t.h;
+
+    for (int y = 0; y < t.h; y++) {
+        const uint32_t *row = surface_row(s, (unsigned int)(t.y + y)) + t.x;
+
+        for (int x = 0; x < t.w; x++) {
+            uint32_t p = row[x];
+
+            if (n <= 127) {
+                if (n == 0 || palette[last] != p) {
+                    int i = 0;
+                    while (i < n && palette[i] != p)
+                        i++;
+                    if (i == n) {
+                        if (n < 127)
+                            palette[i] = p;
+                        n++;
+                    }
+                    last = i;
+                }
+                index[y * t.w + x] = (unsigned char)last;
+            }
+            if (run > 0 && p == run_pixel) {
+                run++;
+                continue;
+            }
+            if (run > 0) {
+                runs++;
+                rle_bytes += (run - 1) / 255 + 1;
+                pal_rle_bytes += run == 1 ? 1 : 1 + (run - 1) / 255 + 1;
+            }
+            run_pixel = p;
+            run = 1;
+        }
+    }
+    runs++;
+    rle_bytes += (run - 1) / 255 + 1;
+    pal_rle_bytes += run == 1 ? 1 : 1 + (run - 1) / 255 + 1;
+
+    if (n == 1) {
+        buf_u8(z, 1);
+        rfb_put_cpixel(z, c, palette[0]);
+        return;
+    }
+
+    int bits = n <= 2 ? 1 : n <= 4 ? 2 : 4;
+    size_t raw = npix * cp;
+    size_t plain_rle = runs * cp + rle_bytes;
+    size_t packed = n <= 16 ? n * cp + (size_t)t.h * (((size_t)t.w * bits + 7) / 8) : SIZE_MAX;
+    size_t pal_rle = n <= 127 ? n * cp + pal_rle_bytes : SIZE_MAX;
+    size_t best = raw;
+
+    if (plain_rle < best)
+        best = plain_rle;
+    if (packed < best)
+        best = packed;
+    if (pal_rle < best)
+        best = pal_rle;
+
+    if (best == packed) {
+        buf_u8(z, (unsigned int)n);
+        for (int i = 0; i < n; i++)
+            rfb_put_cpixel(z, c, palette[i]);
+        for (int y = 0; y < t.h; y++) {
+            unsigned int acc = 0, used = 0;
+            for (int x = 0; x < t.w; x++) {
+                acc = (acc << bits) | index[y * t.w + x];
+                used += bits;
+                if (used == 8) {
+                    buf_u8(z, acc);
+                    acc = used = 0;
+                }
+            }
+            if (used)
+                buf_u8(z, acc << (8 - used));
+        }
+    } else if (best == pal_rle || best == plain_rle) {
+        int use_palette = best == pal_rle;
+
+        buf_u8(z, use_palette ? 128 + (unsigned int)n : 128);
+        if (use_palette)
+            for (int i = 0; i < n; i++)
+                rfb_put_cpixel(z, c, palette[i]);
+        for (size_t i = 0; i < npix;) {
+            const uint32_t p = surface_row(s, (unsigned int)(t.y + i / t.w))[t.x + i % t.w];
+            size_t end = i + 1;
+
+            while (end < npix && surface_row(s, (unsigned int)(t.y + end / t.w))[t.x + end % t.w] == p)
+                end++;
+            if (!use_palette) {
+                rfb_put_cpixel(z, c, p);
+                rfb_zrle_length(z, end - i);
+            } else if (end - i == 1) {
+                buf_u8(z, index[i]);
+            } else {
+                buf_u8(z, index[i] | 128u);
+                rfb_zrle_length(z, end - i);
+            }
+            i = end;
+        }
+    } else {
+        buf_u8(z, 0);
+        for (int y = 0; y < t.h; y++) {
+            const uint32_t *row = surface_row(s, (unsigned int)(t.y + y)) + t.x;
+            for (int x = 0; x < t.w; x++)
+                rfb_put_cpixel(z, c, row[x]);
+        }
+    }
+}
+
+static void rfb_encode_zrle(ByteBuffer *b, ByteBuffer *z, RfbClient *c, const Surface *s, Rect r)
+{
+    z->len = 0;
+    for (int ty = r.y; ty < r.y + r.h; ty += RFB_ZRLE_TILE) {
+        for (int tx = r.x; tx < r.x + r.w; tx += RFB_ZRLE_TILE) {
+            Rect t = { tx, ty, RFB_ZRLE_TILE, RFB_ZRLE_TILE };
+            if (t.x + t.w > r.x + r.w)
+                t.w = r.x + r.w - t.x;
+            if (t.y + t.h > r.y + r.h)
+                t.h = r.y + r.h - t.y;
+            rfb_zrle_tile(z, c, s, t);
+        }
+    }
+    if (z->failed) {
+        b->failed = 1;
+        return;
+    }
+    rfb_rect_header(b, r, RFB_ENCODING_ZRLE);
+    zlib_stored(b, z->data, z->len, &c->zlib_started);
+}
+
+/*
+ * Function: rfb_client_try_update
+ *
+ * Sends a FramebufferUpdate if the viewer asked for one, everything sent
+ * earlier has drained to the socket, and some tile in the requested area
+ * changed. Dirty tiles are grouped into horizontal runs per tile row.
+ * Tiles only partly inside the requested area are sent in part and then
+ * considered clean; viewers request the whole screen in practice.
+ */
+static void rfb_client_try_update(RfbServer *srv, RfbClient *c)
+{
+    Rect *rects = srv->update_rects;
+    int count = 0;
+
+    if (c->state != RFB_STATE_NORMAL || !c->update_requested || c->out.pos < c->out.len)
+        return;
+
+    Rect req = c->requested;
+    unsigned int tx0 = (unsigned int)req.x / TILE_SIZE, tx1 = (unsigned int)(req.x + req.w - 1) / TILE_SIZE;
+    unsigned int ty0 = (unsigned int)req.y / TILE_SIZE, ty1 = (unsigned int)(req.y + req.h - 1) / TILE_SIZE;
+
+    for (unsigned int ty = ty0; ty <= ty1; ty++) {
+        unsigned char *dirty = c->dirty + (size_t)ty * srv->cols;
+
+        for (unsigned int tx = tx0; tx <= tx1; tx++) {
+            if (!dirty[tx])
+                continue;
+            unsigned int end = tx;
+            while (end <= tx1 && dirty[end])
+                dirty[end++] = 0;
+            Rect run = { (int)(tx * TILE_SIZE), (int)(ty * TILE_SIZE),
+                         (int)((end - tx) * TILE_SIZE), TILE_SIZE };
+            if (rect_clip(&run, req))
+                rects[count++] = run;
+            tx = end;
+        }
+    }
+    if (count == 0)
+        return;
+
+    uint64_t start = now_ns();
+    c->update_requested = 0;
+    c->out.len = c->out.pos = 0;
+    buf_u8(&c->out, 0);   /* FramebufferUpdate */
+    buf_u8(&c->out, 0);   /* Padding */
+    buf_u16(&c->out, (unsigned int)count);
+    for (int i = 0; i < count; i++) {
+        if (c->encoding == RFB_ENCODING_ZRLE)
+            rfb_encode_zrle(&c->out, &srv->scratch, c, &srv->frame, rects[i]);
+        else if (c->encoding == RFB_ENCODING_RRE)
+            rfb_encode_rre(&c->out, c, &srv->frame, rects[i]);
+        else
+            rfb_encode_raw(&c->out, c, &srv->frame, rects[i]);
+    }
+    telemetry_record(srv->telemetry, now_ns() - start, 0);
+    telemetry_add_bytes(srv->telemetry, c->out.len);
+}
+
+/* Handles complete messages in the client's input buffer; returns -1 to drop it */
+static int rfb_client_process(RfbServer *srv, RfbClient *c)
+{
+    size_t used = 0;
+
+    for (;;) {
+        const unsigned char *m = c->in + used;
+        size_t avail = c->in_len - used;
+        size_t need;
+
+        if (c->discard > 0) {
+            size_t n = avail < c->discard ? avail : c->discard;
+            c->discard -= n;
+            used += n;
+            if (c->discard > 0)
+                break;
+            continue;
+        }
+
+        if (c->state == RFB_STATE_VERSION) {
+            if (avail < 12)
+                break;
+            if (memcmp(m, "RFB 003.", 8) != 0)
+                return -1;
+            c->minor = (m[8] - '0') * 100 + (m[9] - '0') * 10 + (m[10] - '0');
+            if (c->minor >= 8) {
+                c->minor = 8;
+            } else if (c->minor != 7) {
+                c->minor = 3;
+            }
+            if (c->minor == 3) {
+                buf_u32(&c->out, 1);   /* Security type None, server's choice */
+                c->state = RFB_STATE_CLIENT_INIT;
+            } else {
+                buf_u8(&c->out, 1);    /* One security type offered ... */
+                buf_u8(&c->out, 1);    /* ... None */
+                c->state = RFB_STATE_SECURITY;
+            }
+            used += 12;
+        } else if (c->state == RFB_STATE_SECURITY) {
+            if (avail < 1)
+                break;
+            if (m[0] != 1)
+                return -1;
+            if (c->minor == 8)
+                buf_u32(&c->out, 0);   /* SecurityResult: OK */
+            c->state = RFB_STATE_CLIENT_INIT;
+            used += 1;
+        } else if (c->state == RFB_STATE_CLIENT_INIT) {
+            static const char name[] = "rainbow";
+            const RfbPixelFormat *pf = &rfb_server_format;
+
+            if (avail < 1)
+                break;
+            buf_u16(&c->out, srv->frame.width);
+            buf_u16(&c->out, srv->frame.height);
+            buf_u8(&c->out, pf->bpp);
+            buf_u8(&c->out, pf->depth);
+            buf_u8(&c->out, pf->big_endian);
+            buf_u8(&c->out, pf->true_colour);
+            buf_u16(&c->out, pf->red_max);
+            buf_u16(&c->out, pf->green_max);
+            buf_u16(&c->out, pf->blue_max);
+            buf_u8(&c->out, pf->red_shift);
+            buf_u8(&c->out, pf->green_shift);
+            buf_u8(&c->out, pf->blue_shift);
+            buf_put(&c->out, "\0\0\0", 3);
+            buf_u32(&c->out, sizeof(name) - 1);
+            buf_put(&c->out, name, sizeof(name) - 1);
+            c->state = RFB_STATE_NORMAL;
+            used += 1;
+        } else {
+            if (avail < 1)
+                break;
+            switch (m[0]) {
+            case 0:   /* SetPixelFormat */
+                if (avail < 20)
+                    goto incomplete;
+                {
+                    RfbPixelFormat pf = {
+                        m[4], m[5], m[6], m[7], rd_u16(m + 8), rd_u16(m + 10), rd_u16(m + 12),
+                        m[14], m[15], m[16]
+                    };
+                    if (!rfb_format_valid(&pf)) {
+                        fprintf(stderr, "rfb: viewer requested an unsupported pixel format\n");
+                        return -1;
+                    }
+                    rfb_client_set_format(c, &pf);
+                }
+                used += 20;
+                break;
+            case 2:   /* SetEncodings */
+                if (avail < 4)
+                    goto incomplete;
+                need = 4 + 4 * (size_t)rd_u16(m + 2);
+                if (need > sizeof(c->in))
+                    return -1;
+                if (avail < need)
+                    goto incomplete;
+                c->encoding = RFB_ENCODING_RAW;
+                for (size_t i = 4; i < need; i += 4) {
+                    int32_t e = (int32_t)rd_u32(m + i);
+                    if (e == RFB_ENCODING_ZRLE || e == RFB_ENCODING_RRE || e == RFB_ENCODING_RAW) {
+                        c->encoding = e;   /* Viewers list encodings in order of preference */
+                        break;
+                    }
+                }
+                used += need;
+                break;
+            case 3:   /* FramebufferUpdateRequest */
+                if (avail < 10)
+                    goto incomplete;
+                {
+                    Rect req = { rd_u16(m + 2), rd_u16(m + 4), rd_u16(m + 6), rd_u16(m + 8) };
+                    Rect all = { 0, 0, (int)srv->frame.width, (int)srv->frame.height };
+
+                    if (rect_clip(&req, all)) {
+                        c->requested = req;
+                        c->update_requested = 1;
+                        if (!m[1]) {
+                            /* Non-incremental: resend everything in the area */
+                            for (unsigned int ty = (unsigned int)req.y / TILE_SIZE;
+                                 ty <= (unsigned int)(req.y + req.h - 1) / TILE_SIZE; ty++)
+                                for (unsigned int tx = (unsigned int)req.x / TILE_SIZE;
+                                     tx <= (unsigned int)(req.x + req.w - 1) / TILE_SIZE; tx++)
+                                    c->dirty[(size_t)ty * srv->cols + tx] = 1;
+                        }
+                    }
+                }
+                used += 10;
+                break;
+            case 4:   /* KeyEvent: the display is view-only */
+                if (avail < 8)
+                    goto incomplete;
+                used += 8;
+                break;
+            case 5:   /* PointerEvent */
+                if (avail < 6)
+                    goto incomplete;
+                used += 6;
+                break;
+            case 6:   /* ClientCutText */
+                if (avail < 8)
+                    goto incomplete;
+                c->discard = rd_u32(m + 4);
+                used += 8;
+                break;
+            default:
+                fprintf(stderr, "rfb: unknown message type %d from viewer\n", m[0]);
+                return -1;
+            }
+        }
+    }
+incomplete:
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    return c->out.failed ? -1 : 0;
+}
+
+static void rfb_client_drop(RfbServer *srv, int slot)
+{
+    RfbClient *c = srv->clients[slot];
+
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    buf_free(&c->out);
+    free(c->dirty);
+    free(c);
+    srv->clients[slot] = NULL;
+}
+
+/* Writes pending output; returns -1 if the connection is dead */
+static int rfb_client_flush(RfbServer *srv, RfbClient *c, int slot)
+{
+    while (c->out.pos < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->out.pos, c->out.len - c->out.pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        c->out.pos += (size_t)n;
+    }
+    if (c->out.pos == c->out.len)
+        c->out.pos = c->out.len = 0;
+
+    /* Only ask for writability while there is a backlog */
+    int want = c->out.len > 0;
+    if (want != c->want_write) {
+        struct epoll_event ev = { EPOLLIN | (want ? EPOLLOUT : 0), { .u64 = 2 + (uint64_t)slot } };
+        epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = want;
+    }
+    return 0;
+}
+
+static void rfb_accept(RfbServer *srv)
+{
+    for (;;) {
+        int fd = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+
+        int slot = 0;
+        while (slot < RFB_MAX_CLIENTS && srv->clients[slot])
+            slot++;
+        RfbClient *c = slot < RFB_MAX_CLIENTS ? calloc(1, sizeof(*c)) : NULL;
+        if (c)
+            c->dirty = malloc((size_t)srv->cols * srv->rows);
+        if (!c || !c->dirty) {
+            if (c)
+                free(c);
+            close(fd);
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->fd = fd;
+        c->state = RFB_STATE_VERSION;
+        c->encoding = RFB_ENCODING_RAW;
+        memset(c->dirty, 1, (size_t)srv->cols * srv->rows);
+        rfb_client_set_format(c, &rfb_server_format);
+        srv->clients[slot] = c;
+
+        struct epoll_event ev = { EPOLLIN, { .u64 = 2 + (uint64_t)slot } };
+        epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        buf_put(&c->out, "RFB 003.008\n", 12);
+        if (rfb_client_flush(srv, c, slot) != 0)
+            rfb_client_drop(srv, slot);
+    }
+}
+
+/*
+ * Copies the tiles the renderer published since the last pickup into the
+ * server's private frame and marks them dirty for every viewer.
+ * Returns 1 if the server is being stopped.
+ */
+static int rfb_pickup(RfbServer *srv)
+{
+    uint64_t count;
+    ssize_t ignored = read(srv->wake_fd, &count, sizeof(count));
+    (void)ignored;
+
+    pthread_mutex_lock(&srv->lock);
+    if (srv->stopping) {
+        pthread_mutex_unlock(&srv->lock);
+        return 1;
+    }
+    for (unsigned int ty = 0; ty < srv->rows; ty++) {
+        for (unsigned int tx = 0; tx < srv->cols; tx++) {
+            size_t t = (size_t)ty * srv->cols + tx;
+            if (!srv->staged[t])
+                continue;
+            srv->staged[t] = 0;
+
+            Rect r = { (int)(tx * TILE_SIZE), (int)(ty * TILE_SIZE), TILE_SIZE, TILE_SIZE };
+            Rect all = { 0, 0, (int)srv->frame.width, (int)srv->frame.height };
+            rect_clip(&r, all);
+            for (int y = r.y; y < r.y + r.h; y++)
+                memcpy(surface_row(&srv->frame, (unsigned int)y) + r.x,
+                       surface_row(&srv->staging, (unsigned int)y) + r.x, (size_t)r.w * 4);
+            for (int i = 0; i < RFB_MAX_CLIENTS; i++)
+                if (srv->clients[i])
+                    srv->clients[i]->dirty[t] = 1;
+        }
+    }
+    pthread_mutex_unlock(&srv->lock);
+    return 0;
+}
+
+static void *rfb_thread(void *arg)
+{
+    RfbServer *srv = arg;
+    struct epoll_event events[16];
+
+    srv->telemetry = telemetry_register("rfb encode");
+
+    for (;;) {
+        int n = epoll_wait(srv->epoll_fd, events, 16, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("rfb: epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            uint64_t tag = events[i].data.u64;
+
+            if (tag == 0) {
+                rfb_accept(srv);
+            } else if (tag == 1) {
+                if (rfb_pickup(srv))
+                    return NULL;
+            } else {
+                int slot = (int)(tag - 2);
+                RfbClient *c = srv->clients[slot];
+                int dead = 0;
+
+                if (!c)
+                    continue;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    for (;;) {
+                        ssize_t got = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+                        if (got > 0) {
+                            c->in_len += (size_t)got;
+                            if (rfb_client_process(srv, c) != 0) {
+                                dead = 1;
+                                break;
+                            }
+                            continue;
+                        }
+                        if (got < 0 && errno == EINTR)
+                            continue;
+                        if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                            dead = 1;
+                        break;
+                    }
+                }
+                if (!dead)
+                    rfb_client_try_update(srv, c);
+                if (dead || c->out.failed || rfb_client_flush(srv, c, slot) != 0)
+                    rfb_client_drop(srv, slot);
+            }
+        }
+
+        /* New tiles or drained sockets may let waiting viewers make progress */
+        for (int slot = 0; slot < RFB_MAX_CLIENTS; slot++) {
+            RfbClient *c = srv->clients[slot];
+            if (!c)
+                continue;
+            rfb_client_try_update(srv, c);
+            if (c->out.failed || rfb_client_flush(srv, c, slot) != 0)
+                rfb_client_drop(srv, slot);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: rfb_server_start
+ *
+ * Starts serving a surface of the given size on addr:port.
+ *
+ * Returns: 0 on success, -1 on failure (after printing the reason)
+ */
+int rfb_server_start(RfbServer *srv, const char *addr, int port,
+                     unsigned int width, unsigned int height)
+{
+    struct sockaddr_in sa;
+    int one = 1;
+
+    memset(srv, 0, sizeof(*srv));
+    srv->listen_fd = srv->epoll_fd = srv->wake_fd = -1;
+    srv->cols = (width + TILE_SIZE - 1) / TILE_SIZE;
+    srv->rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+        fprintf(stderr, "rfb: invalid listen address '%s'\n", addr);
+        return -1;
+    }
+
+    if (width > 65535 || height > 65535 ||
+        surface_create(&srv->staging, width, height) != 0 ||
+        surface_create(&srv->frame, width, height) != 0 ||
+        !(srv->staged = calloc((size_t)srv->cols * srv->rows, 1)) ||
+        !(srv->update_rects = malloc((size_t)srv->cols * srv->rows * sizeof(Rect)))) {
+        fprintf(stderr, "rfb: failed to allocate server state\n");
+        goto fail;
+    }
+
+    srv->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (srv->listen_fd < 0 ||
+        setsockopt(srv->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(srv->listen_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+        listen(srv->listen_fd, 8) != 0) {
+        perror("rfb: listen");
+        goto fail;
+    }
+
+    srv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    srv->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (srv->epoll_fd < 0 || srv->wake_fd < 0) {
+        perror("rfb: epoll/eventfd");
+        goto fail;
+    }
+    struct epoll_event ev_listen = { EPOLLIN, { .u64 = 0 } };
+    struct epoll_event ev_wake = { EPOLLIN, { .u64 = 1 } };
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->listen_fd, &ev_listen);
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->wake_fd, &ev_wake);
+
+    pthread_mutex_init(&srv->lock, NULL);
+    if (pthread_create(&srv->thread, NULL, rfb_thread, srv) != 0) {
+        fprintf(stderr, "rfb: failed to start server thread\n");
+        pthread_mutex_destroy(&srv->lock);
+        goto fail;
+    }
+    printf("RFB server listening on %s:%d\n", addr, port);
+    return 0;
+
+fail:
+    if (srv->listen_fd >= 0)
+        close(srv->listen_fd);
+    if (srv->epoll_fd >= 0)
+        close(srv->epoll_fd);
+    if (srv->wake_fd >= 0)
+        close(srv->wake_fd);
+    free(srv->staged);
+    free(srv->update_rects);
+    surface_destroy(&srv->staging);
+    surface_destroy(&srv->frame);
+    return -1;
+}
+
+/*
+ * Function: rfb_server_publish
+ *
+ * Hands the damaged regions of a freshly rendered surface to the server,
+ * reading rows through src (NULL for the bare surface). This only copies
+ * pixels into the staging surface; viewers are updated asynchronously on
+ * the server thread.
+ */
+void rfb_server_publish(RfbServer *srv, const Surface *s, const Damage *d, const RowSource *src)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&srv->lock);
+    for (int i = 0; i < d->count; i++) {
+        Rect r = d->rects[i];
+
+        for (int y = r.y; y < r.y + r.h; y++)
+            memcpy(surface_row(&srv->staging, (unsigned int)y) + r.x,
+                   source_row(src, s, y, r.x, r.w), (size_t)r.w * 4);
+        for (unsigned int ty = (unsigned int)r.y / TILE_SIZE;
+             ty <= (unsigned int)(r.y + r.h - 1) / TILE_SIZE; ty++)
+            for (unsigned int tx = (unsigned int)r.x / TILE_SIZE;
+                 tx <= (unsigned int)(r.x + r.w - 1) / TILE_SIZE; tx++)
+                srv->staged[(size_t)ty * srv->cols + tx] = 1;
+    }
+    pthread_mutex_unlock(&srv->lock);
+
+    ssize_t ignored = write(srv->wake_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+void rfb_server_stop(RfbServer *srv)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&srv->lock);
+    srv->stopping = 1;
+    pthread_mutex_unlock(&srv->lock);
+    ssize_t ignored = write(srv->wake_fd, &one, sizeof(one));
+    (void)ignored;
+    pthread_join(srv->thread, NULL);
+
+    for (int i = 0; i < RFB_MAX_CLIENTS; i++)
+        if (srv->clients[i])
+            rfb_client_drop(srv, i);
+    close(srv->listen_fd);
+    close(srv->epoll_fd);
+    close(srv->wake_fd);
+    pthread_mutex_destroy(&srv->lock);
+    free(srv->staged);
+    free(srv->update_rects);
+    buf_free(&srv->scratch);
+    surface_destroy(&srv->staging);
+    surface_destroy(&srv->frame);
+}
+
+/*
+ * ============================================================================
+ * PRESENT PIPELINE
+ * ============================================================================
+ *
+ * By default a frame is rendered and then written out before the next
+ * one is started, so the render thread also pays for pixel conversion,
+ * frame buffer writes and any wait for the display. With --present fifo
+ * or mailbox a present thread does that part, and the render thread
+ * moves on to the next frame as soon as it has handed one over.
+ *
+ * The hand-over is a triple buffer: three screen-sized buffers, one
+ * being filled by the render thread (back), one going to the screen
+ * (front) and one in between (pending). Each thread swaps its buffer
+ * with pending using atomic operations only, and a flag bit in pending
+ * says whether it holds a frame the present thread has not taken yet.
+ * The present thread waits for vertical blank before writing a frame
+ * (where the driver has FBIO_WAITFORVSYNC), so that wait overlaps with
+ * rendering as well.
+ *
+ * The policies differ in what happens when a frame is finished while
+ * the one before it is still pending. FIFO leaves it in the shadow
+ * surface and renders nothing more until the present thread has taken
+ * the pending frame, so every frame handed over is shown. Mailbox takes
+ * the pending frame back and puts the newer one in its place: the
+ * render thread never waits and each vertical blank shows the newest
+ * frame, but some frames are never shown.
+ *
+ * Only damage is copied into a buffer. Each buffer keeps track of what
+ * the frames put into the other two changed since it was last filled,
+ * and that is copied along with the new damage, so a buffer always
+ * holds a whole picture when it is handed over. A frame taken back
+ * passes its damage on to the one that replaces it. Layers are blended
+ * in while copying, so the present thread only converts and writes.
+ */
+
+#define PRESENT_BUFFERS 3
+#define PRESENT_FRESH 4         /* In pending: the buffer holds a frame not taken yet */
+
+/* --present policies */
+enum { PRESENT_SYNC, PRESENT_FIFO, PRESENT_MAILBOX };
+
+static const char *const present_names[] = { "sync", "fifo", "mailbox" };
+
+typedef struct {
+    Surface pixels;
+    Damage damage;              /* Changed since the frame shown before this one */
+    Damage stale;               /* Render thread only: changed since this buffer was last filled */
+} PresentBuffer;
+
+typedef struct {
+    int policy;                 /* PRESENT_* */
+    int started;
+    PresentBuffer buffers[PRESENT_BUFFERS];
+    int back;                   /* Owned by the render thread */
+    int front;                  /* Owned by the present thread */
+    _Alignas(64) atomic_int pending;   /* The third buffer, | PRESENT_FRESH while it holds a new frame */
+    atomic_int stopping;
+    int ready_fd;               /* eventfd: a frame was handed over, or stopping was set */
+    int release_fd;             /* eventfd, FIFO only: the pending frame was taken */
+    FrameBuffer *fb;            /* Outputs, NULL when not used */
+    Wall *wall;
+    RfbServer *rfb;
+    int vsync;                  /* The display can wait for vertical blank */
+    TelemetrySlot *telemetry;
+    pthread_t thread;
+    atomic_uint_fast64_t shown; /* Written by the present thread */
+    atomic_uint_fast64_t bytes;
+    uint64_t replaced;          /* Render thread: frames taken back before they were shown */
+    uint64_t ticks_held;        /* Render thread: ticks skipped while a FIFO frame was waiting */
+} Presenter;
+
+/* Waits for the next vertical blank of the display; -1 if it cannot tell */
+static int present_wait_vsync(const Presenter *p)
+{
+    const FrameBuffer *fb = p->fb ? p->fb : p->wall ? &p->wall->panels[0].fb : NULL;
+    uint32_t crtc = 0;
+
+    return fb ? ioctl(fb->fd, FBIO_WAITFORVSYNC, &crtc) : -1;
+}
+
+static void *present_main(void *arg)
+{
+    Presenter *p = arg;
+    uint64_t one = 1, n;
+
+    while (read(p->ready_fd, &n, sizeof(n)) == sizeof(n) || errno == EINTR) {
+        if (atomic_load(&p->stopping))
+            break;
+
+        /* Only a fresh frame is taken: the render thread may just have taken it back */
+        int got = atomic_load_explicit(&p->pending, memory_order_acquire);
+        while ((got & PRESENT_FRESH) &&
+               !atomic_compare_exchange_weak_explicit(&p->pending, &got, p->front,
+                                                      memory_order_acq_rel, memory_order_acquire))
+            ;
+        if (!(got & PRESENT_FRESH))
+            continue;
+        p->front = got & ~PRESENT_FRESH;
+        if (p->policy == PRESENT_FIFO) {
+            ssize_t ignored = write(p->release_fd, &one, sizeof(one));
+            (void)ignored;
+        }
+
+        PresentBuffer *b = &p->buffers[p->front];
+        Damage d = b->damage;   /* The flushes clear what they are given */
+        size_t written = 0;
+
+        if (p->vsync)
+            present_wait_vsync(p);
+        uint64_t start = now_ns();
+        if (p->fb)
+            written = fb_flush(p->fb, &b->pixels, &d, NULL);
+        else if (p->wall)
+            written = wall_flush(p->wall, &b->pixels, &d, NULL);
+        if (p->rfb)
+            rfb_server_publish(p->rfb, &b->pixels, &b->damage, NULL);
+        telemetry_record(p->telemetry, now_ns() - start, 0);
+        telemetry_add_bytes(p->telemetry, written);
+        counter_add(&p->bytes, written);
+        counter_add(&p->shown, 1);
+    }
+    return NULL;
+}
+
+static void present_free(Presenter *p)
+{
+    for (int i = 0; i < PRESENT_BUFFERS; i++)
+        surface_destroy(&p->buffers[i].pixels);
+    if (p->ready_fd >= 0)
+        close(p->ready_fd);
+    if (p->release_fd >= 0)
+        close(p->release_fd);
+}
+
+/*
+ * Function: present_start
+ *
+ * Sets up the buffers for frames the size of s and starts the present
+ * thread, which writes them to fb or wall and publishes them to rfb
+ * (each NULL when not used) under the given PRESENT_* policy.
+ *
+ * Returns: 0 on success, -1 on failure (after printing the reason)
+ */
+int present_start(Presenter *p, int policy, const Surface *s, FrameBuffer *fb, Wall *wall, RfbServer *rfb)
+{
+    p->policy = policy;
+    p->fb = fb;
+    p->wall = wall;
+    p->rfb = rfb;
+    p->ready_fd = eventfd(0, EFD_CLOEXEC);
+    p->release_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (p->ready_fd < 0 || p->release_fd < 0) {
+        perror("eventfd");
+        goto fail;
+    }
+    for (int i = 0; i < PRESENT_BUFFERS; i++) {
+        PresentBuffer *b = &p->buffers[i];
+        if (surface_create(&b->pixels, s->width, s->height) != 0) {
+            fprintf(stderr, "Failed to allocate present buffers\n");
+            goto fail;
+        }
+        damage_init(&b->damage, &b->pixels);
+        damage_init(&b->stale, &b->pixels);
+    }
+    p->front = 0;
+    atomic_init(&p->pending, 1);
+    p->back = 2;
+    atomic_init(&p->stopping, 0);
+    p->vsync = present_wait_vsync(p) == 0;
+    p->telemetry = telemetry_register("present");
+    if (pthread_create(&p->thread, NULL, present_main, p) != 0) {
+        perror("pthread_create");
+        goto fail;
+    }
+    p->started = 1;
+    return 0;
+
+fail:
+    present_free(p);
+    return -1;
+}
+
+/*
+ * Function: present_queue
+ *
+ * Hands the damaged part of s, read through src, to the present thread
+ * as the next frame and clears d. Under FIFO nothing is handed over
+ * while the frame before is still pending, and d is left as it is.
+ *
+ * Returns: 1 if the frame was handed over, 0 if it has to wait until
+ *          release_fd says the pending frame was taken
+ */
+int present_queue(Presenter *p, const Surface *s, Damage *d, const RowSource *src)
+{
+    int cur = atomic_load_explicit(&p->pending, memory_order_acquire);
+    int taken_back = 0;
+    uint64_t one = 1;
+
+    if (cur & PRESENT_FRESH) {
+        if (p->policy == PRESENT_FIFO)
+            return 0;
+        /* Mailbox: swap the frame back out, unless the present thread gets to it first */
+        if (atomic_compare_exchange_strong_explicit(&p->pending, &cur, p->back,
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            p->back = cur & ~PRESENT_FRESH;
+            p->replaced++;
+            taken_back = 1;
+        }
+    }
+
+    PresentBuffer *b = &p->buffers[p->back];
+    Damage copy = b->stale;
+
+    if (!taken_back)
+        damage_clear(&b->damage);
+    for (int i = 0; i < d->count; i++) {
+        damage_add(&copy, d->rects[i]);
+        damage_add(&b->damage, d->rects[i]);
+        for (int j = 0; j < PRESENT_BUFFERS; j++)
+            if (j != p->back)
+                damage_add(&p->buffers[j].stale, d->rects[i]);
+    }
+    for (int i = 0; i < copy.count; i++) {
+        Rect r = copy.rects[i];
+        for (int y = r.y; y < r.y + r.h; y++)
+            memcpy(surface_row(&b->pixels, (unsigned int)y) + r.x, source_row(src, s, y, r.x, r.w),
+                   (size_t)r.w * 4);
+    }
+    damage_clear(&b->stale);
+
+    /* pending is never fresh here: only this thread makes it so */
+    p->back = atomic_exchange_explicit(&p->pending, p->back | PRESENT_FRESH, memory_order_acq_rel);
+    ssize_t ignored = write(p->ready_fd, &one, sizeof(one));
+    (void)ignored;
+    damage_clear(d);
+    return 1;
+}
+
+/* Stops the present thread, if started, and frees the buffers; a pending frame is dropped */
+void present_stop(Presenter *p)
+{
+    uint64_t one = 1;
+
+    if (!p->started)
+        return;
+    atomic_store(&p->stopping, 1);
+    ssize_t ignored = write(p->ready_fd, &one, sizeof(one));
+    (void)ignored;
+    pthread_join(p->thread, NULL);
+    present_free(p);
+    p->started = 0;
+}
+
+/*
+ * ============================================================================
+ * FRAME RECORDER
+ * ============================================================================
+ *
+ * Produces the frame sequences played by sequence_show(). Each frame is
+ * coded against the previous one: runs of unchanged pixels become SKIP
+ * spans, runs of one colour FILL spans and everything else LITERAL
+ * spans. Short skips and fills inside changed areas are folded into the
+ * surrounding literal, where a new span header would cost more than it
+ * saves.
+ */
+
+#define SEQ_MIN_SKIP 3      /* Unchanged pixels worth ending a literal for */
+#define SEQ_MIN_FILL 4      /* Equal pixels worth a FILL span */
+
+static void buf_le32(ByteBuffer *b, uint32_t v)
+{
+    unsigned char c[4] = { (unsigned char)v, (unsigned char)(v >> 8),
+                           (unsigned char)(v >> 16), (unsigned char)(v >> 24) };
+    buf_put(b, c, 4);
+}
+
+/* Length of the common prefix of a and b, at most n */
+static size_t equal_run(const uint32_t *a, const uint32_t *b, size_t n)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 4 <= n; i += 4) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(a + i)),
+                                     _mm_loadu_si128((const __m128i *)(b + i)));
+        if (_mm_movemask_epi8(eq) != 0xffff)
+            break;
+    }
+#endif
+    while (i < n && a[i] == b[i])
+        i++;
+    return i;
+}
+
+/* Number of pixels from p[0] on that equal p[0], at most n */
+static size_t fill_run(const uint32_t *p, size_t n)
+{
+    size_t i = 1;
+
+#ifdef __SSE2__
+    const __m128i c = _mm_set1_epi32((int)p[0]);
+    for (; i + 4 <= n; i += 4)
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + i)), c)) != 0xffff)
+            break;
+#endif
+    while (i < n && p[i] == p[0])
+        i++;
+    return i;
+}
+
+static void seq_put_span(ByteBuffer *out, int op, size_t count, const uint32_t *pixels)
+{
+    while (count > 0) {
+        size_t n = count < SEQ_MAX_SPAN ? count : SEQ_MAX_SPAN;
+        buf_le32(out, SEQ_SPAN(op, n));
+        if (op == SEQ_FILL)
+            buf_le32(out, pixels[0]);
+        else if (op == SEQ_LITERAL)
+            buf_put(out, pixels, n * 4);   /* Pixels are stored in host order: little-endian only */
+        if (op == SEQ_LITERAL)
+            pixels += n;
+        count -= n;
+    }
+}
+
+/*
+ * Function: sequence_encode
+ *
+ * Appends the spans turning prev into cur (n pixels each, in row order)
+ * to out. With prev NULL the result is a keyframe.
+ */
+void sequence_encode(ByteBuffer *out, const uint32_t *prev, const uint32_t *cur, size_t n)
+{
+    size_t i = 0;
+
+    while (i < n) {
+        size_t run = prev ? equal_run(prev + i, cur + i, n - i) : 0;
+        if (run > 0) {
+            seq_put_span(out, SEQ_SKIP, run, NULL);
+            i += run;
+            continue;
+        }
+        run = fill_run(cur + i, n - i);
+        if (run >= SEQ_MIN_FILL) {
+            seq_put_span(out, SEQ_FILL, run, cur + i);
+            i += run;
+            continue;
+        }
+
+        /* Literal: runs until a skip or fill worth its own span starts */
+        size_t j = i + run;
+        while (j < n) {
+            size_t left = n - j;
+            size_t skip = prev && prev[j] == cur[j] ?
+                          equal_run(prev + j, cur + j, left < SEQ_MIN_SKIP ? left : SEQ_MIN_SKIP) : 0;
+            if (skip == SEQ_MIN_SKIP || skip == left)
+                break;
+            if (j + 1 < n && cur[j + 1] == cur[j] &&
+                fill_run(cur + j, left < SEQ_MIN_FILL ? left : SEQ_MIN_FILL) == SEQ_MIN_FILL)
+                break;
+            j++;
+        }
+        seq_put_span(out, SEQ_LITERAL, j - i, cur + i);
+        i = j;
+    }
+}
+
+typedef struct {
+    FILE *fp;
+    const char *path;
+    uint64_t *index;
+    int frames;                 /* Announced in the header */
+    int written;
+} SequenceWriter;
+
+int sequence_writer_open(SequenceWriter *w, const char *path, int width, int height, int frames, double fps)
+{
+    ByteBuffer hdr;
+
+    memset(w, 0, sizeof(*w));
+    memset(&hdr, 0, sizeof(hdr));
+    w->path = path;
+    w->frames = frames;
+    w->index = calloc((size_t)frames, sizeof(uint64_t));
+    w->fp = fopen(path, "wb");
+    if (!w->index || !w->fp) {
+        fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    buf_put(&hdr, SEQ_MAGIC, 4);
+    buf_le32(&hdr, SEQ_VERSION);
+    buf_le32(&hdr, (uint32_t)width);
+    buf_le32(&hdr, (uint32_t)height);
+    buf_le32(&hdr, (uint32_t)frames);
+    buf_le32(&hdr, (uint32_t)(fps * 1000.0 + 0.5));
+    for (int i = 0; i < frames * 2; i++)
+        buf_le32(&hdr, 0);   /* Index, filled in by sequence_writer_close() */
+    if (hdr.failed || fwrite(hdr.data, 1, hdr.len, w->fp) != hdr.len) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        goto fail;
+    }
+    buf_free(&hdr);
+    return 0;
+
+fail:
+    buf_free(&hdr);
+    if (w->fp)
+        fclose(w->fp);
+    free(w->index);
+    w->fp = NULL;
+    w->index = NULL;
+    return -1;
+}
+
+int sequence_writer_add(SequenceWriter *w, const ByteBuffer *frame, int keyframe)
+{
+    long pos = ftell(w->fp);
+
+    if (frame->failed || w->written == w->frames || pos < 0 ||
+        fwrite(frame->data, 1, frame->len, w->fp) != frame->len) {
+        fprintf(stderr, "Failed to write frame %d to %s\n", w->written, w->path);
+        return -1;
+    }
+    w->index[w->written++] = (uint64_t)pos | (keyframe ? SEQ_KEYFRAME : 0);
+    return 0;
+}
+
+/* Writes the index and closes the file; -1 if anything went wrong on the way */
+int sequence_writer_close(SequenceWriter *w)
+{
+    ByteBuffer idx;
+    int ok = w->written == w->frames;
+
+    memset(&idx, 0, sizeof(idx));
+    for (int i = 0; i < w->written; i++) {
+        buf_le32(&idx, (uint32_t)w->index[i]);
+        buf_le32(&idx, (uint32_t)(w->index[i] >> 32));
+    }
+    ok = ok && !idx.failed && fseek(w->fp, SEQ_HEADER_SIZE, SEEK_SET) == 0 &&
+         fwrite(idx.data, 1, idx.len, w->fp) == idx.len;
+    ok = fclose(w->fp) == 0 && ok;
+    if (!ok)
+        fprintf(stderr, "Failed to finish %s\n", w->path);
+    buf_free(&idx);
+    free(w->index);
+    memset(w, 0, sizeof(*w));
+    return ok ? 0 : -1;
+}
+
+/*
+ * Function: sequence_check
+ *
+ * Round trip of the codec: encodes a small keyframe and two deltas,
+ * decodes them again through sequence_show() and compares each frame
+ * with what went in. Between them the frames hold fills, skips and
+ * literals running on across rows, runs too short for a span of their
+ * own (folded into literals), a change in the very last pixel and a
+ * delta that is one skip over the whole frame.
+ *
+ * Returns: 0 if every frame came back byte-identical, -1 if not
+ */
+#define SEQ_CHECK_W 37
+#define SEQ_CHECK_H 9
+#define SEQ_CHECK_FRAMES 3
+
+int sequence_check(void)
+{
+    enum { W = SEQ_CHECK_W, N = SEQ_CHECK_W * SEQ_CHECK_H };
+    static uint32_t src[SEQ_CHECK_FRAMES][N];
+    ByteBuffer coded[SEQ_CHECK_FRAMES], file;
+    uint64_t offset = SEQ_HEADER_SIZE + SEQ_CHECK_FRAMES * 8;
+    Sequence seq;
+    Surface s;
+    Damage d;
+    int bad = -1, ret = -1;
+
+    /* Keyframe: noise, a fill over two row ends, and a fill too short to keep */
+    for (int i = 0; i < N; i++)
+        src[0][i] = ((uint32_t)i * 2654435761u) & 0x00ffffff;
+    for (int i = 2 * W + 5; i < 4 * W + 20; i++)
+        src[0][i] = 0x336699;
+    for (int i = 10; i < 10 + SEQ_MIN_FILL - 1; i++)
+        src[0][i] = 0x123456;
+
+    /* Delta: a fill and a literal across rows, and changes with short skips between them */
+    memcpy(src[1], src[0], sizeof(src[1]));
+    for (int i = W + 1; i < 3 * W + 2; i++)
+        src[1][i] = 0xff8000;
+    for (int i = 5 * W + 3; i < 7 * W + 30; i++)
+        src[1][i] ^= 0x010101u * (uint32_t)(i % 7 + 1);
+    src[1][N - 1 - SEQ_MIN_SKIP] ^= 0x000001;
+    src[1][N - 1] ^= 0xffffff;
+
+    /* Unchanged: a single skip */
+    memcpy(src[2], src[1], sizeof(src[2]));
+
+    memset(coded, 0, sizeof(coded));
+    memset(&file, 0, sizeof(file));
+    buf_put(&file, SEQ_MAGIC, 4);
+    buf_le32(&file, SEQ_VERSION);
+    buf_le32(&file, SEQ_CHECK_W);
+    buf_le32(&file, SEQ_CHECK_H);
+    buf_le32(&file, SEQ_CHECK_FRAMES);
+    buf_le32(&file, 30000);
+    for (int f = 0; f < SEQ_CHECK_FRAMES; f++) {
+        uint64_t entry = offset | (f == 0 ? SEQ_KEYFRAME : 0);
+        sequence_encode(&coded[f], f ? src[f - 1] : NULL, src[f], N);
+        buf_le32(&file, (uint32_t)entry);
+        buf_le32(&file, (uint32_t)(entry >> 32));
+        offset += coded[f].len;
+    }
+    for (int f = 0; f < SEQ_CHECK_FRAMES; f++)
+        buf_put(&file, coded[f].data, coded[f].len);
+    if (file.failed || surface_create(&s, SEQ_CHECK_W, SEQ_CHECK_H) != 0) {
+        fprintf(stderr, "Out of memory checking the frame sequence codec\n");
+        goto out;
+    }
+
+    memset(&seq, 0, sizeof(seq));
+    seq.map = file.data;
+    seq.map_len = file.len;
+    seq.width = SEQ_CHECK_W;
+    seq.height = SEQ_CHECK_H;
+    seq.frames = SEQ_CHECK_FRAMES;
+    seq.current = -1;
+    memset(s.pixels, 0xa5, (size_t)N * sizeof(uint32_t));   /* The keyframe has to cover all of it */
+    damage_init(&d, &s);
+    /* In order, then back to the start, which decodes the keyframe again */
+    for (int step = 0; step <= SEQ_CHECK_FRAMES && bad < 0; step++) {
+        int f = step % SEQ_CHECK_FRAMES;
+        if (sequence_show(&seq, f, &s, 0, 0, &d) != 0 || memcmp(s.pixels, src[f], sizeof(src[f])) != 0)
+            bad = f;
+    }
+    if (bad >= 0)
+        fprintf(stderr, "Frame sequence codec check failed: frame %d did not decode to what was encoded\n", bad);
+    else
+        ret = 0;
+    surface_destroy(&s);
+
+out:
+    for (int f = 0; f < SEQ_CHECK_FRAMES; f++)
+        buf_free(&coded[f]);
+    buf_free(&file);
+    return ret;
+}
+
+/*
+ * ============================================================================
+ * COMMAND LINE OPTIONS
+ * ============================================================================
+ */
+
+typedef struct {
+    const char *fb_path;        /* Frame buffer device */
+    int wall;                   /* Span every frame buffer device instead of fb_path */
+    int wall_cols;              /* Wall grid, 0 = every device in one row */
+    int wall_rows;
+    const char *compositor_path; /* Show other processes' surfaces, served on this socket */
+    const char *client_path;    /* Draw into a surface of the compositor on this socket */
+    Rect client_rect;           /* --geometry: where, and how big (0 x 0 = the whole screen) */
+    int client_z;               /* Stacking order among the compositor's clients */
+    unsigned int headless_w;    /* Non-zero: render without a frame buffer device */
+    unsigned int headless_h;
+    char rfb_addr[64];          /* RFB listen address */
+    int rfb_port;               /* 0 = RFB server disabled */
+    const char *config_path;    /* Watched and re-applied on change, or NULL */
+    RainbowParams rainbow;
+    int cpu;                    /* Core to pin the render thread to, -1 = any */
+    int fifo_priority;          /* SCHED_FIFO priority for the render thread, 0 = normal */
+    int mlock;                  /* Lock all memory to avoid page-fault stalls */
+    int pages;                  /* PAGES_* for surfaces */
+    int present;                /* PRESENT_*: how finished frames reach the screen */
+    int rotate;                 /* Degrees clockwise the picture is turned on the panel, -1 = var_info.rotate */
+    int mirror;                 /* Flip the picture left to right */
+    unsigned int overlay_scale; /* Live statistics overlay text scale, 0 = no overlay */
+    const char *font_path;      /* PSF font for on-screen text, NULL = built-in */
+    int show_info;              /* Draw the display information on screen */
+    const char *status_text;    /* Translucent status bar text, NULL = no status bar */
+    int shapes;                 /* Animated primitives drawn over the gradient */
+    int sprites;                /* Bouncing sprites drawn over the gradient */
+    int threads;                /* Worker pool size including the main thread, 0 = one per CPU */
+    const char *image_path;     /* Background image instead of the gradient */
+    int image_filter;           /* SCALE_*, or -1 to pick by scale factor */
+    const char *play_path;      /* Frame sequence to loop instead of the gradient */
+    const char *record_path;    /* Render offline into this frame sequence and exit */
+    int record_frames;          /* Frames to record, 0 = default length */
+    int keyframe_interval;      /* Frames between recorded keyframes, 0 = one per second */
+    int effect;                 /* EFFECT_* drawn when there is no image or sequence, -1 = a plugin */
+    const char *effect_name;    /* --effect as given, resolved once plugins are loaded */
+    const char *plugin_paths[PLUGIN_MAX];
+    int plugin_count;
+    const char *plugin_args;    /* Passed to every plugin's create() */
+    const char *shader_source;  /* --shader expression */
+    FilterSpec filter;          /* Applied to the effect or image background */
+    int render_level;           /* Effect resolution, out of RES_LEVELS (the upper limit with --dynamic-res) */
+    int min_render_level;       /* --dynamic-res lower limit, 0 = fixed resolution */
+    int frost;                  /* Blur what lies under the --overlay box */
+    int bench_frames;           /* Non-zero: benchmark the effects over this many frames and exit */
+} Options;
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [options]\n"
+           "  --fb PATH            frame buffer device (default /dev/fb0)\n"
+           "  --wall [CxR]         spread one picture over every /dev/fbN, as C columns by R\n"
+           "                       rows of panels in device order (default: all in one row)\n"
+           "  --headless WxH       render into memory only, without a frame buffer device\n"
+           "  --compositor SOCKET  show the surfaces of --client processes (see rainbow_shm.h),\n"
+           "                       stacked by z over black, instead of drawing a picture\n"
+           "  --client SOCKET      draw into a surface of the compositor listening on SOCKET\n"
+           "  --geometry WxH+X+Y   --client surface size and position (default: whole screen)\n"
+           "  --z N                --client stacking order, higher in front (default 0)\n"
+           "  --rfb [ADDR:]PORT    serve the screen to VNC viewers; no authentication,\n"
+           "                       so ADDR defaults to 127.0.0.1 (use 0.0.0.0 for all)\n"
+           "  --effect NAME        rainbow, plasma, noise, fire, shader or a plugin's name (default\n"
+           "                       rainbow, or the first plugin)\n"
+           "  --shader EXPR        draw the expression EXPR, e.g. \"hsv(x * 360 / w + phase, sat, val)\";\n"
+           "                       see the EXPRESSION SHADERS comment in main.c for the language\n"
+           "  --filter F           filter the background before shapes and sprites are drawn:\n"
+           "                       box:RADIUS[:PASSES], gaussian:SIGMA, or a 3x3/5x5 kernel:\n"
+           "                       smooth, smooth5, sharpen, edge or emboss\n"
+           "  --render-scale F     draw the effect at F (0.0625 to 1) of the screen size and\n"
+           "                       scale it up (default 1)\n"
+           "  --dynamic-res [MIN]  lower the effect resolution, down to MIN of the screen size\n"
+           "                       (default 0.25), whenever frames take too long for --fps,\n"
+           "                       and raise it again when there is time to spare\n"
+           "  --plugin FILE.so     load a span plugin (see rainbow_plugin.h); repeatable\n"
+           "  --plugin-args TEXT   settings passed to the plugins when they start\n"
+           "  --fps N              animate the rainbow at N frames per second (default: static)\n"
+           "  --speed DEG          hue drift while animating, degrees per second (default 60)\n"
+           "  --config FILE        read fps/speed/saturation/value from FILE (key = value\n"
+           "                       lines) and re-apply them whenever it changes\n"
+           "  --cpu N              pin the render thread to core N\n"
+           "  --fifo PRIO          run the render thread under SCHED_FIFO at PRIO (1-99)\n"
+           "  --mlock              lock all memory (mlockall) so frames never wait on page faults\n"
+           "  --present MODE       sync (write each frame before rendering the next, the\n"
+           "                       default), fifo (show every frame from a present thread\n"
+           "                       while the next renders) or mailbox (likewise, but always\n"
+           "                       the newest frame, dropping any the display had no time for)\n"
+           "  --huge-pages MODE    back screen-sized buffers with off (4 KiB pages), thp\n"
+           "                       (transparent huge pages, the default) or hugetlb (the\n"
+           "                       vm.nr_hugepages pool, falling back to thp when it is empty)\n"
+           "  --rotate DEG         turn the picture 0, 90, 180 or 270 degrees clockwise on the\n"
+           "                       panel (default: the frame buffer's rotate setting)\n"
+           "  --mirror             flip the picture left to right on the panel\n"
+           "  --overlay [SCALE]    draw live FPS and frame time percentiles in the top-left\n"
+           "                       corner, text magnified SCALE times (default 2)\n"
+           "  --frost              show the --overlay box as frosted glass over the picture\n"
+           "  --info               show resolution, depth and scanline length on screen\n"
+           "  --font FILE.psf      PSF1/PSF2 console font for on-screen text (default built-in)\n"
+           "  --status-bar TEXT    show TEXT on a translucent bar along the bottom edge\n"
+           "  --shapes N           draw N animated rectangles, lines, circles and polygons\n"
+           "  --sprites N          draw N bouncing sprites\n"
+           "  --threads N          threads for parallel work (default: one per CPU)\n"
+           "  --image FILE         show a PPM (P6) or raw XRGB8888 image instead of the gradient\n"
+           "  --image-filter F     nearest, bilinear or area scaling for --image\n"
+           "                       (default: area when shrinking, bilinear when enlarging)\n"
+           "  --play FILE          loop a recorded frame sequence instead of the gradient\n"
+           "  --record FILE        render frames offline into a sequence for --play and exit;\n"
+           "                       needs --headless, records whatever else is selected\n"
+           "  --frames N           frames to record (default: one hue turn, or 10 seconds\n"
+           "                       with --shapes or --sprites)\n"
+           "  --keyframe-interval N  frames between keyframes when recording (default: fps)\n"
+           "  --bench [FRAMES]     time every effect over FRAMES frames (default 300), with how\n"
+           "                       busy each worker thread was, and exit\n"
+           "  --help               show this help\n"
+           "\n"
+           "Enter, SIGINT or SIGTERM exits; SIGUSR1 prints frame statistics.\n", prog);
+}
+
+/* Parses a non-negative number option value; returns -1 if it is not one */
+static int parse_float(const char *name, const char *val, float max, float *out)
+{
+    char *end;
+    float f = strtof(val, &end);
+
+    if (end == val || *end != '\0' || !(f >= 0.0f && f <= max)) {
+        fprintf(stderr, "Invalid value '%s' for %s\n", val, name);
+        return -1;
+    }
+    *out = f;
+    return 0;
+}
+
+/*
+ * Function: load_config
+ *
+ * Reads "key = value" lines (fps, speed, saturation, value) into p.
+ * Blank lines and lines starting with '#' are ignored. Keys missing from
+ * the file keep their current values.
+ *
+ * Returns: 0 on success, -1 if the file cannot be read or has a bad line
+ */
+int load_config(const char *path, RainbowParams *p)
+{
+    FILE *f = fopen(path, "r");
+    RainbowParams next = *p;
+    char line[256];
+    int lineno = 0;
+
+    if (!f) {
+        fprintf(stderr, "Failed to open config %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char key[32], val[64];
+        int ok;
+
+        lineno++;
+        if (sscanf(line, " %31s", key) != 1 || key[0] == '#')
+            continue;
+        if (sscanf(line, " %31[a-z_] = %63s", key, val) != 2) {
+            fprintf(stderr, "%s:%d: expected 'key = value'\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+        if (strcmp(key, "fps") == 0)
+            ok = parse_float(key, val, 1000.0f, &next.fps);
+        else if (strcmp(key, "speed") == 0)
+            ok = parse_float(key, val, 1e6f, &next.speed);
+        else if (strcmp(key, "saturation") == 0)
+            ok = parse_float(key, val, 1.0f, &next.saturation);
+        else if (strcmp(key, "value") == 0)
+            ok = parse_float(key, val, 1.0f, &next.value);
+        else {
+            fprintf(stderr, "%s:%d: unknown key '%s'\n", path, lineno, key);
+            ok = -1;
+        }
+        if (ok != 0) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    *p = next;
+    return 0;
+}
+
+/*
+ * Function: parse_options
+ *
+ * Returns: 0 to run, 1 if only help was requested, -1 on a bad argument
+ */
+int parse_options(int argc, char **argv, Options *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->fb_path = "/dev/fb0";
+    opts->rainbow.fps = 0.0f;
+    opts->rainbow.speed = 60.0f;
+    opts->rainbow.saturation = 1.0f;
+    opts->rainbow.value = 1.0f;
+    opts->cpu = -1;
+    opts->image_filter = -1;
+    opts->rotate = -1;
+    opts->render_level = RES_LEVELS;
+    opts->pages = PAGES_THP;
+    opts->present = PRESENT_SYNC;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            usage(argv[0]);
+            return 1;
+        } else if (strcmp(arg, "--fb") == 0 && val) {
+            opts->fb_path = val;
+            i++;
+        } else if (strcmp(arg, "--wall") == 0) {
+            opts->wall = 1;
+            if (val && val[0] >= '0' && val[0] <= '9') {
+                if (sscanf(val, "%dx%d", &opts->wall_cols, &opts->wall_rows) != 2 || opts->wall_cols < 1 ||
+                    opts->wall_rows < 1 || opts->wall_cols * opts->wall_rows > WALL_MAX_PANELS) {
+                    fprintf(stderr, "Invalid wall layout '%s', expected CxR with at most %d panels\n",
+                            val, WALL_MAX_PANELS);
+                    return -1;
+                }
+                i++;
+            }
+        } else if (strcmp(arg, "--compositor") == 0 && val) {
+            opts->compositor_path = val;
+            i++;
+        } else if (strcmp(arg, "--client") == 0 && val) {
+            opts->client_path = val;
+            i++;
+        } else if (strcmp(arg, "--geometry") == 0 && val) {
+            Rect *r = &opts->client_rect;
+            if (sscanf(val, "%dx%d+%d+%d", &r->w, &r->h, &r->x, &r->y) != 4 || r->w < 1 || r->h < 1 ||
+                r->w > SHM_MAX_SIZE || r->h > SHM_MAX_SIZE) {
+                fprintf(stderr, "Invalid geometry '%s', expected WxH+X+Y\n", val);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--z") == 0 && val) {
+            opts->client_z = atoi(val);
+            i++;
+        } else if (strcmp(arg, "--headless") == 0 && val) {
+            if (sscanf(val, "%ux%u", &opts->headless_w, &opts->headless_h) != 2 ||
+                opts->headless_w == 0 || opts->headless_h == 0) {
+                fprintf(stderr, "Invalid size '%s', expected WxH\n", val);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--rfb") == 0 && val) {
+            const char *colon = strrchr(val, ':');
+            size_t len = colon ? (size_t)(colon - val) : 0;
+
+            if (len >= sizeof(opts->rfb_addr)) {
+                fprintf(stderr, "Invalid RFB address '%s'\n", val);
+                return -1;
+            }
+            memcpy(opts->rfb_addr, val, len);
+            opts->rfb_addr[len] = '\0';
+            if (len == 0)
+                strcpy(opts->rfb_addr, "127.0.0.1");
+            opts->rfb_port = atoi(colon ? colon + 1 : val);
+            if (opts->rfb_port <= 0 || opts->rfb_port > 65535) {
+                fprintf(stderr, "Invalid RFB port in '%s'\n", val);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--fps") == 0 && val) {
+            if (parse_float(arg, val, 1000.0f, &opts->rainbow.fps) != 0)
+                return -1;
+            i++;
+        } else if (strcmp(arg, "--speed") == 0 && val) {
+            if (parse_float(arg, val, 1e6f, &opts->rainbow.speed) != 0)
+                return -1;
+            i++;
+        } else if (strcmp(arg, "--config") == 0 && val) {
+            opts->config_path = val;
+            i++;
+        } else if (strcmp(arg, "--cpu") == 0 && val) {
+            opts->cpu = atoi(val);
+            if (opts->cpu < 0 || opts->cpu >= CPU_SETSIZE) {
+                fprintf(stderr, "Invalid core '%s'\n", val);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--fifo") == 0 && val) {
+            opts->fifo_priority = atoi(val);
+            if (opts->fifo_priority < 1 || opts->fifo_priority > 99) {
+                fprintf(stderr, "Invalid SCHED_FIFO priority '%s', expected 1-99\n", val);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--rotate") == 0 && val) {
+            opts->rotate = atoi(val);
+            if (opts->rotate % 90 != 0 || opts->rotate < 0 || opts->rotate > 270) {
+                fprintf(stderr, "Invalid rotation '%s' (0, 90, 180 or 270)\n", val);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--mirror") == 0) {
+            opts->mirror = 1;
+        } else if (strcmp(arg, "--mlock") == 0) {
+            opts->mlock = 1;
+        } else if (strcmp(arg, "--present") == 0 && val) {
+            opts->present = -1;
+            for (int p = 0; p < (int)(sizeof(present_names) / sizeof(present_names[0])); p++)
+                if (strcmp(val, present_names[p]) == 0)
+                    opts->present = p;
+            if (opts->present < 0) {
+                fprintf(stderr, "Unknown present mode: %s (sync, fifo or mailbox)\n", val);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--huge-pages") == 0 && val) {
+            if (strcmp(val, "off") == 0) {
+                opts->pages = PAGES_SMALL;
+            } else if (strcmp(val, "thp") == 0) {
+                opts->pages = PAGES_THP;
+            } else if (strcmp(val, "hugetlb") == 0) {
+                opts->pages = PAGES_HUGETLB;
+            } else {
+                fprintf(stderr, "Unknown huge page mode: %s (off, thp or hugetlb)\n", val);
+                return -1;
+            }
+            i++;
+        } else if ((strcmp(arg, "--shapes") == 0 || strcmp(arg, "--sprites") == 0) && val) {
+            int *count = strcmp(arg, "--shapes") == 0 ? &opts->shapes : &opts->sprites;
+            *count = atoi(val);
+            if (*count < 0) {
+                fprintf(stderr, "Invalid count for %s: %s\n", arg, val);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--threads") == 0 && val) {
+            opts->threads = atoi(val);
+            if (opts->threads < 1 || opts->threads > POOL_MAX_THREADS) {
+                fprintf(stderr, "Thread count must be 1-%d: %s\n", POOL_MAX_THREADS, val);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--play") == 0 && val) {
+            opts->play_path = val;
+            i++;
+        } else if (strcmp(arg, "--effect") == 0 && val) {
+            opts->effect_name = val;
+            i++;
+        } else if (strcmp(arg, "--plugin") == 0 && val) {
+            if (opts->plugin_count == PLUGIN_MAX) {
+                fprintf(stderr, "At most %d plugins can be loaded\n", PLUGIN_MAX);
+                return -1;
+            }
+            opts->plugin_paths[opts->plugin_count++] = val;
+            i++;
+        } else if (strcmp(arg, "--shader") == 0 && val) {
+            opts->shader_source = val;
+            i++;
+        } else if (strcmp(arg, "--filter") == 0 && val) {
+            if (filter_parse(&opts->filter, val) != 0) {
+                fprintf(stderr, "Invalid filter '%s'\n", val);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--render-scale") == 0 && val) {
+            float scale = strtof(val, NULL);
+            if (!(scale >= 1.0f / RES_LEVELS && scale <= 1.0f)) {
+                fprintf(stderr, "Invalid render scale '%s' (%.4g to 1)\n", val, 1.0 / RES_LEVELS);
+                return -1;
+            }
+            opts->render_level = (int)(scale * RES_LEVELS + 0.5f);
+            i++;
+        } else if (strcmp(arg, "--dynamic-res") == 0) {
+            opts->min_render_level = RES_LEVELS / 4;
+            if (val && ((val[0] >= '0' && val[0] <= '9') || val[0] == '.')) {
+                float scale = strtof(val, NULL);
+                if (!(scale >= 1.0f / RES_LEVELS && scale <= 1.0f)) {
+                    fprintf(stderr, "Invalid minimum render scale '%s'\n", val);
+                    return -1;
+                }
+                opts->min_render_level = (int)(scale * RES_LEVELS + 0.5f);
+                i++;
+            }
+        } else if (strcmp(arg, "--frost") == 0) {
+            opts->frost = 1;
+        } else if (strcmp(arg, "--plugin-args") == 0 && val) {
+            opts->plugin_args = val;
+            i++;
+        } else if (strcmp(arg, "--bench") == 0) {
+            opts->bench_frames = 300;
+            if (val && val[0] >= '1' && val[0] <= '9') {
+                opts->bench_frames = atoi(val);
+                i++;
+            }
+        } else if (strcmp(arg, "--record") == 0 && val) {
+            opts->record_path = val;
+            i++;
+        } else if ((strcmp(arg, "--frames") == 0 || strcmp(arg, "--keyframe-interval") == 0) && val) {
+            int *count = strcmp(arg, "--frames") == 0 ? &opts->record_frames : &opts->keyframe_interval;
+            *count = atoi(val);
+            if (*count < 1) {
+                fprintf(stderr, "Invalid count for %s: %s\n", arg, val);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--image") == 0 && val) {
+            opts->image_path = val;
+            i++;
+        } else if (strcmp(arg, "--image-filter") == 0 && val) {
+            if (strcmp(val, "nearest") == 0) {
+                opts->image_filter = SCALE_NEAREST;
+            } else if (strcmp(val, "bilinear") == 0) {
+                opts->image_filter = SCALE_BILINEAR;
+            } else if (strcmp(val, "area") == 0) {
+                opts->image_filter = SCALE_AREA;
+            } else {
+                fprintf(stderr, "Unknown scaling filter: %s\n", val);
+                return -1;
+            }
+            i++;
+        } else if (strcmp(arg, "--status-bar") == 0 && val) {
+            opts->status_text = val;
+            i++;
+        } else if (strcmp(arg, "--info") == 0) {
+            opts->show_info = 1;
+        } else if (strcmp(arg, "--font") == 0 && val) {
+            opts->font_path = val;
+            i++;
+        } else if (strcmp(arg, "--overlay") == 0) {
+            opts->overlay_scale = 2;
+            if (val && val[0] >= '1' && val[0] <= '9') {
+                opts->overlay_scale = (unsigned int)atoi(val);
+                if (opts->overlay_scale > 16) {
+                    fprintf(stderr, "Invalid overlay scale '%s'\n", val);
+                    return -1;
+                }
+                i++;
+            }
+        } else {
+            fprintf(stderr, "Unknown or incomplete option '%s'\n", arg);
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (opts->play_path && (opts->image_path || opts->shapes || opts->sprites)) {
+        /* Frames are decoded as deltas on top of the previous one, which
+         * anything moving over them would corrupt */
+        fprintf(stderr, "--play cannot be combined with --image, --shapes or --sprites\n");
+        return -1;
+    }
+    if (opts->play_path && (opts->filter.kind != FILTER_NONE || opts->frost)) {
+        /* Likewise for filtering a frame in place */
+        fprintf(stderr, "--play cannot be combined with --filter or --frost\n");
+        return -1;
+    }
+    if ((opts->render_level < RES_LEVELS || opts->min_render_level) &&
+        (opts->image_path || opts->play_path || opts->record_path || opts->bench_frames)) {
+        fprintf(stderr, "--render-scale and --dynamic-res only apply to live effects, not --image,\n"
+                        "--play, --record or --bench\n");
+        return -1;
+    }
+    if (opts->frost && !opts->overlay_scale) {
+        fprintf(stderr, "--frost needs --overlay\n");
+        return -1;
+    }
+    if (opts->shader_source && !opts->effect_name)
+        opts->effect_name = effect_names[EFFECT_SHADER];
+    if (opts->effect_name || opts->plugin_count) {
+        /* Plugin names are only known once they are loaded */
+        opts->effect = -1;
+        for (int e = 0; e < EFFECT_COUNT && opts->effect_name; e++)
+            if (strcmp(opts->effect_name, effect_names[e]) == 0)
+                opts->effect = e;
+        if (opts->effect < 0 && !opts->plugin_count) {
+            fprintf(stderr, "Unknown effect: %s\n", opts->effect_name);
+            return -1;
+        }
+        if (opts->image_path || opts->play_path) {
+            fprintf(stderr, "--effect and --plugin cannot be combined with --image or --play\n");
+            return -1;
+        }
+    }
+    if (opts->compositor_path &&
+        (opts->client_path || opts->image_path || opts->play_path || opts->record_path || opts->bench_frames ||
+         opts->effect_name || opts->plugin_count || opts->shader_source || opts->shapes || opts->sprites ||
+         opts->filter.kind != FILTER_NONE || opts->render_level < RES_LEVELS || opts->min_render_level)) {
+        /* It has no picture of its own to put any of these in */
+        fprintf(stderr, "--compositor only shows its clients; it cannot be combined with --client, --image,\n"
+                        "--play, --record, --bench, --effect, --plugin, --shader, --shapes, --sprites,\n"
+                        "--filter, --render-scale or --dynamic-res\n");
+        return -1;
+    }
+    if (opts->client_path && (opts->headless_w || opts->wall || opts->record_path || opts->bench_frames)) {
+        fprintf(stderr, "--client cannot be combined with --headless, --wall, --record or --bench\n");
+        return -1;
+    }
+    if ((opts->client_rect.w || opts->client_z) && !opts->client_path) {
+        fprintf(stderr, "--geometry and --z need --client\n");
+        return -1;
+    }
+    if (opts->present != PRESENT_SYNC && (opts->client_path || opts->record_path || opts->bench_frames)) {
+        /* A client hands frames to its compositor, which already takes them asynchronously */
+        fprintf(stderr, "--present cannot be combined with --client, --record or --bench\n");
+        return -1;
+    }
+    if (opts->wall && opts->headless_w) {
+        fprintf(stderr, "--wall cannot be combined with --headless\n");
+        return -1;
+    }
+    if (opts->record_path && (!opts->headless_w || opts->play_path || opts->bench_frames)) {
+        fprintf(stderr, "--record needs --headless and cannot be combined with --play or --bench\n");
+        return -1;
+    }
+    if (opts->config_path && load_config(opts->config_path, &opts->rainbow) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * REAL-TIME SCHEDULING AND JITTER MEASUREMENT
+ * ============================================================================
+ */
+
+/*
+ * Frame start lateness histogram. Bucket 0 counts starts less than 1 us
+ * late; bucket i counts lateness in [2^(i-1), 2^i) us, so the top bucket
+ * begins at about 4 seconds.
+ */
+#define JITTER_BUCKETS 24
+
+typedef struct {
+    uint64_t buckets[JITTER_BUCKETS];
+    uint64_t count;
+    uint64_t missed;            /* Frames that started a whole period or more late */
+    double sum_us;
+    double max_us;
+} JitterHistogram;
+
+void jitter_record(JitterHistogram *h, double late_us, double period_us)
+{
+    int b = 0;
+
+    if (late_us < 0.0)
+        late_us = 0.0;   /* Timer and clock read can round a hair early */
+    for (double edge = 1.0; late_us >= edge && b < JITTER_BUCKETS - 1; edge *= 2.0)
+        b++;
+    h->buckets[b]++;
+    h->count++;
+    h->sum_us += late_us;
+    if (late_us > h->max_us)
+        h->max_us = late_us;
+    if (late_us >= period_us)
+        h->missed++;
+}
+
+/* Upper edge (us) of the bucket holding the given fraction of samples */
+static double jitter_percentile(const JitterHistogram *h, double fraction)
+{
+    uint64_t target = (uint64_t)(fraction * (double)h->count);
+    uint64_t seen = 0;
+
+    for (int b = 0; b < JITTER_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > target || seen == h->count)
+            return (double)(1u << b);
+    }
+    return h->max_us;
+}
+
+void jitter_print(const JitterHistogram *h, FILE *out)
+{
+    uint64_t peak = 0;
+
+    if (h->count == 0)
+        return;
+    fprintf(out, "frame start lateness: %llu frames, avg %.1f us, p50 < %.0f us, p99 < %.0f us, "
+                 "max %.1f us, %llu missed a whole period\n",
+            (unsigned long long)h->count, h->sum_us / h->count,
+            jitter_percentile(h, 0.50), jitter_percentile(h, 0.99), h->max_us,
+            (unsigned long long)h->missed);
+    for (int b = 0; b < JITTER_BUCKETS; b++)
+        if (h->buckets[b] > peak)
+            peak = h->buckets[b];
+    for (int b = 0; b < JITTER_BUCKETS; b++) {
+        if (!h->buckets[b])
+            continue;
+        int bar = (int)(h->buckets[b] * 40 / peak);
+        fprintf(out, "  %8u - %-8u us %10llu %.*s\n", b ? 1u << (b - 1) : 0u, 1u << b,
+                (unsigned long long)h->buckets[b], bar > 0 ? bar : 1,
+                "########################################");
+    }
+}
+
+/*
+ * Function: apply_realtime
+ *
+ * Pins the calling (render) thread to a core, switches it to SCHED_FIFO
+ * and locks memory, as requested by the options. New threads inherit
+ * affinity and policy from their creator, so this is called after the
+ * helper threads are running to keep them off the render core's budget.
+ * Failures (typically EPERM without CAP_SYS_NICE or CAP_IPC_LOCK) are
+ * reported and the program carries on without them.
+ */
+void apply_realtime(const Options *opts)
+{
+    if (opts->cpu >= 0) {
+        cpu_set_t set;
+        int err;
+
+        CPU_ZERO(&set);
+        CPU_SET(opts->cpu, &set);
+        err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err)
+            fprintf(stderr, "Warning: cannot pin render thread to core %d: %s\n",
+                    opts->cpu, strerror(err));
+    }
+    if (opts->fifo_priority > 0) {
+        struct sched_param sp;
+        int err;
+
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = opts->fifo_priority;
+        err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+        if (err)
+            fprintf(stderr, "Warning: cannot switch render thread to SCHED_FIFO: %s\n",
+                    strerror(err));
+    }
+    if (opts->mlock && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        fprintf(stderr, "Warning: mlockall failed: %s\n", strerror(errno));
+}
+
+/*
+ * ============================================================================
+ * EVENT LOOP
+ * ============================================================================
+ *
+ * Everything the program waits for is a file descriptor in one epoll set:
+ * stdin (Enter quits), a signalfd for SIGINT/SIGTERM (clean exit) and
+ * SIGUSR1 (statistics dump), a timerfd that ticks once per animation
+ * frame, and an inotify watch on the config file. The process sleeps in
+ * epoll_wait() between events and never busy-waits.
+ */
+
+/* Counters reported on SIGUSR1 and at exit */
+typedef struct {
+    uint64_t frames;            /* Frames rendered */
+    uint64_t frames_flushed;    /* Frames in which at least one tile changed */
+    uint64_t ticks_missed;      /* Timer ticks that passed while a frame was still rendering */
+    uint64_t tiles_changed;
+    uint64_t bytes_flushed;
+    double busy_seconds;        /* Time spent rendering, hashing and flushing */
+    double start;
+} Stats;
+
+typedef struct {
+    Options opts;
+    RainbowParams rainbow;      /* Current settings (config reloads change these) */
+    FrameBuffer fb;
+    int have_fb;
+    Wall wall;                  /* --wall panels, used instead of fb */
+    ShmServer shm;              /* --compositor clients */
+    ShmClient client;           /* --client: our surface in the compositor, used instead of fb */
+    Surface surface;
+    Damage damage;
+    TileHasher tiles;
+    RfbServer rfb;
+    Presenter present;          /* --present fifo or mailbox */
+    int present_held;           /* FIFO: the last frame is still in the surface, waiting for a buffer */
+    Stats stats;
+    TelemetrySlot *render_telemetry;
+    Font font;
+    GlyphCache label_glyphs;    /* White text for --info labels ... */
+    GlyphCache shadow_glyphs;   /* ... over a black drop shadow */
+    TextBatch labels;           /* Static labels drawn over every frame */
+    DrawBatch shapes;           /* --shapes demo, rebuilt every frame */
+    WorkerPool pool;
+    Scaler scaler;
+    Filter filter;
+    EffectRenderer effects;     /* Background when there is no image or sequence ... */
+    Surface lowres;             /* ... drawn here and scaled up when below full resolution */
+    ResGovernor res;
+    MappedImage image;          /* --image background */
+    Sequence sequence;          /* --play animation */
+    int sequence_x;             /* Where it is shown, centred */
+    int sequence_y;
+    Rect image_rect;            /* Where it is shown, letterboxed to keep its aspect ratio */
+    Surface ball_pixels;        /* --sprites demo: keyed ball and its blended shadow */
+    Surface shadow_pixels;
+    Image ball;
+    Image ball_shadow;
+    Compositor compositor;      /* Blends layers over the surface on output */
+    Layer status_bar;
+    Overlay overlay;
+    JitterHistogram jitter;
+    double timer_origin;        /* When tick 1 was due (CLOCK_MONOTONIC seconds) */
+    double timer_period;
+    uint64_t timer_ticks;       /* Expirations consumed since the timer was armed */
+    int epoll_fd;
+    int signal_fd;
+    int timer_fd;
+    int inotify_fd;
+    const char *config_name;    /* Basename of the config file inside the watched directory */
+} App;
+
+enum { EV_STDIN, EV_SIGNAL, EV_TIMER, EV_INOTIFY, EV_PRESENT };
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Queues the --shapes demo: a fixed pseudo-random set of primitives that
+ * drift and bounce around the screen as t advances.
+ */
+static void app_build_shapes(const App *app, DrawBatch *b, double t)
+{
+    int w = (int)app->surface.width, h = (int)app->surface.height;
+    int size = (h < w ? h : w) / 12 + 4;
+
+    draw_batch_clear(b);
+    for (int i = 0; i < app->opts.shapes; i++) {
+        uint32_t seed = (uint32_t)i * 2654435761u;
+        uint32_t color = (seed >> 8) & 0xffffff;
+        /* Triangle waves give each shape a bouncing path across the screen */
+        double px = (double)(seed % 997) / 997.0 + t * (0.05 + (seed >> 20 & 15) / 150.0);
+        double py = (double)(seed % 991) / 991.0 + t * (0.05 + (seed >> 24 & 15) / 150.0);
+        px -= (double)(int64_t)px;
+        py -= (double)(int64_t)py;
+        int x = (int)((px < 0.5 ? px * 2 : 2 - px * 2) * (w - size));
+        int y = (int)((py < 0.5 ? py * 2 : 2 - py * 2) * (h - size));
+        int r = size / 2;
+
+        switch (i % 6) {
+        case 0: {
+            Rect box = { x, y, size, size * 2 / 3 };
+            draw_batch_rect(b, box, color);
+            break;
+        }
+        case 1: {
+            Rect box = { x, y, size, size };
+            draw_batch_gradient(b, box, color, ~color & 0xffffff, (seed >> 4) & 1);
+            break;
+        }
+        case 2:
+            draw_batch_line(b, x, y, x + size, y + r, color, 0);
+            break;
+        case 3:
+            draw_batch_line(b, x * 256, (y + size) * 256, (x + size) * 256 + 128, y * 256 + 77,
+                            color, 1);
+            break;
+        case 4:
+            draw_batch_circle(b, x + r, y + r, r, color, (seed >> 5) & 1);
+            break;
+        default: {
+            Point star[10];
+            for (int k = 0; k < 10; k++) {
+                /* Five-pointed star from a fixed table of unit offsets (x1000) */
+                static const short unit[10][2] = {
+                    { 0, -1000 }, { 225, -309 }, { 951, -309 }, { 363, 118 }, { 588, 809 },
+                    { 0, 382 }, { -588, 809 }, { -363, 118 }, { -951, -309 }, { -225, -309 },
+                };
+                star[k].x = x + r + unit[k][0] * r / 1000;
+                star[k].y = y + r + unit[k][1] * r / 1000;
+            }
+            draw_batch_polygon(b, star, 10, color);
+            break;
+        }
+        }
+    }
+}
+
+#define SPRITE_KEY 0xff00ff     /* Magenta, exact in RGB565 as 0xf81f */
+#define SPRITE_AUTHORED 256     /* Size the sprites are drawn at before scaling to the screen */
+
+/*
+ * Renders the --sprites demo images: a shaded ball in RGB565 on a
+ * colour-keyed background, and a soft premultiplied shadow for it. Both
+ * are drawn once at a fixed size and scaled to suit the screen, the way
+ * pre-rendered artwork would be: the ball with SCALE_NEAREST, which
+ * keeps the key colour intact, the shadow with SCALE_AREA.
+ */
+static int app_make_sprites(App *app)
+{
+    int size = (int)(app->surface.height < app->surface.width ? app->surface.height : app->surface.width) / 10 + 8;
+    int r = SPRITE_AUTHORED / 2;
+    uint16_t *ball = malloc((size_t)SPRITE_AUTHORED * SPRITE_AUTHORED * sizeof(uint16_t));
+    uint32_t *shadow = malloc((size_t)SPRITE_AUTHORED * SPRITE_AUTHORED * sizeof(uint32_t));
+    int ret = -1;
+
+    if (!ball || !shadow || surface_create(&app->ball_pixels, (unsigned int)size, (unsigned int)size) != 0 ||
+        surface_create(&app->shadow_pixels, (unsigned int)size, (unsigned int)size) != 0)
+        goto out;
+    for (int y = 0; y < SPRITE_AUTHORED; y++) {
+        for (int x = 0; x < SPRITE_AUTHORED; x++) {
+            int dx = x - r, dy = y - r;
+            int d2 = dx * dx + dy * dy;
+            /* Highlight up and to the left of the centre */
+            int hx = x - r / 2, hy = y - r / 2;
+            int light = 255 - (hx * hx + hy * hy) * 200 / (r * r * 2 + 1);
+            if (light < 40)
+                light = 40;
+            ball[y * SPRITE_AUTHORED + x] = d2 > r * r ? 0xf81f :
+                (uint16_t)((light >> 3) << 11 | (light * 3 / 4 >> 2) << 5 | (light / 4 >> 3));
+
+            /* Shadow: black, alpha falling off linearly towards the rim */
+            int a = d2 >= r * r ? 0 : 120 - 120 * d2 / (r * r);
+            shadow[y * SPRITE_AUTHORED + x] = (uint32_t)a << 24;
+        }
+    }
+
+    Image src = { ball, SPRITE_AUTHORED, SPRITE_AUTHORED, SPRITE_AUTHORED * sizeof(uint16_t), PIXEL_RGB565 };
+    Rect all = { 0, 0, size, size };
+    scale_image(&app->scaler, &src, &app->ball_pixels, all, all, SCALE_NEAREST);
+    src.pixels = shadow;
+    src.stride = SPRITE_AUTHORED * sizeof(uint32_t);
+    src.format = PIXEL_ARGB8888;
+    scale_image(&app->scaler, &src, &app->shadow_pixels, all, all, SCALE_AREA);
+
+    app->ball.pixels = app->ball_pixels.pixels;
+    app->ball.width = app->ball.height = size;
+    app->ball.stride = app->ball_pixels.stride * sizeof(uint32_t);
+    app->ball.format = PIXEL_XRGB8888;
+    app->ball_shadow = app->ball;
+    app->ball_shadow.pixels = app->shadow_pixels.pixels;
+    app->ball_shadow.format = PIXEL_ARGB8888;
+    ret = 0;
+out:
+    free(ball);
+    free(shadow);
+    return ret;
+}
+
+static void app_draw_sprites(const App *app, Surface *s, Damage *d, double t)
+{
+    int w = (int)s->width, h = (int)s->height, size = app->ball.width;
+    Rect all = { 0, 0, w, h }, whole = { 0, 0, size, size };
+    int lift = size / 8;
+
+    for (int i = 0; i < app->opts.sprites; i++) {
+        uint32_t seed = (uint32_t)i * 2246822519u + 7;
+        double px = (double)(seed % 983) / 983.0 + t * (0.04 + (seed >> 20 & 15) / 160.0);
+        double py = (double)(seed % 977) / 977.0 + t * (0.04 + (seed >> 24 & 15) / 160.0);
+        px -= (double)(int64_t)px;
+        py -= (double)(int64_t)py;
+        int x = (int)((px < 0.5 ? px * 2 : 2 - px * 2) * (w - size));
+        int y = (int)((py < 0.5 ? py * 2 : 2 - py * 2) * (h - size));
+
+        damage_add(d, blit_image(s, all, x + lift, y + lift, &app->ball_shadow, whole, 0, 0));
+        damage_add(d, blit_image(s, all, x, y, &app->ball, whole, BLIT_COLOR_KEY, SPRITE_KEY));
+    }
+}
+
+/* Background image rows handled per step of app_draw_background() */
+#define IMAGE_BAND_ROWS 64
+
+/*
+ * Draws the --image background into the surface, band by band. For the
+ * start-up splash each band is also written to the frame buffer while
+ * it is still in the cache, and the next band's file pages are
+ * requested from the kernel while this one is converted, so the picture
+ * appears as fast as the file can be read.
+ */
+static void app_draw_background(const App *app, Surface *s, Damage *d, Scaler *sc, int splash)
+{
+    const Image *img = &app->image.image;
+    Rect dst = app->image_rect;
+    Rect whole = { 0, 0, img->width, img->height };
+    int w = (int)s->width, h = (int)s->height;
+    int scaled = dst.w != img->width || dst.h != img->height;
+    int filter = app->opts.image_filter >= 0 ? app->opts.image_filter :
+                 dst.w < img->width ? SCALE_AREA : SCALE_BILINEAR;
+    /* Letterbox bars around the picture */
+    Rect bars[4] = {
+        { 0, 0, w, dst.y }, { 0, dst.y + dst.h, w, h - dst.y - dst.h },
+        { 0, dst.y, dst.x, dst.h }, { dst.x + dst.w, dst.y, w - dst.x - dst.w, dst.h },
+    };
+
+    for (int y = 0; y < h; y += IMAGE_BAND_ROWS) {
+        Rect band = { 0, y, w, h - y < IMAGE_BAND_ROWS ? h - y : IMAGE_BAND_ROWS };
+
+        if (splash) {
+            /* Source rows behind the next band */
+            int64_t from = (int64_t)(y + IMAGE_BAND_ROWS - dst.y) * img->height / dst.h;
+            int64_t to = (int64_t)(y + 2 * IMAGE_BAND_ROWS - dst.y) * img->height / dst.h + 1;
+            image_prefetch_rows(&app->image, (int)(from < 0 ? 0 : from), (int)(to < 0 ? 0 : to));
+        }
+        for (int i = 0; i < 4; i++)
+            fill_rect(s, band, bars[i], 0x000000);
+        if (scaled)
+            scale_image(sc, img, s, band, dst, filter);
+        else
+            blit_image(s, band, dst.x, dst.y, img, whole, 0, 0);
+        if (splash && app->have_fb)
+            fb_write_rect(&app->fb, s, band, NULL);
+        else if (splash && app->opts.wall)
+            wall_write_rect(&app->wall, s, band);
+    }
+    damage_add_all(d);
+}
+
+/*
+ * Function: app_draw_scene
+ *
+ * Draws everything but the labels and overlay for time t into s: the
+ * effect or image background, passed through --filter, then the
+ * shapes and sprites. The effect is drawn into lowres instead, sized to
+ * match fx, and scaled up when lowres is not NULL. A static image is
+ * only redrawn when something moves over it, or when full is set
+ * because s holds some other frame. Touches nothing in app, so workers
+ * can draw different frames at once given their own shapes batch,
+ * scaler, filter and effect renderer.
+ */
+static void app_draw_scene(const App *app, Surface *s, Damage *d, DrawBatch *shapes, Scaler *sc,
+                           Filter *flt, EffectRenderer *fx, Surface *lowres, double t, int full)
+{
+    Rect all = { 0, 0, (int)s->width, (int)s->height };
+    int drawn = 1;
+
+    if (!app->opts.image_path && lowres) {
+        Image img = { lowres->pixels, (int)lowres->width, (int)lowres->height,
+                      lowres->stride * sizeof(uint32_t), PIXEL_XRGB8888 };
+        effect_render(fx, lowres, d, &app->rainbow, app->rainbow.fps > 0.0f ? t : 0.0);
+        scale_image(sc, &img, s, all, all, SCALE_BILINEAR);
+    } else if (!app->opts.image_path) {
+        effect_render(fx, s, d, &app->rainbow, app->rainbow.fps > 0.0f ? t : 0.0);
+    } else if (full || app->opts.shapes || app->opts.sprites) {
+        app_draw_background(app, s, d, sc, 0);
+    } else {
+        drawn = 0;      /* Still there, already filtered, from the last frame */
+    }
+    if (drawn)
+        filter_apply(flt, s, all, &app->opts.filter);
+    if (app->opts.shapes) {
+        app_build_shapes(app, shapes, t);
+        draw_batch_run(shapes, s, all, d);
+    }
+    if (app->opts.sprites)
+        app_draw_sprites(app, s, d, t);
+}
+
+/*
+ * Function: app_set_render_level
+ *
+ * Sets the effect resolution to level out of RES_LEVELS, reallocating
+ * the effect renderer (and the surface it draws into below full
+ * resolution) at the new size. Effect state such as fire restarts.
+ *
+ * Returns: 0 on success, -1 if memory ran out (the old size is kept)
+ */
+static int app_set_render_level(App *app, int level)
+{
+    unsigned int w = res_scaled(app->surface.width, level), h = res_scaled(app->surface.height, level);
+    Surface lowres = { NULL, 0, 0, 0, 0, PAGES_SMALL };
+    EffectRenderer fx;
+
+    if (level < RES_LEVELS && surface_create(&lowres, w, h) != 0)
+        return -1;
+    if (effect_renderer_init(&fx, app->opts.effect, &app->pool, (int)w, (int)h) != 0) {
+        surface_destroy(&lowres);
+        return -1;
+    }
+    effect_renderer_destroy(&app->effects);
+    surface_destroy(&app->lowres);
+    app->effects = fx;
+    app->lowres = lowres;
+    return 0;
+}
+
+/*
+ * Function: app_render_frame
+ *
+ * Renders the rainbow for time t (seconds since start), narrows the
+ * damage to tiles that really changed and sends those to the frame
+ * buffer and RFB viewers.
+ */
+static void app_render_frame(App *app, double t)
+{
+    uint64_t start = now_ns();
+    int changed, declared = 0;
+
+    if (app->opts.compositor_path) {
+        /* Nothing of its own: the clients' layers are blended over the black surface on output */
+    } else if (app->opts.play_path) {
+        Sequence *seq = &app->sequence;
+        int frame = (int)((uint64_t)(t * seq->fps) % (uint64_t)seq->frames);
+        if (sequence_show(seq, frame, &app->surface, app->sequence_x, app->sequence_y, &app->damage) != 0)
+            fprintf(stderr, "%s: frame %d is corrupt\n", app->opts.play_path, frame);
+    } else {
+        /* The first frame replaces the unfiltered splash; frosting darkens the frame in place */
+        app_draw_scene(app, &app->surface, &app->damage, &app->shapes, &app->scaler, &app->filter,
+                       &app->effects, app->lowres.pixels ? &app->lowres : NULL, t,
+                       app->stats.frames == 0 || app->opts.frost);
+    }
+    text_batch_draw(&app->labels, &app->surface, &app->damage);
+    if (app->opts.overlay_scale) {
+        overlay_update(&app->overlay, app->render_telemetry);
+        if (app->opts.frost)
+            filter_gaussian(&app->filter, &app->surface, overlay_rect(&app->overlay),
+                            3.0f * (float)app->overlay.glyphs.scale);
+        overlay_draw(&app->overlay, &app->surface, &app->damage);
+    }
+    changed = tile_hasher_filter(&app->tiles, &app->surface, &app->damage);
+    if (app->opts.compositor_path && app->shm.damage.count) {
+        /* Clients say exactly what they changed, and it is not in the surface to hash anyway */
+        for (int i = 0; i < app->shm.damage.count; i++)
+            damage_add(&app->damage, app->shm.damage.rects[i]);
+        damage_clear(&app->shm.damage);
+        declared = 1;
+    }
+    if ((changed > 0 || declared) && app->present.started) {
+        /* The present thread publishes and writes it; FIFO may have to hold it back for now */
+        app->present_held = !present_queue(&app->present, &app->surface, &app->damage, &app->compositor.source);
+        app->stats.frames_flushed++;
+        app->stats.tiles_changed += (uint64_t)changed;
+    } else if (changed > 0 || declared) {
+        if (app->opts.rfb_port)
+            rfb_server_publish(&app->rfb, &app->surface, &app->damage, &app->compositor.source);
+        if (app->have_fb)
+            app->stats.bytes_flushed += fb_flush(&app->fb, &app->surface, &app->damage,
+                                                 &app->compositor.source);
+        else if (app->opts.wall)
+            app->stats.bytes_flushed += wall_flush(&app->wall, &app->surface, &app->damage, &app->compositor);
+        else if (app->opts.client_path)
+            app->stats.bytes_flushed += shm_client_flush(&app->client, &app->surface, &app->damage,
+                                                         &app->compositor.source);
+        damage_clear(&app->damage);
+        app->stats.frames_flushed++;
+        app->stats.tiles_changed += (uint64_t)changed;
+    }
+    app->stats.frames++;
+
+    uint64_t elapsed = now_ns() - start;
+    app->stats.busy_seconds += elapsed / 1e9;
+    telemetry_record(app->render_telemetry, elapsed,
+                     app->rainbow.fps > 0.0f ? (uint64_t)(1e9 / app->rainbow.fps) : 0);
+    if (res_governor_update(&app->res, elapsed) && app_set_render_level(app, app->res.level) != 0)
+        app->res.adaptive = 0;   /* Out of memory: stay where it is */
+}
+
+/*
+ * --record renders frames as fast as the CPUs allow instead of on a
+ * timer, and writes them as a frame sequence for --play. Frames are
+ * handled in batches of one per worker: each worker first renders a
+ * frame of the batch with its own draw batch, scaler and effect
+ * renderer, then codes it against the frame before it, so only writing
+ * the file is serial. Fire cannot skip ahead, so its frames are drawn
+ * in order instead, each one spread over the whole pool.
+ */
+
+typedef struct {
+    App *app;
+    Surface frames[POOL_MAX_THREADS + 1];   /* [0] holds the last frame of the previous batch */
+    ByteBuffer coded[POOL_MAX_THREADS];
+    DrawBatch shapes[POOL_MAX_THREADS];     /* Per worker */
+    Scaler scalers[POOL_MAX_THREADS];
+    Filter filters[POOL_MAX_THREADS];
+    EffectRenderer effects[POOL_MAX_THREADS];
+    int first;                  /* Frame number of frames[1] */
+    int keyframe_interval;
+} Recorder;
+
+static void record_frame(Recorder *rec, int item, DrawBatch *shapes, Scaler *sc, Filter *flt, EffectRenderer *fx)
+{
+    Surface *s = &rec->frames[item + 1];
+    Damage d;
+
+    damage_init(&d, s);
+    app_draw_scene(rec->app, s, &d, shapes, sc, flt, fx, NULL, (double)(rec->first + item) / rec->app->rainbow.fps, 1);
+    text_batch_draw(&rec->app->labels, s, &d);
+}
+
+static void record_render(void *ctx, int item, int worker)
+{
+    Recorder *rec = ctx;
+
+    record_frame(rec, item, &rec->shapes[worker], &rec->scalers[worker], &rec->filters[worker],
+                 &rec->effects[worker]);
+}
+
+static void record_encode(void *ctx, int item, int worker)
+{
+    Recorder *rec = ctx;
+    const Surface *s = &rec->frames[item + 1];
+    int key = (rec->first + item) % rec->keyframe_interval == 0;
+
+    (void)worker;
+    rec->coded[item].len = 0;
+    sequence_encode(&rec->coded[item], key ? NULL : rec->frames[item].pixels, s->pixels,
+                    (size_t)s->width * s->height);
+}
+
+/*
+ * Function: app_record
+ *
+ * Renders opts.record_frames frames (0 = a default length) and writes
+ * them to opts.record_path, once sequence_check() has passed.
+ *
+ * Returns: 0 on success, -1 on failure
+ */
+static int app_record(App *app)
+{
+    static Recorder rec;
+    SequenceWriter w;
+    int batch = worker_pool_size(&app->pool);
+    int frames = app->opts.record_frames, keys = 0;
+    uint64_t bytes = 0, start = now_ns();
+    int ret = -1;
+
+    if (sequence_check() != 0)
+        return -1;
+    if (app->rainbow.fps <= 0.0f)
+        app->rainbow.fps = 30.0f;
+    if (frames == 0) {
+        /* One full hue turn loops seamlessly; anything moving gets ten seconds */
+        double turn = app->rainbow.speed > 0.0f ? app->rainbow.fps * 360.0 / app->rainbow.speed : 0.0;
+        frames = turn >= 1.0 && turn < 36000.0 && !app->opts.shapes && !app->opts.sprites ?
+                 (int)(turn + 0.5) : (int)(app->rainbow.fps * 10.0f + 0.5f);
+    }
+    rec.app = app;
+    rec.keyframe_interval = app->opts.keyframe_interval ? app->opts.keyframe_interval :
+                            (int)(app->rainbow.fps + 0.5f);
+    if (rec.keyframe_interval < 1)
+        rec.keyframe_interval = 1;
+    for (int i = 0; i < batch; i++) {
+        draw_batch_init(&rec.shapes[i]);
+        scaler_init(&rec.scalers[i], NULL);   /* Already running on a worker */
+        filter_init(&rec.filters[i], NULL);
+    }
+    for (int i = 0; i <= batch; i++) {
+        if (surface_create(&rec.frames[i], app->surface.width, app->surface.height) != 0 ||
+            (i < batch && effect_renderer_init(&rec.effects[i], app->opts.effect, NULL, (int)app->surface.width,
+                                               (int)app->surface.height) != 0)) {
+            fprintf(stderr, "Failed to allocate recording surfaces\n");
+            goto out;
+        }
+    }
+    if (sequence_writer_open(&w, app->opts.record_path, (int)app->surface.width, (int)app->surface.height,
+                             frames, app->rainbow.fps) != 0)
+        goto out;
+
+    for (rec.first = 0; rec.first < frames; rec.first += batch) {
+        int n = frames - rec.first < batch ? frames - rec.first : batch;
+
+        if (app->opts.effect == EFFECT_FIRE && !app->opts.image_path)
+            for (int i = 0; i < n; i++)
+                record_frame(&rec, i, &app->shapes, &app->scaler, &app->filter, &app->effects);
+        else
+            worker_pool_run(&app->pool, record_render, &rec, n);
+        worker_pool_run(&app->pool, record_encode, &rec, n);
+        for (int i = 0; i < n; i++) {
+            int key = (rec.first + i) % rec.keyframe_interval == 0;
+            if (sequence_writer_add(&w, &rec.coded[i], key) != 0) {
+                sequence_writer_close(&w);
+                goto out;
+            }
+            keys += key;
+            bytes += rec.coded[i].len;
+        }
+        /* The batch's last frame is the reference for the next one */
+        Surface last = rec.frames[0];
+        rec.frames[0] = rec.frames[n];
+        rec.frames[n] = last;
+    }
+    if (sequence_writer_close(&w) != 0)
+        goto out;
+
+    double seconds = (now_ns() - start) / 1e9;
+    printf("Recorded %d frames (%d keyframes, %.1f fps) to %s: %.1f MB in %.2f s, %.1f frames/s\n",
+           frames, keys, app->rainbow.fps, app->opts.record_path, bytes / 1e6, seconds,
+           frames / (seconds > 0.0 ? seconds : 1e-9));
+    ret = 0;
+out:
+    for (int i = 0; i <= batch; i++)
+        surface_destroy(&rec.frames[i]);
+    for (int i = 0; i < batch; i++) {
+        buf_free(&rec.coded[i]);
+        draw_batch_destroy(&rec.shapes[i]);
+        scaler_destroy(&rec.scalers[i]);
+        filter_destroy(&rec.filters[i]);
+        effect_renderer_destroy(&rec.effects[i]);
+    }
+    return ret;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Opens a counter of user-space data TLB read misses for the calling
+ * thread and every thread it starts afterwards.
+ *
+ * Returns: the counter's descriptor, or -1 with errno set if the kernel
+ * has no such counter (most virtual machines) or perf_event_paranoid
+ * forbids it
+ */
+static int dtlb_counter_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                  PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t dtlb_counter_read(int fd)
+{
+    uint64_t v = 0;
+    return fd >= 0 && read(fd, &v, sizeof(v)) == (ssize_t)sizeof(v) ? v : 0;
+}
+
+/* Bytes of the mapping holding p that are on huge pages right now, from /proc/self/smaps */
+static size_t huge_bytes_at(const void *p)
+{
+    FILE *f = fopen("/proc/self/smaps", "r");
+    char line[256];
+    size_t kb = 0;
+    int inside = 0;
+
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long lo, hi, n;
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+            inside = (uintptr_t)p >= lo && (uintptr_t)p < hi;
+        else if (inside && (sscanf(line, "AnonHugePages: %lu kB", &n) == 1 ||
+                            sscanf(line, "Private_Hugetlb: %lu kB", &n) == 1))
+            kb += n;
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+/*
+ * Times the filters whose vertical passes walk down columns, on a
+ * surface of each page size. On 4 KiB pages every few rows of a column
+ * is a TLB miss; on huge pages hundreds of rows share one entry. The
+ * misses come from a hardware counter, so they are only shown where
+ * the kernel exposes one; the timings are shown regardless.
+ */
+static int bench_pages(App *app, uint64_t *times)
+{
+    static const char *const tests[] = { "box:8", "gaussian:16" };
+    int frames = app->opts.bench_frames;
+    int w = (int)app->surface.width, h = (int)app->surface.height;
+    int modes[2] = { PAGES_SMALL, app->opts.pages == PAGES_SMALL ? PAGES_THP : app->opts.pages };
+    int policy = surface_pages, failed = 0, counter_err = 0;
+    Rect all = { 0, 0, w, h };
+
+    if ((size_t)w * h * sizeof(uint32_t) < HUGE_PAGE_SIZE) {
+        printf("pages: the screen fits in one huge page, nothing to compare\n");
+        return 0;
+    }
+    printf("%-12s %-6s %9s %9s %9s %9s %12s %9s\n", "pages", "path", "mean ms", "p50 ms", "p99 ms", "Mpix/s",
+           "dTLB/frame", "huge MB");
+    for (int m = 0; m < 2 && !failed; m++) {
+        WorkerPool pool;
+        Filter f;
+        Surface s;
+        int fd;
+
+        surface_pages = modes[m];
+        if (surface_create(&s, (unsigned int)w, (unsigned int)h) != 0) {
+            fprintf(stderr, "Failed to allocate benchmark surface\n");
+            failed = 1;
+            break;
+        }
+        memcpy(s.pixels, app->surface.pixels, (size_t)w * h * sizeof(uint32_t));
+        /* A pool of its own, started after the counter so its threads are counted too */
+        fd = dtlb_counter_open();
+        if (fd < 0)
+            counter_err = errno;
+        worker_pool_start(&pool, worker_pool_size(&app->pool));
+        filter_init(&f, &pool);
+
+        for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]) && !failed; i++) {
+            FilterSpec spec;
+            uint64_t total = 0, misses;
+
+            filter_parse(&spec, tests[i]);
+            if (filter_apply(&f, &s, all, &spec) != 0) {   /* Warm up */
+                fprintf(stderr, "Failed to allocate filter buffers\n");
+                failed = 1;
+                break;
+            }
+            misses = dtlb_counter_read(fd);
+            for (int k = 0; k < frames; k++) {
+                uint64_t start = now_ns();
+                filter_apply(&f, &s, all, &spec);
+                times[k] = now_ns() - start;
+                total += times[k];
+            }
+            misses = dtlb_counter_read(fd) - misses;
+            qsort(times, (size_t)frames, sizeof(uint64_t), compare_u64);
+            printf("%-12s %-6s %9.3f %9.3f %9.3f %9.1f ", tests[i],
+                   s.pages == PAGES_SMALL ? "4k" : s.pages == PAGES_THP ? "thp" : "tlb",
+                   total / 1e6 / frames, times[frames / 2] / 1e6, times[(frames - 1) * 99 / 100] / 1e6,
+                   (double)w * h * frames / (total / 1e3));
+            if (fd >= 0)
+                printf("%12.0f", (double)misses / frames);
+            else
+                printf("%12s", "-");
+            printf(" %9.1f\n", huge_bytes_at(s.pixels) / 1048576.0);
+        }
+
+        filter_destroy(&f);
+        worker_pool_stop(&pool);
+        if (fd >= 0)
+            close(fd);
+        surface_destroy(&s);
+    }
+    if (counter_err)
+        printf("(dTLB misses not available: %s)\n", strerror(counter_err));
+    surface_pages = policy;
+    return failed ? -1 : 0;
+}
+
+/* Worker pool counters summed over the benchmark */
+typedef struct {
+    uint64_t run_ns;
+    uint64_t busy_ns[POOL_MAX_THREADS];
+    uint64_t items[POOL_MAX_THREADS];
+    uint64_t stolen[POOL_MAX_THREADS];
+} PoolTotals;
+
+/*
+ * Ends a benchmark line with how evenly the test kept the workers busy:
+ * their mean and lowest utilization and the share of items that were
+ * stolen tiles. Adds the test to t and resets the pool's counters.
+ */
+static void bench_print_utilization(WorkerPool *p, PoolTotals *t)
+{
+    int n = worker_pool_size(p);
+    double mean = 0.0, least = 100.0;
+    uint64_t items = 0, stolen = 0;
+
+    for (int i = 0; i < n; i++) {
+        double u = worker_pool_utilization(p, i);
+        mean += u / n;
+        if (u < least)
+            least = u;
+        items += p->workers[i].items;
+        stolen += p->workers[i].stolen;
+        t->busy_ns[i] += p->workers[i].busy_ns;
+        t->items[i] += p->workers[i].items;
+        t->stolen[i] += p->workers[i].stolen;
+    }
+    t->run_ns += p->run_ns;
+    printf(" %6.1f %6.1f %7.1f\n", mean, least, items ? 100.0 * (double)stolen / (double)items : 0.0);
+    worker_pool_reset_stats(p);
+}
+
+/*
+ * Function: app_bench
+ *
+ * Times every effect and plugin, then a range of filters, through the
+ * SSE2 and the scalar kernels, over opts.bench_frames frames at the
+ * screen size with the worker pool, and prints a table of frame times
+ * and throughput. Last, the column-walking filters are timed again on
+ * 4 KiB and on huge pages (see bench_pages).
+ *
+ * Returns: 0 on success, -1 on failure
+ */
+static int app_bench(App *app)
+{
+    int frames = app->opts.bench_frames;
+    int w = (int)app->surface.width, h = (int)app->surface.height;
+    uint64_t *times = malloc((size_t)frames * sizeof(uint64_t));
+    static PoolTotals totals;
+
+    if (!times)
+        return -1;
+    printf("Benchmark: %d x %d, %d threads, %d frames per test\n", w, h, worker_pool_size(&app->pool), frames);
+    printf("%-12s %-6s %9s %9s %9s %9s %6s %6s %7s\n", "effect", "path", "mean ms", "p50 ms", "p99 ms", "Mpix/s",
+           "util%", "min%", "stolen%");
+    for (int e = 0; e < EFFECT_COUNT + plugin_count; e++) {
+#ifdef __SSE2__
+        int paths = e == EFFECT_RAINBOW || e >= EFFECT_COUNT ? 1 : 2;   /* The rainbow only copies rows */
+#else
+        int paths = 1;
+#endif
+        for (int scalar = 0; scalar < paths; scalar++) {
+            EffectRenderer fx;
+            uint64_t total = 0;
+
+            if (effect_renderer_init(&fx, e, &app->pool, w, h) != 0) {
+                fprintf(stderr, "Failed to allocate effect tables\n");
+                free(times);
+                return -1;
+            }
+            fx.scalar = scalar || paths == 1;
+            effect_render(&fx, &app->surface, &app->damage, &app->rainbow, 0.0);   /* Warm up */
+            worker_pool_reset_stats(&app->pool);
+            for (int i = 0; i < frames; i++) {
+                uint64_t start = now_ns();
+                effect_render(&fx, &app->surface, &app->damage, &app->rainbow, (i + 1) / 60.0);
+                times[i] = now_ns() - start;
+                total += times[i];
+            }
+            effect_renderer_destroy(&fx);
+            damage_clear(&app->damage);
+
+            qsort(times, (size_t)frames, sizeof(uint64_t), compare_u64);
+            printf("%-12s %-6s %9.3f %9.3f %9.3f %9.1f", effect_name(e),
+                   paths == 1 ? "-" : scalar ? "scalar" : "sse2",
+                   total / 1e6 / frames, times[frames / 2] / 1e6, times[(frames - 1) * 99 / 100] / 1e6,
+                   (double)w * h * frames / (total / 1e3));
+            bench_print_utilization(&app->pool, &totals);
+        }
+    }
+
+    /* Box radii far apart, to show they cost the same */
+    static const char *const filters[] = {
+        "box:2", "box:32", "gaussian:2", "gaussian:16", "smooth", "sharpen", "smooth5",
+    };
+    Rect all = { 0, 0, w, h };
+    printf("filter\n");
+    for (size_t i = 0; i < sizeof(filters) / sizeof(filters[0]); i++) {
+        FilterSpec spec;
+#ifdef __SSE2__
+        int paths = 2;
+#else
+        int paths = 1;
+#endif
+        filter_parse(&spec, filters[i]);
+        for (int scalar = 0; scalar < paths; scalar++) {
+            uint64_t total = 0;
+
+            app->filter.scalar = scalar || paths == 1;
+            if (filter_apply(&app->filter, &app->surface, all, &spec) != 0) {   /* Warm up */
+                fprintf(stderr, "Failed to allocate filter buffers\n");
+                free(times);
+                return -1;
+            }
+            worker_pool_reset_stats(&app->pool);
+            for (int f = 0; f < frames; f++) {
+                uint64_t start = now_ns();
+                filter_apply(&app->filter, &app->surface, all, &spec);
+                times[f] = now_ns() - start;
+                total += times[f];
+            }
+            qsort(times, (size_t)frames, sizeof(uint64_t), compare_u64);
+            printf("%-12s %-6s %9.3f %9.3f %9.3f %9.1f", filters[i],
+                   paths == 1 ? "-" : app->filter.scalar ? "scalar" : "sse2",
+                   total / 1e6 / frames, times[frames / 2] / 1e6, times[(frames - 1) * 99 / 100] / 1e6,
+                   (double)w * h * frames / (total / 1e3));
+            bench_print_utilization(&app->pool, &totals);
+        }
+    }
+    app->filter.scalar = 0;
+
+    /* Worker n - 1 is the thread that posts the jobs */
+    printf("worker  busy%%      items  stolen\n");
+    for (int i = 0; i < worker_pool_size(&app->pool); i++)
+        printf("%6d %6.1f %10llu %7llu\n", i,
+               totals.run_ns ? 100.0 * (double)totals.busy_ns[i] / (double)totals.run_ns : 0.0,
+               (unsigned long long)totals.items[i], (unsigned long long)totals.stolen[i]);
+    if (bench_pages(app, times) != 0) {
+        free(times);
+        return -1;
+    }
+    free(times);
+    return 0;
+}
+
+/*
+ * Queues the display information that is otherwise only printed to
+ * stdout as labels in the bottom-left corner, so it can be read off a
+ * kiosk screen.
+ */
+static int app_add_info_labels(App *app)
+{
+    char lines[5][96];
+    int n = 0;
+    unsigned int scale = app->surface.height >= 1080 ? 3 : 2;
+
+    if (glyph_cache_init(&app->label_glyphs, &app->font, scale, 0xffffff, TEXT_TRANSPARENT) != 0 ||
+        glyph_cache_init(&app->shadow_glyphs, &app->font, scale, 0x000000, TEXT_TRANSPARENT) != 0)
+        return -1;
+
+    if (app->have_fb) {
+        snprintf(lines[n++], sizeof(lines[0]), "%s (%.16s)", app->opts.fb_path, app->fb.fix_info.id);
+        snprintf(lines[n++], sizeof(lines[0]), "Resolution: %u x %u",
+                 app->fb.var_info.xres, app->fb.var_info.yres);
+        snprintf(lines[n++], sizeof(lines[0]), "Bits per pixel: %u", app->fb.var_info.bits_per_pixel);
+        snprintf(lines[n++], sizeof(lines[0]), "Scanline length: %u bytes", app->fb.fix_info.line_length);
+        snprintf(lines[n++], sizeof(lines[0]), "Frame buffer size: %u bytes", app->fb.fix_info.smem_len);
+    } else if (app->opts.client_path) {
+        snprintf(lines[n++], sizeof(lines[0]), "Client of %s: %u x %u", app->opts.client_path,
+                 app->surface.width, app->surface.height);
+    } else if (app->opts.wall) {
+        snprintf(lines[n++], sizeof(lines[0]), "Wall: %d displays, %u x %u",
+                 app->wall.count, app->wall.width, app->wall.height);
+        for (int i = 0; i < app->wall.count && n < 5; i++) {
+            const FrameBuffer *fb = &app->wall.panels[i].fb;
+            snprintf(lines[n++], sizeof(lines[0]), "%s (%.16s) %u x %u at %d,%d", app->wall.panels[i].path,
+                     fb->fix_info.id, fb->width, fb->height, fb->x, fb->y);
+        }
+    } else {
+        snprintf(lines[n++], sizeof(lines[0]), "Headless: %u x %u",
+                 app->surface.width, app->surface.height);
+    }
+
+    int line_h = (int)app->label_glyphs.cell_h;
+    int y = (int)app->surface.height - n * line_h - (int)(4 * scale);
+    for (int i = 0; i < n; i++, y += line_h) {
+        if (text_batch_add(&app->labels, &app->shadow_glyphs, (int)(4 * scale) + (int)scale,
+                           y + (int)scale, lines[i]) != 0 ||
+            text_batch_add(&app->labels, &app->label_glyphs, (int)(4 * scale), y, lines[i]) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Builds the translucent status bar layer along the bottom edge */
+static int app_add_status_bar(App *app)
+{
+    unsigned int scale = app->surface.height >= 1080 ? 3 : 2;
+    GlyphCache text;
+    int pad = (int)(4 * scale);
+    unsigned int height;
+
+    if (glyph_cache_init(&text, &app->font, scale, 0xffffffff, TEXT_TRANSPARENT) != 0)
+        return -1;
+    height = text.cell_h + 2 * (unsigned int)pad;
+    if (height > app->surface.height)
+        height = app->surface.height;
+    if (layer_create(&app->status_bar, app->surface.width, height) != 0) {
+        glyph_cache_destroy(&text);
+        return -1;
+    }
+
+    Rect all = { 0, 0, (int)app->surface.width, (int)height };
+    layer_fill(&app->status_bar, all, 0xa0000000);   /* Black at 5/8 opacity */
+    draw_text(&app->status_bar.pixels, &text, pad, pad, app->opts.status_text);
+    glyph_cache_destroy(&text);
+    layer_update_coverage(&app->status_bar, all);
+
+    app->status_bar.x = 0;
+    app->status_bar.y = (int)(app->surface.height - height);
+    app->status_bar.z = INT_MAX;   /* Above any --compositor client */
+    return compositor_add(&app->compositor, &app->status_bar);
+}
+
+static void app_print_stats(const App *app)
+{
+    const Stats *st = &app->stats;
+    double elapsed = now_seconds() - st->start;
+    uint64_t written = st->bytes_flushed + atomic_load_explicit(&app->present.bytes, memory_order_relaxed);
+
+    fprintf(stderr,
+            "stats: %.1f s, %llu frames (%.1f fps), %llu flushed, %llu ticks missed, "
+            "%llu tiles changed, %.1f MB written, %.3f ms/frame busy\n",
+            elapsed, (unsigned long long)st->frames,
+            elapsed > 0 ? st->frames / elapsed : 0.0,
+            (unsigned long long)st->frames_flushed, (unsigned long long)st->ticks_missed,
+            (unsigned long long)st->tiles_changed, written / 1e6,
+            st->frames ? st->busy_seconds * 1e3 / st->frames : 0.0);
+    if (app->lowres.pixels || app->res.adaptive)
+        fprintf(stderr, "resolution: effect at %d/%d of the screen (%u x %u), %llu changes\n",
+                app->res.level, RES_LEVELS, res_scaled(app->surface.width, app->res.level),
+                res_scaled(app->surface.height, app->res.level), (unsigned long long)app->res.changes);
+    if (app->opts.compositor_path) {
+        int connected = 0;
+        uint64_t frames = 0;
+        for (int i = 0; i < SHM_MAX_CLIENTS; i++) {
+            connected += app->shm.peers[i].hdr != NULL;
+            frames += app->shm.peers[i].frames;
+        }
+        fprintf(stderr, "compositor: %d clients connected (%llu in all), %llu frames from those, "
+                "%.1f MB copied in\n", connected, (unsigned long long)app->shm.clients,
+                (unsigned long long)frames, app->shm.bytes_copied / 1e6);
+    }
+    if (app->present.started)
+        fprintf(stderr, "present: %s, %llu frames shown, %llu replaced before they were shown, "
+                "%llu ticks waiting for the present thread\n", present_names[app->present.policy],
+                (unsigned long long)atomic_load_explicit(&app->present.shown, memory_order_relaxed),
+                (unsigned long long)app->present.replaced, (unsigned long long)app->present.ticks_held);
+    if (app->opts.client_path)
+        fprintf(stderr, "client: %llu frames posted, %llu flushes held back while the compositor had the surface\n",
+                (unsigned long long)app->client.frames_posted, (unsigned long long)app->client.frames_held);
+}
+
+/*
+ * (Re)arms the frame timer for the current fps; 0 fps disarms it. The
+ * first expiry is set as an absolute time so every later tick's due time
+ * is known exactly and frame start lateness can be measured against it.
+ */
+static void app_arm_timer(App *app)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    app->timer_ticks = 0;
+    if (app->rainbow.fps > 0.0f) {
+        long period = (long)(1e9 / app->rainbow.fps);
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        its.it_interval.tv_sec = period / 1000000000L;
+        its.it_interval.tv_nsec = period % 1000000000L;
+        its.it_value.tv_sec = now.tv_sec + its.it_interval.tv_sec;
+        its.it_value.tv_nsec = now.tv_nsec + its.it_interval.tv_nsec;
+        if (its.it_value.tv_nsec >= 1000000000L) {
+            its.it_value.tv_sec++;
+            its.it_value.tv_nsec -= 1000000000L;
+        }
+        app->timer_origin = its.it_value.tv_sec + its.it_value.tv_nsec / 1e9;
+        app->timer_period = period / 1e9;
+    }
+    app->res.period_ns = app->rainbow.fps > 0.0f ? (uint64_t)(1e9 / app->rainbow.fps) : 0;
+    timerfd_settime(app->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int epoll_add(int epoll_fd, int fd, uint64_t tag)
+{
+    struct epoll_event ev = { EPOLLIN, { .u64 = tag } };
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * Function: app_setup_events
+ *
+ * Creates the epoll set and the descriptors it watches. The handled
+ * signals must already be blocked in every thread (see main_linux).
+ *
+ * Returns: 0 on success, -1 on failure
+ */
+static int app_setup_events(App *app, const sigset_t *signals)
+{
+    app->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    app->signal_fd = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    app->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (app->epoll_fd < 0 || app->signal_fd < 0 || app->timer_fd < 0) {
+        perror("Failed to set up event loop");
+        return -1;
+    }
+    epoll_add(app->epoll_fd, app->signal_fd, EV_SIGNAL);
+    epoll_add(app->epoll_fd, app->timer_fd, EV_TIMER);
+    /* Fails harmlessly when stdin is a regular file or /dev/null (e.g. under a service manager) */
+    epoll_add(app->epoll_fd, STDIN_FILENO, EV_STDIN);
+
+    if (app->opts.config_path) {
+        /*
+         * Watch the directory rather than the file: editors usually save
+         * by writing a new file and renaming it over the old one.
+         */
+        const char *path = app->opts.config_path;
+        const char *slash = strrchr(path, '/');
+        char dir[4096];
+
+        if (!slash) {
+            strcpy(dir, ".");
+        } else if (slash == path) {
+            strcpy(dir, "/");
+        } else if ((size_t)(slash - path) < sizeof(dir)) {
+            memcpy(dir, path, (size_t)(slash - path));
+            dir[slash - path] = '\0';
+        } else {
+            fprintf(stderr, "Config path too long\n");
+            return -1;
+        }
+        app->config_name = slash ? slash + 1 : path;
+
+        app->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (app->inotify_fd < 0 ||
+            inotify_add_watch(app->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            perror("Failed to watch config file");
+            return -1;
+        }
+        epoll_add(app->epoll_fd, app->inotify_fd, EV_INOTIFY);
+    }
+    app_arm_timer(app);
+    return 0;
+}
+
+static void app_reload_config(App *app)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int relevant = 0;
+    ssize_t n;
+
+    while ((n = read(app->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len && strcmp(ev->name, app->config_name) == 0)
+                relevant = 1;
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+    if (!relevant)
+        return;
+
+    RainbowParams next = app->rainbow;
+    if (load_config(app->opts.config_path, &next) != 0) {
+        fprintf(stderr, "Keeping previous settings\n");
+        return;
+    }
+    int fps_changed = next.fps != app->rainbow.fps;
+    app->rainbow = next;
+    fprintf(stderr, "Reloaded %s: fps %.1f, speed %.1f, saturation %.2f, value %.2f\n",
+            app->opts.config_path, next.fps, next.speed, next.saturation, next.value);
+    if (fps_changed)
+        app_arm_timer(app);
+    app_render_frame(app, now_seconds() - app->stats.start);
+}
+
+/*
+ * Function: app_run
+ *
+ * Dispatches events until Enter, SIGINT or SIGTERM.
+ */
+static void app_run(App *app)
+{
+    int running = 1;
+
+    while (running) {
+        struct epoll_event events[8];
+        int n = epoll_wait(app->epoll_fd, events, 8, -1);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n && running; i++) {
+            switch (events[i].data.u64) {
+            case EV_STDIN: {
+                char buf[256];
+                ssize_t got = read(STDIN_FILENO, buf, sizeof(buf));
+                if (got > 0 && memchr(buf, '\n', (size_t)got)) {
+                    running = 0;
+                } else if (got == 0) {
+                    /* stdin closed (detached or service): keep running until a signal */
+                    epoll_ctl(app->epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                }
+                break;
+            }
+            case EV_SIGNAL: {
+                struct signalfd_siginfo si;
+                while (read(app->signal_fd, &si, sizeof(si)) == sizeof(si)) {
+                    if (si.ssi_signo == SIGUSR1) {
+                        app_print_stats(app);
+                        telemetry_print(stderr);
+                        plugin_print_stats(stderr);
+                        jitter_print(&app->jitter, stderr);
+                    } else {
+                        fprintf(stderr, "Caught %s, exiting\n", strsignal((int)si.ssi_signo));
+                        running = 0;
+                    }
+                }
+                break;
+            }
+            case EV_TIMER: {
+                uint64_t expirations = 0;
+                if (read(app->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                    break;
+                if (expirations > 1)
+                    app->stats.ticks_missed += expirations - 1;
+
+                /* Lateness of this frame's start relative to the tick it answers */
+                double now = now_seconds();
+                app->timer_ticks += expirations;
+                if (app->present_held) {
+                    /* FIFO: no buffer to render into until the present thread takes the pending frame */
+                    app->present.ticks_held += expirations;
+                    break;
+                }
+                double due = app->timer_origin + (double)(app->timer_ticks - 1) * app->timer_period;
+                jitter_record(&app->jitter, (now - due) * 1e6, app->timer_period * 1e6);
+                app_render_frame(app, now - app->stats.start);
+                break;
+            }
+            case EV_INOTIFY:
+                app_reload_config(app);
+                break;
+            case EV_PRESENT: {
+                uint64_t taken;
+                if (read(app->present.release_fd, &taken, sizeof(taken)) != sizeof(taken) || !app->present_held)
+                    break;
+                app->present_held = !present_queue(&app->present, &app->surface, &app->damage,
+                                                   &app->compositor.source);
+                if (!app->present_held && app->shm.damage.count && app->rainbow.fps <= 0.0f)
+                    app_render_frame(app, now_seconds() - app->stats.start);
+                break;
+            }
+            case EV_SHM_LISTEN:
+                shm_server_accept(&app->shm);
+                break;
+            case EV_SHM_SERVER:
+                /* The compositor never writes after the welcome, so this is it going away */
+                fprintf(stderr, "The compositor closed the connection, exiting\n");
+                running = 0;
+                break;
+            case EV_SHM_RELEASE: {
+                uint64_t released;
+                if (read(app->client.release_fd, &released, sizeof(released)) == sizeof(released))
+                    app->stats.bytes_flushed += shm_client_flush(&app->client, &app->surface, NULL,
+                                                                 &app->compositor.source);
+                break;
+            }
+            default: {
+                uint64_t tag = events[i].data.u64;
+                if (tag >= EV_SHM_READY && tag < EV_SHM_READY + SHM_MAX_CLIENTS)
+                    shm_server_ready(&app->shm, (int)(tag - EV_SHM_READY));
+                else if (tag >= EV_SHM_PEER && tag < EV_SHM_PEER + SHM_MAX_CLIENTS)
+                    shm_server_peer_event(&app->shm, (int)(tag - EV_SHM_PEER));
+                /* Without a frame rate, show client changes at once; otherwise on the next tick */
+                if (app->shm.damage.count && app->rainbow.fps <= 0.0f && !app->present_held)
+                    app_render_frame(app, now_seconds() - app->stats.start);
+                break;
+            }
+            }
+        }
+    }
+}
+
+int main_linux(int argc, char **argv)
+{
+    static App app;
+    sigset_t signals;
+    int status = 1;
+
+    switch (parse_options(argc, argv, &app.opts)) {
+    case 0:
+        break;
+    case 1:
+        return 0;
+    default:
+        return 1;
+    }
+    app.rainbow = app.opts.rainbow;
+    app.epoll_fd = app.signal_fd = app.timer_fd = app.inotify_fd = -1;
+    surface_pages = app.opts.pages;
+
+    /*
+     * Block the handled signals before any thread is started so that every
+     * thread inherits the mask and they are only ever seen via signalfd.
+     */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    app.have_fb = app.opts.headless_w == 0 && !app.opts.wall && !app.opts.client_path;
+    if (app.opts.wall) {
+        if (wall_open(&app.wall, app.opts.wall_cols, app.opts.wall_rows,
+                      app.opts.rotate >= 0 ? app.opts.rotate / 90 : -1, app.opts.mirror) != 0)
+            return 1;
+        printf("Video wall: %d displays, %u x %u\n", app.wall.count, app.wall.width, app.wall.height);
+        for (int i = 0; i < app.wall.count; i++) {
+            const FrameBuffer *fb = &app.wall.panels[i].fb;
+            printf("  %s (%.16s): %u x %u, %u bits per pixel, at %d,%d%s\n", app.wall.panels[i].path,
+                   fb->fix_info.id, fb->width, fb->height, fb->var_info.bits_per_pixel, fb->x, fb->y,
+                   fb->rotate_rows ? ", turned or mirrored" : "");
+        }
+        wall_start(&app.wall);
+    } else if (app.opts.client_path) {
+        if (shm_client_connect(&app.client, app.opts.client_path, app.opts.client_rect, app.opts.client_z) != 0)
+            return 1;
+        printf("Compositor client: %u x %u surface on a %u x %u screen\n", app.client.shared.width,
+               app.client.shared.height, app.client.screen_w, app.client.screen_h);
+    } else if (app.have_fb) {
+        if (fb_open(&app.fb, app.opts.fb_path) != 0)
+            return 1;
+        if ((app.opts.rotate >= 0 || app.opts.mirror) &&
+            fb_set_orientation(&app.fb, app.opts.rotate >= 0 ? app.opts.rotate / 90 : app.fb.rotate,
+                               app.opts.mirror) != 0)
+            goto out_fb;
+
+        /* Print detected screen information for debugging */
+        printf("Frame Buffer Information:\n");
+        printf("Resolution: %d x %d\n", app.fb.var_info.xres, app.fb.var_info.yres);
+        printf("Bits per pixel: %d\n", app.fb.var_info.bits_per_pixel);
+        printf("Frame buffer size: %u bytes\n", app.fb.fix_info.smem_len);
+        printf("Scanline length: %d bytes\n", app.fb.fix_info.line_length);
+        if (app.fb.rotate_rows)
+            printf("Orientation: turned %d degrees%s, drawing at %u x %u\n", app.fb.rotate * 90,
+                   app.fb.mirror ? " and mirrored" : "", app.fb.width, app.fb.height);
+    }
+
+    /*
+     * Draw into the shadow surface first; only damaged regions are then
+     * converted and copied to video memory.
+     */
+    unsigned int width = app.opts.headless_w, height = app.opts.headless_h;
+    if (app.have_fb) {
+        width = app.fb.width;
+        height = app.fb.height;
+    } else if (app.opts.wall) {
+        width = app.wall.width;
+        height = app.wall.height;
+    } else if (app.opts.client_path) {
+        width = app.client.shared.width;
+        height = app.client.shared.height;
+    }
+    if (surface_create(&app.surface, width, height) != 0) {
+        fprintf(stderr, "Failed to allocate shadow surface\n");
+        goto out_fb;
+    }
+    if (app.opts.pages == PAGES_HUGETLB && app.surface.pages != PAGES_HUGETLB && app.surface.map_len)
+        fprintf(stderr, "Warning: no reserved huge pages left (vm.nr_hugepages), using transparent ones\n");
+    damage_init(&app.damage, &app.surface);
+    if (tile_hasher_init(&app.tiles, &app.surface) != 0) {
+        fprintf(stderr, "Failed to allocate tile hashes\n");
+        goto out_surface;
+    }
+    if ((app.opts.font_path ? font_load_psf(&app.font, app.opts.font_path)
+                            : font_builtin(&app.font)) != 0)
+        goto out_tiles;
+    text_batch_init(&app.labels);
+    draw_batch_init(&app.shapes);
+    worker_pool_start(&app.pool, app.opts.threads ? app.opts.threads : (int)sysconf(_SC_NPROCESSORS_ONLN));
+    scaler_init(&app.scaler, &app.pool);
+    filter_init(&app.filter, &app.pool);
+    if (expr_compile(&shader_program, app.opts.shader_source ? app.opts.shader_source : SHADER_RAINBOW) != 0)
+        goto out_text;
+    for (int i = 0; i < app.opts.plugin_count; i++)
+        if (plugin_load(app.opts.plugin_paths[i], (int)app.surface.width, (int)app.surface.height,
+                        app.opts.plugin_args) != 0)
+            goto out_text;
+    if (app.opts.effect < 0) {
+        app.opts.effect = EFFECT_COUNT;   /* The first plugin, unless one is named */
+        for (int i = 0; i < plugin_count && app.opts.effect_name; i++)
+            if (strcmp(app.opts.effect_name, plugins[i].api->name) == 0)
+                app.opts.effect = EFFECT_COUNT + i;
+        if (app.opts.effect_name && strcmp(app.opts.effect_name, effect_name(app.opts.effect)) != 0) {
+            fprintf(stderr, "Unknown effect: %s\n", app.opts.effect_name);
+            goto out_text;
+        }
+    }
+    if (effect_renderer_init(&app.effects, app.opts.effect, &app.pool, (int)app.surface.width,
+                             (int)app.surface.height) != 0) {
+        fprintf(stderr, "Failed to allocate effect tables\n");
+        goto out_text;
+    }
+    res_governor_init(&app.res, app.opts.min_render_level, app.opts.render_level);
+    if (app.res.level < RES_LEVELS || app.res.adaptive) {
+        if (app.opts.effect >= EFFECT_COUNT) {
+            fprintf(stderr, "--render-scale and --dynamic-res need a built-in effect; plugins are set up "
+                            "for the screen size\n");
+            goto out_text;
+        }
+        if (app_set_render_level(&app, app.res.level) != 0) {
+            fprintf(stderr, "Failed to allocate effect tables\n");
+            goto out_text;
+        }
+    }
+    if (app.opts.image_path) {
+        if (image_map(&app.image, app.opts.image_path, (int)app.surface.width, (int)app.surface.height) != 0)
+            goto out_text;
+        app.image_rect = image_fit(&app.image.image, (int)app.surface.width, (int)app.surface.height);
+        app_draw_background(&app, &app.surface, &app.damage, &app.scaler, 1);
+    }
+    if (app.opts.play_path) {
+        if (sequence_open(&app.sequence, app.opts.play_path) != 0)
+            goto out_text;
+        if (app.sequence.width > (int)app.surface.width || app.sequence.height > (int)app.surface.height) {
+            fprintf(stderr, "%s is %dx%d, larger than the %ux%u screen\n", app.opts.play_path,
+                    app.sequence.width, app.sequence.height, app.surface.width, app.surface.height);
+            goto out_text;
+        }
+        app.sequence_x = ((int)app.surface.width - app.sequence.width) / 2;
+        app.sequence_y = ((int)app.surface.height - app.sequence.height) / 2;
+        if (app.rainbow.fps <= 0.0f)
+            app.rainbow.fps = (float)app.sequence.fps;   /* Refresh at the sequence's own rate */
+    }
+    if (app.opts.shapes && blend_check() != 0)   /* The shapes include anti-aliased lines */
+        goto out_text;
+    if (app.opts.sprites && app_make_sprites(&app) != 0) {
+        fprintf(stderr, "Failed to allocate sprites\n");
+        goto out_text;
+    }
+    if (app.opts.show_info && app_add_info_labels(&app) != 0) {
+        fprintf(stderr, "Failed to set up information labels\n");
+        goto out_text;
+    }
+    if (app.opts.record_path || app.opts.bench_frames) {
+        status = (app.opts.record_path ? app_record(&app) : app_bench(&app)) == 0 ? 0 : 1;
+        goto out_text;
+    }
+    if (compositor_init(&app.compositor, app.surface.width) != 0 ||
+        (app.opts.status_text && app_add_status_bar(&app) != 0)) {
+        fprintf(stderr, "Failed to set up layers\n");
+        goto out_layers;
+    }
+    if (app.opts.overlay_scale && overlay_init(&app.overlay, &app.font, app.opts.overlay_scale, app.opts.frost) != 0) {
+        fprintf(stderr, "Failed to allocate overlay glyphs\n");
+        goto out_layers;
+    }
+    app.render_telemetry = telemetry_register("render");
+    if (app.opts.rfb_port &&
+        rfb_server_start(&app.rfb, app.opts.rfb_addr, app.opts.rfb_port,
+                         app.surface.width, app.surface.height) != 0)
+        goto out_overlay;
+    if (app_setup_events(&app, &signals) != 0)
+        goto out_events;
+    if (app.opts.compositor_path &&
+        shm_server_open(&app.shm, app.opts.compositor_path, app.epoll_fd, &app.compositor, &app.surface) != 0)
+        goto out_events;
+    if (app.opts.client_path) {
+        epoll_add(app.epoll_fd, app.client.sock, EV_SHM_SERVER);
+        epoll_add(app.epoll_fd, app.client.release_fd, EV_SHM_RELEASE);
+    }
+    if (app.opts.present != PRESENT_SYNC) {
+        if (present_start(&app.present, app.opts.present, &app.surface, app.have_fb ? &app.fb : NULL,
+                          app.opts.wall ? &app.wall : NULL, app.opts.rfb_port ? &app.rfb : NULL) != 0)
+            goto out_events;
+        epoll_add(app.epoll_fd, app.present.release_fd, EV_PRESENT);
+        printf("Presenting from a separate thread (%s), %s\n", present_names[app.opts.present],
+               app.present.vsync ? "at vertical blank" : "as soon as frames arrive (no vsync on this display)");
+    }
+
+    /* After the RFB thread exists, so only the render thread is pinned and real-time */
+    apply_realtime(&app.opts);
+
+    app.stats.start = now_seconds();
+    app_render_frame(&app, 0.0);
+
+    if (app.opts.compositor_path)
+        printf("Compositor listening on %s\n", app.opts.compositor_path);
+    else
+        printf(app.have_fb ? "%s written to frame buffer!\n" :
+               app.opts.wall ? "%s written to the video wall!\n" :
+               app.opts.client_path ? "%s handed to the compositor!\n" : "%s rendered (headless)\n",
+               app.opts.image_path ? "Image" : app.opts.play_path ? "Sequence" :
+               app.opts.effect == EFFECT_RAINBOW ? "Rainbow gradient" : "Effect");
+    printf("Press Enter to exit and restore the display...\n");
+    fflush(stdout);
+    app_run(&app);
+    app_print_stats(&app);
+    telemetry_print(stderr);
+    plugin_print_stats(stderr);
+    jitter_print(&app.jitter, stderr);
+    status = 0;
+
+out_events:
+    present_stop(&app.present);
+    if (app.opts.compositor_path)
+        shm_server_close(&app.shm);
+    if (app.inotify_fd >= 0)
+        close(app.inotify_fd);
+    if (app.timer_fd >= 0)
+        close(app.timer_fd);
+    if (app.signal_fd >= 0)
+        close(app.signal_fd);
+    if (app.epoll_fd >= 0)
+        close(app.epoll_fd);
+    if (app.opts.rfb_port)
+        rfb_server_stop(&app.rfb);
+out_overlay:
+    if (app.opts.overlay_scale)
+        overlay_destroy(&app.overlay);
+out_layers:
+    layer_destroy(&app.status_bar);
+    compositor_destroy(&app.compositor);
+out_text:
+    sequence_close(&app.sequence);
+    image_unmap(&app.image);
+    surface_destroy(&app.ball_pixels);
+    surface_destroy(&app.shadow_pixels);
+    effect_renderer_destroy(&app.effects);
+    surface_destroy(&app.lowres);
+    plugin_unload_all();
+    scaler_destroy(&app.scaler);
+    filter_destroy(&app.filter);
+    worker_pool_stop(&app.pool);
+    draw_batch_destroy(&app.shapes);
+    text_batch_destroy(&app.labels);
+    glyph_cache_destroy(&app.label_glyphs);
+    glyph_cache_destroy(&app.shadow_glyphs);
+    font_destroy(&app.font);
+out_tiles:
+    tile_hasher_destroy(&app.tiles);
+out_surface:
+    surface_destroy(&app.surface);
+out_fb:
+    if (app.have_fb)
+        fb_close(&app.fb);
+    if (app.opts.wall)
+        wall_close(&app.wall);
+    if (app.opts.client_path)
+        shm_client_close(&app.client);
+    return status;
+}
+
+#endif /* __linux__ */
+
+/*
+ * ============================================================================
+ * WINDOWS IMPLEMENTATION
+ * ============================================================================
+ */
+#ifdef _WIN32
+
+/* Global variables for Windows implementation */
+HWND hwnd = NULL;
+HDC hdc = NULL;
+unsigned int screen_width = 0;
+unsigned int screen_height = 0;
+
+/*
+ * Window procedure: handles window events and messages
+ * This window cannot be closed by user interaction - it will persist indefinitely
+ */
+LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    /* Ignore all messages - the window will not close */
+    return DefWindowProc(hwnd, uMsg, wParam, lParam);
+}
+
+int main_windows()
+{
+    /* Get the screen dimensions */
+    screen_width = GetSystemMetrics(SM_CXSCREEN);
+    screen_height = GetSystemMetrics(SM_CYSCREEN);
+
+    printf("Creating fullscreen window: %d x %d\n", screen_width, screen_height);
+
+    /* Register the window class */
+    const char CLASS_NAME[] = "Rainbow Window Class";
+    WNDCLASS wc = {0};
+    wc.lpfnWndProc = WindowProc;
+    wc.lpszClassName = CLASS_NAME;
+    wc.style = CS_HREDRAW | CS_VREDRAW;
+    wc.hbrBackground = (HBRUSH)(COLOR_WINDOW + 1);
+
+    RegisterClass(&wc);
+
+    /* Create a fullscreen window */
+    hwnd = CreateWindowEx(
+        WS_EX_TOPMOST,           /* Window is always on top */
+        CLASS_NAME,
+        "Rainbow Gradient",
+        WS_POPUP,                /* Fullscreen, no decorations */
+        0, 0,                    /* Position at 0,0 */
+        screen_width,
+        screen_height,
+        NULL, NULL, NULL, NULL
+    );
+
+    if (hwnd == NULL) {
+        printf("Failed to create window\n");
+        return 1;
+    }
+
+    /* Display the window */
+    ShowWindow(hwnd, SW_SHOW);
+    UpdateWindow(hwnd);
+
+    /* Get the device context for drawing */
+    hdc = GetDC(hwnd);
+    if (hdc == NULL) {
+        printf("Failed to get device context\n");
+        DestroyWindow(hwnd);
+        return 1;
+    }
+
+    printf("Rendering rainbow gradient...\n");
+
+    /* 
+     * Main rendering loop: iterate through every pixel on the screen
+     * 
+     * Strategy: Use horizontal position (x) to determine the hue
+     * This creates a smooth left-to-right rainbow gradient
+     */
+    for (unsigned int y = 0; y < screen_height; y++) {
+        for (unsigned int x = 0; x < screen_width; x++) {
+            /* 
+             * Calculate the hue based on horizontal position
+             * hue ranges from 0° (red) to 360° (magenta)
+             */
+            float hue = (x / (float)screen_width) * 360.0f;
+            
+            /* Convert HSV to RGB for the rainbow effect */
+            RGB pixel_color = hsv_to_rgb(hue, 1.0f, 1.0f);
+
+            /* 
+             * Create a Windows COLORREF (0x00BGR format)
+             * RGB() macro packs the color values into the correct format
+             */
+            COLORREF color = RGB(pixel_color.red, pixel_color.green, pixel_color.blue);
+
+            /* Set the pixel at this location */
+            SetPixel(hdc, x, y, color);
+        }
+
+        /* 
+         * Process Windows messages to keep the window responsive
+         * This allows the user to close the window or press a key to exit
+         */
+        MSG msg;
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+    }
+
+    printf("Rainbow gradient displayed!\n");
+    printf("Window is locked and cannot be closed. Use Ctrl+Alt+Delete or force-terminate the process to exit.\n");
+
+    /* Infinite loop - the window will never close */
+    while (1) {
+        MSG msg;
+        if (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+    }
+
+    return 0;
+}
+
+#endif /* _WIN32 */
@@ -0,0 +1,71 @@
+/*
+ * Rainbow Span Plugin Interface
+ *
+ * A plugin is a shared object that draws a full-screen pattern for the
+ * rainbow program, the same way its built-in effects do: one span of
+ * pixels at a time. Load one with --plugin FILE.so and select it with
+ * --effect NAME (the first plugin loaded is the default effect).
+ *
+ * The shared object exports one function, named by RAINBOW_PLUGIN_ENTRY:
+ *
+ *   const RainbowPlugin *rainbow_plugin_entry(void);
+ *
+ * which returns a description that stays valid until the plugin is
+ * unloaded. Build it position independent, for example:
+ *
+ *   gcc -O2 -shared -fPIC -o zoneplate.so example_plugin.c
+ *
+ * Threading: create() and destroy() are called once each, on the main
+ * thread. span() is called from several threads at once, for different
+ * spans of the same or of different frames, so it must only read the
+ * state create() returned. A frame may be drawn more than once or out
+ * of order (recording renders several frames in parallel), so a span
+ * must depend on nothing but its arguments.
+ */
+
+#ifndef RAINBOW_PLUGIN_H
+#define RAINBOW_PLUGIN_H
+
+#include <stdint.h>
+
+/* Bumped whenever RainbowPlugin or RainbowFrame change incompatibly */
+#define RAINBOW_PLUGIN_ABI 1
+
+#define RAINBOW_PLUGIN_ENTRY "rainbow_plugin_entry"
+
+/* What is being drawn; the same for every span of one frame */
+typedef struct {
+    double t;           /* Animation time in seconds, 0 for a static picture */
+    int width;          /* Screen size in pixels */
+    int height;
+    float speed;        /* Hue drift in degrees per second (--speed) */
+    float saturation;   /* 0.0 to 1.0, from the --config file */
+    float value;        /* 0.0 to 1.0, from the --config file */
+    float phase;        /* Hue drift at time t, 0.0 to 360.0 degrees */
+} RainbowFrame;
+
+typedef struct {
+    uint32_t abi;       /* RAINBOW_PLUGIN_ABI */
+    const char *name;   /* Effect name for --effect; short, no spaces */
+
+    /*
+     * Optional. Called once with the screen size and the --plugin-args
+     * text (NULL if none) before any span. Returns the state passed to
+     * span() and destroy(); NULL is a valid state unless *failed is set,
+     * which makes loading fail.
+     */
+    void *(*create)(int width, int height, const char *args, int *failed);
+
+    /* Optional. Frees what create() returned */
+    void (*destroy)(void *state);
+
+    /*
+     * Required. Writes n pixels of row y starting at column x to dst,
+     * as 0x00RRGGBB. The span always lies inside the screen.
+     */
+    void (*span)(void *state, const RainbowFrame *frame, uint32_t *dst, int x, int y, int n);
+} RainbowPlugin;
+
+typedef const RainbowPlugin *(*RainbowPluginEntry)(void);
+
+#endif /* RAINBOW_PLUGIN_H */
@@ -0,0 +1,85 @@
+/*
+ * Rainbow Shared-Memory Client Protocol
+ *
+ * Started with --compositor SOCKET, the rainbow program owns the screen
+ * and shows the surfaces of other processes on it, stacked by z and
+ * blended over black. The rainbow program itself becomes such a client
+ * with --client SOCKET.
+ *
+ * A client connects a SOCK_SEQPACKET Unix socket to SOCKET and sends one
+ * RainbowShmHello. The compositor answers with one RainbowShmWelcome
+ * carrying three descriptors (SCM_RIGHTS), in this order:
+ *
+ *   memfd      the surface: a RainbowShmHeader, then height rows of
+ *              stride pixels at pixels_offset. Map it shared, read and
+ *              write. It cannot be shrunk.
+ *   ready      eventfd the client writes 1 to after posting a frame
+ *   release    eventfd the compositor writes 1 to after taking one
+ *
+ * A frame is posted by writing its pixels, putting the rectangles that
+ * changed (surface coordinates) into ring[head % RAINBOW_SHM_RING] for
+ * head, head + 1, ... and then storing the new head with release
+ * ordering, followed by a write to ready. The compositor copies those
+ * rectangles out and stores tail = head, again with release ordering,
+ * then writes to release. Until tail has caught up with head (loaded
+ * with acquire ordering) the pixels belong to the compositor: keep
+ * drawing elsewhere, or wait for release. A frame with more than
+ * RAINBOW_SHM_RING changed rectangles should send their bounding box.
+ *
+ * The surface goes away when the socket is closed. Nothing else is
+ * ever sent over the socket, in either direction.
+ */
+
+#ifndef RAINBOW_SHM_H
+#define RAINBOW_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define RAINBOW_SHM_MAGIC 0x52534842u
+
+/* Bumped whenever a structure below changes incompatibly */
+#define RAINBOW_SHM_VERSION 1
+
+/* Changed rectangles the ring holds; a power of two */
+#define RAINBOW_SHM_RING 64
+
+/* Hello flags */
+#define RAINBOW_SHM_PREMULTIPLIED 1u   /* Pixels are premultiplied 0xAARRGGBB, not opaque 0x00RRGGBB */
+
+typedef struct {
+    int32_t x, y, w, h;
+} RainbowShmRect;
+
+typedef struct {
+    uint32_t magic;             /* RAINBOW_SHM_MAGIC */
+    uint32_t version;           /* RAINBOW_SHM_VERSION */
+    int32_t x;                  /* Where the surface's top-left corner goes on screen */
+    int32_t y;
+    uint32_t width;             /* Surface size; 0 x 0 asks for the whole screen */
+    uint32_t height;
+    int32_t z;                  /* Stacking order: higher is in front, equal stacks newest in front */
+    uint32_t flags;             /* RAINBOW_SHM_* */
+} RainbowShmHello;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t status;             /* 0, or an errno value saying why the surface was refused */
+    uint32_t screen_width;
+    uint32_t screen_height;
+    uint32_t width;             /* Surface size granted */
+    uint32_t height;
+} RainbowShmWelcome;
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;            /* Distance between rows, in pixels */
+    uint32_t pixels_offset;     /* Bytes from the start of the mapping to the first pixel */
+    _Alignas(64) atomic_uint head;   /* Rectangles posted; written by the client */
+    _Alignas(64) atomic_uint tail;   /* Rectangles taken; written by the compositor */
+    _Alignas(64) RainbowShmRect ring[RAINBOW_SHM_RING];
+} RainbowShmHeader;
+
+#endif /* RAINBOW_SHM_H */